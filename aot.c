@@ -0,0 +1,436 @@
+/**
+ * aot.c - lc3-aot, an ahead-of-time translator from LC-3 images to C
+ *
+ * Loads the images the way the VM does, recovers their control-flow graph with
+ * cfg_build and writes one C function in which every basic block is a labelled
+ * region and every statically known branch, call and fall-through is a goto.
+ * Guest registers and the condition codes are locals, so an optimizing C compiler
+ * keeps them in host registers and drops condition codes nobody reads.
+ *
+ * JMP/JSRR/RET and traps that redirect the PC go through a switch over all block
+ * leaders; an address the walk never reached is run by the interpreter, one
+ * instruction at a time, until control is back on translated code. Traps call
+ * trap_execute, and device registers go through mem_read/mem_write, so the
+ * translated program links against the same runtime as the VM, archived by the
+ * Makefile as lc3rt.a.
+ *
+ * The translated words are claimed in the code map (codemap.h), block by block,
+ * and every block checks on entry that its first word is still claimed. A store
+ * into a translated word, from the program or from a trap, releases the words of
+ * the block holding it and sends control back to the dispatcher, so that block
+ * is interpreted from then on while every other block keeps running translated.
+ * Images that modify their own code thus run correctly and only lose speed in
+ * the blocks they modify.
+ *
+ * Usage: lc3-aot [--os-traps] [-o out.c] image-file1 ...
+ */
+#include "main.h"
+#include "trap.h"
+#include "cfg.h"
+#include <string.h>
+
+/**
+ * emit_goto - Transfer control to target: a direct goto if it was translated, the dispatcher otherwise
+ */
+static void emit_goto(FILE *out, uint16_t target)
+{
+    if ((cfg_flags[target] & CFG_CODE) && (cfg_flags[target] & CFG_LEADER))
+    {
+        fprintf(out, "goto L%04X;", target);
+    }
+    else
+    {
+        fprintf(out, "{ pc = 0x%04X; goto dispatch; }", target);
+    }
+}
+
+/**
+ * emit_instr - Write the C statements for the instruction at pc
+ */
+static void emit_instr(FILE *out, uint16_t pc, uint16_t instr)
+{
+    uint16_t next = pc + 1;
+    uint16_t dr = (instr >> 9) & 0x7;
+    uint16_t sr1 = (instr >> 6) & 0x7;
+    uint16_t pc_target = next + sign_extend(instr & 0x1FF, 9);
+
+    fprintf(out, "    /* %04X: %04X */ ", pc, instr);
+    switch (instr >> 12)
+    {
+    case OP_ADD:
+    case OP_AND:
+    {
+        const char *op = (instr >> 12) == OP_ADD ? "+" : "&";
+        if ((instr >> 5) & 0x1)
+            fprintf(out, "r%d = r%d %s 0x%04X;", dr, sr1, op, sign_extend(instr & 0x1F, 5));
+        else
+            fprintf(out, "r%d = r%d %s r%d;", dr, sr1, op, instr & 0x7);
+        fprintf(out, " cond = FLAGS(r%d);\n", dr);
+        break;
+    }
+
+    case OP_NOT:
+        fprintf(out, "r%d = ~r%d; cond = FLAGS(r%d);\n", dr, sr1, dr);
+        break;
+
+    case OP_LEA:
+        fprintf(out, "r%d = 0x%04X; cond = FLAGS(r%d);\n", dr, pc_target, dr);
+        break;
+
+    case OP_LD:
+        if (pc_target < MR_KBSR)
+            fprintf(out, "r%d = memory[0x%04X];", dr, pc_target);
+        else
+            fprintf(out, "LOAD(r%d, 0x%04X, 0x%04X);", dr, pc_target, next);
+        fprintf(out, " cond = FLAGS(r%d);\n", dr);
+        break;
+
+    case OP_LDI:
+        fprintf(out, "LOAD(r%d, memory[0x%04X], 0x%04X); cond = FLAGS(r%d);\n", dr, pc_target, next, dr);
+        break;
+
+    case OP_LDR:
+        fprintf(out, "LOAD(r%d, r%d + 0x%04X, 0x%04X); cond = FLAGS(r%d);\n", dr, sr1,
+                sign_extend(instr & 0x3F, 6), next, dr);
+        break;
+
+    case OP_ST:
+        if (pc_target < MR_KBSR && !(cfg_flags[pc_target] & CFG_CODE))
+            fprintf(out, "memory[0x%04X] = r%d;\n", pc_target, dr);
+        else
+            fprintf(out, "STORE(0x%04X, r%d, 0x%04X);\n", pc_target, dr, next);
+        break;
+
+    case OP_STI:
+        fprintf(out, "STORE(memory[0x%04X], r%d, 0x%04X);\n", pc_target, dr, next);
+        break;
+
+    case OP_STR:
+        fprintf(out, "STORE(r%d + 0x%04X, r%d, 0x%04X);\n", sr1, sign_extend(instr & 0x3F, 6), dr, next);
+        break;
+
+    case OP_BR:
+        if (dr == 0)
+        {
+            fprintf(out, "/* never taken */\n");
+        }
+        else
+        {
+            if (dr != 0x7)
+                fprintf(out, "if (cond & %d) ", dr);
+            emit_goto(out, pc_target);
+            fprintf(out, "\n");
+        }
+        break;
+
+    case OP_JSR:
+        /* R7 is written before a JSRR reads its base register, as in execute() */
+        fprintf(out, "r7 = 0x%04X; ", next);
+        if ((instr >> 11) & 1)
+            emit_goto(out, next + sign_extend(instr & 0x7FF, 11));
+        else
+            fprintf(out, "pc = r%d; goto dispatch;", sr1);
+        fprintf(out, "\n");
+        break;
+
+    case OP_JMP:
+        fprintf(out, "pc = r%d; goto dispatch;\n", sr1);
+        break;
+
+    case OP_TRAP:
+        fprintf(out, "SYNC(0x%04X); trap_execute(0x%02X); LEAVE_IF_MODIFIED(); RELOAD();\n", next, instr & 0xFF);
+        fprintf(out, "    if (reg[R_PC] != 0x%04X) { pc = reg[R_PC]; goto dispatch; }\n", next);
+        break;
+
+    default:
+        /* RTI and the reserved opcode: whatever the interpreter does */
+        fprintf(out, "SYNC(0x%04X); execute(0x%04X); LEAVE_IF_MODIFIED(); RELOAD(); pc = reg[R_PC]; goto dispatch;\n",
+                next, instr);
+        break;
+    }
+}
+
+/**
+ * emit_run - Write run(), the translated code of every block plus the dispatcher
+ */
+static void emit_run(FILE *out)
+{
+    fprintf(out, "static void run(uint16_t pc)\n{\n");
+    fprintf(out, "    uint16_t r0, r1, r2, r3, r4, r5, r6, r7, cond;\n");
+    fprintf(out, "    uint64_t writes = code_stats.writes;\n");
+    fprintf(out, "    RELOAD();\n\n");
+    fprintf(out, "dispatch:\n    switch (pc)\n    {\n");
+    for (int b = 0; b < cfg_block_count; ++b)
+    {
+        fprintf(out, "    case 0x%04X: goto L%04X;\n", cfg_blocks[b].start, cfg_blocks[b].start);
+    }
+    fprintf(out, "    default:\n");
+    fprintf(out, "    interpret:\n");
+    fprintf(out, "        /* Not reached by the static walk, or overwritten since: interpret one instruction */\n");
+    fprintf(out, "        SYNC(pc + 1);\n");
+    fprintf(out, "        execute(memory[pc]);\n");
+    fprintf(out, "        LEAVE_IF_MODIFIED();\n");
+    fprintf(out, "        RELOAD();\n");
+    fprintf(out, "        pc = reg[R_PC];\n");
+    fprintf(out, "        goto dispatch;\n    }\n");
+
+    for (int b = 0; b < cfg_block_count; ++b)
+    {
+        const struct cfg_block *block = &cfg_blocks[b];
+        fprintf(out, "\nL%04X:\n", block->start);
+        fprintf(out, "    if (!code_refs[0x%04X]) { pc = 0x%04X; goto interpret; }\n", block->start, block->start);
+        for (uint32_t pc = block->start; pc <= block->end; ++pc)
+        {
+            emit_instr(out, pc, memory[pc]);
+        }
+
+        /* Fall through to the next word unless the last instruction always leaves */
+        uint16_t last = memory[block->end];
+        uint16_t op = last >> 12;
+        int leaves = (op == OP_BR && ((last >> 9) & 0x7) == 0x7) || op == OP_JSR || op == OP_JMP || op == OP_RTI ||
+                     op == OP_RES;
+        uint16_t next = block->end + 1;
+        int adjacent = b + 1 < cfg_block_count && cfg_blocks[b + 1].start == next;
+        if (!leaves && !adjacent)
+        {
+            fprintf(out, "    ");
+            emit_goto(out, next);
+            fprintf(out, "\n");
+        }
+    }
+    fprintf(out, "}\n\n");
+}
+
+/**
+ * emit_image - Write the loaded words, so the translated program needs no image file
+ */
+static void emit_image(FILE *out)
+{
+    int segments = 0;
+    for (uint32_t a = 0; a < MEMORY_MAX;)
+    {
+        if (!(cfg_flags[a] & CFG_LOADED))
+        {
+            ++a;
+            continue;
+        }
+        uint32_t start = a;
+        fprintf(out, "static const uint16_t image_%04X[] = {", start);
+        for (; a < MEMORY_MAX && (cfg_flags[a] & CFG_LOADED); ++a)
+        {
+            fprintf(out, "%s0x%04X,", (a - start) % 12 == 0 ? "\n    " : " ", memory[a]);
+        }
+        fprintf(out, "\n};\n");
+        ++segments;
+    }
+
+    fprintf(out, "\nstatic const struct\n{\n    uint16_t origin;\n    uint32_t count;\n    const uint16_t *words;\n} segments[] = {\n");
+    for (uint32_t a = 0; a < MEMORY_MAX;)
+    {
+        if (!(cfg_flags[a] & CFG_LOADED))
+        {
+            ++a;
+            continue;
+        }
+        uint32_t start = a;
+        while (a < MEMORY_MAX && (cfg_flags[a] & CFG_LOADED))
+        {
+            ++a;
+        }
+        fprintf(out, "    {0x%04X, %u, image_%04X},\n", start, a - start, start);
+    }
+    if (segments == 0)
+    {
+        fprintf(out, "    {0, 0, NULL},\n");
+    }
+    fprintf(out, "};\n\n");
+
+    /* The translated words, claimed in the code map so stores into them are noticed */
+    fprintf(out, "static const uint16_t translated[][2] = {\n");
+    for (int b = 0; b < cfg_block_count; ++b)
+    {
+        fprintf(out, "    {0x%04X, 0x%04X},\n", cfg_blocks[b].start, cfg_blocks[b].end);
+    }
+    if (cfg_block_count == 0)
+    {
+        fprintf(out, "    {0x0001, 0x0000},\n");
+    }
+    fprintf(out, "};\n\n");
+}
+
+/**
+ * emit_main - Write main(): load the image, set up the console and run
+ */
+static void emit_main(FILE *out, int trap_mode)
+{
+    fprintf(out, "/* Index in translated[] plus one of the block each word belongs to, 0 for other words */\n");
+    fprintf(out, "static uint16_t block_of[MEMORY_MAX];\n\n");
+    fprintf(out, "/* code_write_handler: release the block holding the overwritten word, whose entry check\n");
+    fprintf(out, "   then leaves it to the interpreter */\n");
+    fprintf(out, "static int discard_block(uint16_t address)\n{\n");
+    fprintf(out, "    if (!block_of[address])\n    {\n        return 0;\n    }\n");
+    fprintf(out, "    uint16_t b = block_of[address] - 1;\n");
+    fprintf(out, "    for (uint32_t a = translated[b][0]; a <= translated[b][1]; ++a)\n");
+    fprintf(out, "    {\n        code_release(a);\n    }\n");
+    fprintf(out, "    return 1;\n}\n\n");
+    fprintf(out, "int main(int argc, const char *argv[])\n{\n");
+    fprintf(out, "    (void)argc;\n    (void)argv;\n");
+    fprintf(out, "    for (size_t i = 0; i < sizeof(segments) / sizeof(segments[0]); ++i)\n");
+    fprintf(out, "    {\n        memcpy(&memory[segments[i].origin], segments[i].words, segments[i].count * sizeof(uint16_t));\n    }\n");
+    fprintf(out, "    for (size_t i = 0; i < sizeof(translated) / sizeof(translated[0]); ++i)\n");
+    fprintf(out, "    {\n        for (uint32_t a = translated[i][0]; a <= translated[i][1]; ++a)\n");
+    fprintf(out, "        {\n            code_claim(a);\n            block_of[a] = (uint16_t)(i + 1);\n        }\n    }\n");
+    fprintf(out, "    code_write_handler = discard_block;\n");
+    fprintf(out, "    trap_init(%s);\n", trap_mode == TRAP_MODE_OS ? "TRAP_MODE_OS" : "TRAP_MODE_NATIVE");
+    fprintf(out, "    memory[MR_MCR] = (1 << 15);\n\n");
+    fprintf(out, "    signal(SIGINT, handle_interrupt);\n    disable_input_buffering();\n\n");
+    fprintf(out, "    reg[R_COND] = FL_ZRO;\n    reg[R_PC] = PC_START;\n    running = 1;\n");
+    fprintf(out, "    run(PC_START);\n\n");
+    fprintf(out, "    restore_input_buffering();\n    printf(\"\\nVM Halted. Exiting.\\n\");\n");
+    fprintf(out, "    return EXIT_SUCCESS;\n}\n");
+}
+
+/* Helpers every translated program starts with */
+static const char *prelude =
+    "#include \"main.h\"\n"
+    "#include \"trap.h\"\n"
+    "#include \"codemap.h\"\n"
+    "#include <string.h>\n"
+    "\n"
+    "#define FLAGS(v) ((v) == 0 ? FL_ZRO : ((v) >> 15) ? FL_NEG : FL_POS)\n"
+    "/* Hand the architectural state to the runtime (next = address after the instruction), and take it back */\n"
+    "#define SYNC(next) (reg[R_R0] = r0, reg[R_R1] = r1, reg[R_R2] = r2, reg[R_R3] = r3, reg[R_R4] = r4, \\\n"
+    "                    reg[R_R5] = r5, reg[R_R6] = r6, reg[R_R7] = r7, reg[R_COND] = cond, reg[R_PC] = (next))\n"
+    "#define RELOAD() (r0 = reg[R_R0], r1 = reg[R_R1], r2 = reg[R_R2], r3 = reg[R_R3], r4 = reg[R_R4], \\\n"
+    "                  r5 = reg[R_R5], r6 = reg[R_R6], r7 = reg[R_R7], cond = reg[R_COND])\n"
+    "/* After a runtime call: stop if the machine halted, and if the call overwrote translated\n"
+    "   code, which may be the current block, go on from the dispatcher */\n"
+    "#define LEAVE_IF_MODIFIED()                 \\\n"
+    "    do                                      \\\n"
+    "    {                                       \\\n"
+    "        if (!running)                       \\\n"
+    "            return;                         \\\n"
+    "        if (code_stats.writes != writes)    \\\n"
+    "        {                                   \\\n"
+    "            writes = code_stats.writes;     \\\n"
+    "            RELOAD();                       \\\n"
+    "            pc = reg[R_PC];                 \\\n"
+    "            goto dispatch;                  \\\n"
+    "        }                                   \\\n"
+    "    } while (0)\n"
+    "/* Plain memory is accessed directly; the device page goes through the runtime */\n"
+    "#define LOAD(dst, address, next)                  \\\n"
+    "    do                                            \\\n"
+    "    {                                             \\\n"
+    "        uint16_t a_ = (address);                  \\\n"
+    "        if (a_ < MR_KBSR)                         \\\n"
+    "        {                                         \\\n"
+    "            dst = memory[a_];                     \\\n"
+    "        }                                         \\\n"
+    "        else                                      \\\n"
+    "        {                                         \\\n"
+    "            SYNC(next);                           \\\n"
+    "            uint16_t v_ = mem_read(a_);           \\\n"
+    "            RELOAD();                             \\\n"
+    "            dst = v_;                             \\\n"
+    "        }                                         \\\n"
+    "    } while (0)\n"
+    "#define STORE(address, value, next)               \\\n"
+    "    do                                            \\\n"
+    "    {                                             \\\n"
+    "        uint16_t a_ = (address);                  \\\n"
+    "        if (a_ < MR_KBSR)                         \\\n"
+    "        {                                         \\\n"
+    "            memory[a_] = (value);                 \\\n"
+    "            if (code_is_translated(a_))           \\\n"
+    "            {                                     \\\n"
+    "                code_write(a_);                   \\\n"
+    "                writes = code_stats.writes;       \\\n"
+    "                pc = (next);                      \\\n"
+    "                goto dispatch;                    \\\n"
+    "            }                                     \\\n"
+    "        }                                         \\\n"
+    "        else                                      \\\n"
+    "        {                                         \\\n"
+    "            SYNC(next);                           \\\n"
+    "            mem_write(a_, (value));               \\\n"
+    "            LEAVE_IF_MODIFIED();                  \\\n"
+    "            RELOAD();                             \\\n"
+    "        }                                         \\\n"
+    "    } while (0)\n"
+    "\n";
+
+/**
+ * Main program
+ *
+ * Parameters:
+ *   argc: Number of command line arguments
+ *   argv: Options, then the images to translate
+ *
+ * Returns:
+ *   int: Exit status (EXIT_SUCCESS or EXIT_FAILURE)
+ */
+int main(int argc, const char *argv[])
+{
+    int trap_mode = TRAP_MODE_NATIVE;
+    const char *out_path = NULL;
+    int first_image = 1;
+    for (; first_image < argc && argv[first_image][0] == '-'; ++first_image)
+    {
+        if (strcmp(argv[first_image], "--os-traps") == 0)
+        {
+            trap_mode = TRAP_MODE_OS;
+        }
+        else if (strcmp(argv[first_image], "-o") == 0 && first_image + 1 < argc)
+        {
+            out_path = argv[++first_image];
+        }
+        else
+        {
+            printf("unknown option: %s\n", argv[first_image]);
+            exit(2);
+        }
+    }
+
+    if (first_image >= argc)
+    {
+        printf("lc3-aot [--os-traps] [-o out.c] [image-file1] ...\n");
+        exit(2);
+    }
+
+    for (int j = first_image; j < argc; ++j)
+    {
+        if (!read_image(argv[j]))
+        {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+    }
+    /* The walk needs to know which traps have native handlers */
+    trap_init(trap_mode);
+    cfg_build(PC_START);
+
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out)
+    {
+        printf("cannot write %s\n", out_path);
+        exit(1);
+    }
+
+    fprintf(out, "/* Translated by lc3-aot from");
+    for (int j = first_image; j < argc; ++j)
+    {
+        fprintf(out, " %s", argv[j]);
+    }
+    fprintf(out, "; link with lc3rt.a, the runtime archive the Makefile builds */\n");
+    fputs(prelude, out);
+    emit_image(out);
+    emit_run(out);
+    emit_main(out, trap_mode);
+
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/**
+ * arena.c - Bump allocator over one large, hugepage-backed mapping (see arena.h)
+ */
+#include "arena.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+/**
+ * arena_init - Reserve size bytes of address space for an arena
+ *
+ * On Unix, reserved huge pages are tried first. They are committed up front, so
+ * the mapping fails cleanly when too few are free. Otherwise the mapping is
+ * aligned to ARENA_HUGE_PAGE and marked for transparent huge pages, and memory
+ * is only committed as it is touched.
+ *
+ * Parameters:
+ *   a: The arena to set up
+ *   size: Bytes to reserve, rounded up to whole huge pages
+ *
+ * Returns:
+ *   int: 1 on success, 0 if the address space could not be reserved
+ */
+int arena_init(struct arena *a, size_t size)
+{
+    size = (size + ARENA_HUGE_PAGE - 1) & ~(size_t)(ARENA_HUGE_PAGE - 1);
+    a->used = 0;
+    a->size = size;
+    a->backing = ARENA_SMALL;
+#ifdef _WIN32
+    a->base = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    return a->base != NULL;
+#else
+#ifdef MAP_HUGETLB
+    a->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (a->base != MAP_FAILED)
+    {
+        a->backing = ARENA_HUGETLB;
+        return 1;
+    }
+#endif
+
+    /* Over-map by one huge page and trim, so the arena starts on a huge page boundary */
+    char *raw = mmap(NULL, size + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED)
+    {
+        a->base = NULL;
+        return 0;
+    }
+    size_t head = (ARENA_HUGE_PAGE - (uintptr_t)raw % ARENA_HUGE_PAGE) % ARENA_HUGE_PAGE;
+    if (head)
+    {
+        munmap(raw, head);
+    }
+    munmap(raw + head + size, ARENA_HUGE_PAGE - head);
+    a->base = raw + head;
+#ifdef MADV_HUGEPAGE
+    if (madvise(a->base, size, MADV_HUGEPAGE) == 0)
+    {
+        a->backing = ARENA_THP;
+    }
+#endif
+    return 1;
+#endif
+}
+
+/**
+ * arena_protect - Switch a code cache between writable and executable
+ *
+ * The whole mapping changes at once, which keeps it a single mapping the
+ * kernel can go on backing with huge pages; a code cache is never writable and
+ * executable at the same time.
+ *
+ * Returns:
+ *   int: 1 on success
+ */
+int arena_protect(struct arena *a, int writable)
+{
+#ifdef _WIN32
+    DWORD old;
+    return VirtualProtect(a->base, a->size, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old) != 0;
+#else
+    return mprotect(a->base, a->size, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+/**
+ * arena_alloc - Carve size bytes aligned to align (a power of two) off the arena
+ *
+ * The memory is zero-filled, as fresh anonymous memory is.
+ *
+ * Returns:
+ *   void*: The block, or NULL when the arena is exhausted
+ */
+void *arena_alloc(struct arena *a, size_t size, size_t align)
+{
+    size_t start = (a->used + align - 1) & ~(align - 1);
+    if (a->base == NULL || start > a->size || size > a->size - start)
+    {
+        return NULL;
+    }
+    a->used = start + size;
+    return a->base + start;
+}
+
+/**
+ * arena_destroy - Release an arena and everything allocated from it
+ */
+void arena_destroy(struct arena *a)
+{
+    if (a->base != NULL)
+    {
+#ifdef _WIN32
+        VirtualFree(a->base, 0, MEM_RELEASE);
+#else
+        munmap(a->base, a->size);
+#endif
+    }
+    a->base = NULL;
+    a->size = a->used = 0;
+}
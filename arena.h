@@ -0,0 +1,46 @@
+/**
+ * arena.h - Bump allocator over one large, hugepage-backed mapping
+ *
+ * Long-lived workers allocate everything their VM instances need from an arena
+ * instead of malloc: the address range is reserved once, physical memory is
+ * faulted in as the arena grows, and it is backed with huge pages so thousands
+ * of guest pages cost a handful of TLB entries. Explicit huge pages
+ * (MAP_HUGETLB) are used when the administrator has reserved enough of them;
+ * otherwise the mapping is aligned and marked for transparent huge pages. Nothing is
+ * freed individually; owners recycle what they allocated (see batch.h) and the
+ * whole arena goes away at once.
+ *
+ * An arena starts out writable; one that holds generated host code is switched
+ * to executable with arena_protect once the code is written.
+ */
+#ifndef ARENA_H
+#define ARENA_H
+#include "main.h"
+
+#define ARENA_HUGE_PAGE (2u << 20) /* huge page size the mapping is aligned to */
+
+/* How an arena is backed */
+enum
+{
+    ARENA_SMALL = 0, /* ordinary pages */
+    ARENA_THP,       /* transparent huge pages, as the kernel manages to provide them */
+    ARENA_HUGETLB    /* reserved huge pages */
+};
+
+struct arena
+{
+    char *base;
+    size_t size; /* bytes reserved */
+    size_t used; /* bytes handed out */
+    int backing; /* ARENA_* */
+};
+
+/**
+ * Function declarations/prototype
+ */
+int arena_init(struct arena *a, size_t size);
+int arena_protect(struct arena *a, int writable);
+void *arena_alloc(struct arena *a, size_t size, size_t align);
+void arena_destroy(struct arena *a);
+
+#endif /* ARENA_H */
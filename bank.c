@@ -0,0 +1,135 @@
+/**
+ * bank.c - Bank-switched extended memory: the backing object and bank selection (see bank.h)
+ */
+#include "bank.h"
+#include "codemap.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+struct bank_stats bank_stats;
+
+static uint32_t banks; /* number of banks, 0 without --banks */
+static int fd = -1;    /* the object holding every bank */
+static int copying;    /* host pages do not fit the window, so switches copy */
+
+#ifndef _WIN32
+/**
+ * map_bank - Bring a bank of the object into the window of memory[]
+ *
+ * The bank is mapped over the window, or with copying set, the window is
+ * written back to the bank it holds (old) and the new bank read in.
+ *
+ * Returns:
+ *   int: 1 on success, 0 if the mapping or the copy failed
+ */
+static int map_bank(uint16_t old, uint16_t bank)
+{
+    if (copying)
+    {
+        return pwrite(fd, memory + BANK_WINDOW, BANK_WINDOW_BYTES, (off_t)old * BANK_WINDOW_BYTES) ==
+                   BANK_WINDOW_BYTES &&
+               pread(fd, memory + BANK_WINDOW, BANK_WINDOW_BYTES, (off_t)bank * BANK_WINDOW_BYTES) ==
+                   BANK_WINDOW_BYTES;
+    }
+    void *window = mmap(memory + BANK_WINDOW, BANK_WINDOW_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+                        (off_t)bank * BANK_WINDOW_BYTES);
+    return window != MAP_FAILED;
+}
+
+/**
+ * bank_init - Create count banks and map bank 0, holding the window's current contents, into the window
+ *
+ * Returns:
+ *   int: 1 on success, 0 if count is out of range or the object cannot be
+ *        created or mapped
+ */
+int bank_init(uint32_t count)
+{
+    if (count == 0 || count > BANK_COUNT_MAX)
+    {
+        return 0;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    copying = page <= 0 || BANK_WINDOW_BYTES % page != 0 || (uintptr_t)(memory + BANK_WINDOW) % page != 0;
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("lc3-banks", MFD_CLOEXEC);
+#else
+    FILE *tmp = tmpfile();
+    fd = tmp ? dup(fileno(tmp)) : -1;
+    if (tmp)
+    {
+        fclose(tmp);
+    }
+#endif
+    /* Extending the empty object leaves it sparse: banks take memory as the guest touches them */
+    if (fd < 0 || ftruncate(fd, (off_t)count * BANK_WINDOW_BYTES) != 0 ||
+        pwrite(fd, memory + BANK_WINDOW, BANK_WINDOW_BYTES, 0) != BANK_WINDOW_BYTES || (!copying && !map_bank(0, 0)))
+    {
+        bank_close();
+        return 0;
+    }
+    banks = count;
+    memory[MR_BANK] = 0;
+    memory[MR_BANK_COUNT] = (uint16_t)count;
+    return 1;
+}
+
+/**
+ * bank_close - Drop the object; the window keeps the bank it shows until the process exits
+ */
+void bank_close(void)
+{
+    if (fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+}
+
+/**
+ * bank_select - Handle a store to MR_BANK, before the store itself
+ *
+ * Returns:
+ *   uint16_t: The bank in the window afterwards, which is the value MR_BANK takes
+ */
+uint16_t bank_select(uint16_t bank)
+{
+    uint16_t current = memory[MR_BANK];
+    if (bank >= banks)
+    {
+        ++bank_stats.ignored;
+        return current;
+    }
+    if (bank == current)
+    {
+        return current;
+    }
+    if (!map_bank(current, bank))
+    {
+        /* The old mapping may be gone, so the window has no defined contents to go on with */
+        printf("failed to map bank %u\n", bank);
+        exit(1);
+    }
+    ++bank_stats.switches;
+    code_write_range(BANK_WINDOW, BANK_WINDOW_WORDS);
+    return bank;
+}
+#else
+int bank_init(uint32_t count)
+{
+    (void)count;
+    return 0; /* no mmap */
+}
+
+void bank_close(void)
+{
+}
+
+uint16_t bank_select(uint16_t bank)
+{
+    (void)bank;
+    ++bank_stats.ignored;
+    return memory[MR_BANK];
+}
+#endif
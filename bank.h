@@ -0,0 +1,58 @@
+/**
+ * bank.h - Bank-switched extended memory behind a window of the address space
+ *
+ * With --banks N the guest gets N banks of BANK_WINDOW_WORDS words, of which one
+ * at a time appears at BANK_WINDOW (x8000-xBFFF). Two registers in the device
+ * page (main.h) control it:
+ *
+ *   MR_BANK        storing a bank number below N maps that bank into the window;
+ *                  other values are ignored. Reads return the bank in the window
+ *   MR_BANK_COUNT  N, read-only
+ *
+ * The banks live in one sparse host memory object of N * BANK_WINDOW_BYTES
+ * bytes, of which only the pages the guest touches take host memory. memory[]
+ * is aligned so that the window covers whole host pages, and selecting a bank
+ * maps that bank's part of the object over the window in place: the switch
+ * rewrites the host page table instead of copying words, and memory[] keeps
+ * its address. The handler table, traces and native code therefore go on
+ * indexing memory[] directly and see the new bank with no check of their own
+ * on the load and store paths. What the window held when the banks were set up
+ * (code or data from the images) becomes the initial contents of bank 0.
+ *
+ * Where host pages are larger than the window, as on aarch64 kernels with 64KB
+ * pages, the window cannot be mapped on its own. A switch then writes the
+ * window back to the bank it held and reads the new bank in: the guest sees
+ * the same banks, at the cost of copying two windows per switch.
+ *
+ * Translations built from words in the window are discarded on every switch,
+ * as if the whole window had been stored to. The lockstep checker rolls back a
+ * switch with the store to MR_BANK that made it. The other banks are outside
+ * the state reverse execution and batch jobs copy, so --banks cannot be
+ * combined with --reverse or --batch.
+ */
+#ifndef BANK_H
+#define BANK_H
+#include "main.h"
+
+#define BANK_WINDOW 0x8000                         /* first word of the window */
+#define BANK_WINDOW_WORDS 0x4000                   /* words in the window and in each bank */
+#define BANK_WINDOW_BYTES (BANK_WINDOW_WORDS * 2)
+#define BANK_COUNT_MAX 0xFFFF                      /* most banks, so that MR_BANK_COUNT can hold N */
+
+/* Counters for --stats */
+struct bank_stats
+{
+    uint64_t switches; /* stores to MR_BANK that mapped another bank */
+    uint64_t ignored;  /* stores to MR_BANK naming a bank past the end */
+};
+
+extern struct bank_stats bank_stats;
+
+/**
+ * Function declarations/prototype
+ */
+int bank_init(uint32_t count);
+void bank_close(void);
+uint16_t bank_select(uint16_t bank);
+
+#endif /* BANK_H */
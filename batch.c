@@ -0,0 +1,1032 @@
+/**
+ * batch.c - Lockstep batch engine (see batch.h)
+ *
+ * The image in memory[] is the template every lane starts from. The vector
+ * path covers the instructions that only touch registers and the PC; everything
+ * that reads or writes guest memory runs lane by lane through lane_step, which
+ * is also the scalar path used for outliers.
+ *
+ * Running out of arena in the middle of a job is fatal, like running out of
+ * memory elsewhere in the VM.
+ */
+#include "batch.h"
+#include "trap.h"
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define SELECT(m, a, b) (((a) & (m)) | ((b) & ~(m)))
+
+/**
+ * sext - Sign-extend the low bits of an instruction field
+ */
+static inline uint16_t sext(uint16_t x, int bits)
+{
+    return (uint16_t)((int16_t)(x << (16 - bits)) >> (16 - bits));
+}
+
+/**
+ * set_reg - Write value into register dr of one lane and set its condition codes
+ */
+static inline void set_reg(struct batch *b, int l, int dr, uint16_t value)
+{
+    b->r[dr][l] = value;
+    b->cond[l] = value == 0 ? FL_ZRO : (value >> 15 ? FL_NEG : FL_POS);
+}
+
+/**
+ * pool_alloc - Allocate from the arena of a batch's pool, or give up
+ */
+static void *pool_alloc(struct batch_pool *pool, size_t size, size_t align)
+{
+    void *block = arena_alloc(&pool->arena, size, align);
+    if (block == NULL)
+    {
+        fprintf(stderr, "batch: arena of %zu MB exhausted\n", pool->arena.size >> 20);
+        exit(1);
+    }
+    return block;
+}
+
+/**
+ * lane_end - Finish the job of a lane, report it and take the lane out of the schedule
+ */
+static void lane_end(struct batch *b, int l, int status)
+{
+    struct batch_lane *lane = &b->lane[l];
+    struct batch_job *job = lane->job;
+    if (job == NULL)
+    {
+        return;
+    }
+    job->status = status;
+    job->instructions = b->retired[l];
+    lane->job = NULL;
+    b->live[l] = 0;
+    ++b->ended;
+    b->done(job, lane->output, lane->output_len, b->done_ctx);
+}
+
+/**
+ * lane_emit - Append a character to the console output of a lane's job
+ */
+static void lane_emit(struct batch *b, int l, char c)
+{
+    struct batch_lane *lane = &b->lane[l];
+    if (lane->job == NULL)
+    {
+        return;
+    }
+    if (lane->output_len == lane->output_cap)
+    {
+        /* The outgrown buffer stays in the arena; the doubling bounds what is left behind */
+        size_t cap = lane->output_cap * 2;
+        char *output = pool_alloc(b->pool, cap, 1);
+        memcpy(output, lane->output, lane->output_len);
+        lane->output = output;
+        lane->output_cap = cap;
+    }
+    lane->output[lane->output_len++] = c;
+}
+
+/**
+ * lane_print - Append a string to the console output of a lane's job
+ */
+static void lane_print(struct batch *b, int l, const char *s)
+{
+    while (*s)
+    {
+        lane_emit(b, l, *s++);
+    }
+}
+
+/**
+ * lane_key - Take the next character of a lane's input
+ *
+ * Returns:
+ *   int: The character, or -1 after the input ran out, in which case the job has ended
+ */
+static int lane_key(struct batch *b, int l)
+{
+    struct batch_lane *lane = &b->lane[l];
+    if (lane->job == NULL || lane->input_pos >= lane->job->input_len)
+    {
+        lane_end(b, l, JOB_STARVED);
+        return -1;
+    }
+    return (unsigned char)lane->job->input[lane->input_pos++];
+}
+
+/**
+ * lane_peek - Read a word of a lane's memory without device side effects
+ */
+static inline uint16_t lane_peek(const struct batch *b, int l, uint16_t address)
+{
+    return b->lane[l].page[address >> PAGE_SHIFT][address & (PAGE_WORDS - 1)];
+}
+
+/**
+ * lane_copy - Give a lane its own copy of a shared page
+ */
+static void lane_copy(struct batch *b, int l, uint16_t page)
+{
+    struct batch_lane *lane = &b->lane[l];
+    struct batch_pool *pool = b->pool;
+    uint16_t *copy = pool->free_pages;
+    if (copy != NULL)
+    {
+        pool->free_pages = *(void **)copy;
+    }
+    else
+    {
+        copy = pool_alloc(pool, sizeof(uint16_t) * PAGE_WORDS, 64);
+        ++pool->stats.pages;
+    }
+    memcpy(copy, lane->page[page], sizeof(uint16_t) * PAGE_WORDS);
+    lane->page[page] = copy;
+    lane->private[page] = 1;
+    lane->dirty[lane->dirty_count++] = (uint8_t)page;
+    ++pool->stats.page_copies;
+}
+
+/**
+ * lane_poke - Write a word of a lane's memory without device side effects
+ */
+static inline void lane_poke(struct batch *b, int l, uint16_t address, uint16_t val)
+{
+    uint16_t page = address >> PAGE_SHIFT;
+    if (!b->lane[l].private[page])
+    {
+        lane_copy(b, l, page);
+    }
+    b->lane[l].page[page][address & (PAGE_WORDS - 1)] = val;
+}
+
+/**
+ * lane_unshare - Return the private pages of a lane, which then sees the image again
+ *
+ * Only the pages the last job dirtied are touched.
+ */
+static void lane_unshare(struct batch *b, int l)
+{
+    struct batch_lane *lane = &b->lane[l];
+    struct batch_pool *pool = b->pool;
+    while (lane->dirty_count > 0)
+    {
+        int page = lane->dirty[--lane->dirty_count];
+        *(void **)lane->page[page] = pool->free_pages;
+        pool->free_pages = lane->page[page];
+        lane->private[page] = 0;
+        lane->page[page] = memory + (page << PAGE_SHIFT);
+    }
+}
+
+/**
+ * lane_read - mem_read for one lane: the keyboard is fed from the job's input
+ */
+static uint16_t lane_read(struct batch *b, int l, uint16_t address)
+{
+    if (address == MR_KBSR)
+    {
+        int c = lane_key(b, l);
+        if (c >= 0)
+        {
+            lane_poke(b, l, MR_KBSR, 1 << 15);
+            lane_poke(b, l, MR_KBDR, (uint16_t)c);
+        }
+    }
+    else if (address == MR_DSR)
+    {
+        lane_poke(b, l, MR_DSR, 1 << 15);
+    }
+    return lane_peek(b, l, address);
+}
+
+/**
+ * lane_write - mem_write for one lane: the display goes to the job's output
+ */
+static void lane_write(struct batch *b, int l, uint16_t address, uint16_t val)
+{
+    if (address == MR_DDR)
+    {
+        lane_emit(b, l, (char)val);
+    }
+    else if (address == MR_MCR && !(val >> 15))
+    {
+        lane_end(b, l, JOB_HALTED);
+    }
+    lane_poke(b, l, address, val);
+}
+
+/**
+ * lane_trap - trap_execute for one lane
+ *
+ * Vectors without a native handler go to the guest routine exactly as in
+ * trap_execute. The native ones are reimplemented against the lane's memory and
+ * console, with the semantics documented in trap.h.
+ */
+static void lane_trap(struct batch *b, int l, uint8_t vect)
+{
+    b->r[R_R7][l] = b->pc[l];
+
+    if (!trap_is_native(vect))
+    {
+        uint16_t routine = lane_read(b, l, vect);
+        if (routine != 0 || trap_mode == TRAP_MODE_OS)
+        {
+            b->pc[l] = routine;
+        }
+        return;
+    }
+
+    uint16_t r0 = b->r[R_R0][l], r1 = b->r[R_R1][l];
+    uint32_t r2 = b->r[R_R2][l];
+    switch (vect)
+    {
+    case TRAP_GETC:
+    {
+        int c = lane_key(b, l);
+        if (c >= 0)
+        {
+            set_reg(b, l, R_R0, (uint16_t)c);
+        }
+    }
+    break;
+
+    case TRAP_OUT:
+        lane_emit(b, l, (char)r0);
+        break;
+
+    case TRAP_PUTS:
+        for (uint16_t c; (c = lane_peek(b, l, r0)) != 0; ++r0)
+        {
+            lane_emit(b, l, (char)c);
+        }
+        break;
+
+    case TRAP_IN:
+    {
+        lane_print(b, l, "Enter a character: ");
+        int c = lane_key(b, l);
+        if (c >= 0)
+        {
+            lane_emit(b, l, (char)c);
+            set_reg(b, l, R_R0, (uint16_t)(char)c);
+        }
+    }
+    break;
+
+    case TRAP_PUTSP:
+        for (uint16_t c; (c = lane_peek(b, l, r0)) != 0; ++r0)
+        {
+            lane_emit(b, l, (char)(c & 0xFF));
+            if (c >> 8)
+            {
+                lane_emit(b, l, (char)(c >> 8));
+            }
+        }
+        break;
+
+    case TRAP_HALT:
+        lane_print(b, l, "HALT\n");
+        lane_end(b, l, JOB_HALTED);
+        break;
+
+    case TRAP_MEMMOVE:
+        /* Through the bounce buffer, which handles overlap and wrapping alike */
+        for (uint32_t i = 0; i < r2; ++i)
+        {
+            b->pool->bounce[i] = lane_peek(b, l, (uint16_t)(r1 + i));
+        }
+        for (uint32_t i = 0; i < r2; ++i)
+        {
+            lane_poke(b, l, (uint16_t)(r0 + i), b->pool->bounce[i]);
+        }
+        break;
+
+    case TRAP_MEMSET:
+        for (uint32_t i = 0; i < r2; ++i)
+        {
+            lane_poke(b, l, (uint16_t)(r0 + i), r1);
+        }
+        break;
+
+    case TRAP_MEMCMP:
+    {
+        uint32_t i = 0;
+        uint16_t result = 0;
+        for (; i < r2; ++i)
+        {
+            uint16_t x = lane_peek(b, l, (uint16_t)(r0 + i)), y = lane_peek(b, l, (uint16_t)(r1 + i));
+            if (x != y)
+            {
+                result = x < y ? 0xFFFF : 1;
+                break;
+            }
+        }
+        b->r[R_R1][l] = (uint16_t)i;
+        set_reg(b, l, R_R0, result);
+    }
+    break;
+
+    case TRAP_CHECKSUM:
+    {
+        uint16_t sum = 0;
+        for (uint32_t i = 0; i < r1; ++i)
+        {
+            sum += lane_peek(b, l, (uint16_t)(r0 + i));
+        }
+        set_reg(b, l, R_R0, sum);
+    }
+    break;
+
+    case TRAP_MUL:
+    case TRAP_SMUL:
+    {
+        uint32_t product = vect == TRAP_MUL ? (uint32_t)r0 * r1
+                                            : (uint32_t)((int32_t)(int16_t)r0 * (int16_t)r1);
+        b->r[R_R1][l] = (uint16_t)(product >> 16);
+        set_reg(b, l, R_R0, (uint16_t)product);
+    }
+    break;
+
+    case TRAP_DIVU:
+        b->r[R_R1][l] = r1 == 0 ? r0 : r0 % r1;
+        set_reg(b, l, R_R0, r1 == 0 ? 0xFFFF : r0 / r1);
+        break;
+
+    case TRAP_DIVS:
+    {
+        int32_t dividend = (int16_t)r0, divisor = (int16_t)r1;
+        b->r[R_R1][l] = (uint16_t)(divisor == 0 ? dividend : dividend % divisor);
+        set_reg(b, l, R_R0, divisor == 0 ? 0xFFFF : (uint16_t)(dividend / divisor));
+    }
+    break;
+
+    case TRAP_SHL:
+        set_reg(b, l, R_R0, r1 >= 16 ? 0 : (uint16_t)(r0 << r1));
+        break;
+
+    case TRAP_SHR:
+        set_reg(b, l, R_R0, r1 >= 16 ? 0 : r0 >> r1);
+        break;
+
+    case TRAP_SRA:
+        set_reg(b, l, R_R0, (uint16_t)((int16_t)r0 >> (r1 >= 16 ? 15 : r1)));
+        break;
+
+    default:
+        /* A handler registered by the embedding program works on reg[] and memory[] */
+        lane_end(b, l, JOB_FAULT);
+        break;
+    }
+}
+
+/**
+ * lane_step - Execute one instruction of one lane (the scalar path)
+ *
+ * Mirrors execute(), with guest memory and devices redirected to the lane.
+ */
+static void lane_step(struct batch *b, int l)
+{
+    uint16_t pc = b->pc[l];
+    uint16_t instr = lane_peek(b, l, pc++);
+    uint16_t dr = (instr >> 9) & 0x7;
+    uint16_t sr1 = (instr >> 6) & 0x7;
+    b->pc[l] = pc;
+    ++b->retired[l];
+
+    switch (instr >> 12)
+    {
+    case OP_ADD:
+    case OP_AND:
+    {
+        uint16_t a = b->r[sr1][l];
+        uint16_t c = (instr & 0x20) ? sext(instr & 0x1F, 5) : b->r[instr & 0x7][l];
+        set_reg(b, l, dr, (instr >> 12) == OP_ADD ? (uint16_t)(a + c) : (a & c));
+    }
+    break;
+
+    case OP_NOT:
+        set_reg(b, l, dr, (uint16_t)~b->r[sr1][l]);
+        break;
+
+    case OP_BR:
+        if (dr & b->cond[l])
+        {
+            b->pc[l] = pc + sext(instr & 0x1FF, 9);
+        }
+        break;
+
+    case OP_JMP:
+        b->pc[l] = b->r[sr1][l];
+        break;
+
+    case OP_JSR:
+        /* R7 first, as in execute(): JSRR R7 jumps to the next instruction */
+        b->r[R_R7][l] = pc;
+        b->pc[l] = (instr >> 11) & 1 ? (uint16_t)(pc + sext(instr & 0x7FF, 11)) : b->r[sr1][l];
+        break;
+
+    case OP_LEA:
+        set_reg(b, l, dr, pc + sext(instr & 0x1FF, 9));
+        break;
+
+    case OP_LD:
+        set_reg(b, l, dr, lane_read(b, l, pc + sext(instr & 0x1FF, 9)));
+        break;
+
+    case OP_LDI:
+        set_reg(b, l, dr, lane_read(b, l, lane_read(b, l, pc + sext(instr & 0x1FF, 9))));
+        break;
+
+    case OP_LDR:
+        set_reg(b, l, dr, lane_read(b, l, b->r[sr1][l] + sext(instr & 0x3F, 6)));
+        break;
+
+    case OP_ST:
+        lane_write(b, l, pc + sext(instr & 0x1FF, 9), b->r[dr][l]);
+        break;
+
+    case OP_STI:
+        lane_write(b, l, lane_read(b, l, pc + sext(instr & 0x1FF, 9)), b->r[dr][l]);
+        break;
+
+    case OP_STR:
+        lane_write(b, l, b->r[sr1][l] + sext(instr & 0x3F, 6), b->r[dr][l]);
+        break;
+
+    case OP_TRAP:
+        lane_trap(b, l, instr & 0xFF);
+        break;
+
+    default:
+        /* RTI and the reserved opcode: there is no console to report them on */
+        lane_end(b, l, JOB_FAULT);
+        break;
+    }
+}
+
+/**
+ * vector_step - Execute instr, found at pc, for every lane selected by mask
+ *
+ * Returns:
+ *   int: Non-zero if the instruction was executed on the vector path
+ */
+static int vector_step(struct batch *b, const lanes_t *group, uint16_t pc, uint16_t instr)
+{
+    lanes_t mask = *group;
+    uint16_t next = pc + 1;
+    int dr = (instr >> 9) & 0x7;
+    int sr1 = (instr >> 6) & 0x7;
+    lanes_t value;
+
+    switch (instr >> 12)
+    {
+    case OP_ADD:
+    case OP_AND:
+    {
+        lanes_t operand = (instr & 0x20) ? (lanes_t){0} + sext(instr & 0x1F, 5) : b->r[instr & 0x7];
+        value = (instr >> 12) == OP_ADD ? b->r[sr1] + operand : (b->r[sr1] & operand);
+    }
+    break;
+
+    case OP_NOT:
+        value = ~b->r[sr1];
+        break;
+
+    case OP_LEA:
+        value = (lanes_t){0} + (uint16_t)(next + sext(instr & 0x1FF, 9));
+        break;
+
+    case OP_BR:
+    {
+        lanes_t taken = (lanes_t)((b->cond & (uint16_t)dr) != 0);
+        lanes_t target = SELECT(taken, (lanes_t){0} + (uint16_t)(next + sext(instr & 0x1FF, 9)), (lanes_t){0} + next);
+        b->pc = SELECT(mask, target, b->pc);
+        goto retire;
+    }
+
+    case OP_JMP:
+        b->pc = SELECT(mask, b->r[sr1], b->pc);
+        goto retire;
+
+    case OP_JSR:
+    {
+        /* R7 first, as in lane_step */
+        b->r[R_R7] = SELECT(mask, (lanes_t){0} + next, b->r[R_R7]);
+        lanes_t target = (instr >> 11) & 1 ? (lanes_t){0} + (uint16_t)(next + sext(instr & 0x7FF, 11)) : b->r[sr1];
+        b->pc = SELECT(mask, target, b->pc);
+        goto retire;
+    }
+
+    default:
+        return 0;
+    }
+
+    /* The condition codes of every lane's value, as update_flags computes them */
+    lanes_t zero = (lanes_t)(value == 0);
+    lanes_t cond = (zero & FL_ZRO) | (~zero & (FL_POS + (value >> 15) * (FL_NEG - FL_POS)));
+    b->r[dr] = SELECT(mask, value, b->r[dr]);
+    b->cond = SELECT(mask, cond, b->cond);
+    b->pc = SELECT(mask, (lanes_t){0} + next, b->pc);
+
+retire:
+    b->retired += __builtin_convertvector(mask & 1, counts_t);
+    return 1;
+}
+
+/**
+ * lane_start - Load a job into an idle lane, which starts out seeing the image
+ */
+static void lane_start(struct batch *b, int l, struct batch_job *job)
+{
+    struct batch_lane *lane = &b->lane[l];
+    lane_unshare(b, l);
+    for (int i = 0; i < 8; ++i)
+    {
+        b->r[i][l] = 0;
+    }
+    b->pc[l] = PC_START;
+    b->cond[l] = FL_ZRO;
+    b->live[l] = 0xFFFF;
+    b->waiting[l] = 0;
+    b->retired[l] = 0;
+
+    lane->job = job;
+    lane->input_pos = 0;
+    lane->output_len = 0;
+    job->status = JOB_HALTED;
+}
+
+/**
+ * batch_pool_init - Set up an empty pool with an arena of BATCH_ARENA_SIZE
+ *
+ * Parameters:
+ *   pool: The pool
+ *   node: NUMA node the arena's memory should come from, or NULL for no preference
+ *
+ * Returns:
+ *   int: 1 on success, 0 if the arena could not be reserved
+ */
+int batch_pool_init(struct batch_pool *pool, const struct numa_node *node)
+{
+    memset(pool, 0, sizeof(*pool));
+    if (!arena_init(&pool->arena, BATCH_ARENA_SIZE))
+    {
+        return 0;
+    }
+    if (node != NULL)
+    {
+        numa_bind(pool->arena.base, pool->arena.size, node);
+    }
+    pool->bounce = arena_alloc(&pool->arena, sizeof(uint16_t) * MEMORY_MAX, 64);
+    return pool->bounce != NULL;
+}
+
+/**
+ * batch_pool_destroy - Release a pool together with all its batches and pages
+ */
+void batch_pool_destroy(struct batch_pool *pool)
+{
+    arena_destroy(&pool->arena);
+    memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * batch_acquire - Take a batch with BATCH_LANES idle lanes from a pool
+ *
+ * Released batches are reused; otherwise a new one is carved from the arena
+ * and initialized, with every lane seeing the image in memory[].
+ *
+ * Returns:
+ *   struct batch*: The batch, or NULL if the arena is exhausted
+ */
+struct batch *batch_acquire(struct batch_pool *pool)
+{
+    struct batch *b = pool->idle;
+    if (b != NULL)
+    {
+        pool->idle = b->next_idle;
+        ++pool->stats.reuses;
+        return b;
+    }
+
+    b = arena_alloc(&pool->arena, sizeof(struct batch), _Alignof(struct batch));
+    if (b == NULL)
+    {
+        return NULL;
+    }
+    b->pool = pool;
+    for (int l = 0; l < BATCH_LANES; ++l)
+    {
+        struct batch_lane *lane = &b->lane[l];
+        for (int page = 0; page < PAGE_COUNT; ++page)
+        {
+            lane->page[page] = memory + (page << PAGE_SHIFT);
+        }
+        lane->output_cap = 256;
+        lane->output = arena_alloc(&pool->arena, lane->output_cap, 1);
+        if (lane->output == NULL)
+        {
+            return NULL;
+        }
+    }
+    ++pool->stats.batches;
+    return b;
+}
+
+/**
+ * batch_release - Return a batch whose jobs have all ended to its pool
+ *
+ * The private pages of the last jobs go back to the pool, so the batch is
+ * ready to run again.
+ */
+void batch_release(struct batch *b)
+{
+    for (int l = 0; l < BATCH_LANES; ++l)
+    {
+        lane_unshare(b, l);
+    }
+    b->next_idle = b->pool->idle;
+    b->pool->idle = b;
+}
+
+/**
+ * batch_step - Schedule one group of lanes and run it
+ *
+ * Returns:
+ *   int: Zero if no lane is running a job
+ */
+static int batch_step(struct batch *b)
+{
+    /* Pick the lowest PC, unless a lane has been masked off for too long */
+    int leader = -1, starved = -1;
+    for (int l = 0; l < BATCH_LANES; ++l)
+    {
+        if (!b->live[l])
+        {
+            continue;
+        }
+        if (leader < 0 || b->pc[l] < b->pc[leader])
+        {
+            leader = l;
+        }
+        if (b->waiting[l] > BATCH_PATIENCE && (starved < 0 || b->waiting[l] > b->waiting[starved]))
+        {
+            starved = l;
+        }
+    }
+    if (leader < 0)
+    {
+        return 0;
+    }
+    if (starved >= 0)
+    {
+        leader = starved;
+    }
+
+    /* The group: lanes at the same PC holding the same instruction there (code may be self-modified) */
+    uint16_t pc = b->pc[leader];
+    uint16_t instr = lane_peek(b, leader, pc);
+    lanes_t mask = (lanes_t)(b->pc == pc) & b->live;
+    int size = 0;
+    for (int l = 0; l < BATCH_LANES; ++l)
+    {
+        if (mask[l] && lane_peek(b, l, pc) != instr)
+        {
+            mask[l] = 0;
+        }
+        size += mask[l] & 1;
+    }
+
+    if (size == 1)
+    {
+        /* An outlier: run it alone until it meets another lane */
+        ++b->pool->stats.bursts;
+        for (int i = 0; i < BATCH_BURST && b->live[leader]; ++i)
+        {
+            lane_step(b, leader);
+            ++b->pool->stats.scalar_instrs;
+            lanes_t met = (lanes_t)(b->pc == b->pc[leader]) & b->live;
+            met[leader] = 0;
+            uint16_t any = 0;
+            for (int l = 0; l < BATCH_LANES; ++l)
+            {
+                any |= met[l];
+            }
+            if (any)
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        if (!vector_step(b, &mask, pc, instr))
+        {
+            /* Memory and traps: the same instruction, lane by lane */
+            for (int l = 0; l < BATCH_LANES; ++l)
+            {
+                if (mask[l])
+                {
+                    lane_step(b, l);
+                }
+            }
+        }
+        ++b->pool->stats.vector_steps;
+        b->pool->stats.vector_lanes += size;
+    }
+    b->waiting = (b->waiting + 1) & ~mask & b->live;
+    return 1;
+}
+
+/**
+ * batch_run - Run jobs to completion, BATCH_LANES at a time
+ *
+ * Every job starts from the image in memory[] with PC_START and the Z flag, like
+ * the VM does. A lane that finishes its job takes the next one right away, so
+ * the lanes stay busy until the jobs run out.
+ *
+ * Parameters:
+ *   b: The batch
+ *   next: Returns the next job, or NULL when there are no more; the instruction
+ *         count and status of each job are filled in
+ *   next_ctx: Passed on to next
+ *   done: Called with the output of each job as it ends
+ *   done_ctx: Passed on to done
+ */
+void batch_run(struct batch *b, batch_next_fn next, void *next_ctx, batch_done_fn done, void *done_ctx)
+{
+    b->done = done;
+    b->done_ctx = done_ctx;
+    int more = 1;
+    do
+    {
+        for (int l = 0; l < BATCH_LANES && more; ++l)
+        {
+            if (b->lane[l].job == NULL)
+            {
+                struct batch_job *job = next(next_ctx);
+                if (job == NULL)
+                {
+                    more = 0;
+                }
+                else
+                {
+                    lane_start(b, l, job);
+                }
+            }
+        }
+        b->ended = 0;
+        while (batch_step(b) && !(b->ended && more))
+        {
+        }
+    } while (more);
+}
+
+/* Workers */
+/**
+ * Each worker thread owns a pool, pinned like the thread itself to one NUMA
+ * node, and a queue holding a range of job indices. It takes jobs from the
+ * front of its own queue. Once that is empty it steals the back half of
+ * another worker's queue, trying the workers of its own node first, so jobs
+ * (and the instance memory they touch) cross sockets only when a whole node
+ * has run dry.
+ */
+struct batch_worker
+{
+    struct batch_crew *crew;
+    int id;
+    const struct numa_node *node;
+    size_t head, tail; /* the worker's queue: jobs[head..tail) */
+#ifndef _WIN32
+    pthread_mutex_t lock;
+    pthread_t thread;
+#endif
+    struct batch_pool pool;
+    int failed;
+};
+
+struct batch_crew
+{
+    struct batch_job *jobs;
+    struct batch_worker *workers;
+    int count;
+    batch_done_fn done;
+    void *done_ctx;
+};
+
+static void queue_lock(struct batch_worker *w)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&w->lock);
+#else
+    (void)w;
+#endif
+}
+
+static void queue_unlock(struct batch_worker *w)
+{
+#ifndef _WIN32
+    pthread_mutex_unlock(&w->lock);
+#else
+    (void)w;
+#endif
+}
+
+/**
+ * steal - Move the back half of victim's queue into the empty queue of thief
+ *
+ * Returns:
+ *   int: Non-zero if anything was taken
+ */
+static int steal(struct batch_worker *thief, struct batch_worker *victim)
+{
+    queue_lock(victim);
+    size_t tail = victim->tail;
+    size_t take = (tail - victim->head + 1) / 2;
+    victim->tail -= take;
+    queue_unlock(victim);
+    if (take == 0)
+    {
+        return 0;
+    }
+
+    queue_lock(thief);
+    thief->head = tail - take;
+    thief->tail = tail;
+    queue_unlock(thief);
+    ++thief->pool.stats.steals;
+    if (victim->node != thief->node)
+    {
+        ++thief->pool.stats.remote_steals;
+    }
+    return 1;
+}
+
+/**
+ * worker_next - batch_next_fn of a worker: its own queue first, then stolen jobs
+ */
+static struct batch_job *worker_next(void *ctx)
+{
+    struct batch_worker *w = ctx;
+    struct batch_crew *crew = w->crew;
+    for (;;)
+    {
+        queue_lock(w);
+        if (w->head < w->tail)
+        {
+            struct batch_job *job = &crew->jobs[w->head++];
+            queue_unlock(w);
+            return job;
+        }
+        queue_unlock(w);
+
+        /* Victims on the same node first, then the rest */
+        int stolen = 0;
+        for (int remote = 0; remote < 2 && !stolen; ++remote)
+        {
+            for (int i = 1; i < crew->count && !stolen; ++i)
+            {
+                struct batch_worker *victim = &crew->workers[(w->id + i) % crew->count];
+                if ((victim->node != w->node) == remote)
+                {
+                    stolen = steal(w, victim);
+                }
+            }
+        }
+        if (!stolen)
+        {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * worker_main - Body of a worker thread
+ */
+static void *worker_main(void *arg)
+{
+    struct batch_worker *w = arg;
+    struct batch_crew *crew = w->crew;
+    if (crew->count > 1)
+    {
+        numa_pin_thread(w->node);
+    }
+
+    /* Created after pinning, so first touch also lands on the worker's node */
+    struct batch *b = NULL;
+    if (batch_pool_init(&w->pool, w->node))
+    {
+        b = batch_acquire(&w->pool);
+    }
+    if (b == NULL)
+    {
+        w->failed = 1;
+        return NULL;
+    }
+    batch_run(b, worker_next, w, crew->done, crew->done_ctx);
+    batch_release(b);
+    return NULL;
+}
+
+/**
+ * batch_run_workers - Run jobs on several worker threads, each with its own batch
+ *
+ * Workers are spread round-robin over the NUMA nodes and start with equal,
+ * contiguous shares of the jobs. done is called from the worker threads, but
+ * never concurrently for the same job.
+ *
+ * Parameters:
+ *   jobs: The jobs; their instruction count and status are filled in
+ *   count: Number of jobs
+ *   workers: Number of worker threads; 1 runs in the calling thread
+ *   done: Called with the output of each job as it ends
+ *   ctx: Passed on to done
+ *   stats: Receives the counters of all workers added up, and the arena backing
+ *
+ * Returns:
+ *   int: 1 on success, 0 if a worker could not set up its pool
+ */
+int batch_run_workers(struct batch_job *jobs, size_t count, int workers, batch_done_fn done, void *ctx,
+                      struct batch_stats *stats)
+{
+#ifdef _WIN32
+    workers = 1;
+#endif
+    static struct numa_node nodes[NUMA_MAX_NODES];
+    int node_count = numa_discover(nodes, NUMA_MAX_NODES);
+
+    struct batch_worker *w = calloc(workers, sizeof(struct batch_worker));
+    if (w == NULL)
+    {
+        return 0;
+    }
+    struct batch_crew crew = {jobs, w, workers, done, ctx};
+    for (int i = 0; i < workers; ++i)
+    {
+        w[i].crew = &crew;
+        w[i].id = i;
+        w[i].node = &nodes[i % node_count];
+        w[i].head = count * i / workers;
+        w[i].tail = count * (i + 1) / workers;
+#ifndef _WIN32
+        pthread_mutex_init(&w[i].lock, NULL);
+#endif
+    }
+
+    if (workers == 1)
+    {
+        worker_main(&w[0]);
+    }
+#ifndef _WIN32
+    else
+    {
+        for (int i = 0; i < workers; ++i)
+        {
+            if (pthread_create(&w[i].thread, NULL, worker_main, &w[i]) != 0)
+            {
+                /* Run it here instead; the others steal its jobs meanwhile */
+                w[i].thread = pthread_self();
+                worker_main(&w[i]);
+            }
+        }
+        for (int i = 0; i < workers; ++i)
+        {
+            if (!pthread_equal(w[i].thread, pthread_self()))
+            {
+                pthread_join(w[i].thread, NULL);
+            }
+        }
+    }
+#endif
+
+    int ok = 1;
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < workers; ++i)
+    {
+        struct batch_stats *ws = &w[i].pool.stats;
+        stats->vector_steps += ws->vector_steps;
+        stats->vector_lanes += ws->vector_lanes;
+        stats->scalar_instrs += ws->scalar_instrs;
+        stats->bursts += ws->bursts;
+        stats->page_copies += ws->page_copies;
+        stats->pages += ws->pages;
+        stats->batches += ws->batches;
+        stats->reuses += ws->reuses;
+        stats->steals += ws->steals;
+        stats->remote_steals += ws->remote_steals;
+        stats->arena_used += w[i].pool.arena.used;
+        stats->arena_backing = w[i].pool.arena.backing;
+        ok &= !w[i].failed;
+        batch_pool_destroy(&w[i].pool);
+#ifndef _WIN32
+        pthread_mutex_destroy(&w[i].lock);
+#endif
+    }
+    stats->nodes = node_count < workers ? node_count : workers;
+    free(w);
+    return ok;
+}
@@ -0,0 +1,155 @@
+/**
+ * batch.h - Lockstep execution of many guests running the same image
+ *
+ * A batch runs BATCH_LANES copies of the loaded image side by side, each with
+ * its own input (one job) and its own registers, memory and console output.
+ * The register files are transposed to structure-of-arrays: r[i] is a vector
+ * holding register i of every lane, so one decoded instruction is applied to all
+ * lanes that are at the same PC with a single vector operation. With 16-bit
+ * registers, 16 lanes fill a 256-bit AVX2 register (32 lanes an AVX-512 one);
+ * the vectors use GCC's generic vector extension, so the same code builds for
+ * any target and the compiler picks the widest instructions -march allows.
+ *
+ * Lanes whose branches go different ways end up at different PCs. Each step
+ * executes the group of lanes at the lowest PC, with the other lanes masked
+ * off, which lets loops and if/else arms reconverge at the first instruction
+ * they share. A lane that is alone at its PC (an outlier) is not worth a vector
+ * step: it runs on the scalar path until it catches up with another lane.
+ * Loads, stores and traps are per-lane work and always take the scalar path.
+ *
+ * Guest memory is paged with the pages of codemap.h. A lane's page table starts
+ * out pointing at the pages of the image in memory[], which all lanes share and
+ * never write; the first store into a page gives the lane its own copy. A guest
+ * therefore costs its page table plus the pages it has written, instead of the
+ * whole 128KB, and the shared code and constant tables stay hot in the cache.
+ * memory[] must not change while a batch runs.
+ *
+ * Batches are pooled: a long-lived worker keeps a batch_pool, whose batches,
+ * private pages, output buffers and scratch space all come from one arena (see
+ * arena.h) and are recycled rather than freed. A batch comes out of the pool
+ * fully initialized, and getting a lane ready for the next job only undoes what
+ * the last one dirtied: its private pages and its registers.
+ *
+ * Input is fed to the keyboard of each lane, and a lane's job ends when it
+ * halts, faults, or asks for more input than its job supplied.
+ */
+#ifndef BATCH_H
+#define BATCH_H
+#include "main.h"
+#include "codemap.h"
+#include "arena.h"
+#include "numa.h"
+
+#define PAGE_WORDS (1 << PAGE_SHIFT)
+
+#ifndef BATCH_LANES
+#define BATCH_LANES 16 /* guests per batch; 8 fills a 128-bit register, 16 a 256-bit one */
+#endif
+
+#define BATCH_BURST 256    /* longest run of a lone lane on the scalar path before rescheduling */
+#define BATCH_PATIENCE 512 /* steps a lane may be masked off before it is scheduled regardless of its PC */
+#define BATCH_ARENA_SIZE ((size_t)64 << 20) /* address space reserved per pool; committed as it is used */
+
+/* One 16-bit value per lane; comparisons yield 0xFFFF in the lanes where they hold */
+typedef uint16_t lanes_t __attribute__((vector_size(BATCH_LANES * sizeof(uint16_t))));
+/* One instruction counter per lane */
+typedef uint64_t counts_t __attribute__((vector_size(BATCH_LANES * sizeof(uint64_t))));
+
+/* How a job ended */
+enum
+{
+    JOB_HALTED = 0, /* HALT, or the OS clearing MCR */
+    JOB_STARVED,    /* the guest waited for input after consuming all of it */
+    JOB_FAULT       /* RTI, a reserved opcode or a trap the batch engine cannot service */
+};
+
+/* A unit of work: the guest's keyboard input and, once it has run, how it ended */
+struct batch_job
+{
+    const char *input;
+    size_t input_len;
+    uint64_t instructions;
+    int status; /* JOB_* */
+};
+
+/**
+ * Called as each job ends, with the job's console output. The output lives in
+ * the lane's recycled buffer, so it is only valid during the call.
+ */
+typedef void (*batch_done_fn)(struct batch_job *job, const char *output, size_t len, void *ctx);
+
+/* Supplies the jobs of batch_run, one at a time; NULL when there are no more */
+typedef struct batch_job *(*batch_next_fn)(void *ctx);
+
+/* Per-lane state that is not a register */
+struct batch_lane
+{
+    struct batch_job *job; /* NULL while the lane is idle */
+    size_t input_pos;
+    char *output; /* console output of the current job, kept with its capacity across jobs */
+    size_t output_len;
+    size_t output_cap;
+    uint16_t *page[PAGE_COUNT];  /* where each page of the lane's memory is: in memory[] or a private copy */
+    uint8_t private[PAGE_COUNT]; /* pages the lane has written, and so copied */
+    uint8_t dirty[PAGE_COUNT];   /* the private pages, in the order they were copied */
+    int dirty_count;
+};
+
+/* Counters for --stats */
+struct batch_stats
+{
+    uint64_t vector_steps;  /* instructions executed for a group of lanes at once */
+    uint64_t vector_lanes;  /* lane-instructions retired by those steps */
+    uint64_t scalar_instrs; /* lane-instructions retired on the scalar path */
+    uint64_t bursts;        /* times a lone lane was run on the scalar path */
+    uint64_t page_copies;   /* pages copied on the first store of a job */
+    uint64_t pages;         /* private pages allocated, each reused by later jobs */
+    uint64_t batches;       /* batches carved from the arena */
+    uint64_t reuses;        /* batches handed out again after a release */
+    uint64_t steals;        /* job ranges taken from another worker */
+    uint64_t remote_steals; /* of those, from a worker on another NUMA node */
+    size_t arena_used;      /* bytes of arena in use, filled in by batch_run_workers */
+    int arena_backing;      /* ARENA_*, filled in by batch_run_workers */
+    int nodes;              /* NUMA nodes the workers were spread over */
+};
+
+struct batch;
+
+/* Recycled batches and guest pages of one worker, all allocated from its arena */
+struct batch_pool
+{
+    struct arena arena;
+    struct batch *idle;          /* released batches, ready to run */
+    void *free_pages;            /* private pages of finished jobs, linked through their first word */
+    uint16_t *bounce;            /* scratch for MEMMOVE, MEMORY_MAX words */
+    struct batch_stats stats;
+};
+
+struct batch
+{
+    lanes_t r[8]; /* r[i][lane] = register Ri of a lane */
+    lanes_t pc;
+    lanes_t cond;
+    lanes_t live;    /* 0xFFFF in lanes running a job */
+    lanes_t waiting; /* steps each lane has been masked off */
+    counts_t retired; /* instructions of the current job */
+    int ended;        /* jobs finished since batch_run last refilled the lanes */
+    struct batch_lane lane[BATCH_LANES];
+    struct batch_pool *pool;
+    struct batch *next_idle;
+    batch_done_fn done;
+    void *done_ctx;
+};
+
+/**
+ * Function declarations/prototype
+ */
+int batch_pool_init(struct batch_pool *pool, const struct numa_node *node);
+void batch_pool_destroy(struct batch_pool *pool);
+struct batch *batch_acquire(struct batch_pool *pool);
+void batch_release(struct batch *b);
+void batch_run(struct batch *b, batch_next_fn next, void *next_ctx, batch_done_fn done, void *done_ctx);
+int batch_run_workers(struct batch_job *jobs, size_t count, int workers, batch_done_fn done, void *ctx,
+                      struct batch_stats *stats);
+
+#endif /* BATCH_H */
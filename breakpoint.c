@@ -0,0 +1,429 @@
+/**
+ * breakpoint.c - Hooking handler_table entries for breakpoints (see breakpoint.h)
+ */
+#include "breakpoint.h"
+#include "decode.h"
+#include "codemap.h"
+#include "trace.h"
+#include <string.h>
+#include <ctype.h>
+
+uint8_t bp_slot[MEMORY_MAX];
+struct breakpoint breakpoints[BP_MAX];
+bp_handler_fn bp_handler;
+
+static op_handler original[MEMORY_MAX]; /* handler a hooked word had before */
+static uint8_t hooks[MEMORY_MAX];       /* breakpoints sitting on each instruction word */
+static op_handler saved[MEMORY_MAX];    /* the table while bp_stop_next has it pointing at h_stop */
+static volatile sig_atomic_t stopping;  /* set while handler_table is all h_stop */
+static volatile sig_atomic_t editing;   /* set while the table is being changed */
+static volatile sig_atomic_t deferred;  /* bp_stop_next came in during an edit */
+
+/**
+ * live_table - The table hooks go into: handler_table, or its saved copy while it is all h_stop
+ */
+static op_handler *live_table(void)
+{
+    return stopping ? saved : handler_table;
+}
+
+/**
+ * end_edit - Finish a change to the table, then take a stop request that arrived meanwhile
+ */
+static void end_edit(void)
+{
+    editing = 0;
+    if (deferred)
+    {
+        deferred = 0;
+        bp_stop_next();
+    }
+}
+
+/**
+ * bp_matches - Evaluate the condition of a breakpoint on the current registers
+ *
+ * Handlers run with the PC already past the instruction, so PC terms compare
+ * bp->address, where the guest is stopped.
+ */
+static int bp_matches(const struct breakpoint *bp)
+{
+    for (int i = 0; i < bp->term_count; ++i)
+    {
+        const struct bp_term *t = &bp->terms[i];
+        uint16_t v = t->index == R_PC ? bp->address : reg[t->index];
+        int holds;
+        switch (t->op)
+        {
+        case BP_EQ:
+            holds = v == t->value;
+            break;
+        case BP_NE:
+            holds = v != t->value;
+            break;
+        case BP_LT:
+            holds = (int16_t)v < (int16_t)t->value;
+            break;
+        case BP_LE:
+            holds = (int16_t)v <= (int16_t)t->value;
+            break;
+        case BP_GT:
+            holds = (int16_t)v > (int16_t)t->value;
+            break;
+        default:
+            holds = (int16_t)v >= (int16_t)t->value;
+            break;
+        }
+        if (!holds)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * divert - Stop before the instruction at pc, then carry on from wherever bp_handler left the machine
+ *
+ * bp_handler sees instr_count without the instruction, which has not executed
+ * yet. It may move the PC, rewrite memory or take the machine somewhere else
+ * entirely (replay.h); exactly one instruction, the one at the PC it leaves,
+ * then executes. Not through the table: a breakpoint there must not stop the
+ * guest a second time, and a step asked for by bp_handler has already filled
+ * it with h_stop.
+ */
+static void divert(uint16_t pc, uint16_t instr, struct breakpoint *bp)
+{
+    reg[R_PC] = pc;
+    uint64_t count = --instr_count;
+    bp_handler(bp);
+    if (!running)
+    {
+        return;
+    }
+    if (instr_count != count || reg[R_PC] != pc || memory[pc] != instr)
+    {
+        pc = reg[R_PC];
+        instr = memory[pc];
+    }
+    reg[R_PC] = pc + 1;
+    ++instr_count;
+    (hooks[instr] ? original[instr] : live_table()[instr])(instr);
+}
+
+/**
+ * h_breakpoint - Handler of every hooked instruction word
+ *
+ * Runs with the PC already past the instruction, like any handler.
+ */
+static void h_breakpoint(uint16_t instr)
+{
+    uint16_t pc = reg[R_PC] - 1;
+    struct breakpoint *bp = bp_at(pc);
+    if (bp && bp_handler && bp_matches(bp))
+    {
+        ++bp->hits;
+        divert(pc, instr, bp);
+        return;
+    }
+    original[instr](instr);
+}
+
+/**
+ * h_stop - Handler of every instruction word after bp_stop_next
+ */
+static void h_stop(uint16_t instr)
+{
+    uint16_t pc = reg[R_PC] - 1;
+    editing = 1;
+    memcpy(handler_table, saved, sizeof(saved));
+    stopping = 0;
+    end_edit();
+
+    if (bp_handler)
+    {
+        divert(pc, instr, NULL);
+        return;
+    }
+    (hooks[instr] ? original[instr] : live_table()[instr])(instr);
+}
+
+/**
+ * bp_stop_next - Call bp_handler before the next instruction executes
+ */
+void bp_stop_next(void)
+{
+    if (stopping)
+    {
+        return;
+    }
+    if (editing)
+    {
+        deferred = 1;
+        return;
+    }
+    memcpy(saved, handler_table, sizeof(saved));
+    for (uint32_t i = 0; i < MEMORY_MAX; ++i)
+    {
+        handler_table[i] = h_stop;
+    }
+    stopping = 1;
+}
+
+/**
+ * hook - Route an instruction word through h_breakpoint
+ */
+static void hook(uint16_t word)
+{
+    editing = 1;
+    if (hooks[word]++ == 0)
+    {
+        original[word] = live_table()[word];
+        live_table()[word] = h_breakpoint;
+    }
+    end_edit();
+}
+
+/**
+ * unhook - Drop one breakpoint's hook of an instruction word
+ */
+static void unhook(uint16_t word)
+{
+    editing = 1;
+    if (--hooks[word] == 0)
+    {
+        live_table()[word] = original[word];
+    }
+    end_edit();
+}
+
+/**
+ * bp_parse_value - Read a constant: decimal, #decimal, xHEX or 0xHEX
+ *
+ * Parameters:
+ *   text: Where the constant starts
+ *   end: Set to the first character after it
+ *   value: The constant, truncated to 16 bits
+ *
+ * Returns:
+ *   int: 1 on success, 0 if text does not start with a constant
+ */
+int bp_parse_value(const char *text, const char **end, uint16_t *value)
+{
+    int base = 10;
+    if (*text == '#')
+    {
+        ++text;
+    }
+    else if (*text == 'x' || *text == 'X')
+    {
+        base = 16;
+        ++text;
+    }
+    else if (text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+    {
+        base = 16;
+        text += 2;
+    }
+    char *stop;
+    long v = strtol(text, &stop, base);
+    if (stop == text || (base == 16 && *text == '-'))
+    {
+        return 0;
+    }
+    *end = stop;
+    *value = (uint16_t)v;
+    return 1;
+}
+
+/**
+ * bp_compile - Compile a condition into the terms of a breakpoint
+ *
+ * Parameters:
+ *   text: The condition (see breakpoint.h), or NULL or "" for none
+ *   bp: Breakpoint whose terms are filled in
+ *
+ * Returns:
+ *   int: 1 on success, 0 if the condition does not parse or has too many terms
+ */
+int bp_compile(const char *text, struct breakpoint *bp)
+{
+    static const char *const names[] = {"R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "COND"};
+    static const char *const ops[] = {"==", "!=", "<", "<=", ">", ">="};
+
+    bp->term_count = 0;
+    const char *p = text ? text : "";
+    while (isspace((unsigned char)*p))
+    {
+        ++p;
+    }
+    while (*p)
+    {
+        if (bp->term_count == BP_TERMS)
+        {
+            return 0;
+        }
+        struct bp_term *t = &bp->terms[bp->term_count++];
+
+        size_t len = 0;
+        while (isalnum((unsigned char)p[len]))
+        {
+            ++len;
+        }
+        int index = -1;
+        for (int i = 0; i < R_COUNT; ++i)
+        {
+            if (strlen(names[i]) == len && strncmp(names[i], p, len) == 0)
+            {
+                index = i;
+            }
+        }
+        if (index < 0)
+        {
+            return 0;
+        }
+        t->index = (uint8_t)index;
+        p += len;
+        while (isspace((unsigned char)*p))
+        {
+            ++p;
+        }
+
+        /* Longest operator first, so "<=" is not taken for "<" */
+        int op = -1;
+        for (int i = 0; i < 6; ++i)
+        {
+            if (strncmp(p, ops[i], strlen(ops[i])) == 0 && (op < 0 || strlen(ops[i]) > strlen(ops[op])))
+            {
+                op = i;
+            }
+        }
+        if (op < 0)
+        {
+            return 0;
+        }
+        t->op = (uint8_t)op;
+        p += strlen(ops[op]);
+        while (isspace((unsigned char)*p))
+        {
+            ++p;
+        }
+
+        if (!bp_parse_value(p, &p, &t->value))
+        {
+            return 0;
+        }
+        while (isspace((unsigned char)*p))
+        {
+            ++p;
+        }
+        if (p[0] == '&' && p[1] == '&')
+        {
+            p += 2;
+            while (isspace((unsigned char)*p))
+            {
+                ++p;
+            }
+            if (*p == '\0')
+            {
+                return 0;
+            }
+        }
+        else if (*p)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * bp_set - Set a breakpoint, or replace the condition of the one at address
+ *
+ * Builds the handler table first if the interpreter runs on the decode switch.
+ *
+ * Parameters:
+ *   address: Where the guest stops, before executing the instruction there
+ *   condition: Condition that must hold for it to stop, or NULL
+ *
+ * Returns:
+ *   struct breakpoint *: The breakpoint, or NULL if the condition is invalid or
+ *   all BP_MAX breakpoints are in use
+ */
+struct breakpoint *bp_set(uint16_t address, const char *condition)
+{
+    struct breakpoint compiled;
+    if (!bp_compile(condition, &compiled))
+    {
+        return NULL;
+    }
+    struct breakpoint *bp = bp_at(address);
+    if (bp)
+    {
+        bp->term_count = compiled.term_count;
+        memcpy(bp->terms, compiled.terms, sizeof(compiled.terms));
+        return bp;
+    }
+
+    int slot = 0;
+    while (slot < BP_MAX && bp_slot[breakpoints[slot].address] == slot + 1)
+    {
+        ++slot;
+    }
+    if (slot == BP_MAX)
+    {
+        return NULL;
+    }
+    if (!decode_ready)
+    {
+        decode_init();
+    }
+
+    bp = &breakpoints[slot];
+    *bp = compiled;
+    bp->address = address;
+    bp->word = memory[address];
+    bp->hits = 0;
+    bp_slot[address] = (uint8_t)(slot + 1);
+    hook(bp->word);
+
+    /* Traces run the instruction without going through the table */
+    trace_invalidate(address);
+    code_claim(address);
+    return bp;
+}
+
+/**
+ * bp_clear - Remove the breakpoint at address
+ *
+ * Returns:
+ *   int: 1 if there was one, 0 otherwise
+ */
+int bp_clear(uint16_t address)
+{
+    struct breakpoint *bp = bp_at(address);
+    if (bp == NULL)
+    {
+        return 0;
+    }
+    unhook(bp->word);
+    bp_slot[address] = 0;
+    code_release(address);
+    return 1;
+}
+
+/**
+ * bp_write - Follow a store over a breakpointed word by hooking the new word
+ *
+ * Called from code_write.
+ */
+void bp_write(uint16_t address)
+{
+    struct breakpoint *bp = bp_at(address);
+    if (bp && bp->word != memory[address])
+    {
+        unhook(bp->word);
+        bp->word = memory[address];
+        hook(bp->word);
+    }
+}
@@ -0,0 +1,95 @@
+/**
+ * breakpoint.h - Breakpoints that cost nothing where none is set
+ *
+ * The interpreter has no "is there a breakpoint here?" test. Instead, setting a
+ * breakpoint swaps the entry of handler_table (decode.h) for the instruction word
+ * at its address with a trampoline, keeping the original handler aside. Since the
+ * table is indexed by instruction word rather than by address, the trampoline also
+ * runs for the same word elsewhere in memory: it looks the PC up in bp_slot[] and
+ * falls through to the original handler when there is no breakpoint there. Every
+ * other instruction word dispatches exactly as before.
+ *
+ * A breakpoint may carry a condition, compiled when it is set into a short list
+ * of comparisons of registers with constants, all of which must hold:
+ *
+ *   R1==5 && R2<0 && PC!=x3010
+ *
+ * Registers are R0-R7, PC and COND; == and != compare the 16-bit values, < <= >
+ * and >= compare them as signed. Constants are decimal, #decimal or xHEX.
+ *
+ * When a breakpoint is hit and its condition holds, bp_handler runs with the PC
+ * at the breakpoint and the instruction neither executed nor counted in
+ * instr_count. Unless it stops the machine, the instruction at the PC it leaves
+ * then executes, be it the one at the breakpoint or, if it moved the PC or the
+ * whole machine state (replay.h), another.
+ *
+ * Single-stepping and interrupting a running guest use the same trick on the
+ * whole table: bp_stop_next points every entry at a handler that puts the table
+ * back and calls bp_handler (with no breakpoint) before the next instruction,
+ * whatever it is. It may be called from a signal handler.
+ *
+ * Breakpointed words are claimed in the code map (codemap.h): a store over one
+ * re-hooks the new word, and the trace tier discards its traces through the
+ * address and does not record new ones across it.
+ */
+#ifndef BREAKPOINT_H
+#define BREAKPOINT_H
+#include "main.h"
+
+#define BP_MAX 64  /* breakpoints set at once */
+#define BP_TERMS 4 /* comparisons in a condition */
+
+/* Comparison of a condition term */
+enum
+{
+    BP_EQ,
+    BP_NE,
+    BP_LT,
+    BP_LE,
+    BP_GT,
+    BP_GE
+};
+
+/* One comparison: reg[index] op value */
+struct bp_term
+{
+    uint8_t index; /* R_R0..R_COND */
+    uint8_t op;    /* BP_* */
+    uint16_t value;
+};
+
+struct breakpoint
+{
+    uint16_t address;
+    uint16_t word;    /* instruction word whose handler is hooked for it */
+    int term_count;   /* 0 for an unconditional breakpoint */
+    struct bp_term terms[BP_TERMS];
+    uint64_t hits;    /* times it stopped the guest */
+};
+
+/* Called when a breakpoint is hit and its condition holds, or with NULL for a bp_stop_next stop */
+typedef void (*bp_handler_fn)(struct breakpoint *bp);
+
+extern uint8_t bp_slot[MEMORY_MAX];  /* 1 + index in breakpoints[] of the breakpoint at each address, or 0 */
+extern struct breakpoint breakpoints[BP_MAX];
+extern bp_handler_fn bp_handler;
+
+/**
+ * bp_at - The breakpoint at address, or NULL
+ */
+static inline struct breakpoint *bp_at(uint16_t address)
+{
+    return bp_slot[address] ? &breakpoints[bp_slot[address] - 1] : NULL;
+}
+
+/**
+ * Function declarations/prototype
+ */
+int bp_compile(const char *text, struct breakpoint *bp);
+struct breakpoint *bp_set(uint16_t address, const char *condition);
+int bp_clear(uint16_t address);
+void bp_write(uint16_t address);
+void bp_stop_next(void);
+int bp_parse_value(const char *text, const char **end, uint16_t *value);
+
+#endif /* BREAKPOINT_H */
@@ -0,0 +1,505 @@
+/**
+ * cfg.c - Control-flow graph recovery, dead-code flagging and loop nesting
+ *
+ * The walk follows every statically known control transfer from the entry point:
+ * both sides of conditional branches, JSR targets and their return points, and the
+ * guest routines of traps that have no native handler. JMP/JSRR through a register
+ * cannot be followed (RET included), so code only reachable that way is reported
+ * as data; the number of such jumps is part of the report.
+ *
+ * Loops are found from dominators: an edge to a block that dominates its source is
+ * a back edge, and the natural loop of a header is everything that reaches one of
+ * its back edges without passing through the header.
+ */
+#include "cfg.h"
+#include "trap.h"
+#include <string.h>
+
+uint8_t cfg_flags[MEMORY_MAX];             /* CFG_* flags for every word of memory */
+struct cfg_block cfg_blocks[MEMORY_MAX];   /* blocks in address order */
+int cfg_block_count;                       /* number of valid entries in cfg_blocks */
+
+static int32_t block_index[MEMORY_MAX];    /* block containing each code word, -1 for data */
+static uint16_t cfg_entry;                 /* entry point of the last build */
+static int indirect_count;                 /* JMP/JSRR with unknown targets */
+static int loop_count;                     /* distinct loop headers */
+static int irreducible_count;              /* retreating edges that are not back edges */
+
+/* How control leaves a single instruction */
+enum
+{
+    FLOW_NEXT = 1 << 0,   /* may continue with the next word */
+    FLOW_TARGET = 1 << 1, /* may transfer to a statically known target */
+    FLOW_END = 1 << 2     /* ends its basic block */
+};
+
+/**
+ * instr_flow - Classify the control flow of the instruction at pc
+ *
+ * Parameters:
+ *   pc: Address of the instruction
+ *   target: Receives the target address when FLOW_TARGET is returned
+ *
+ * Returns:
+ *   int: A combination of FLOW_* flags
+ */
+static int instr_flow(uint16_t pc, uint16_t *target)
+{
+    uint16_t instr = memory[pc];
+    uint16_t next = pc + 1;
+
+    switch (instr >> 12)
+    {
+    case OP_BR:
+    {
+        uint16_t cond_flag = (instr >> 9) & 0x7;
+        if (cond_flag == 0)
+        {
+            return FLOW_NEXT; /* never taken: a NOP */
+        }
+        *target = next + sign_extend(instr & 0x1FF, 9);
+        return cond_flag == 0x7 ? FLOW_TARGET | FLOW_END : FLOW_NEXT | FLOW_TARGET | FLOW_END;
+    }
+
+    case OP_JSR:
+        if ((instr >> 11) & 1)
+        {
+            *target = next + sign_extend(instr & 0x7FF, 11);
+            return FLOW_NEXT | FLOW_TARGET | FLOW_END;
+        }
+        return FLOW_NEXT | FLOW_END; /* JSRR: the callee is unknown, but it returns here */
+
+    case OP_JMP:
+    case OP_RTI:
+    case OP_RES:
+        return FLOW_END;
+
+    case OP_TRAP:
+    {
+        uint16_t trapvect = instr & 0xFF;
+        if (trapvect == TRAP_HALT && trap_is_native(TRAP_HALT))
+        {
+            return FLOW_END;
+        }
+        if (!trap_is_native(trapvect) && memory[trapvect] != 0)
+        {
+            *target = memory[trapvect]; /* the guest trap routine */
+            return FLOW_NEXT | FLOW_TARGET | FLOW_END;
+        }
+        return FLOW_NEXT | FLOW_END;
+    }
+
+    default:
+        return FLOW_NEXT;
+    }
+}
+
+/**
+ * cfg_mark_loaded - Record that count words were loaded starting at origin
+ */
+void cfg_mark_loaded(uint16_t origin, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        cfg_flags[(uint16_t)(origin + i)] |= CFG_LOADED;
+    }
+}
+
+/**
+ * walk - Mark every instruction reachable from entry as code, and the block leaders
+ */
+static void walk(uint16_t entry)
+{
+    /* Every push comes from a distinct instruction, which can push at most two addresses */
+    static uint16_t stack[2 * MEMORY_MAX];
+    int top = 0;
+
+    cfg_flags[entry] |= CFG_LEADER;
+    stack[top++] = entry;
+
+    while (top > 0)
+    {
+        uint16_t pc = stack[--top];
+
+        /* Follow straight-line code until it ends or joins code already seen */
+        while ((cfg_flags[pc] & CFG_LOADED) && !(cfg_flags[pc] & CFG_CODE))
+        {
+            cfg_flags[pc] |= CFG_CODE;
+
+            uint16_t target = 0;
+            int flow = instr_flow(pc, &target);
+            if (flow & FLOW_TARGET)
+            {
+                cfg_flags[target] |= CFG_LEADER;
+                stack[top++] = target;
+            }
+            if (!(flow & FLOW_END))
+            {
+                ++pc;
+                continue;
+            }
+
+            uint16_t op = memory[pc] >> 12;
+            if ((op == OP_JMP && ((memory[pc] >> 6) & 0x7) != R_R7) || (op == OP_JSR && !((memory[pc] >> 11) & 1)))
+            {
+                cfg_flags[pc] |= CFG_INDIRECT;
+                ++indirect_count;
+            }
+            if (flow & FLOW_NEXT)
+            {
+                cfg_flags[(uint16_t)(pc + 1)] |= CFG_LEADER;
+                stack[top++] = pc + 1;
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * split_blocks - Cut the code words into basic blocks and link their successors
+ */
+static void split_blocks(void)
+{
+    cfg_block_count = 0;
+    int cur = -1;
+
+    for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+    {
+        if (!(cfg_flags[a] & CFG_CODE))
+        {
+            block_index[a] = -1;
+            cur = -1;
+            continue;
+        }
+
+        if (cur < 0 || (cfg_flags[a] & CFG_LEADER))
+        {
+            cfg_flags[a] |= CFG_LEADER;
+            cur = cfg_block_count++;
+            memset(&cfg_blocks[cur], 0, sizeof(cfg_blocks[cur]));
+            cfg_blocks[cur].start = a;
+        }
+        cfg_blocks[cur].end = a;
+        block_index[a] = cur;
+
+        uint16_t target;
+        if (instr_flow(a, &target) & FLOW_END)
+        {
+            cur = -1;
+        }
+    }
+
+    for (int b = 0; b < cfg_block_count; ++b)
+    {
+        struct cfg_block *block = &cfg_blocks[b];
+        uint16_t target = 0;
+        int flow = instr_flow(block->end, &target);
+        uint16_t next = block->end + 1;
+
+        if ((flow & FLOW_TARGET) && (cfg_flags[target] & CFG_CODE))
+        {
+            block->succ[block->succ_count++] = target;
+        }
+        if ((!(flow & FLOW_END) || (flow & FLOW_NEXT)) && (cfg_flags[next] & CFG_CODE) && next != 0)
+        {
+            block->succ[block->succ_count++] = next;
+        }
+    }
+}
+
+/**
+ * find_loops - Compute dominators, then the natural loops and each block's nesting depth
+ *
+ * Dominators use the iterative algorithm of Cooper, Harvey and Kennedy over a
+ * reverse postorder of the blocks reachable from the entry.
+ */
+static void find_loops(void)
+{
+    int n = cfg_block_count;
+    int32_t *rpo = malloc(sizeof(int32_t) * (n + 1));       /* blocks in reverse postorder */
+    int32_t *order = malloc(sizeof(int32_t) * (n + 1));     /* rpo position of each block, -1 if unreachable */
+    int32_t *idom = malloc(sizeof(int32_t) * (n + 1));      /* immediate dominator, as an rpo position */
+    int32_t *pred_start = calloc(n + 1, sizeof(int32_t));   /* predecessor lists, CSR style */
+    int32_t *preds = malloc(sizeof(int32_t) * (2 * n + 1));
+    int32_t *stack = malloc(sizeof(int32_t) * (n + 1));
+    uint8_t *next_succ = calloc(n + 1, 1);
+    int32_t *stamp = malloc(sizeof(int32_t) * (n + 1));     /* header that last claimed a block */
+
+    loop_count = 0;
+    irreducible_count = 0;
+    int root = cfg_block_at(cfg_entry);
+    if (root < 0)
+    {
+        goto out;
+    }
+
+    /* Predecessors */
+    for (int b = 0; b < n; ++b)
+    {
+        for (int s = 0; s < cfg_blocks[b].succ_count; ++s)
+        {
+            ++pred_start[cfg_block_at(cfg_blocks[b].succ[s]) + 1];
+        }
+    }
+    for (int b = 0; b < n; ++b)
+    {
+        pred_start[b + 1] += pred_start[b];
+    }
+    for (int b = 0; b < n; ++b)
+    {
+        for (int s = 0; s < cfg_blocks[b].succ_count; ++s)
+        {
+            int t = cfg_block_at(cfg_blocks[b].succ[s]);
+            preds[pred_start[t] + next_succ[t]++] = b;
+        }
+    }
+
+    /* Reverse postorder by an explicit depth-first search */
+    memset(next_succ, 0, n);
+    for (int b = 0; b < n; ++b)
+    {
+        order[b] = -1;
+    }
+    int top = 0, post = n;
+    stack[top++] = root;
+    order[root] = 0; /* visited */
+    while (top > 0)
+    {
+        int b = stack[top - 1];
+        if (next_succ[b] < cfg_blocks[b].succ_count)
+        {
+            int s = cfg_block_at(cfg_blocks[b].succ[next_succ[b]++]);
+            if (order[s] < 0)
+            {
+                order[s] = 0;
+                stack[top++] = s;
+            }
+            continue;
+        }
+        rpo[--post] = b;
+        --top;
+    }
+    /* Reachable blocks now occupy rpo[post..n-1]; shift them to the front */
+    int reachable = n - post;
+    memmove(rpo, rpo + post, sizeof(int32_t) * reachable);
+    for (int b = 0; b < n; ++b)
+    {
+        order[b] = -1;
+    }
+    for (int i = 0; i < reachable; ++i)
+    {
+        order[rpo[i]] = i;
+        idom[i] = -1;
+    }
+
+    /* Dominators */
+    idom[0] = 0;
+    for (int changed = 1; changed;)
+    {
+        changed = 0;
+        for (int i = 1; i < reachable; ++i)
+        {
+            int b = rpo[i];
+            int new_idom = -1;
+            for (int p = pred_start[b]; p < pred_start[b + 1]; ++p)
+            {
+                int q = order[preds[p]];
+                if (q < 0 || idom[q] < 0)
+                {
+                    continue;
+                }
+                if (new_idom < 0)
+                {
+                    new_idom = q;
+                    continue;
+                }
+                /* intersect */
+                int x = q, y = new_idom;
+                while (x != y)
+                {
+                    while (x > y)
+                        x = idom[x];
+                    while (y > x)
+                        y = idom[y];
+                }
+                new_idom = x;
+            }
+            if (idom[i] != new_idom)
+            {
+                idom[i] = new_idom;
+                changed = 1;
+            }
+        }
+    }
+
+    /* Back edges and natural loops */
+    for (int i = 0; i < reachable; ++i)
+    {
+        stamp[i] = -1;
+    }
+    for (int h = 0; h < reachable; ++h)
+    {
+        int header = rpo[h];
+        int is_header = 0;
+        top = 0;
+        stamp[h] = h; /* the header bounds the search for its loop body */
+
+        for (int p = pred_start[header]; p < pred_start[header + 1]; ++p)
+        {
+            int u = order[preds[p]];
+            if (u < 0 || u < h)
+            {
+                continue; /* unreachable, or a forward edge */
+            }
+            /* Retreating edge: a back edge only if the header dominates its source */
+            int d = u;
+            while (d != h && d != 0)
+            {
+                d = idom[d];
+            }
+            if (d != h)
+            {
+                ++irreducible_count;
+                continue;
+            }
+            is_header = 1;
+            if (stamp[u] != h)
+            {
+                stamp[u] = h;
+                stack[top++] = u;
+            }
+        }
+        if (!is_header)
+        {
+            continue;
+        }
+
+        ++loop_count;
+        int blocks = 1;
+        ++cfg_blocks[header].loop_depth;
+        while (top > 0)
+        {
+            int u = stack[--top];
+            ++blocks;
+            ++cfg_blocks[rpo[u]].loop_depth;
+            for (int p = pred_start[rpo[u]]; p < pred_start[rpo[u] + 1]; ++p)
+            {
+                int v = order[preds[p]];
+                if (v >= 0 && stamp[v] != h)
+                {
+                    stamp[v] = h;
+                    stack[top++] = v;
+                }
+            }
+        }
+        cfg_blocks[header].loop_blocks = blocks;
+    }
+
+out:
+    free(rpo);
+    free(order);
+    free(idom);
+    free(pred_start);
+    free(preds);
+    free(stack);
+    free(next_succ);
+    free(stamp);
+}
+
+/**
+ * cfg_build - Recover the control-flow graph of the loaded images
+ *
+ * Must run after the images are loaded and the trap layer is initialized, since
+ * whether a TRAP continues in a guest routine depends on both.
+ *
+ * Parameters:
+ *   entry: Address execution starts at (PC_START)
+ *
+ * Returns:
+ *   int: The number of basic blocks found
+ */
+int cfg_build(uint16_t entry)
+{
+    for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+    {
+        cfg_flags[a] &= CFG_LOADED;
+    }
+    cfg_entry = entry;
+    indirect_count = 0;
+
+    walk(entry);
+    split_blocks();
+    find_loops();
+    return cfg_block_count;
+}
+
+/**
+ * cfg_block_at - Find the basic block containing an address
+ *
+ * Returns:
+ *   int: Index into cfg_blocks, or -1 if the address is not code
+ */
+int cfg_block_at(uint16_t address)
+{
+    return (cfg_flags[address] & CFG_CODE) ? block_index[address] : -1;
+}
+
+/**
+ * cfg_report - Print block counts, data ranges and loop nesting of the last build
+ *
+ * Parameters:
+ *   out: Stream to print to
+ */
+void cfg_report(FILE *out)
+{
+    int loaded = 0, code = 0, max_depth = 0;
+    for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+    {
+        loaded += (cfg_flags[a] & CFG_LOADED) != 0;
+        code += (cfg_flags[a] & CFG_CODE) != 0;
+    }
+    for (int b = 0; b < cfg_block_count; ++b)
+    {
+        if (cfg_blocks[b].loop_depth > max_depth)
+        {
+            max_depth = cfg_blocks[b].loop_depth;
+        }
+    }
+
+    fprintf(out, "control-flow graph from 0x%04X\n", cfg_entry);
+    fprintf(out, "  loaded words:      %d\n", loaded);
+    fprintf(out, "  code words:        %d\n", code);
+    fprintf(out, "  data words:        %d\n", loaded - code);
+    fprintf(out, "  basic blocks:      %d\n", cfg_block_count);
+    fprintf(out, "  indirect jumps:    %d\n", indirect_count);
+    fprintf(out, "  loops:             %d (max nesting depth %d)\n", loop_count, max_depth);
+    if (irreducible_count > 0)
+    {
+        fprintf(out, "  irreducible edges: %d\n", irreducible_count);
+    }
+
+    /* Loaded words that are never reached */
+    for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+    {
+        if ((cfg_flags[a] & (CFG_LOADED | CFG_CODE)) != CFG_LOADED)
+        {
+            continue;
+        }
+        uint32_t end = a;
+        while (end + 1 < MEMORY_MAX && (cfg_flags[end + 1] & (CFG_LOADED | CFG_CODE)) == CFG_LOADED)
+        {
+            ++end;
+        }
+        fprintf(out, "  data  0x%04X-0x%04X  %u words\n", a, end, end - a + 1);
+        a = end;
+    }
+
+    /* Loop headers, with the depth of the loop they start and its size */
+    for (int b = 0; b < cfg_block_count; ++b)
+    {
+        if (cfg_blocks[b].loop_blocks > 0)
+        {
+            fprintf(out, "  loop  0x%04X  depth %d  %d blocks\n", cfg_blocks[b].start, cfg_blocks[b].loop_depth, cfg_blocks[b].loop_blocks);
+        }
+    }
+}
@@ -0,0 +1,47 @@
+/**
+ * cfg.h - Static control-flow graph recovery for loaded images
+ *
+ * After the images are loaded, cfg_build walks the code reachable from the entry
+ * point through BR/JSR/JMP/TRAP targets, splits it into basic blocks and flags
+ * every loaded word that is never reached as data. The per-word flags tell lc3-aot
+ * where blocks begin and which words not to translate, and keep data words out of
+ * the lcov report of --cover; cfg_report prints the block and loop structure. The
+ * interpreter does not need them, so vm only runs the analysis for --cfg and --cover.
+ */
+#ifndef CFG_H
+#define CFG_H
+#include "main.h"
+
+/* Per-word flags in cfg_flags[] */
+enum
+{
+    CFG_LOADED = 1 << 0, /* word was loaded from an image file */
+    CFG_CODE = 1 << 1,   /* word is reachable as an instruction */
+    CFG_LEADER = 1 << 2, /* first instruction of a basic block */
+    CFG_INDIRECT = 1 << 3 /* JMP/JSRR whose target is not known statically */
+};
+
+/* A basic block: a straight run of instructions entered only at the top */
+struct cfg_block
+{
+    uint16_t start;      /* address of the first instruction */
+    uint16_t end;        /* address of the last instruction (the terminator, if any) */
+    uint16_t succ[2];    /* known successors: branch/call target and/or fall-through */
+    uint8_t succ_count;  /* number of valid entries in succ */
+    uint8_t loop_depth;  /* number of loops this block is nested in */
+    uint16_t loop_blocks; /* for a loop header, the number of blocks in its loop; 0 otherwise */
+};
+
+extern uint8_t cfg_flags[MEMORY_MAX];
+extern struct cfg_block cfg_blocks[];
+extern int cfg_block_count;
+
+/**
+ * Function declarations/prototype
+ */
+void cfg_mark_loaded(uint16_t origin, uint32_t count);
+int cfg_build(uint16_t entry);
+int cfg_block_at(uint16_t address);
+void cfg_report(FILE *out);
+
+#endif /* CFG_H */
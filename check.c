@@ -0,0 +1,731 @@
+/**
+ * check.c - Running the engines in lockstep, and generated programs to drive them (see check.h)
+ */
+#include "check.h"
+#include "codemap.h"
+#include "decode.h"
+#include "trace.h"
+#include "trap.h"
+#include "replay.h"
+#include "bank.h"
+#include <string.h>
+
+#define CHECK_RING 8 /* reference instructions kept for the report, before and at the start of a block */
+
+/* Layout of a generated program */
+#define RANDOM_ORIGIN PC_START
+#define RANDOM_CODE 48  /* instructions, the closing back edge included */
+#define RANDOM_DATA 208 /* words of data after the code, filling the page */
+#define RANDOM_ITERS 1024 /* trace iterations per run, as generated loops need not end */
+
+int check_enabled;
+int check_failed;
+struct check_stats check_stats;
+
+/* A logged store: the word at address went from old to value */
+struct store
+{
+    uint16_t address;
+    uint16_t old;
+    uint16_t value;
+};
+
+/* The stores of one run of a block */
+struct store_log
+{
+    struct store *at;
+    size_t len, cap;
+    size_t settled; /* entries before this have their value; those of a MEMMOVE/MEMSET get it at the next store */
+};
+
+/* The state the two runs of a block must agree on */
+struct machine
+{
+    uint16_t reg[R_COUNT];
+    uint16_t devices[3]; /* KBSR, KBDR and DSR, which reads update without a store */
+    uint64_t count;
+    int running;
+    size_t input; /* position in the input log */
+};
+
+static const uint16_t device_regs[3] = {MR_KBSR, MR_KBDR, MR_DSR};
+static const char *const device_names[3] = {"KBSR", "KBDR", "DSR"};
+static const char *const reg_names[R_COUNT] = {"R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "COND"};
+
+static struct store_log cand_log, ref_log;
+static struct store_log *logging; /* log of the running pass, NULL between passes */
+static struct machine start, cand_end, ref_end;
+static uint64_t calls;              /* handler calls of the last candidate pass */
+static uint64_t limit = UINT64_MAX; /* instruction count at which check_interpret returns */
+
+static uint16_t ring_pc[CHECK_RING], ring_instr[CHECK_RING];
+static uint64_t ring_count; /* reference instructions executed so far */
+static uint16_t saved_pc[CHECK_RING], saved_instr[CHECK_RING];
+static uint64_t saved_count; /* the ring as it was when the last block started */
+static uint16_t step_pc[CHECK_RING], step_instr[CHECK_RING];
+static uint64_t step_len; /* reference instructions of the last block */
+
+static uint32_t rng; /* state of the program generator */
+
+/**
+ * oom - Give up when a store log cannot grow
+ */
+static void oom(void)
+{
+    printf("out of memory for the lockstep store log\n");
+    exit(1);
+}
+
+/**
+ * append - Add a store to a log
+ */
+static void append(struct store_log *log, uint16_t address, uint16_t old, uint16_t value)
+{
+    if (log->len == log->cap)
+    {
+        log->cap = log->cap ? log->cap * 2 : 1024;
+        log->at = realloc(log->at, log->cap * sizeof(struct store));
+        if (log->at == NULL)
+        {
+            oom();
+        }
+    }
+    log->at[log->len].address = address;
+    log->at[log->len].old = old;
+    log->at[log->len++].value = value;
+}
+
+/**
+ * settle - Fill in the values of the last block write, which is complete by now
+ */
+static void settle(struct store_log *log)
+{
+    for (size_t i = log->settled; i < log->len; ++i)
+    {
+        log->at[i].value = memory[log->at[i].address];
+    }
+    log->settled = log->len;
+}
+
+/**
+ * check_store - Slow path of mem_write for pages tagged PAGE_CHECK: log the store
+ */
+void check_store(uint16_t address, uint16_t val)
+{
+    if (logging)
+    {
+        settle(logging);
+        append(logging, address, memory[address], val);
+        logging->settled = logging->len;
+    }
+}
+
+/**
+ * check_store_range - Log a block write before it happens; the values are read once it is done
+ */
+void check_store_range(uint16_t address, uint32_t count)
+{
+    if (logging)
+    {
+        settle(logging);
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            uint16_t a = address + i;
+            append(logging, a, memory[a], memory[a]);
+        }
+    }
+}
+
+/**
+ * begin - Start logging the stores of a pass into log
+ */
+static void begin(struct store_log *log)
+{
+    log->len = log->settled = 0;
+    logging = log;
+}
+
+/**
+ * finish - Stop logging the stores of the running pass
+ */
+static void finish(void)
+{
+    settle(logging);
+    logging = NULL;
+}
+
+/**
+ * undo - Put back what the stores of a log overwrote, newest first
+ */
+static void undo(const struct store_log *log)
+{
+    for (size_t i = log->len; i > 0; --i)
+    {
+        uint16_t address = log->at[i - 1].address;
+        if (address == MR_BANK)
+        {
+            bank_select(log->at[i - 1].old);
+        }
+        memory[address] = log->at[i - 1].old;
+        if (code_is_translated(address))
+        {
+            code_write(address);
+        }
+    }
+}
+
+/**
+ * save - Capture the state the runs are compared on
+ */
+static void save(struct machine *m)
+{
+    memcpy(m->reg, reg, sizeof(m->reg));
+    for (int i = 0; i < 3; ++i)
+    {
+        m->devices[i] = memory[device_regs[i]];
+    }
+    m->count = instr_count;
+    m->running = running;
+    m->input = replay_mark();
+}
+
+/**
+ * load - Go back to a captured state, memory aside
+ */
+static void load(const struct machine *m)
+{
+    memcpy(reg, m->reg, sizeof(reg));
+    for (int i = 0; i < 3; ++i)
+    {
+        memory[device_regs[i]] = m->devices[i];
+    }
+    instr_count = m->count;
+    running = m->running;
+    replay_rewind(m->input);
+}
+
+/**
+ * run_candidate - Run the handler table for up to max handler calls, stopping after a control transfer
+ */
+static void run_candidate(uint64_t max)
+{
+    calls = 0;
+    while (running && instr_count < limit)
+    {
+        uint16_t instr = memory[reg[R_PC]++];
+        ++instr_count;
+        handler_table[instr](instr);
+        uint16_t op = instr >> 12;
+        if (++calls >= max || op == OP_BR || op == OP_JMP || op == OP_JSR || op == OP_TRAP || op == OP_RTI)
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * run_reference - Run execute() until instr_count reaches end, with the trace tier out of the way
+ */
+static void run_reference(uint64_t end)
+{
+    int tier = trace_tier;
+    trace_tier = 0;
+    while (running && instr_count < end)
+    {
+        uint16_t pc = reg[R_PC]++;
+        uint16_t instr = memory[pc];
+        ring_pc[ring_count % CHECK_RING] = pc;
+        ring_instr[ring_count++ % CHECK_RING] = instr;
+        if (step_len < CHECK_RING)
+        {
+            step_pc[step_len] = pc;
+            step_instr[step_len] = instr;
+        }
+        ++step_len;
+        ++instr_count;
+        execute(instr);
+    }
+    trace_tier = tier;
+}
+
+/**
+ * same_stores - Whether both passes stored the same values to the same addresses in the same order
+ */
+static int same_stores(void)
+{
+    if (cand_log.len != ref_log.len)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < ref_log.len; ++i)
+    {
+        if (cand_log.at[i].address != ref_log.at[i].address || cand_log.at[i].value != ref_log.at[i].value)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * lockstep - Run the next block on the candidate engine, roll it back and run it on the reference
+ *
+ * The machine is left in the reference's state.
+ *
+ * Parameters:
+ *   max: Most handler calls in the block
+ *
+ * Returns:
+ *   int: 1 if the two runs agree, 0 if they diverged
+ */
+static int lockstep(uint64_t max)
+{
+    save(&start);
+    memcpy(saved_pc, ring_pc, sizeof(ring_pc));
+    memcpy(saved_instr, ring_instr, sizeof(ring_instr));
+    saved_count = ring_count;
+    step_len = 0;
+
+    begin(&cand_log);
+    run_candidate(max);
+    finish();
+    save(&cand_end);
+
+    undo(&cand_log);
+    load(&start);
+    /* The candidate has written the block's output; the reference only replays it */
+    if (replay_horizon < cand_end.count)
+    {
+        replay_horizon = cand_end.count;
+    }
+    begin(&ref_log);
+    run_reference(cand_end.count);
+    finish();
+    save(&ref_end);
+
+    ++check_stats.blocks;
+    check_stats.stores += ref_log.len;
+    return memcmp(cand_end.reg, ref_end.reg, sizeof(ref_end.reg)) == 0 &&
+           memcmp(cand_end.devices, ref_end.devices, sizeof(ref_end.devices)) == 0 &&
+           cand_end.count == ref_end.count && cand_end.running == ref_end.running &&
+           cand_end.input == ref_end.input && same_stores();
+}
+
+/**
+ * print_store - Print entry i of a store log, or that there is none
+ */
+static void print_store(const char *who, const struct store_log *log, size_t i)
+{
+    if (i < log->len)
+    {
+        fprintf(stderr, "    %-13s x%04X <- x%04X (was x%04X)\n", who, log->at[i].address, log->at[i].value,
+                log->at[i].old);
+    }
+    else
+    {
+        fprintf(stderr, "    %-13s none\n", who);
+    }
+}
+
+/**
+ * report - Describe the last lockstep that diverged
+ */
+static void report(void)
+{
+    const char *engine = trace_tier ? "trace tier" : "handler table";
+    fprintf(stderr, "\ncheck: the %s and the reference diverged at x%04X after %llu instructions\n", engine,
+            start.reg[R_PC], (unsigned long long)start.count);
+    if (cand_end.count != ref_end.count || cand_end.running != ref_end.running)
+    {
+        fprintf(stderr, "  %s: %llu instructions%s; reference: %llu%s\n", engine,
+                (unsigned long long)(cand_end.count - start.count), cand_end.running ? "" : ", halted",
+                (unsigned long long)(ref_end.count - start.count), ref_end.running ? "" : ", halted");
+    }
+    for (int i = 0; i < R_COUNT; ++i)
+    {
+        if (cand_end.reg[i] != ref_end.reg[i])
+        {
+            fprintf(stderr, "  %-4s %s x%04X, reference x%04X\n", reg_names[i], engine, cand_end.reg[i], ref_end.reg[i]);
+        }
+    }
+    for (int i = 0; i < 3; ++i)
+    {
+        if (cand_end.devices[i] != ref_end.devices[i])
+        {
+            fprintf(stderr, "  %-4s %s x%04X, reference x%04X\n", device_names[i], engine, cand_end.devices[i],
+                    ref_end.devices[i]);
+        }
+    }
+    if (cand_end.input != ref_end.input)
+    {
+        fprintf(stderr, "  input events read: %s %zu, reference %zu\n", engine, cand_end.input - start.input,
+                ref_end.input - start.input);
+    }
+    size_t first = 0;
+    while (first < cand_log.len && first < ref_log.len && cand_log.at[first].address == ref_log.at[first].address &&
+           cand_log.at[first].value == ref_log.at[first].value)
+    {
+        ++first;
+    }
+    if (first < cand_log.len || first < ref_log.len)
+    {
+        fprintf(stderr, "  store %zu of %zu / %zu:\n", first + 1, cand_log.len, ref_log.len);
+        print_store(engine, &cand_log, first);
+        print_store("reference", &ref_log, first);
+    }
+
+    uint64_t shown = saved_count < CHECK_RING ? saved_count : CHECK_RING;
+    fprintf(stderr, "  the reference ran, before:\n");
+    for (uint64_t i = saved_count - shown; i < saved_count; ++i)
+    {
+        fprintf(stderr, "    x%04X: x%04X\n", saved_pc[i % CHECK_RING], saved_instr[i % CHECK_RING]);
+    }
+    fprintf(stderr, "  and in the diverging step:\n");
+    for (uint64_t i = 0; i < step_len && i < CHECK_RING; ++i)
+    {
+        fprintf(stderr, "    x%04X: x%04X\n", step_pc[i], step_instr[i]);
+    }
+    if (step_len > CHECK_RING)
+    {
+        fprintf(stderr, "    ... %llu more\n", (unsigned long long)(step_len - CHECK_RING));
+    }
+}
+
+/**
+ * diverged - Narrow a diverging block down to one handler call, report it and stop the guest
+ */
+static void diverged(void)
+{
+    int found = 1;
+    uint64_t block_calls = calls;
+    if (block_calls > 1)
+    {
+        undo(&ref_log);
+        load(&start);
+        memcpy(ring_pc, saved_pc, sizeof(ring_pc));
+        memcpy(ring_instr, saved_instr, sizeof(ring_instr));
+        ring_count = saved_count;
+        found = 0;
+        for (uint64_t i = 0; i < block_calls && !found; ++i)
+        {
+            found = !lockstep(1);
+        }
+    }
+    if (found)
+    {
+        report();
+    }
+    else
+    {
+        fprintf(stderr, "\ncheck: the block at x%04X diverged, but not when stepped one handler call at a time\n",
+                start.reg[R_PC]);
+    }
+    check_failed = 1;
+    running = 0;
+}
+
+/**
+ * check_init - Start checking: log the stores of every page and record the host input
+ *
+ * Builds the handler table if needed.
+ */
+void check_init(void)
+{
+    if (!decode_ready)
+    {
+        decode_init();
+    }
+    if (!replay_enabled)
+    {
+        replay_init();
+    }
+    for (int i = 0; i < PAGE_COUNT; ++i)
+    {
+        page_flags[i] |= PAGE_CHECK;
+    }
+    check_enabled = 1;
+}
+
+/**
+ * check_interpret - The instruction cycle of interpret() while checking, one compared block at a time
+ */
+void check_interpret(void)
+{
+    while (running && instr_count < limit)
+    {
+        if (!lockstep(CHECK_BLOCK_MAX))
+        {
+            diverged();
+            return;
+        }
+    }
+}
+
+/**
+ * next - Advance the program generator (xorshift32)
+ */
+static uint32_t next(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/**
+ * field - A random signed field of the given width, half the time one of its edge cases
+ */
+static uint16_t field(int bits)
+{
+    uint16_t mask = (1 << bits) - 1;
+    switch (next() % 10)
+    {
+    case 0:
+        return 1 << (bits - 1); /* most negative */
+    case 1:
+        return mask >> 1; /* most positive */
+    case 2:
+        return mask; /* -1 */
+    case 3:
+        return 0;
+    case 4:
+        return 1;
+    default:
+        return next() & mask;
+    }
+}
+
+/**
+ * offset - A PC-relative field for the instruction at at, mostly aimed at the first span words of the program
+ */
+static uint16_t offset(uint16_t at, int bits, uint16_t span)
+{
+    if (next() % 4 == 0)
+    {
+        return field(bits);
+    }
+    uint16_t target = RANDOM_ORIGIN + next() % span;
+    return (uint16_t)(target - at - 1) & ((1 << bits) - 1);
+}
+
+/**
+ * value - A random word, half the time one that sits on a sign or carry boundary
+ */
+static uint16_t value(void)
+{
+    static const uint16_t edges[] = {0x0000, 0x0001, 0x7FFF, 0x8000, 0xFFFF, 0xFFFE, 0x8001, RANDOM_ORIGIN};
+    return next() % 2 ? edges[next() % (sizeof(edges) / sizeof(edges[0]))] : (uint16_t)next();
+}
+
+/**
+ * trap_vector - A random trap vector: mostly the built-in traps and the two guest routines, rarely HALT
+ */
+static uint16_t trap_vector(void)
+{
+    static const uint8_t vectors[] = {TRAP_GETC, TRAP_OUT,  TRAP_PUTS,     TRAP_IN,  TRAP_PUTSP, 0x26,
+                                      0x27,      TRAP_MEMMOVE, TRAP_MEMSET, TRAP_MEMCMP, TRAP_CHECKSUM,
+                                      TRAP_MUL,  TRAP_SMUL, TRAP_DIVU,     TRAP_DIVS, TRAP_SHL,   TRAP_SHR,
+                                      TRAP_SRA};
+    uint32_t pick = next() % 64;
+    if (pick == 0)
+    {
+        return TRAP_HALT;
+    }
+    if (pick < 8)
+    {
+        return next() & 0xFF;
+    }
+    return vectors[next() % sizeof(vectors)];
+}
+
+/**
+ * instruction - A random instruction for address at
+ *
+ * The opcodes are equally likely, except for RTI and the reserved opcode,
+ * which end every trace recording and so are kept rare.
+ */
+static uint16_t instruction(uint16_t at)
+{
+    uint16_t op = next() % 16;
+    while ((op == OP_RTI || op == OP_RES) && next() % 8)
+    {
+        op = next() % 16;
+    }
+    uint16_t dr = next() & 0x7;
+    uint16_t sr = next() & 0x7;
+    switch (op)
+    {
+    case OP_ADD:
+    case OP_AND:
+        return op << 12 | dr << 9 | sr << 6 | (next() % 2 ? 1 << 5 | field(5) : (next() & 0x7));
+    case OP_NOT:
+        return op << 12 | dr << 9 | sr << 6 | 0x3F;
+    case OP_BR:
+        return op << 12 | (next() & 0x7) << 9 | offset(at, 9, RANDOM_CODE);
+    case OP_JMP:
+        return op << 12 | (next() % 4 ? R_R7 : sr) << 6;
+    case OP_JSR:
+        return next() % 4 ? op << 12 | 1 << 11 | offset(at, 11, RANDOM_CODE) : op << 12 | sr << 6;
+    case OP_LD:
+    case OP_LDI:
+    case OP_ST:
+    case OP_STI:
+    case OP_LEA:
+        return op << 12 | dr << 9 | offset(at, 9, RANDOM_CODE + RANDOM_DATA);
+    case OP_LDR:
+    case OP_STR:
+        return op << 12 | dr << 9 | sr << 6 | field(6);
+    case OP_TRAP:
+        return op << 12 | trap_vector();
+    default:
+        /* RTI and the reserved opcode, with random low bits */
+        return op << 12 | (next() & 0xFFF);
+    }
+}
+
+/**
+ * loop_safe - Whether an instruction can go in a generated counted loop without ending it early
+ */
+static int loop_safe(uint16_t instr, uint16_t counter)
+{
+    switch (instr >> 12)
+    {
+    case OP_BR:
+    case OP_JMP:
+    case OP_JSR:
+    case OP_RTI:
+    case OP_RES:
+        return 0;
+    case OP_TRAP:
+        /* The arithmetic traps, which only write R0, R1 and R7; block copies would make iterations slow */
+        return (instr & 0xFF) >= TRAP_MUL && (instr & 0xFF) <= TRAP_SRA;
+    case OP_ST:
+    case OP_STI:
+    case OP_STR:
+        return 1;
+    default:
+        return ((instr >> 9) & 0x7) != counter;
+    }
+}
+
+/**
+ * counted_loop - Generate a loop of straight-line code and forward branches, run a random number of times
+ *
+ * The traces the tier builds come from loops like this one; the body can
+ * still store into itself.
+ *
+ * Returns:
+ *   uint16_t: Address after the loop
+ */
+static uint16_t counted_loop(uint16_t at, uint16_t count_at)
+{
+    uint16_t counter = R_R3 + next() % 4;
+    uint16_t length = 4 + next() % 20;
+    memory[at] = OP_LD << 12 | counter << 9 | ((uint16_t)(count_at - at - 1) & 0x1FF);
+    memory[count_at] = 16 + next() % 1000;
+
+    uint16_t head = at + 1;
+    uint16_t tail = head + length; /* the decrement */
+    for (uint16_t a = head; a < tail; ++a)
+    {
+        uint16_t instr;
+        if (next() % 6 == 0)
+        {
+            /* A forward branch that stays in the body: a guard in the trace */
+            instr = OP_BR << 12 | (1 + next() % 7) << 9 | next() % (tail - a);
+        }
+        else
+        {
+            do
+            {
+                instr = instruction(a);
+            } while (!loop_safe(instr, counter));
+        }
+        memory[a] = instr;
+    }
+    memory[tail] = OP_ADD << 12 | counter << 9 | counter << 6 | 1 << 5 | 0x1F; /* counter -= 1 */
+    memory[tail + 1] = OP_BR << 12 | FL_POS << 9 | ((uint16_t)(head - tail - 2) & 0x1FF);
+    return tail + 2;
+}
+
+/**
+ * generate - Replace the machine with a random program and registers
+ *
+ * Programs from odd seeds start with a counted loop.
+ */
+static void generate(uint32_t seed)
+{
+    rng = seed * 2654435761u ^ 0x6A09E667u;
+    if (rng == 0)
+    {
+        rng = 1;
+    }
+    trace_flush();
+    /* Control that escapes the program lands on TRAP x26, whose routine is back inside it;
+       the zero words in between are NOPs that keep strings read from there short */
+    memset(memory, 0, sizeof(memory));
+    for (uint32_t a = 0x0100; a < TRACE_MMIO; ++a)
+    {
+        memory[a] = a % 16 ? OP_TRAP << 12 | 0x26 : 0;
+    }
+    memory[MR_MCR] = 1 << 15;
+
+    uint16_t end = RANDOM_ORIGIN + RANDOM_CODE - 1;
+    for (uint16_t a = end + 1; a < end + 1 + RANDOM_DATA; ++a)
+    {
+        memory[a] = value();
+    }
+    uint16_t a = seed % 2 ? counted_loop(RANDOM_ORIGIN, end + 1) : RANDOM_ORIGIN;
+    for (; a < end; ++a)
+    {
+        memory[a] = instruction(a);
+    }
+    /* BRnzp back to the start, so the program loops until it halts or runs out of budget */
+    memory[end] = OP_BR << 12 | 0x7 << 9 | ((uint16_t)(RANDOM_ORIGIN - end - 1) & 0x1FF);
+    /* Two guest trap routines inside the program */
+    memory[0x26] = RANDOM_ORIGIN + next() % RANDOM_CODE;
+    memory[0x27] = RANDOM_ORIGIN + next() % RANDOM_CODE;
+
+    for (int r = R_R0; r <= R_R7; ++r)
+    {
+        reg[r] = value();
+    }
+    reg[R_PC] = RANDOM_ORIGIN;
+    reg[R_COND] = FL_ZRO;
+    running = 1;
+}
+
+/**
+ * check_random - Check the engines on generated programs
+ *
+ * Program i is generated from seed + i and runs for CHECK_RANDOM_BUDGET
+ * instructions, or until it halts. Many generated loops never end, so trace
+ * runs are cut after RANDOM_ITERS iterations. Call check_init first.
+ *
+ * Parameters:
+ *   programs: Number of programs
+ *   seed: Seed of the first program
+ *
+ * Returns:
+ *   int: 1 if the engines agreed on all of them, 0 after reporting a divergence
+ */
+int check_random(uint64_t programs, uint32_t seed)
+{
+    trace_iter_max = RANDOM_ITERS;
+    for (uint64_t i = 0; i < programs; ++i)
+    {
+        uint32_t program_seed = seed + (uint32_t)i;
+        generate(program_seed);
+        limit = instr_count + CHECK_RANDOM_BUDGET;
+        check_interpret();
+        ++check_stats.programs;
+        if (check_failed)
+        {
+            fprintf(stderr, "check: in the program generated from seed %u\n", program_seed);
+            return 0;
+        }
+    }
+    limit = UINT64_MAX;
+    trace_iter_max = UINT64_MAX;
+    return 1;
+}
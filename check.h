@@ -0,0 +1,63 @@
+/**
+ * check.h - Differential lockstep checking of the execution engines
+ *
+ * The handler table (decode.h) and the trace tier (trace.h) are meant to behave
+ * exactly like the reference decode switch, execute(). With --check the VM runs
+ * every block twice and compares the two runs:
+ *
+ *   - the candidate engine (the handler table, plus traces with --hot-traces)
+ *     runs up to CHECK_BLOCK_MAX instructions, ending after the first control
+ *     transfer (BR, JMP, JSR, TRAP or RTI); a BR entering a trace runs the trace
+ *     as part of it. Every store is logged with the value it overwrote,
+ *   - the stores are undone in reverse, the registers and instr_count are put
+ *     back, and execute() runs the same number of instructions, logging its
+ *     stores too,
+ *   - reg[] (PC and R_COND included), instr_count, the device registers, the
+ *     input consumed and the two store streams must then be identical.
+ *
+ * Stores are logged through the page map: check_init tags every page PAGE_CHECK
+ * (codemap.h), which mem_write already tests along with the watchpoint and
+ * snapshot tags, and MEMMOVE/MEMSET log their ranges. Host input is read once
+ * and replayed to the second run from replay.c's input log; output of the second
+ * run is muted like that of re-executed history.
+ *
+ * On the first difference the block is rolled back and stepped again one
+ * handler call at a time, and the first call on which the engines disagree is
+ * reported to stderr: the registers and first store that differ, and the
+ * instructions the reference ran before and during that step.
+ *
+ * check_random drives the checker with generated programs (--random). They use
+ * all 16 opcodes, with immediates and offsets biased to the extremes of their
+ * sign extension, data and registers seeded with values such as 0, 1, x7FFF,
+ * x8000 and xFFFF, native traps and guest trap routines. Half of them start
+ * with a counted loop, hot enough for the trace tier to compile.
+ */
+#ifndef CHECK_H
+#define CHECK_H
+#include "main.h"
+
+#define CHECK_BLOCK_MAX 64           /* most instructions per block without a control transfer */
+#define CHECK_RANDOM_BUDGET 100000   /* instructions per generated program */
+
+/* Counters for --stats */
+struct check_stats
+{
+    uint64_t blocks;   /* blocks compared */
+    uint64_t stores;   /* stores compared */
+    uint64_t programs; /* generated programs run */
+};
+
+extern int check_enabled;  /* set by check_init */
+extern int check_failed;   /* set once the engines diverged */
+extern struct check_stats check_stats;
+
+/**
+ * Function declarations/prototype
+ */
+void check_init(void);
+void check_interpret(void);
+void check_store(uint16_t address, uint16_t val);
+void check_store_range(uint16_t address, uint32_t count);
+int check_random(uint64_t programs, uint32_t seed);
+
+#endif /* CHECK_H */
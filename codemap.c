@@ -0,0 +1,86 @@
+/**
+ * codemap.c - Tagging of translated code and invalidation on self-modifying stores
+ *
+ * See codemap.h. code_write is the single place where a store into translated
+ * code is turned into invalidations of the tiers that hold translations.
+ */
+#include "codemap.h"
+#include "trace.h"
+#include "breakpoint.h"
+
+uint8_t page_flags[PAGE_COUNT];
+uint16_t code_refs[MEMORY_MAX];
+struct code_stats code_stats;
+int (*code_write_handler)(uint16_t address);
+
+static uint16_t page_refs[PAGE_COUNT]; /* claimed words in each page */
+
+/**
+ * code_claim - Record that one more translation is built from the word at address
+ */
+void code_claim(uint16_t address)
+{
+    uint16_t page = address >> PAGE_SHIFT;
+    if (code_refs[address]++ == 0 && page_refs[page]++ == 0)
+    {
+        page_flags[page] |= PAGE_CODE;
+    }
+}
+
+/**
+ * code_release - Drop a claim made by code_claim
+ */
+void code_release(uint16_t address)
+{
+    uint16_t page = address >> PAGE_SHIFT;
+    if (--code_refs[address] == 0 && --page_refs[page] == 0)
+    {
+        page_flags[page] &= ~PAGE_CODE;
+    }
+}
+
+/**
+ * code_write - Discard the translations of a word that has just been overwritten
+ *
+ * Parameters:
+ *   address: A word for which code_is_translated is true
+ */
+void code_write(uint16_t address)
+{
+    ++code_stats.writes;
+    code_stats.invalidations += trace_invalidate(address);
+    if (code_write_handler)
+    {
+        code_stats.invalidations += code_write_handler(address);
+    }
+    bp_write(address);
+}
+
+/**
+ * code_write_range - code_write every translated word of a block that was written in bulk
+ *
+ * The block may wrap around the end of memory. Untagged pages are skipped whole.
+ */
+void code_write_range(uint16_t address, uint32_t count)
+{
+    while (count > 0)
+    {
+        uint32_t in_page = (1u << PAGE_SHIFT) - (address & ((1u << PAGE_SHIFT) - 1));
+        if (in_page > count)
+        {
+            in_page = count;
+        }
+        if (page_flags[address >> PAGE_SHIFT] & PAGE_CODE)
+        {
+            for (uint32_t i = 0; i < in_page; ++i)
+            {
+                if (code_refs[(uint16_t)(address + i)])
+                {
+                    code_write(address + i);
+                }
+            }
+        }
+        address += in_page;
+        count -= in_page;
+    }
+}
@@ -0,0 +1,60 @@
+/**
+ * codemap.h - Page-granular map of the memory that holds translated code
+ *
+ * Every caching tier registers the guest words it has translated with code_claim
+ * and drops them with code_release. Memory is split into 256-word pages; a page
+ * is tagged PAGE_CODE while any of its words is claimed, so the store path only
+ * looks further for stores into such pages. Within a tagged page, a per-word count
+ * tells code apart from data sitting next to it, so only stores into translated
+ * words reach code_write, which discards the translations built from that word.
+ */
+#ifndef CODEMAP_H
+#define CODEMAP_H
+#include "main.h"
+
+#define PAGE_SHIFT 8                        /* 256 words per page */
+#define PAGE_COUNT (MEMORY_MAX >> PAGE_SHIFT)
+
+/* Per-page flags in page_flags[] */
+enum
+{
+    PAGE_CODE = 1 << 0,     /* some word of the page is part of a translation */
+    PAGE_WATCH = 1 << 1,    /* some word of the page is in a watchpoint's range (watch.h) */
+    PAGE_SNAPSHOT = 1 << 2, /* the page is unchanged since the fuzzing snapshot (fuzz.h) */
+    PAGE_CHECK = 1 << 3     /* stores into the page are logged by the lockstep checker (check.h) */
+};
+
+/* Counters for --stats */
+struct code_stats
+{
+    uint64_t writes;        /* stores into translated words */
+    uint64_t invalidations; /* translations discarded by those stores */
+};
+
+extern uint8_t page_flags[PAGE_COUNT];
+extern uint16_t code_refs[MEMORY_MAX];   /* translations each word is part of */
+extern struct code_stats code_stats;
+
+/* Translations held outside the VM's tiers (programs written by lc3-aot): called by
+   code_write to discard those built from the word, returning how many it discarded */
+extern int (*code_write_handler)(uint16_t address);
+
+/**
+ * code_is_translated - Check whether a store to address must go through code_write
+ *
+ * Stores to pages without code cost one table lookup.
+ */
+static inline int code_is_translated(uint16_t address)
+{
+    return (page_flags[address >> PAGE_SHIFT] & PAGE_CODE) && code_refs[address];
+}
+
+/**
+ * Function declarations/prototype
+ */
+void code_claim(uint16_t address);
+void code_release(uint16_t address);
+void code_write(uint16_t address);
+void code_write_range(uint16_t address, uint32_t count);
+
+#endif /* CODEMAP_H */
@@ -0,0 +1,257 @@
+/**
+ * cover.c - Hooking control transfers for the edge bitmap, and the lcov export (see cover.h)
+ */
+#include "cover.h"
+#include "cfg.h"
+#include "decode.h"
+#include "trace.h"
+
+int cover_enabled;
+uint8_t *cover_map;
+uint32_t cover_in[MEMORY_MAX];
+uint32_t cover_out[MEMORY_MAX];
+
+static uint8_t own_map[COVER_MAP_SIZE];
+static uint32_t map_mask;
+static op_handler original[MEMORY_MAX]; /* handlers of the wrapped words */
+
+/**
+ * edge - Bump the bitmap entry of the edge from -> to
+ *
+ * The two addresses are scrambled separately and the source shifted, as AFL
+ * does with block IDs, so that A -> B and B -> A land in different entries.
+ */
+static inline void edge(uint16_t from, uint16_t to)
+{
+    uint32_t h = ((uint32_t)(uint16_t)(from * 0x9E37u) >> 1) ^ (uint16_t)(to * 0x85EBu);
+    ++cover_map[h & map_mask];
+}
+
+/**
+ * count - Book a taken transfer for cover_write_lcov
+ */
+static inline void count(uint16_t from, uint16_t to)
+{
+    ++cover_out[from];
+    ++cover_in[to];
+}
+
+/*
+ * The handlers come in two sets: one that also counts transfers for the lcov
+ * export, and one that only fills the bitmap, for fuzzers that never ask for
+ * lcov. BR, the hot transfer, is executed here instead of through the wrapped
+ * handler: for opcode 0, instr >> 9 is the nzp mask, which R_COND always meets
+ * for BRnzp and never for a mask of 0. Traces are off, so no back edge is noted.
+ */
+#define DEF_TRANSFER(name, COUNT)                                              \
+    /* BR: record the branch if taken */                                       \
+    static void h_br##name(uint16_t instr)                                     \
+    {                                                                          \
+        uint16_t offset = instr & 0x1FF;                                       \
+        if (((instr >> 9) & reg[R_COND]) && offset)                            \
+        {                                                                      \
+            uint16_t from = reg[R_PC] - 1;                                     \
+            uint16_t to = reg[R_PC] += (uint16_t)((int16_t)(offset << 7) >> 7); \
+            COUNT(from, to);                                                   \
+            edge(from, to);                                                    \
+        }                                                                      \
+    }                                                                          \
+    /* JMP and JSR: record the transfer if it does not fall through */         \
+    static void h_transfer##name(uint16_t instr)                               \
+    {                                                                          \
+        uint16_t from = reg[R_PC] - 1;                                         \
+        original[instr](instr);                                                \
+        uint16_t to = reg[R_PC];                                               \
+        if (to != (uint16_t)(from + 1))                                        \
+        {                                                                      \
+            COUNT(from, to);                                                   \
+            edge(from, to);                                                    \
+        }                                                                      \
+    }                                                                          \
+    /* TRAP: native traps return to the next word, but are still an edge */    \
+    static void h_trap##name(uint16_t instr)                                   \
+    {                                                                          \
+        uint16_t from = reg[R_PC] - 1;                                         \
+        original[instr](instr);                                                \
+        uint16_t to = reg[R_PC];                                               \
+        if (to != (uint16_t)(from + 1))                                        \
+        {                                                                      \
+            COUNT(from, to);                                                   \
+        }                                                                      \
+        edge(from, to);                                                        \
+    }
+
+#define NO_COUNT(from, to) ((void)(from), (void)(to))
+DEF_TRANSFER(, count)
+DEF_TRANSFER(_map, NO_COUNT)
+
+/**
+ * cover_init - Start collecting coverage
+ *
+ * Builds the handler table if needed and turns the trace tier off.
+ *
+ * Parameters:
+ *   map: Bitmap to fill, or NULL for the built-in one
+ *   size: Bytes in map; only the largest power of two that fits is used
+ *   lines: Non-zero to also count transfers for cover_write_lcov
+ */
+void cover_init(uint8_t *map, uint32_t size, int lines)
+{
+    if (!decode_ready)
+    {
+        decode_init();
+    }
+    trace_tier = 0;
+    if (map == NULL)
+    {
+        map = own_map;
+        size = COVER_MAP_SIZE;
+    }
+    cover_map = map;
+    map_mask = 1;
+    while (map_mask * 2 <= size)
+    {
+        map_mask *= 2;
+    }
+    --map_mask;
+
+    for (uint32_t i = 0; i < MEMORY_MAX; ++i)
+    {
+        uint16_t op = i >> 12;
+        if (op == OP_BR)
+        {
+            handler_table[i] = lines ? h_br : h_br_map;
+        }
+        else if (op == OP_JMP || op == OP_JSR || op == OP_TRAP)
+        {
+            original[i] = handler_table[i];
+            if (op == OP_TRAP)
+            {
+                handler_table[i] = lines ? h_trap : h_trap_map;
+            }
+            else
+            {
+                handler_table[i] = lines ? h_transfer : h_transfer_map;
+            }
+        }
+    }
+    cover_enabled = 1;
+}
+
+/**
+ * cover_start - Book the arrival at the first instruction of a run
+ */
+void cover_start(uint16_t pc)
+{
+    ++cover_in[pc];
+}
+
+/**
+ * cover_stop - Book the end of a run: the instruction at the PC did not execute
+ *
+ * The counts are modular, so the arrival taken back here may be one that the
+ * fall-through from the previous word only adds in cover_write_lcov.
+ */
+void cover_stop(void)
+{
+    --cover_in[reg[R_PC]];
+}
+
+/**
+ * cover_edges - Count the bitmap entries that are set
+ */
+uint32_t cover_edges(void)
+{
+    uint32_t set = 0;
+    for (uint32_t i = 0; i <= map_mask; ++i)
+    {
+        set += cover_map[i] != 0;
+    }
+    return set;
+}
+
+/**
+ * cover_write_lcov - Write the execution counts as an lcov tracefile
+ *
+ * There is one record per image, named after its file. Line numbers are guest
+ * addresses (decimal), over the words of the image that cfg_build found
+ * reachable or that executed; conditional BRs also get branch data, taken and
+ * not taken.
+ *
+ * Parameters:
+ *   path: File to write
+ *   images: Image files that were loaded, whose headers give their address ranges
+ *   image_count: Number of images
+ *
+ * Returns:
+ *   int: 1 on success, 0 if the file could not be written
+ */
+int cover_write_lcov(const char *path, const char *const *images, int image_count)
+{
+    static uint32_t count[MEMORY_MAX];
+    uint32_t fall = 0;
+    for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+    {
+        count[a] = cover_in[a] + fall;
+        fall = count[a] - cover_out[a];
+    }
+
+    FILE *out = fopen(path, "w");
+    if (!out)
+    {
+        return 0;
+    }
+    for (int i = 0; i < image_count; ++i)
+    {
+        FILE *file = fopen(images[i], "rb");
+        if (!file)
+        {
+            continue;
+        }
+        uint8_t origin_bytes[2];
+        uint32_t origin = 0, words = 0;
+        if (fread(origin_bytes, 1, 2, file) == 2)
+        {
+            origin = (uint32_t)origin_bytes[0] << 8 | origin_bytes[1];
+            fseek(file, 0, SEEK_END);
+            words = (uint32_t)(ftell(file) - 2) / 2;
+        }
+        fclose(file);
+        if (words > MEMORY_MAX - origin)
+        {
+            words = MEMORY_MAX - origin;
+        }
+
+        uint32_t found = 0, hit = 0, branches = 0, branches_hit = 0;
+        fprintf(out, "TN:\nSF:%s\n", images[i]);
+        for (uint32_t a = origin; a < origin + words; ++a)
+        {
+            if (!(cfg_flags[a] & CFG_CODE) && count[a] == 0)
+            {
+                continue;
+            }
+            fprintf(out, "DA:%u,%u\n", a, count[a]);
+            ++found;
+            hit += count[a] != 0;
+
+            uint16_t instr = memory[a];
+            uint16_t mask = (instr >> 9) & 0x7;
+            if (instr >> 12 == OP_BR && mask != 0 && mask != 0x7)
+            {
+                if (count[a])
+                {
+                    fprintf(out, "BRDA:%u,0,0,%u\nBRDA:%u,0,1,%u\n", a, cover_out[a], a, count[a] - cover_out[a]);
+                }
+                else
+                {
+                    fprintf(out, "BRDA:%u,0,0,-\nBRDA:%u,0,1,-\n", a, a);
+                }
+                branches += 2;
+                branches_hit += (cover_out[a] != 0) + (count[a] - cover_out[a] != 0);
+            }
+        }
+        fprintf(out, "BRF:%u\nBRH:%u\nLF:%u\nLH:%u\nend_of_record\n", branches, branches_hit, found, hit);
+    }
+    fclose(out);
+    return 1;
+}
@@ -0,0 +1,49 @@
+/**
+ * cover.h - Edge coverage of the guest for coverage-guided tools and lcov
+ *
+ * Coverage is collected at control transfers only. cover_init wraps the
+ * handler_table entries of every BR, JMP/RET, JSR/JSRR and TRAP word; all other
+ * instructions run exactly as before. A wrapped handler compares the PC after
+ * the instruction with the fall-through address and, for a taken transfer from
+ * address from to address to:
+ *
+ *   - bumps the AFL-style bitmap entry of hash(from, to), so tools see each
+ *     distinct edge; TRAPs are entered in the bitmap even when they return
+ *     straight to the next word,
+ *   - counts one departure from from and one arrival at to.
+ *
+ * The departure and arrival counts are enough to recover how often every word
+ * executed: a word runs once per arrival plus once per time its predecessor ran
+ * without leaving (count(a) = in(a) + count(a - 1) - out(a - 1)). cover_start and
+ * cover_stop book the arrival at the first instruction of a run and the one at
+ * the instruction it stopped before. cover_write_lcov turns this into an lcov
+ * tracefile with one "line" per guest address, and branch data for conditional
+ * BRs.
+ *
+ * The bitmap is cover_map: a static one by default, or one shared with the
+ * fuzzer (AFL++'s __afl_area_ptr, libFuzzer's extra counters) passed to
+ * cover_init. Fuzzers that never write lcov pass lines = 0 to cover_init and
+ * get handlers that only fill the bitmap. Traces bypass the table, so coverage
+ * turns the trace tier off.
+ */
+#ifndef COVER_H
+#define COVER_H
+#include "main.h"
+
+#define COVER_MAP_SIZE (1 << 16) /* bytes in the default bitmap, as in AFL */
+
+extern int cover_enabled;
+extern uint8_t *cover_map;
+extern uint32_t cover_in[MEMORY_MAX];  /* taken transfers to, and runs starting at, each address */
+extern uint32_t cover_out[MEMORY_MAX]; /* taken transfers from each address */
+
+/**
+ * Function declarations/prototype
+ */
+void cover_init(uint8_t *map, uint32_t size, int lines);
+void cover_start(uint16_t pc);
+void cover_stop(void);
+uint32_t cover_edges(void);
+int cover_write_lcov(const char *path, const char *const *images, int image_count);
+
+#endif /* COVER_H */
@@ -0,0 +1,242 @@
+/**
+ * decode.c - Generation of the specialized handlers and of handler_table
+ *
+ * See decode.h. Handlers are named h_<op>[_<mode>]_<register fields>; the X-macros
+ * below define them and collect them into small arrays indexed by the register
+ * fields, from which decode_init fills the table.
+ */
+#include "decode.h"
+#include "trap.h"
+#include "trace.h"
+
+op_handler handler_table[MEMORY_MAX];
+int decode_ready;
+
+/* Sign-extend the low bits of x without a branch */
+#define SEXT(x, bits) ((uint16_t)((int16_t)(uint16_t)((x) << (16 - (bits))) >> (16 - (bits))))
+
+/* Condition codes of a value, as update_flags would set them */
+#define SET_FLAGS(v) (reg[R_COND] = (v) == 0 ? FL_ZRO : ((v) >> 15) ? FL_NEG : FL_POS)
+
+/* Expand X once per register, with and without a fixed first argument */
+#define REGS_1(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7)
+#define REGS_2(X, a) X(a, 0) X(a, 1) X(a, 2) X(a, 3) X(a, 4) X(a, 5) X(a, 6) X(a, 7)
+
+/* Rows of function pointers: one entry per register, or an 8 x 8 array */
+#define ENTRY_1(name) name,
+#define ROW_2(name, a) {REGS_2(ENTRY_2_##name, a)},
+
+/*
+ * ADD/AND: destination and first source fixed; the second operand is the register
+ * in bits 2-0 or the immediate in bits 4-0
+ */
+#define DEF_ALU(d, s)                                                          \
+    static void h_add_reg_##d##_##s(uint16_t instr)                            \
+    {                                                                          \
+        reg[d] = reg[s] + reg[instr & 0x7];                                    \
+        SET_FLAGS(reg[d]);                                                     \
+    }                                                                          \
+    static void h_add_imm_##d##_##s(uint16_t instr)                            \
+    {                                                                          \
+        reg[d] = reg[s] + SEXT(instr & 0x1F, 5);                               \
+        SET_FLAGS(reg[d]);                                                     \
+    }                                                                          \
+    static void h_and_reg_##d##_##s(uint16_t instr)                            \
+    {                                                                          \
+        reg[d] = reg[s] & reg[instr & 0x7];                                    \
+        SET_FLAGS(reg[d]);                                                     \
+    }                                                                          \
+    static void h_and_imm_##d##_##s(uint16_t instr)                            \
+    {                                                                          \
+        reg[d] = reg[s] & SEXT(instr & 0x1F, 5);                               \
+        SET_FLAGS(reg[d]);                                                     \
+    }                                                                          \
+    static void h_not_##d##_##s(uint16_t instr)                                \
+    {                                                                          \
+        (void)instr;                                                           \
+        reg[d] = ~reg[s];                                                      \
+        SET_FLAGS(reg[d]);                                                     \
+    }                                                                          \
+    static void h_ldr_##d##_##s(uint16_t instr)                                \
+    {                                                                          \
+        reg[d] = mem_read(reg[s] + SEXT(instr & 0x3F, 6));                     \
+        SET_FLAGS(reg[d]);                                                     \
+    }                                                                          \
+    static void h_str_##d##_##s(uint16_t instr)                                \
+    {                                                                          \
+        mem_write(reg[s] + SEXT(instr & 0x3F, 6), reg[d]);                     \
+    }
+#define DEF_ALU_ROW(d) REGS_2(DEF_ALU, d)
+REGS_1(DEF_ALU_ROW)
+
+/* PC-relative loads and stores: the register in bits 11-9 fixed */
+#define DEF_PCREL(d)                                                           \
+    static void h_ld_##d(uint16_t instr)                                       \
+    {                                                                          \
+        reg[d] = mem_read(reg[R_PC] + SEXT(instr & 0x1FF, 9));                 \
+        SET_FLAGS(reg[d]);                                                     \
+    }                                                                          \
+    static void h_ldi_##d(uint16_t instr)                                      \
+    {                                                                          \
+        reg[d] = mem_read(mem_read(reg[R_PC] + SEXT(instr & 0x1FF, 9)));       \
+        SET_FLAGS(reg[d]);                                                     \
+    }                                                                          \
+    static void h_lea_##d(uint16_t instr)                                      \
+    {                                                                          \
+        reg[d] = reg[R_PC] + SEXT(instr & 0x1FF, 9);                           \
+        SET_FLAGS(reg[d]);                                                     \
+    }                                                                          \
+    static void h_st_##d(uint16_t instr)                                       \
+    {                                                                          \
+        mem_write(reg[R_PC] + SEXT(instr & 0x1FF, 9), reg[d]);                 \
+    }                                                                          \
+    static void h_sti_##d(uint16_t instr)                                      \
+    {                                                                          \
+        mem_write(mem_read(reg[R_PC] + SEXT(instr & 0x1FF, 9)), reg[d]);       \
+    }                                                                          \
+    /* JMP/JSRR: base register in bits 8-6 */                                  \
+    static void h_jmp_##d(uint16_t instr)                                      \
+    {                                                                          \
+        (void)instr;                                                           \
+        reg[R_PC] = reg[d];                                                    \
+    }                                                                          \
+    static void h_jsrr_##d(uint16_t instr)                                     \
+    {                                                                          \
+        (void)instr;                                                           \
+        reg[R_R7] = reg[R_PC];                                                 \
+        reg[R_PC] = reg[d];                                                    \
+    }
+REGS_1(DEF_PCREL)
+
+/* BR: one handler per condition mask; never- and always-taken need no test */
+#define DEF_BR(m)                                                              \
+    static void h_br_##m(uint16_t instr)                                       \
+    {                                                                          \
+        if ((m) == 0 || ((m) != 0x7 && !((m) & reg[R_COND])))                  \
+            return;                                                            \
+        uint16_t pc_offset = SEXT(instr & 0x1FF, 9);                           \
+        reg[R_PC] += pc_offset;                                                \
+        /* A taken backward branch closes a loop, as in execute() */           \
+        if ((pc_offset >> 15) && trace_tier)                                   \
+            trace_backedge(reg[R_PC]);                                         \
+    }
+REGS_1(DEF_BR)
+
+static void h_jsr(uint16_t instr)
+{
+    reg[R_R7] = reg[R_PC];
+    reg[R_PC] += SEXT(instr & 0x7FF, 11);
+}
+
+static void h_trap(uint16_t instr)
+{
+    trap_execute(instr & 0xFF);
+}
+
+/* RTI and the reserved opcode */
+static void h_execute(uint16_t instr)
+{
+    execute(instr);
+}
+
+/* Handler arrays, indexed by the register fields */
+#define ENTRY_2_add_reg(d, s) h_add_reg_##d##_##s,
+#define ENTRY_2_add_imm(d, s) h_add_imm_##d##_##s,
+#define ENTRY_2_and_reg(d, s) h_and_reg_##d##_##s,
+#define ENTRY_2_and_imm(d, s) h_and_imm_##d##_##s,
+#define ENTRY_2_not(d, s) h_not_##d##_##s,
+#define ENTRY_2_ldr(d, s) h_ldr_##d##_##s,
+#define ENTRY_2_str(d, s) h_str_##d##_##s,
+#define ROW_add_reg(d) ROW_2(add_reg, d)
+#define ROW_add_imm(d) ROW_2(add_imm, d)
+#define ROW_and_reg(d) ROW_2(and_reg, d)
+#define ROW_and_imm(d) ROW_2(and_imm, d)
+#define ROW_not(d) ROW_2(not, d)
+#define ROW_ldr(d) ROW_2(ldr, d)
+#define ROW_str(d) ROW_2(str, d)
+#define ENTRY_ld(d) h_ld_##d,
+#define ENTRY_ldi(d) h_ldi_##d,
+#define ENTRY_lea(d) h_lea_##d,
+#define ENTRY_st(d) h_st_##d,
+#define ENTRY_sti(d) h_sti_##d,
+#define ENTRY_jmp(d) h_jmp_##d,
+#define ENTRY_jsrr(d) h_jsrr_##d,
+#define ENTRY_br(m) h_br_##m,
+
+static const op_handler add_reg[8][8] = {REGS_1(ROW_add_reg)};
+static const op_handler add_imm[8][8] = {REGS_1(ROW_add_imm)};
+static const op_handler and_reg[8][8] = {REGS_1(ROW_and_reg)};
+static const op_handler and_imm[8][8] = {REGS_1(ROW_and_imm)};
+static const op_handler not_op[8][8] = {REGS_1(ROW_not)};
+static const op_handler ldr[8][8] = {REGS_1(ROW_ldr)};
+static const op_handler str[8][8] = {REGS_1(ROW_str)};
+static const op_handler ld[8] = {REGS_1(ENTRY_ld)};
+static const op_handler ldi[8] = {REGS_1(ENTRY_ldi)};
+static const op_handler lea[8] = {REGS_1(ENTRY_lea)};
+static const op_handler st[8] = {REGS_1(ENTRY_st)};
+static const op_handler sti[8] = {REGS_1(ENTRY_sti)};
+static const op_handler jmp[8] = {REGS_1(ENTRY_jmp)};
+static const op_handler jsrr[8] = {REGS_1(ENTRY_jsrr)};
+static const op_handler br[8] = {REGS_1(ENTRY_br)};
+
+/**
+ * decode_init - Fill handler_table with the handler of every instruction word
+ */
+void decode_init(void)
+{
+    for (uint32_t instr = 0; instr < MEMORY_MAX; ++instr)
+    {
+        uint16_t dr = (instr >> 9) & 0x7;
+        uint16_t sr1 = (instr >> 6) & 0x7;
+        int imm = (instr >> 5) & 0x1;
+        op_handler h = h_execute;
+
+        switch (instr >> 12)
+        {
+        case OP_BR:
+            h = br[dr];
+            break;
+        case OP_ADD:
+            h = imm ? add_imm[dr][sr1] : add_reg[dr][sr1];
+            break;
+        case OP_AND:
+            h = imm ? and_imm[dr][sr1] : and_reg[dr][sr1];
+            break;
+        case OP_NOT:
+            h = not_op[dr][sr1];
+            break;
+        case OP_LD:
+            h = ld[dr];
+            break;
+        case OP_LDI:
+            h = ldi[dr];
+            break;
+        case OP_LEA:
+            h = lea[dr];
+            break;
+        case OP_LDR:
+            h = ldr[dr][sr1];
+            break;
+        case OP_ST:
+            h = st[dr];
+            break;
+        case OP_STI:
+            h = sti[dr];
+            break;
+        case OP_STR:
+            h = str[dr][sr1];
+            break;
+        case OP_JMP:
+            h = jmp[sr1];
+            break;
+        case OP_JSR:
+            h = ((instr >> 11) & 1) ? h_jsr : jsrr[sr1];
+            break;
+        case OP_TRAP:
+            h = h_trap;
+            break;
+        }
+        handler_table[instr] = h;
+    }
+    decode_ready = 1;
+}
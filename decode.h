@@ -0,0 +1,29 @@
+/**
+ * decode.h - Specialized instruction handlers selected by a 64K-entry table
+ *
+ * The reference interpreter, execute(), re-decodes every instruction: it switches
+ * on the opcode, tests the immediate flag of ADD/AND and indexes reg[] through the
+ * register fields. Here the decoding is done once, when the table is built: the
+ * handlers are generated with X-macros for every opcode x addressing mode x
+ * register operand, so each one has its registers and mode as constants, and the
+ * table maps every possible 16-bit instruction word to its handler. Executing an
+ * instruction is then a single indirect call through handler_table[instr].
+ *
+ * The remaining instruction fields (immediates and offsets) are extracted in the
+ * handler without branches. RTI and the reserved opcode go to execute().
+ */
+#ifndef DECODE_H
+#define DECODE_H
+#include "main.h"
+
+typedef void (*op_handler)(uint16_t instr);
+
+extern op_handler handler_table[MEMORY_MAX]; /* handler for every instruction word */
+extern int decode_ready;                     /* set once decode_init has filled the table */
+
+/**
+ * Function declarations/prototype
+ */
+void decode_init(void);
+
+#endif /* DECODE_H */
@@ -0,0 +1,128 @@
+/**
+ * disk.c - The block device: mapping the host file and running DMA commands (see disk.h)
+ */
+#include "disk.h"
+#include "codemap.h"
+#include "watch.h"
+#include "fuzz.h"
+#include "check.h"
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+struct disk_stats disk_stats;
+
+static uint16_t *disk; /* the mapped file, NULL without a disk */
+static uint32_t sectors;
+
+#ifndef _WIN32
+/**
+ * disk_open - Attach a host file as the disk
+ *
+ * The file must be at least one sector long; a partial sector at its end is
+ * left out, as are sectors past the 65535 that MR_DISK_SECTOR can select.
+ *
+ * Returns:
+ *   int: 1 on success, 0 if the file cannot be opened or mapped
+ */
+int disk_open(const char *path)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < DISK_SECTOR_BYTES)
+    {
+        close(fd);
+        return 0;
+    }
+    sectors = st.st_size / DISK_SECTOR_BYTES > 0xFFFF ? 0xFFFF : (uint32_t)(st.st_size / DISK_SECTOR_BYTES);
+    void *map = mmap(NULL, (size_t)sectors * DISK_SECTOR_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return 0;
+    }
+    disk = map;
+    memory[MR_DISK_STATUS] = DISK_READY;
+    memory[MR_DISK_SIZE] = (uint16_t)sectors;
+    return 1;
+}
+
+/**
+ * disk_close - Detach the disk, leaving what the guest wrote in the file
+ */
+void disk_close(void)
+{
+    if (disk)
+    {
+        munmap(disk, (size_t)sectors * DISK_SECTOR_BYTES);
+        disk = NULL;
+    }
+}
+#else
+int disk_open(const char *path)
+{
+    (void)path;
+    return 0; /* no mmap */
+}
+
+void disk_close(void)
+{
+}
+#endif
+
+/**
+ * disk_command - Run a command stored into MR_DISK_CMD, before the store itself
+ */
+void disk_command(uint16_t command)
+{
+    uint16_t sector = memory[MR_DISK_SECTOR];
+    uint16_t address = memory[MR_DISK_ADDR];
+
+    /* The buffer must end before the device page, which also keeps it from wrapping */
+    if (!disk || sector >= sectors || (uint32_t)address + DISK_SECTOR_WORDS > MR_KBSR ||
+        (command != DISK_READ && command != DISK_WRITE))
+    {
+        memory[MR_DISK_STATUS] = disk ? DISK_READY | DISK_ERROR : DISK_ERROR;
+        ++disk_stats.refused;
+        return;
+    }
+
+    uint16_t *data = disk + (size_t)sector * DISK_SECTOR_WORDS;
+    if (command == DISK_READ)
+    {
+        if (watch_count)
+        {
+            for (int i = 0; i < DISK_SECTOR_WORDS; ++i)
+            {
+                if (page_flags[(address + i) >> PAGE_SHIFT] & PAGE_WATCH)
+                {
+                    watch_store(address + i, data[i]);
+                }
+            }
+        }
+        if (fuzz_enabled)
+        {
+            fuzz_dirty_range(address, DISK_SECTOR_WORDS);
+        }
+        if (check_enabled)
+        {
+            check_store_range(address, DISK_SECTOR_WORDS);
+        }
+        memcpy(memory + address, data, DISK_SECTOR_BYTES);
+        code_write_range(address, DISK_SECTOR_WORDS);
+        ++disk_stats.reads;
+    }
+    else
+    {
+        memcpy(data, memory + address, DISK_SECTOR_BYTES);
+        ++disk_stats.writes;
+    }
+    memory[MR_DISK_STATUS] = DISK_READY;
+}
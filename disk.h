@@ -0,0 +1,68 @@
+/**
+ * disk.h - Block storage device backed by a memory-mapped host file
+ *
+ * With --disk FILE the guest gets a block device with its registers in the
+ * device page, next to the keyboard and display (main.h):
+ *
+ *   MR_DISK_SECTOR  sector to transfer
+ *   MR_DISK_ADDR    guest address of the DISK_SECTOR_WORDS-word buffer
+ *   MR_DISK_CMD     storing DISK_READ copies the sector into the buffer,
+ *                   DISK_WRITE copies the buffer into the sector
+ *   MR_DISK_STATUS  DISK_READY while a disk is attached, plus DISK_ERROR if
+ *                   the last command was refused
+ *   MR_DISK_SIZE    sectors on the disk
+ *
+ * The file is mapped shared, so a transfer is a single memcpy between the
+ * mapping and memory[], and sectors the guest writes reach the file through
+ * the page cache. A sector is DISK_SECTOR_WORDS words in host byte order, the
+ * size of a page of the code map. Commands complete within the store that
+ * issues them, so the status is final as soon as the guest can read it.
+ *
+ * A command is refused when no disk is attached, the sector is past the end,
+ * the buffer would run into the device page or wrap around memory, or the
+ * command is unknown. Reads into memory[] go through the same hooks as
+ * MEMMOVE: translations of the overwritten words are discarded, watchpoints,
+ * fuzzing snapshots and the lockstep checker see the stores. The file is
+ * outside the machine state: replaying history would read what the guest wrote
+ * to it since, so --disk cannot be combined with --reverse, nor with --batch,
+ * whose jobs run without devices.
+ */
+#ifndef DISK_H
+#define DISK_H
+#include "main.h"
+
+#define DISK_SECTOR_WORDS 256 /* words per sector */
+#define DISK_SECTOR_BYTES (DISK_SECTOR_WORDS * 2)
+
+/* Commands, stored into MR_DISK_CMD */
+enum
+{
+    DISK_READ = 1, /* sector -> memory */
+    DISK_WRITE = 2 /* memory -> sector */
+};
+
+/* Bits of MR_DISK_STATUS */
+enum
+{
+    DISK_ERROR = 1 << 0,
+    DISK_READY = 1 << 15
+};
+
+/* Counters for --stats */
+struct disk_stats
+{
+    uint64_t reads;   /* sectors copied into memory */
+    uint64_t writes;  /* sectors copied to the disk */
+    uint64_t refused; /* commands refused */
+};
+
+extern struct disk_stats disk_stats;
+
+/**
+ * Function declarations/prototype
+ */
+int disk_open(const char *path);
+void disk_close(void);
+void disk_command(uint16_t command);
+
+#endif /* DISK_H */
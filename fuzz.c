@@ -0,0 +1,229 @@
+/**
+ * fuzz.c - Running test cases from a snapshot and resetting only dirty pages (see fuzz.h)
+ */
+#include "fuzz.h"
+#include "codemap.h"
+#include "decode.h"
+#include "trace.h"
+#include "cover.h"
+#include <string.h>
+
+int fuzz_enabled;
+struct fuzz_stats fuzz_stats;
+
+static uint16_t snap_memory[MEMORY_MAX];
+static uint16_t snap_reg[R_COUNT];
+static uint64_t snap_count;
+static uint64_t case_budget;
+
+static uint8_t dirty[PAGE_COUNT]; /* pages written since the snapshot, in the order of their first store */
+static int dirty_count;
+
+static const uint8_t *input; /* the running test case */
+static size_t input_len, input_pos;
+static int outcome; /* FUZZ_* of the running test case */
+
+/**
+ * end_case - Stop the running test case with the given outcome
+ */
+static void end_case(int how)
+{
+    outcome = how;
+    running = 0;
+}
+
+/**
+ * h_fault - Handler of every RTI and reserved instruction word while fuzzing
+ */
+static void h_fault(uint16_t instr)
+{
+    (void)instr;
+    end_case(FUZZ_FAULT);
+}
+
+/**
+ * run - Execute until the guest stops or instr_count reaches limit
+ */
+static void run(uint64_t limit)
+{
+    while (running && instr_count < limit)
+    {
+        uint16_t instr = memory[reg[R_PC]++];
+        ++instr_count;
+        handler_table[instr](instr);
+    }
+}
+
+/**
+ * fuzz_dirty - Slow path of mem_write for pages still tagged PAGE_SNAPSHOT
+ */
+void fuzz_dirty(uint16_t address)
+{
+    uint16_t page = address >> PAGE_SHIFT;
+    if (page_flags[page] & PAGE_SNAPSHOT)
+    {
+        page_flags[page] &= ~PAGE_SNAPSHOT;
+        dirty[dirty_count++] = (uint8_t)page;
+    }
+}
+
+/**
+ * fuzz_dirty_range - Record the pages of a block write, which may wrap around the end of memory
+ */
+void fuzz_dirty_range(uint16_t address, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i += 1 << PAGE_SHIFT)
+    {
+        fuzz_dirty(address + i);
+    }
+    if (count)
+    {
+        fuzz_dirty(address + count - 1);
+    }
+}
+
+/**
+ * fuzz_key - Whether the test case has input left; a guest polling after the last byte ends it
+ */
+uint16_t fuzz_key(void)
+{
+    if (input_pos < input_len)
+    {
+        return 1;
+    }
+    end_case(FUZZ_STARVED);
+    return 0;
+}
+
+/**
+ * fuzz_getchar - Take the next byte of the test case, ending it if there is none
+ */
+uint16_t fuzz_getchar(void)
+{
+    if (input_pos < input_len)
+    {
+        return input[input_pos++];
+    }
+    end_case(FUZZ_STARVED);
+    return 0xFFFF;
+}
+
+/**
+ * fuzz_init - Run the loaded image up to entry and snapshot it there
+ *
+ * The guest gets no input on the way, and at most FUZZ_WARMUP_MAX instructions.
+ * Builds the handler table if needed and turns the trace tier off.
+ *
+ * Parameters:
+ *   entry: PC at which test cases start; the current PC starts them right away
+ *   budget: Instructions each test case may execute
+ *
+ * Returns:
+ *   int: 1 on success, 0 if the guest stopped or ran out of instructions before reaching entry
+ */
+int fuzz_init(uint16_t entry, uint64_t budget)
+{
+    if (!decode_ready)
+    {
+        decode_init();
+    }
+    trace_tier = 0;
+    fuzz_enabled = 1;
+    case_budget = budget;
+    for (uint32_t i = 0; i < MEMORY_MAX; ++i)
+    {
+        uint16_t op = i >> 12;
+        if (op == OP_RTI || op == OP_RES)
+        {
+            handler_table[i] = h_fault;
+        }
+    }
+
+    input_len = input_pos = 0;
+    uint64_t limit = instr_count + FUZZ_WARMUP_MAX;
+    while (running && reg[R_PC] != entry)
+    {
+        if (instr_count == limit)
+        {
+            return 0;
+        }
+        uint16_t instr = memory[reg[R_PC]++];
+        ++instr_count;
+        handler_table[instr](instr);
+    }
+    if (!running)
+    {
+        return 0;
+    }
+
+    memcpy(snap_memory, memory, sizeof(snap_memory));
+    memcpy(snap_reg, reg, sizeof(snap_reg));
+    snap_count = instr_count;
+    for (int i = 0; i < PAGE_COUNT; ++i)
+    {
+        page_flags[i] |= PAGE_SNAPSHOT;
+    }
+    dirty_count = 0;
+    return 1;
+}
+
+/**
+ * reset - Put the machine back in the state of the snapshot
+ */
+static void reset(void)
+{
+    for (int i = 0; i < dirty_count; ++i)
+    {
+        uint32_t at = (uint32_t)dirty[i] << PAGE_SHIFT;
+        memcpy(memory + at, snap_memory + at, sizeof(uint16_t) << PAGE_SHIFT);
+        page_flags[dirty[i]] |= PAGE_SNAPSHOT;
+    }
+    fuzz_stats.pages += dirty_count;
+    dirty_count = 0;
+
+    /* Reading the device registers updates them without a store */
+    memory[MR_KBSR] = snap_memory[MR_KBSR];
+    memory[MR_KBDR] = snap_memory[MR_KBDR];
+    memory[MR_DSR] = snap_memory[MR_DSR];
+
+    memcpy(reg, snap_reg, sizeof(reg));
+    instr_count = snap_count;
+    running = 1;
+}
+
+/**
+ * fuzz_run - Run one test case from the snapshot, then reset
+ *
+ * Parameters:
+ *   data, size: The guest's keyboard input
+ *
+ * Returns:
+ *   int: How the case ended (FUZZ_*)
+ */
+int fuzz_run(const uint8_t *data, size_t size)
+{
+    input = data;
+    input_len = size;
+    input_pos = 0;
+    outcome = FUZZ_HALTED;
+
+    if (cover_enabled)
+    {
+        cover_start(reg[R_PC]);
+    }
+    run(snap_count + case_budget);
+    if (running)
+    {
+        outcome = FUZZ_BUDGET;
+    }
+    if (cover_enabled)
+    {
+        cover_stop();
+    }
+    ++fuzz_stats.cases;
+    fuzz_stats.instructions += instr_count - snap_count;
+    ++fuzz_stats.outcomes[outcome];
+
+    reset();
+    return outcome;
+}
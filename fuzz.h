@@ -0,0 +1,64 @@
+/**
+ * fuzz.h - In-process fuzzing with snapshot reset
+ *
+ * Starting a VM per test case spends nearly all of its time loading images and
+ * setting up the process. The harness instead runs the loaded image once up to
+ * a configured entry PC, snapshots the machine there and then runs every test
+ * case from that snapshot in the same process:
+ *
+ *   - the case's bytes are the guest's keyboard: GETC, IN and KBSR/KBDR read
+ *     them in order, and a guest asking for more input than the case holds ends
+ *     the case (FUZZ_STARVED),
+ *   - the case ends after a budget of instructions (FUZZ_BUDGET), at HALT, or at
+ *     RTI or a reserved opcode (FUZZ_FAULT, which front ends report as a crash),
+ *   - resetting for the next case copies back only the pages the last one wrote.
+ *     After the snapshot, every page is tagged PAGE_SNAPSHOT in page_flags[]
+ *     (codemap.h); the first store into a tagged page puts it on the dirty list
+ *     and clears the tag, so the store path looks at no more than it already did
+ *     for watchpoints.
+ *
+ * Guest console output is discarded while fuzzing. The loop is the handler
+ * table's plus a budget check, so the trace tier stays off.
+ *
+ * lc3-fuzz (fuzz_main.c) wraps this for AFL++ persistent mode, libFuzzer and
+ * plain runs over files.
+ */
+#ifndef FUZZ_H
+#define FUZZ_H
+#include "main.h"
+
+#define FUZZ_BUDGET_DEFAULT 1000000 /* instructions per test case */
+#define FUZZ_WARMUP_MAX 100000000   /* instructions the image may run before reaching the entry */
+
+/* How a test case ended */
+enum
+{
+    FUZZ_HALTED = 0, /* HALT, or the OS clearing MCR */
+    FUZZ_STARVED,    /* the guest waited for input after consuming all of it */
+    FUZZ_BUDGET,     /* the instruction budget ran out */
+    FUZZ_FAULT       /* RTI or a reserved opcode */
+};
+
+/* Counters for --stats */
+struct fuzz_stats
+{
+    uint64_t cases;
+    uint64_t instructions; /* executed by the cases, not counting the run to the entry */
+    uint64_t pages;        /* dirty pages copied back */
+    uint64_t outcomes[4];  /* cases per FUZZ_* */
+};
+
+extern int fuzz_enabled; /* set by fuzz_init */
+extern struct fuzz_stats fuzz_stats;
+
+/**
+ * Function declarations/prototype
+ */
+int fuzz_init(uint16_t entry, uint64_t budget);
+int fuzz_run(const uint8_t *data, size_t size);
+void fuzz_dirty(uint16_t address);
+void fuzz_dirty_range(uint16_t address, uint32_t count);
+uint16_t fuzz_key(void);
+uint16_t fuzz_getchar(void);
+
+#endif /* FUZZ_H */
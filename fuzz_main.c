@@ -0,0 +1,281 @@
+/**
+ * fuzz_main.c - lc3-fuzz, the in-process fuzzing front end (see fuzz.h)
+ *
+ * Usage: lc3-fuzz [--os-traps] [--entry ADDR] [--budget N] [--runs N] [--stats] [--cover FILE] image... [-- case...]
+ *
+ *   --os-traps   service the standard traps with an OS image loaded alongside, as vm --os-traps
+ *   --entry ADDR run the images to ADDR before taking the snapshot (default: the start PC)
+ *   --budget N   instructions each test case may execute (default FUZZ_BUDGET_DEFAULT)
+ *   --runs N     run every case N times, for measuring execs per second
+ *   --stats      print the outcome counters and the execution rate to stderr
+ *   --cover FILE collect the guest's edge coverage over all cases and write it to FILE as an lcov tracefile
+ *
+ * How the cases arrive depends on how lc3-fuzz was built:
+ *
+ *   - with afl-clang-fast, it is an AFL++ persistent-mode target: the fork
+ *     server starts after the snapshot, and each iteration of __AFL_LOOP runs a
+ *     case from the shared-memory test case buffer; the guest's edges go
+ *     into AFL's coverage map,
+ *   - with -DFUZZ_LIBFUZZER and -fsanitize=fuzzer, it is a libFuzzer target;
+ *     the options and images above come from the LC3_FUZZ environment
+ *     variable, as libFuzzer owns the command line, and the guest's edges
+ *     are libFuzzer extra counters,
+ *   - otherwise each case file after "--" (or stdin, without any) is run once
+ *     per --runs and its outcome printed; coverage is only collected with --cover.
+ *
+ * In every mode a case ending in FUZZ_FAULT aborts the process, which is how
+ * fuzzers recognize a crash.
+ */
+#include "fuzz.h"
+#include "trap.h"
+#include "cfg.h"
+#include "breakpoint.h"
+#include "cover.h"
+#include <string.h>
+
+#define FUZZ_AFL_LOOP 100000 /* cases per persistent-mode process */
+#define FUZZ_CASE_MAX (1 << 20) /* longest case read from a file */
+
+static int stats;
+static uint64_t runs = 1;
+static const char *cover_file;
+static const char **images; /* the image files, for the lcov report */
+static int image_count;
+
+/**
+ * setup - Parse the options, load the images and take the snapshot
+ *
+ * Returns:
+ *   int: Index of the first case file in argv (argc if there are none)
+ */
+static int setup(int argc, const char *argv[])
+{
+    int trap_mode_arg = TRAP_MODE_NATIVE;
+    uint16_t entry = PC_START;
+    uint64_t budget = FUZZ_BUDGET_DEFAULT;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] == '-' && argv[i][2] != '\0'; ++i)
+    {
+        const char *end;
+        if (strcmp(argv[i], "--os-traps") == 0)
+        {
+            trap_mode_arg = TRAP_MODE_OS;
+        }
+        else if (strcmp(argv[i], "--entry") == 0 && i + 1 < argc && bp_parse_value(argv[i + 1], &end, &entry) &&
+                 *end == '\0')
+        {
+            ++i;
+        }
+        else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc)
+        {
+            budget = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+        {
+            runs = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            stats = 1;
+        }
+        else if (strcmp(argv[i], "--cover") == 0 && i + 1 < argc)
+        {
+            cover_file = argv[++i];
+        }
+        else
+        {
+            printf("unknown option: %s\n", argv[i]);
+            exit(2);
+        }
+    }
+
+    int first_case = i;
+    while (first_case < argc && strcmp(argv[first_case], "--") != 0)
+    {
+        ++first_case;
+    }
+    if (i == first_case)
+    {
+        printf("lc3-fuzz [--os-traps] [--entry addr] [--budget n] [--runs n] [--stats] [--cover file] image-file... [-- case-file...]\n");
+        exit(2);
+    }
+    images = argv + i;
+    image_count = first_case - i;
+    for (; i < first_case; ++i)
+    {
+        if (!read_image(argv[i]))
+        {
+            printf("failed to load image: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    trap_init(trap_mode_arg);
+    memory[MR_MCR] = (1 << 15);
+    /* The lcov report leaves out words the analysis found to be data */
+    if (cover_file)
+    {
+        cfg_build(PC_START);
+    }
+    reg[R_COND] = FL_ZRO;
+    reg[R_PC] = PC_START;
+    running = 1;
+
+    if (!fuzz_init(entry, budget))
+    {
+        printf("the guest stopped or ran %d instructions before reaching x%04X\n", FUZZ_WARMUP_MAX, entry);
+        exit(1);
+    }
+    return first_case < argc ? first_case + 1 : argc;
+}
+
+/**
+ * run_case - Run one test case, aborting on a fault
+ */
+static int run_case(const uint8_t *data, size_t size)
+{
+    int outcome = fuzz_run(data, size);
+    if (outcome == FUZZ_FAULT)
+    {
+        abort();
+    }
+    return outcome;
+}
+
+#ifdef FUZZ_LIBFUZZER
+/* The guest's edges, which libFuzzer reads alongside its own coverage */
+__attribute__((used, section("__libfuzzer_extra_counters"))) static uint8_t extra_counters[COVER_MAP_SIZE];
+
+/**
+ * LLVMFuzzerInitialize - Set up from the LC3_FUZZ environment variable, e.g. LC3_FUZZ="--entry x3010 prog.obj"
+ */
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    (void)argc;
+    static const char *args[64];
+    int count = 0;
+    args[count++] = (*argv)[0];
+    const char *env = getenv("LC3_FUZZ");
+    char *copy = env ? strdup(env) : NULL;
+    for (char *word = copy ? strtok(copy, " ") : NULL; word && count < 63; word = strtok(NULL, " "))
+    {
+        args[count++] = word;
+    }
+    args[count] = NULL;
+    setup(count, args);
+    cover_init(extra_counters, sizeof(extra_counters), 0);
+    return 0;
+}
+
+/**
+ * LLVMFuzzerTestOneInput - Run one case from the snapshot
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    run_case(data, size);
+    return 0;
+}
+#else
+
+static const char *const outcome_names[4] = {"halted", "starved", "budget", "fault"};
+
+/**
+ * print_stats - Write the fuzzing counters to stderr
+ */
+static void print_stats(double seconds)
+{
+    fprintf(stderr, "cases: %llu (%llu halted, %llu starved, %llu over budget), %llu instructions, %llu pages reset\n",
+            (unsigned long long)fuzz_stats.cases, (unsigned long long)fuzz_stats.outcomes[FUZZ_HALTED],
+            (unsigned long long)fuzz_stats.outcomes[FUZZ_STARVED], (unsigned long long)fuzz_stats.outcomes[FUZZ_BUDGET],
+            (unsigned long long)fuzz_stats.instructions, (unsigned long long)fuzz_stats.pages);
+    if (seconds > 0)
+    {
+        fprintf(stderr, "rate: %.0f cases/s\n", fuzz_stats.cases / seconds);
+    }
+    if (cover_enabled)
+    {
+        fprintf(stderr, "coverage: %u edges\n", cover_edges());
+    }
+}
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+__AFL_FUZZ_INIT();
+#endif
+#ifdef __AFL_HAVE_MANUAL_CONTROL
+extern unsigned char *__afl_area_ptr;
+extern unsigned int __afl_map_size;
+#endif
+
+/**
+ * read_case - Read a whole case file (or stdin, for "-")
+ *
+ * Returns:
+ *   size_t: Bytes read into buf
+ */
+static size_t read_case(const char *path, uint8_t *buf)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!file)
+    {
+        printf("failed to open case: %s\n", path);
+        exit(1);
+    }
+    size_t size = fread(buf, 1, FUZZ_CASE_MAX, file);
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+    return size;
+}
+
+int main(int argc, const char *argv[])
+{
+    int first_case = setup(argc, argv);
+
+#ifdef __AFL_HAVE_MANUAL_CONTROL
+    /* Everything up to here, the snapshot included, is shared by all forks */
+    __AFL_INIT();
+    cover_init(__afl_area_ptr, __afl_map_size, 0);
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+    unsigned char *afl_buf = __AFL_FUZZ_TESTCASE_BUF;
+    while (__AFL_LOOP(FUZZ_AFL_LOOP))
+    {
+        run_case(afl_buf, __AFL_FUZZ_TESTCASE_LEN);
+    }
+    return EXIT_SUCCESS;
+#endif
+#endif
+
+    if (cover_file)
+    {
+        cover_init(NULL, 0, 1);
+    }
+
+    static uint8_t buf[FUZZ_CASE_MAX];
+    const char *stdin_case[] = {"-"};
+    const char **cases = first_case < argc ? argv + first_case : stdin_case;
+    int case_count = first_case < argc ? argc - first_case : 1;
+
+    uint64_t start = host_time_ns();
+    for (int c = 0; c < case_count; ++c)
+    {
+        size_t size = read_case(cases[c], buf);
+        int outcome = FUZZ_HALTED;
+        for (uint64_t r = 0; r < runs; ++r)
+        {
+            outcome = run_case(buf, size);
+        }
+        printf("%s: %s\n", cases[c], outcome_names[outcome]);
+    }
+    if (stats)
+    {
+        print_stats((host_time_ns() - start) / 1e9);
+    }
+    if (cover_file && !cover_write_lcov(cover_file, images, image_count))
+    {
+        printf("failed to write coverage to %s\n", cover_file);
+        exit(1);
+    }
+    return EXIT_SUCCESS;
+}
+#endif /* FUZZ_LIBFUZZER */
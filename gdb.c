@@ -0,0 +1,675 @@
+/**
+ * gdb.c - GDB remote serial protocol stub (see gdb.h)
+ */
+#include "gdb.h"
+#include "breakpoint.h"
+#include "codemap.h"
+#include "decode.h"
+#include "watch.h"
+#include "replay.h"
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+/* Signal numbers of stop replies */
+enum
+{
+    GDB_SIGINT = 2, /* stopped by Ctrl-C in the debugger */
+    GDB_SIGTRAP = 5 /* breakpoint, step, or the stop on attaching */
+};
+
+/* Who set the breakpoint at an address, in owner[] */
+enum
+{
+    OWNER_Z = 1 << 0,      /* a Z0/Z1 packet */
+    OWNER_MONITOR = 1 << 1 /* "monitor break" */
+};
+
+#ifndef _WIN32
+static int client = -1;
+static const char *socket_path;
+static int resumed;                       /* the debugger waits for a stop reply */
+static volatile sig_atomic_t interrupted; /* SIGIO saw input while the guest ran */
+static char stop_reply[32] = "S05";       /* why the guest last stopped */
+static uint8_t owner[MEMORY_MAX];
+static uint8_t watch_owned[WATCH_MAX];    /* watchpoints set by Z2/Z3/Z4 */
+static struct watchpoint *watch_hit;      /* watchpoint that asked for the pending stop */
+static uint16_t watch_address;
+
+/**
+ * get_char - Next byte from the debugger, or -1 once it has gone
+ */
+static int get_char(void)
+{
+    unsigned char c;
+    ssize_t n;
+    do
+    {
+        n = recv(client, &c, 1, 0);
+    } while (n < 0 && errno == EINTR);
+    return n == 1 ? c : -1;
+}
+
+/**
+ * put_bytes - Send bytes to the debugger, ignoring a connection that has gone
+ */
+static void put_bytes(const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(client, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+/**
+ * send_packet - Frame data as $data#checksum and send it
+ *
+ * The debugger's acknowledgements are skipped by receive_packet.
+ */
+static void send_packet(const char *data)
+{
+    static char frame[GDB_PACKET_MAX + 5];
+    size_t len = strlen(data);
+    uint8_t sum = 0;
+    for (size_t i = 0; i < len; ++i)
+    {
+        sum += (uint8_t)data[i];
+    }
+    snprintf(frame, sizeof(frame), "$%s#%02x", data, sum);
+    put_bytes(frame, strlen(frame));
+}
+
+/**
+ * hex_value - Value of a hex digit, or -1
+ */
+static int hex_value(int c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/**
+ * receive_packet - Read the next packet into buf, acknowledging it
+ *
+ * Returns:
+ *   int: Length of the packet data, or -1 once the debugger has gone
+ */
+static int receive_packet(char *buf)
+{
+    for (;;)
+    {
+        int c;
+        do
+        {
+            c = get_char(); /* skips acks and a Ctrl-C that came in after the guest stopped */
+        } while (c >= 0 && c != '$');
+        if (c < 0)
+        {
+            return -1;
+        }
+
+        int len = 0;
+        uint8_t sum = 0;
+        while ((c = get_char()) >= 0 && c != '#')
+        {
+            if (len < GDB_PACKET_MAX)
+            {
+                buf[len++] = (char)c;
+            }
+            sum += (uint8_t)c;
+        }
+        int hi = get_char(), lo = get_char();
+        if (c < 0 || lo < 0)
+        {
+            return -1;
+        }
+        buf[len] = '\0';
+        if (hex_value(hi) * 16 + hex_value(lo) == sum)
+        {
+            put_bytes("+", 1);
+            return len;
+        }
+        put_bytes("-", 1);
+    }
+}
+
+/**
+ * put_word - Append a 16-bit value as four hex digits, low byte first
+ */
+static char *put_word(char *out, uint16_t value)
+{
+    sprintf(out, "%02x%02x", value & 0xFF, value >> 8);
+    return out + 4;
+}
+
+/**
+ * get_word - Read four hex digits, low byte first
+ *
+ * Returns:
+ *   int: 1 on success, 0 if text does not start with four hex digits
+ */
+static int get_word(const char *text, uint16_t *value)
+{
+    int v = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        if (hex_value(text[i]) < 0)
+        {
+            return 0;
+        }
+    }
+    v = hex_value(text[0]) << 4 | hex_value(text[1]) | hex_value(text[2]) << 12 | hex_value(text[3]) << 8;
+    *value = (uint16_t)v;
+    return 1;
+}
+
+/**
+ * set_async - Turn signalling of debugger input (SIGIO) on while the guest runs, off while it is stopped
+ */
+static void set_async(int on)
+{
+    int flags = fcntl(client, F_GETFL);
+    fcntl(client, F_SETFL, on ? flags | O_ASYNC : flags & ~O_ASYNC);
+}
+
+/**
+ * on_sigio - Stop the running guest when the debugger sends something (a Ctrl-C, or a hang-up)
+ */
+static void on_sigio(int sig)
+{
+    (void)sig;
+    int saved = errno;
+    char c;
+    if (client >= 0 && recv(client, &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0)
+    {
+        interrupted = 1;
+        bp_stop_next();
+    }
+    errno = saved;
+}
+
+/**
+ * release - Drop the debugger's claim on a breakpoint, clearing it when nobody holds it
+ */
+static void release(uint16_t address, uint8_t who)
+{
+    owner[address] &= ~who;
+    if (owner[address] == 0)
+    {
+        bp_clear(address);
+    }
+}
+
+/**
+ * detach - Remove the debugger's breakpoints and let the guest run on by itself
+ */
+static void detach(void)
+{
+    for (uint32_t a = 0; a < MEMORY_MAX; ++a)
+    {
+        if (owner[a])
+        {
+            release((uint16_t)a, owner[a]);
+        }
+    }
+    for (int i = 0; i < WATCH_MAX; ++i)
+    {
+        if (watch_owned[i])
+        {
+            watch_owned[i] = 0;
+            watch_clear(watchpoints[i].lo, watchpoints[i].hi, watchpoints[i].kind);
+        }
+    }
+    bp_handler = NULL;
+    watch_handler = NULL;
+    close(client);
+    client = -1;
+}
+
+/**
+ * monitor - Run a "monitor" command: break ADDR [COND] or delete ADDR
+ *
+ * Returns:
+ *   int: 1 on success, 0 if the command is unknown or invalid
+ */
+static int monitor(const char *hex)
+{
+    char text[GDB_PACKET_MAX / 2 + 1];
+    size_t len = 0;
+    for (; hex_value(hex[0]) >= 0 && hex_value(hex[1]) >= 0; hex += 2)
+    {
+        text[len++] = (char)(hex_value(hex[0]) << 4 | hex_value(hex[1]));
+    }
+    text[len] = '\0';
+
+    const char *end;
+    uint16_t address;
+    if (strncmp(text, "break ", 6) == 0 && bp_parse_value(text + 6, &end, &address) &&
+        (*end == '\0' || *end == ' ') && bp_set(address, end))
+    {
+        owner[address] |= OWNER_MONITOR;
+        return 1;
+    }
+    if (strncmp(text, "delete ", 7) == 0 && bp_parse_value(text + 7, &end, &address) && *end == '\0' &&
+        (owner[address] & OWNER_MONITOR))
+    {
+        release(address, OWNER_MONITOR);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * watch - Set (insert non-zero) or remove the watchpoint of a Z2/Z3/Z4 packet
+ *
+ * Parameters:
+ *   type: 2 for stores, 3 for loads, 4 for both
+ *   address: First word
+ *   length: Bytes watched, two per word
+ *
+ * Returns:
+ *   int: 1 on success, 0 otherwise
+ */
+static int watch(int insert, int type, uint16_t address, unsigned long length)
+{
+    static const int kinds[] = {WATCH_STORE, WATCH_LOAD, WATCH_ACCESS};
+    int kind = kinds[type - 2];
+    unsigned long words = length > 2 ? (length + 1) / 2 : 1;
+    uint16_t hi = words > (unsigned long)(0xFFFF - address) ? 0xFFFF : (uint16_t)(address + words - 1);
+    if (insert)
+    {
+        struct watchpoint *w = watch_set(address, hi, kind);
+        if (w)
+        {
+            watch_owned[w - watchpoints] = 1;
+        }
+        return w != NULL;
+    }
+    for (int i = 0; i < WATCH_MAX; ++i)
+    {
+        struct watchpoint *w = &watchpoints[i];
+        if (watch_owned[i] && w->kind == kind && w->lo == address && w->hi == hi)
+        {
+            watch_owned[i] = 0;
+            return watch_clear(address, hi, kind);
+        }
+    }
+    return 0;
+}
+
+/**
+ * gdb_watch - watch_handler while a debugger is attached: stop once the instruction completes
+ */
+static void gdb_watch(struct watchpoint *w, uint16_t address, int kind, uint16_t value)
+{
+    (void)kind;
+    (void)value;
+    if (replaying)
+    {
+        replay_hit(instr_count);
+        return;
+    }
+    if (watch_hit == NULL)
+    {
+        watch_hit = w;
+        watch_address = address;
+    }
+    bp_stop_next();
+}
+
+/**
+ * serve - Answer packets until the debugger resumes the guest, kills it or goes away
+ */
+static void serve(void)
+{
+    static char packet[GDB_PACKET_MAX + 1];
+    static char reply[GDB_PACKET_MAX + 1];
+
+    if (resumed)
+    {
+        send_packet(stop_reply);
+        resumed = 0;
+    }
+    for (;;)
+    {
+        if (receive_packet(packet) < 0)
+        {
+            detach();
+            return;
+        }
+        char *out = reply;
+        char *p = packet + 1;
+        unsigned long address, length;
+        uint16_t value;
+        reply[0] = '\0';
+
+        switch (packet[0])
+        {
+        case '?':
+            strcpy(reply, stop_reply);
+            break;
+        case 'g':
+            for (int i = 0; i < R_COUNT; ++i)
+            {
+                out = put_word(out, reg[i]);
+            }
+            break;
+        case 'G':
+            for (int i = 0; i < R_COUNT && get_word(p + 4 * i, &value); ++i)
+            {
+                reg[i] = value;
+            }
+            strcpy(reply, "OK");
+            break;
+        case 'p':
+            address = strtoul(p, NULL, 16);
+            if (address < R_COUNT)
+            {
+                put_word(out, reg[address]);
+            }
+            else
+            {
+                strcpy(reply, "E01");
+            }
+            break;
+        case 'P':
+            address = strtoul(p, &p, 16);
+            if (address < R_COUNT && *p == '=' && get_word(p + 1, &value))
+            {
+                reg[address] = value;
+                strcpy(reply, "OK");
+            }
+            else
+            {
+                strcpy(reply, "E01");
+            }
+            break;
+        case 'm':
+            address = strtoul(p, &p, 16);
+            length = *p == ',' ? strtoul(p + 1, NULL, 16) : 0;
+            if (length > GDB_PACKET_MAX / 2)
+            {
+                length = GDB_PACKET_MAX / 2;
+            }
+            for (unsigned long i = 0; i < length; ++i)
+            {
+                uint16_t word = memory[(uint16_t)(address + i / 2)];
+                out += sprintf(out, "%02x", (i & 1 ? word >> 8 : word) & 0xFF);
+            }
+            break;
+        case 'M':
+            address = strtoul(p, &p, 16);
+            length = *p == ',' ? strtoul(p + 1, &p, 16) : 0;
+            if (*p++ != ':')
+            {
+                strcpy(reply, "E01");
+                break;
+            }
+            for (unsigned long i = 0; i < length && hex_value(p[0]) >= 0 && hex_value(p[1]) >= 0; ++i, p += 2)
+            {
+                uint16_t at = (uint16_t)(address + i / 2);
+                int byte = hex_value(p[0]) << 4 | hex_value(p[1]);
+                memory[at] = i & 1 ? (memory[at] & 0x00FF) | byte << 8 : (memory[at] & 0xFF00) | byte;
+                if ((i & 1 || i + 1 == length) && code_is_translated(at))
+                {
+                    code_write(at);
+                }
+            }
+            strcpy(reply, "OK");
+            break;
+        case 'c':
+        case 's':
+            if (*p)
+            {
+                reg[R_PC] = (uint16_t)strtoul(p, NULL, 16);
+            }
+            if (packet[0] == 's')
+            {
+                bp_stop_next();
+            }
+            resumed = 1;
+            set_async(1);
+            return;
+        case 'b':
+            /* Reverse step and reverse continue, with --reverse */
+            if (!replay_enabled || (p[0] != 's' && p[0] != 'c') || p[1])
+            {
+                break;
+            }
+            if (p[0] == 's' ? replay_step_back() : replay_continue_back())
+            {
+                sprintf(stop_reply, "S%02x", GDB_SIGTRAP);
+            }
+            else
+            {
+                sprintf(stop_reply, "T%02xreplaylog:begin;", GDB_SIGTRAP);
+            }
+            strcpy(reply, stop_reply);
+            break;
+        case 'Z':
+        case 'z':
+            if (p[0] < '0' || p[0] > '4' || p[1] != ',')
+            {
+                break;
+            }
+            address = strtoul(p + 2, &p, 16) & 0xFFFF;
+            if (packet[1] >= '2')
+            {
+                length = *p == ',' ? strtoul(p + 1, NULL, 16) : 2;
+                strcpy(reply, watch(packet[0] == 'Z', packet[1] - '0', (uint16_t)address, length) ? "OK" : "E01");
+            }
+            else if (packet[0] == 'z')
+            {
+                if (owner[address] & OWNER_Z)
+                {
+                    release((uint16_t)address, OWNER_Z);
+                }
+                strcpy(reply, "OK");
+            }
+            else if (owner[address] || bp_set((uint16_t)address, NULL))
+            {
+                owner[address] |= OWNER_Z;
+                strcpy(reply, "OK");
+            }
+            else
+            {
+                strcpy(reply, "E01");
+            }
+            break;
+        case 'k':
+            running = 0;
+            detach();
+            return;
+        case 'D':
+            send_packet("OK");
+            detach();
+            return;
+        case 'H':
+        case 'T':
+            strcpy(reply, "OK");
+            break;
+        case 'q':
+            if (strncmp(packet, "qSupported", 10) == 0)
+            {
+                sprintf(reply, "PacketSize=%x%s", GDB_PACKET_MAX, replay_enabled ? ";ReverseStep+;ReverseContinue+" : "");
+            }
+            else if (strcmp(packet, "qAttached") == 0)
+            {
+                strcpy(reply, "1");
+            }
+            else if (strcmp(packet, "qC") == 0)
+            {
+                strcpy(reply, "QC1");
+            }
+            else if (strcmp(packet, "qfThreadInfo") == 0)
+            {
+                strcpy(reply, "m1");
+            }
+            else if (strcmp(packet, "qsThreadInfo") == 0)
+            {
+                strcpy(reply, "l");
+            }
+            else if (strncmp(packet, "qRcmd,", 6) == 0)
+            {
+                strcpy(reply, monitor(packet + 6) ? "OK" : "E01");
+            }
+            break;
+        }
+        send_packet(reply);
+    }
+}
+
+/**
+ * gdb_stop - bp_handler while a debugger is attached: report the stop and serve it
+ */
+static void gdb_stop(struct breakpoint *bp)
+{
+    if (replaying)
+    {
+        /* Re-executing the past: only note where the guest would have stopped */
+        if (bp)
+        {
+            replay_hit(instr_count);
+        }
+        return;
+    }
+    set_async(0);
+    if (watch_hit)
+    {
+        const char *name = watch_hit->kind == WATCH_STORE ? "watch" : watch_hit->kind == WATCH_LOAD ? "rwatch" : "awatch";
+        sprintf(stop_reply, "T%02x%s:%x;", GDB_SIGTRAP, name, watch_address);
+    }
+    else
+    {
+        sprintf(stop_reply, "S%02x", bp == NULL && interrupted ? GDB_SIGINT : GDB_SIGTRAP);
+    }
+    watch_hit = NULL;
+    interrupted = 0;
+    serve();
+}
+
+/**
+ * gdb_open - Wait for a debugger on a Unix socket and stop the guest before its first instruction
+ *
+ * Builds the handler table if needed, since breakpoints and steps hook it.
+ *
+ * Returns:
+ *   int: 1 once a debugger is attached, 0 if the socket could not be set up,
+ *        e.g. because path names something other than a socket
+ */
+int gdb_open(const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        return 0;
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        return 0;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    /* A socket left by an earlier run is replaced, anything else at the path is kept */
+    struct stat st;
+    if (lstat(path, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            close(listener);
+            return 0;
+        }
+        unlink(path);
+    }
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0)
+    {
+        close(listener);
+        return 0;
+    }
+    fprintf(stderr, "waiting for gdb on %s\n", path);
+    do
+    {
+        client = accept(listener, NULL, NULL);
+    } while (client < 0 && errno == EINTR);
+    close(listener);
+    if (client < 0)
+    {
+        unlink(path);
+        return 0;
+    }
+    socket_path = path;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_sigio;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGIO, &action, NULL);
+    fcntl(client, F_SETOWN, getpid());
+
+    if (!decode_ready)
+    {
+        decode_init();
+    }
+    bp_handler = gdb_stop;
+    watch_handler = gdb_watch;
+    bp_stop_next();
+    return 1;
+}
+
+/**
+ * gdb_close - Tell an attached debugger that the guest has exited, and remove the socket
+ */
+void gdb_close(void)
+{
+    if (client >= 0)
+    {
+        set_async(0);
+        send_packet("W00");
+        close(client);
+        client = -1;
+    }
+    if (socket_path)
+    {
+        unlink(socket_path);
+        socket_path = NULL;
+    }
+}
+#else
+int gdb_open(const char *path)
+{
+    (void)path;
+    return 0; /* no Unix sockets */
+}
+
+void gdb_close(void)
+{
+}
+#endif
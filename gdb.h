@@ -0,0 +1,36 @@
+/**
+ * gdb.h - GDB remote serial protocol stub on a Unix socket
+ *
+ * With --gdb PATH the VM listens on a Unix socket at PATH, waits for a debugger
+ * to connect (e.g. "target remote PATH" in gdb) and stops before the first
+ * instruction. Stops are breakpoints of breakpoint.h, so the guest runs at full
+ * interpreter speed between them; the stub is bp_handler and serves packets
+ * until the debugger resumes the guest.
+ *
+ * Supported packets: ? g G p P m M c s Z0-Z4/z0-z4 k D, the qSupported,
+ * qAttached, qC and thread queries gdb sends on connecting, and qRcmd for
+ * "monitor break ADDR [COND]", which sets a conditional breakpoint. A Ctrl-C
+ * from the debugger stops a running guest (through SIGIO and bp_stop_next).
+ * Watchpoints (Z2-Z4) are those of watch.h; the guest stops once the
+ * instruction making the access has completed.
+ * With --reverse, the bs and bc packets (reverse-stepi and reverse-continue)
+ * take the guest back through the history of replay.h.
+ *
+ * Registers are R0-R7, PC and COND, in that order, 16 bits each and low byte
+ * first. Memory addresses are LC-3 word addresses; lengths count bytes, two per
+ * word, low byte first. Reads and writes go straight to memory[], so inspecting
+ * a device register has no side effects.
+ */
+#ifndef GDB_H
+#define GDB_H
+#include "main.h"
+
+#define GDB_PACKET_MAX 4096 /* longest packet, as announced in qSupported */
+
+/**
+ * Function declarations/prototype
+ */
+int gdb_open(const char *path);
+void gdb_close(void);
+
+#endif /* GDB_H */
@@ -0,0 +1,755 @@
+/**
+ * itrace.c - Binary execution trace: encoder, ring, compressor and decoder (see itrace.h)
+ */
+#include "itrace.h"
+#include "decode.h"
+#include "trap.h"
+#include <string.h>
+#include <stdatomic.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define RING_MASK (ITRACE_RING - 1)
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16) /* worst-case compressed size */
+
+int itrace_enabled;
+struct itrace_stats itrace_stats;
+
+static FILE *trace_file;
+static struct itrace_model encoder;
+static uint8_t ring[ITRACE_RING];
+static atomic_size_t ring_head; /* bytes appended by the interpreter */
+static atomic_size_t ring_tail; /* bytes taken by the compressor */
+static atomic_int closing;
+#ifndef _WIN32
+static pthread_t compressor;
+#endif
+
+/**
+ * put_varint - Write a value in 7-bit groups, low group first
+ *
+ * Returns:
+ *   size_t: Bytes written
+ */
+static size_t put_varint(uint8_t *p, uint16_t delta)
+{
+    /* Zigzag, so small negative differences stay short too */
+    uint32_t v = (uint16_t)((delta << 1) ^ (uint16_t)((int16_t)delta >> 15));
+    size_t n = 0;
+    while (v >= 0x80)
+    {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+/**
+ * itrace_dest - Register an instruction writes, as recorded in the trace
+ *
+ * A TRAP may write several registers; its record lists them in a mask
+ * (ITRACE_REGS) instead.
+ *
+ * Returns:
+ *   int: The register, or -1 if the instruction writes none or is a TRAP
+ */
+int itrace_dest(uint16_t instr)
+{
+    switch (instr >> 12)
+    {
+    case OP_ADD:
+    case OP_AND:
+    case OP_NOT:
+    case OP_LEA:
+    case OP_LD:
+    case OP_LDI:
+    case OP_LDR:
+        return (instr >> 9) & 0x7;
+    case OP_JSR:
+        return R_R7;
+    default:
+        return -1;
+    }
+}
+
+/* Compression */
+/**
+ * A byte-oriented LZ77 in the style of LZ4. A block is a series of sequences,
+ * each a token byte (literal count in the high nibble, match length minus
+ * LZ_MIN_MATCH in the low one, 15 meaning "more bytes follow, 255 at a time"),
+ * the literals, and a 2-byte little-endian offset back to the match. The last
+ * sequence ends after its literals.
+ */
+static size_t lz_length(uint8_t *p, size_t extra)
+{
+    size_t n = 0;
+    for (; extra >= 255; extra -= 255)
+    {
+        p[n++] = 255;
+    }
+    p[n++] = (uint8_t)extra;
+    return n;
+}
+
+static size_t lz_sequence(uint8_t *dst, const uint8_t *literals, size_t count, size_t offset, size_t match)
+{
+    size_t n = 1;
+    size_t lit_code = count < 15 ? count : 15;
+    size_t match_code = 0;
+    if (match)
+    {
+        match_code = match - LZ_MIN_MATCH < 15 ? match - LZ_MIN_MATCH : 15;
+    }
+    dst[0] = (uint8_t)(lit_code << 4 | match_code);
+    if (lit_code == 15)
+    {
+        n += lz_length(dst + n, count - 15);
+    }
+    memcpy(dst + n, literals, count);
+    n += count;
+    if (match)
+    {
+        dst[n++] = (uint8_t)offset;
+        dst[n++] = (uint8_t)(offset >> 8);
+        if (match_code == 15)
+        {
+            n += lz_length(dst + n, match - LZ_MIN_MATCH - 15);
+        }
+    }
+    return n;
+}
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * itrace_compress - Compress len bytes of src into dst, which holds LZ_BOUND(len)
+ *
+ * Returns:
+ *   size_t: Compressed size
+ */
+size_t itrace_compress(const uint8_t *src, size_t len, uint8_t *dst)
+{
+    uint32_t table[1 << LZ_HASH_BITS] = {0}; /* last position + 1 of each hashed 4-byte group */
+    size_t out = 0, anchor = 0, i = 0;
+
+    while (i + LZ_MIN_MATCH <= len)
+    {
+        uint32_t group = lz_read32(src + i);
+        uint32_t h = (group * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[h];
+        table[h] = (uint32_t)i + 1;
+        if (candidate == 0 || i - (candidate - 1) > LZ_MAX_OFFSET || lz_read32(src + candidate - 1) != group)
+        {
+            ++i;
+            continue;
+        }
+        --candidate;
+        size_t match = LZ_MIN_MATCH;
+        while (i + match < len && src[candidate + match] == src[i + match])
+        {
+            ++match;
+        }
+        out += lz_sequence(dst + out, src + anchor, i - anchor, i - candidate, match);
+        i += match;
+        anchor = i;
+    }
+    out += lz_sequence(dst + out, src + anchor, len - anchor, 0, 0);
+    return out;
+}
+
+/**
+ * itrace_decompress - Expand a block made by itrace_compress
+ *
+ * Returns:
+ *   size_t: Bytes written to dst, or (size_t)-1 if the block is corrupt
+ */
+size_t itrace_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    size_t in = 0, out = 0;
+    while (in < len)
+    {
+        uint8_t token = src[in++];
+        size_t count = token >> 4;
+        if (count == 15)
+        {
+            uint8_t more;
+            do
+            {
+                if (in >= len)
+                {
+                    return (size_t)-1;
+                }
+                more = src[in++];
+                count += more;
+            } while (more == 255);
+        }
+        if (count > len - in || count > cap - out)
+        {
+            return (size_t)-1;
+        }
+        memcpy(dst + out, src + in, count);
+        in += count;
+        out += count;
+        if (in == len)
+        {
+            break;
+        }
+
+        if (len - in < 2)
+        {
+            return (size_t)-1;
+        }
+        size_t offset = src[in] | (size_t)src[in + 1] << 8;
+        in += 2;
+        size_t match = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15)
+        {
+            uint8_t more;
+            do
+            {
+                if (in >= len)
+                {
+                    return (size_t)-1;
+                }
+                more = src[in++];
+                match += more;
+            } while (more == 255);
+        }
+        if (offset == 0 || offset > out || match > cap - out)
+        {
+            return (size_t)-1;
+        }
+        /* Byte by byte: the match may overlap what it produces */
+        for (size_t k = 0; k < match; ++k, ++out)
+        {
+            dst[out] = dst[out - offset];
+        }
+    }
+    return out;
+}
+
+/* Writing */
+/**
+ * write_block - Compress count bytes from the ring at tail and append them to the file
+ */
+static void write_block(size_t tail, size_t count)
+{
+    static uint8_t raw[ITRACE_BLOCK];
+    static uint8_t packed[LZ_BOUND(ITRACE_BLOCK)];
+    for (size_t i = 0; i < count; ++i)
+    {
+        raw[i] = ring[(tail + i) & RING_MASK];
+    }
+    atomic_store_explicit(&ring_tail, tail + count, memory_order_release);
+
+    size_t size = itrace_compress(raw, count, packed);
+    const uint8_t *data = packed;
+    uint32_t stored = (uint32_t)size;
+    if (size >= count)
+    {
+        data = raw;
+        stored = (uint32_t)count | ITRACE_RAW;
+        size = count;
+    }
+    uint8_t header[8];
+    for (int i = 0; i < 4; ++i)
+    {
+        header[i] = (uint8_t)(count >> (8 * i));
+        header[4 + i] = (uint8_t)(stored >> (8 * i));
+    }
+    fwrite(header, 1, sizeof(header), trace_file);
+    fwrite(data, 1, size, trace_file);
+    itrace_stats.stored += sizeof(header) + size;
+}
+
+/**
+ * drain - Move whatever the ring holds to the file, one block at a time
+ *
+ * Parameters:
+ *   all: Non-zero to also write a final partial block
+ *
+ * Returns:
+ *   int: Non-zero if anything was written
+ */
+static int drain(int all)
+{
+    int wrote = 0;
+    for (;;)
+    {
+        size_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+        size_t count = head - tail;
+        if (count == 0 || (count < ITRACE_BLOCK && !all))
+        {
+            return wrote;
+        }
+        write_block(tail, count < ITRACE_BLOCK ? count : ITRACE_BLOCK);
+        wrote = 1;
+    }
+}
+
+#ifndef _WIN32
+/**
+ * compress_main - Body of the compressor thread
+ */
+static void *compress_main(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        int last = atomic_load_explicit(&closing, memory_order_acquire);
+        if (!drain(last))
+        {
+            if (last)
+            {
+                return NULL;
+            }
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+#endif
+
+/**
+ * append - Put an encoded record into the ring
+ *
+ * Only waits when the compressor has fallen a whole ring behind.
+ */
+static void append(const uint8_t *rec, size_t n)
+{
+    size_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    if (head + n - atomic_load_explicit(&ring_tail, memory_order_acquire) > ITRACE_RING)
+    {
+        ++itrace_stats.stalls;
+        while (head + n - atomic_load_explicit(&ring_tail, memory_order_acquire) > ITRACE_RING)
+        {
+#ifdef _WIN32
+            drain(0);
+#else
+            struct timespec pause = {0, 100000};
+            nanosleep(&pause, NULL);
+#endif
+        }
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        ring[(head + i) & RING_MASK] = rec[i];
+    }
+    atomic_store_explicit(&ring_head, head + n, memory_order_release);
+    itrace_stats.raw += n;
+}
+
+/**
+ * itrace_open - Start recording into a new trace file
+ *
+ * Returns:
+ *   int: 1 on success, 0 if the file or the compressor thread could not be created
+ */
+int itrace_open(const char *path)
+{
+    trace_file = fopen(path, "wb");
+    if (trace_file == NULL)
+    {
+        return 0;
+    }
+    const uint8_t header[5] = {'L', 'C', '3', 'T', ITRACE_VERSION};
+    fwrite(header, 1, sizeof(header), trace_file);
+    itrace_stats.stored = sizeof(header);
+#ifndef _WIN32
+    if (pthread_create(&compressor, NULL, compress_main, NULL) != 0)
+    {
+        fclose(trace_file);
+        trace_file = NULL;
+        return 0;
+    }
+#endif
+    itrace_enabled = 1;
+    return 1;
+}
+
+/**
+ * itrace_close - Flush the records still in the ring and close the trace file
+ */
+void itrace_close(void)
+{
+    if (!itrace_enabled)
+    {
+        return;
+    }
+#ifndef _WIN32
+    atomic_store_explicit(&closing, 1, memory_order_release);
+    pthread_join(compressor, NULL);
+#else
+    drain(1);
+#endif
+    fclose(trace_file);
+    trace_file = NULL;
+    itrace_enabled = 0;
+}
+
+/**
+ * itrace_interpret - The instruction cycle of interpret(), recording every instruction
+ *
+ * Addresses are computed before the instruction runs, since a load may
+ * overwrite its own base register; an LDI's pointer is read afterwards, once
+ * mem_read has refreshed any device register it points through.
+ */
+void itrace_interpret(void)
+{
+    while (running)
+    {
+        uint16_t pc = reg[R_PC];
+        uint16_t instr = memory[pc];
+        uint16_t pc_rel = pc + 1 + sign_extend(instr & 0x1FF, 9);
+        int access = ACCESS_NONE;
+        uint16_t addr = 0;
+        switch (instr >> 12)
+        {
+        case OP_LD:
+        case OP_LDI:
+        case OP_LDR:
+            access = ACCESS_LOAD;
+            break;
+        case OP_ST:
+        case OP_STI:
+        case OP_STR:
+            access = ACCESS_STORE;
+            break;
+        }
+        switch (instr >> 12)
+        {
+        case OP_LD:
+        case OP_ST:
+            addr = pc_rel;
+            break;
+        case OP_STI:
+            addr = memory[pc_rel];
+            break;
+        case OP_LDR:
+        case OP_STR:
+            addr = reg[(instr >> 6) & 0x7] + sign_extend(instr & 0x3F, 6);
+            break;
+        }
+
+        uint16_t before[8];
+        if ((instr >> 12) == OP_TRAP)
+        {
+            memcpy(before, reg, sizeof(before));
+        }
+
+        ++reg[R_PC];
+        uint64_t count = ++instr_count;
+        if (decode_ready)
+        {
+            handler_table[instr](instr);
+        }
+        else
+        {
+            execute(instr);
+        }
+        if (instr_count < count)
+        {
+            /* A breakpoint stopped the guest before the instruction retired */
+            continue;
+        }
+        if ((instr >> 12) == OP_LDI)
+        {
+            addr = memory[pc_rel];
+        }
+
+        uint8_t rec[ITRACE_RECORD_MAX];
+        size_t n = 1;
+        uint8_t flags = 0;
+        if (pc != encoder.next_pc)
+        {
+            flags |= ITRACE_JUMP;
+            n += put_varint(rec + n, pc - encoder.next_pc);
+        }
+        if (!encoder.seen[pc] || encoder.word[pc] != instr)
+        {
+            flags |= ITRACE_WORD;
+            rec[n++] = (uint8_t)instr;
+            rec[n++] = (uint8_t)(instr >> 8);
+            encoder.word[pc] = instr;
+            encoder.seen[pc] = 1;
+        }
+        int dest = itrace_dest(instr);
+        if (dest >= 0)
+        {
+            flags |= ITRACE_VALUE;
+            n += put_varint(rec + n, reg[dest] - encoder.reg[dest]);
+            encoder.reg[dest] = reg[dest];
+        }
+        if ((instr >> 12) == OP_TRAP)
+        {
+            /* R7 always holds the return address; the rest only if the trap changed them */
+            uint8_t mask = 1 << R_R7;
+            for (int r = R_R0; r < R_R7; ++r)
+            {
+                mask |= (uint8_t)((reg[r] != before[r]) << r);
+            }
+            flags |= ITRACE_REGS;
+            rec[n++] = mask;
+            for (int r = R_R0; r <= R_R7; ++r)
+            {
+                if (mask & (1 << r))
+                {
+                    n += put_varint(rec + n, reg[r] - encoder.reg[r]);
+                    encoder.reg[r] = reg[r];
+                }
+            }
+            /* A native bulk trap returns straight to the next instruction */
+            uint8_t vector = instr & 0xFF;
+            if ((vector == TRAP_MEMMOVE || vector == TRAP_MEMSET) && reg[R_PC] == (uint16_t)(pc + 1))
+            {
+                flags |= ITRACE_UNTRACED;
+            }
+        }
+        if (access != ACCESS_NONE)
+        {
+            flags |= ITRACE_MEM;
+            n += put_varint(rec + n, addr - encoder.addr);
+            encoder.addr = addr;
+            if (access == ACCESS_STORE)
+            {
+                int src = (instr >> 9) & 0x7;
+                flags |= ITRACE_STORE;
+                n += put_varint(rec + n, reg[src] - encoder.reg[src]);
+                encoder.reg[src] = reg[src];
+            }
+        }
+        rec[0] = flags;
+        encoder.next_pc = pc + 1;
+        append(rec, n);
+        ++itrace_stats.records;
+    }
+}
+
+/* Reading */
+/**
+ * next_block - Load and expand the next block of a trace file
+ *
+ * Returns:
+ *   int: 1 if a block was loaded, 0 at the end of the file or on a corrupt block
+ */
+static int next_block(struct itrace_reader *r)
+{
+    uint8_t header[8];
+    if (fread(header, 1, sizeof(header), r->file) != sizeof(header))
+    {
+        return 0;
+    }
+    uint32_t raw = 0, stored = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        raw |= (uint32_t)header[i] << (8 * i);
+        stored |= (uint32_t)header[4 + i] << (8 * i);
+    }
+    size_t size = stored & ~ITRACE_RAW;
+    if (raw > ITRACE_BLOCK || size > LZ_BOUND(ITRACE_BLOCK) || fread(r->packed, 1, size, r->file) != size)
+    {
+        return 0;
+    }
+    if (stored & ITRACE_RAW)
+    {
+        if (size != raw)
+        {
+            return 0;
+        }
+        memcpy(r->block, r->packed, size);
+    }
+    else if (itrace_decompress(r->packed, size, r->block, ITRACE_BLOCK) != raw)
+    {
+        return 0;
+    }
+    r->len = raw;
+    r->pos = 0;
+    return 1;
+}
+
+/**
+ * next_byte - The next byte of the record stream, or -1 at its end
+ */
+static int next_byte(struct itrace_reader *r)
+{
+    while (r->pos == r->len)
+    {
+        if (!next_block(r))
+        {
+            return -1;
+        }
+    }
+    return r->block[r->pos++];
+}
+
+/**
+ * get_varint - Read a value written by put_varint
+ *
+ * Returns:
+ *   int: 1 on success, 0 at the end of the stream
+ */
+static int get_varint(struct itrace_reader *r, uint16_t *delta)
+{
+    uint32_t v = 0;
+    for (int shift = 0; shift < 21; shift += 7)
+    {
+        int byte = next_byte(r);
+        if (byte < 0)
+        {
+            return 0;
+        }
+        v |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            *delta = (uint16_t)((v >> 1) ^ (0u - (v & 1)));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * itrace_reader_open - Open a trace file for reading
+ *
+ * Returns:
+ *   int: 1 on success, 0 if the file is missing or not a trace of this version
+ */
+int itrace_reader_open(struct itrace_reader *r, const char *path)
+{
+    memset(r, 0, sizeof(*r));
+    r->file = fopen(path, "rb");
+    if (r->file == NULL)
+    {
+        return 0;
+    }
+    uint8_t header[5];
+    r->block = malloc(ITRACE_BLOCK);
+    r->packed = malloc(LZ_BOUND(ITRACE_BLOCK));
+    if (fread(header, 1, sizeof(header), r->file) != sizeof(header) || memcmp(header, "LC3T", 4) != 0 ||
+        header[4] != ITRACE_VERSION || r->block == NULL || r->packed == NULL)
+    {
+        itrace_reader_close(r);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * itrace_read - Decode the next record
+ *
+ * Returns:
+ *   int: 1 if rec was filled in, 0 at the end of the trace
+ */
+int itrace_read(struct itrace_reader *r, struct itrace_record *rec)
+{
+    struct itrace_model *m = &r->model;
+    int flags = next_byte(r);
+    if (flags < 0)
+    {
+        return 0;
+    }
+    uint16_t delta;
+    uint16_t pc = m->next_pc;
+    if (flags & ITRACE_JUMP)
+    {
+        if (!get_varint(r, &delta))
+        {
+            return 0;
+        }
+        pc += delta;
+    }
+    if (flags & ITRACE_WORD)
+    {
+        int lo = next_byte(r), hi = next_byte(r);
+        if (hi < 0)
+        {
+            return 0;
+        }
+        m->word[pc] = (uint16_t)(lo | hi << 8);
+        m->seen[pc] = 1;
+    }
+
+    rec->index = r->index++;
+    rec->pc = pc;
+    rec->instr = m->word[pc];
+    rec->dest = -1;
+    rec->regs = 0;
+    rec->untraced = (flags & ITRACE_UNTRACED) != 0;
+    rec->access = ACCESS_NONE;
+    if (flags & ITRACE_VALUE)
+    {
+        rec->dest = itrace_dest(rec->instr);
+        if (rec->dest < 0 || !get_varint(r, &delta))
+        {
+            return 0;
+        }
+        rec->value = m->reg[rec->dest] += delta;
+    }
+    if (flags & ITRACE_REGS)
+    {
+        int mask = next_byte(r);
+        if (mask < 0)
+        {
+            return 0;
+        }
+        rec->regs = (uint8_t)mask;
+        for (int i = R_R0; i <= R_R7; ++i)
+        {
+            if (mask & (1 << i))
+            {
+                if (!get_varint(r, &delta))
+                {
+                    return 0;
+                }
+                rec->values[i] = m->reg[i] += delta;
+            }
+        }
+    }
+    if (flags & ITRACE_MEM)
+    {
+        if (!get_varint(r, &delta))
+        {
+            return 0;
+        }
+        rec->addr = m->addr += delta;
+        rec->access = ACCESS_LOAD;
+        rec->data = rec->value;
+        if (flags & ITRACE_STORE)
+        {
+            int src = (rec->instr >> 9) & 0x7;
+            if (!get_varint(r, &delta))
+            {
+                return 0;
+            }
+            rec->access = ACCESS_STORE;
+            rec->data = m->reg[src] += delta;
+        }
+    }
+    m->next_pc = pc + 1;
+    return 1;
+}
+
+/**
+ * itrace_reader_close - Close a trace file opened with itrace_reader_open
+ */
+void itrace_reader_close(struct itrace_reader *r)
+{
+    if (r->file != NULL)
+    {
+        fclose(r->file);
+    }
+    free(r->block);
+    free(r->packed);
+    memset(r, 0, sizeof(*r));
+}
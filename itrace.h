@@ -0,0 +1,129 @@
+/**
+ * itrace.h - Binary execution trace of every retired instruction
+ *
+ * With --trace FILE the interpreter records, for each instruction it retires,
+ * the PC, the instruction word, the value written to the destination register
+ * and the address and value of a load or store. Records are delta encoded
+ * against what the decoder already knows, so a loop iteration usually costs a
+ * couple of bytes per instruction:
+ *
+ *   flags byte     ITRACE_* bits below
+ *   PC             only if it is not the one after the previous record: zigzag
+ *                  varint of the difference
+ *   word           only if it differs from the last word recorded at this PC: 2 bytes
+ *   value          zigzag varint of the difference to the register's last recorded value
+ *   registers      TRAP only: a byte with a bit per register written, then a value
+ *                  as above for each, lowest register first
+ *   address        zigzag varint of the difference to the previous memory address
+ *   stored value   zigzag varint of the difference to the source register's last
+ *                  recorded value (a load's value is the destination value)
+ *
+ * The destination register follows from the word: DR for ADD/AND/NOT/LEA and
+ * the loads, R7 for JSR/JSRR. A TRAP lists R7 (the return address) and every
+ * other register the trap changed: R0 for GETC/IN, R0 and R1 for MUL/DIVU and
+ * the like, none besides R7 with --os-traps, where the guest routine's own
+ * instructions follow in the trace. The bulk stores of a native MEMMOVE or
+ * MEMSET are not recorded; its record carries ITRACE_UNTRACED instead.
+ *
+ * The interpreter only appends encoded records to a lock-free single-producer
+ * ring. A background thread cuts the ring into blocks, compresses them with a
+ * small LZ77 coder and writes them out, so tracing runs at close to interpreter
+ * speed. The file is the header "LC3T" ITRACE_VERSION followed by blocks of
+ * [raw length, 4 bytes LE][stored length, 4 bytes LE][data]; a block whose
+ * stored length has ITRACE_RAW set is not compressed.
+ *
+ * The lc3-itrace tool reads the file back (see itrace_dump.c).
+ */
+#ifndef ITRACE_H
+#define ITRACE_H
+#include "main.h"
+
+#define ITRACE_VERSION 2
+#define ITRACE_BLOCK (64 * 1024)        /* bytes of records per compressed block */
+#define ITRACE_RING (4 * 1024 * 1024)   /* bytes of the ring between interpreter and compressor */
+#define ITRACE_RAW 0x80000000u          /* stored length flag: the block is not compressed */
+#define ITRACE_RECORD_MAX 32            /* longest encoded record: a TRAP writing every register */
+
+/* Record flags */
+enum
+{
+    ITRACE_JUMP = 1 << 0,     /* the PC is given explicitly */
+    ITRACE_WORD = 1 << 1,     /* the instruction word is given */
+    ITRACE_VALUE = 1 << 2,    /* a destination value follows */
+    ITRACE_MEM = 1 << 3,      /* a memory address follows */
+    ITRACE_STORE = 1 << 4,    /* the access is a store, and its value follows */
+    ITRACE_REGS = 1 << 5,     /* a TRAP's register mask and values follow */
+    ITRACE_UNTRACED = 1 << 6  /* the TRAP stored to memory without records */
+};
+
+/* Memory access of a record */
+enum
+{
+    ACCESS_NONE = 0,
+    ACCESS_LOAD,
+    ACCESS_STORE
+};
+
+/* Counters for --stats */
+struct itrace_stats
+{
+    uint64_t records; /* instructions recorded */
+    uint64_t raw;     /* bytes of encoded records */
+    uint64_t stored;  /* bytes written to the file, headers included */
+    uint64_t stalls;  /* times the interpreter waited for room in the ring */
+};
+
+/* One retired instruction, as decoded from a trace */
+struct itrace_record
+{
+    uint64_t index;     /* instructions retired before it */
+    uint16_t pc;
+    uint16_t instr;
+    int dest;           /* register written, or -1 */
+    uint16_t value;     /* its new value */
+    uint8_t regs;       /* TRAP: mask of the registers written */
+    uint16_t values[8]; /* their new values */
+    int untraced;       /* TRAP: its stores are missing from the trace */
+    int access;         /* ACCESS_* */
+    uint16_t addr;
+    uint16_t data;      /* value loaded or stored */
+};
+
+/* What encoder and decoder both track to compute the deltas */
+struct itrace_model
+{
+    uint16_t next_pc;
+    uint16_t addr;
+    uint16_t reg[8];
+    uint16_t word[MEMORY_MAX];
+    uint8_t seen[MEMORY_MAX]; /* word[] holds the last word recorded at the address */
+};
+
+/* Reading a trace file back */
+struct itrace_reader
+{
+    FILE *file;
+    uint8_t *block;
+    size_t len, pos;
+    uint8_t *packed;
+    struct itrace_model model;
+    uint64_t index;
+};
+
+extern int itrace_enabled; /* set by itrace_open: interpret() records every instruction */
+extern struct itrace_stats itrace_stats;
+
+/**
+ * Function declarations/prototype
+ */
+int itrace_open(const char *path);
+void itrace_close(void);
+void itrace_interpret(void);
+int itrace_dest(uint16_t instr);
+size_t itrace_compress(const uint8_t *src, size_t len, uint8_t *dst);
+size_t itrace_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+int itrace_reader_open(struct itrace_reader *r, const char *path);
+int itrace_read(struct itrace_reader *r, struct itrace_record *rec);
+void itrace_reader_close(struct itrace_reader *r);
+
+#endif /* ITRACE_H */
@@ -0,0 +1,179 @@
+/**
+ * itrace_dump.c - lc3-itrace, the reader for traces recorded with vm --trace
+ *
+ * Prints one line per retired instruction:
+ *
+ *   #index  PC  word  mnemonic  [Rn=value]  [ld|st address = value]
+ *
+ * A TRAP shows every register it wrote, and "(stores not traced)" for a native
+ * MEMMOVE or MEMSET, whose stores have no records.
+ *
+ * or, with --summary, only totals: instructions, loads and stores, and the most
+ * executed addresses.
+ *
+ * Usage: lc3-itrace [-n FROM:TO] [--pc LO[:HI]] [--mem LO[:HI]] [--summary] trace-file
+ *
+ *   -n FROM:TO    only records FROM (inclusive) to TO (exclusive), by index
+ *   --pc LO:HI    only instructions at addresses LO..HI (hex)
+ *   --mem LO:HI   only loads and stores of addresses LO..HI (hex)
+ */
+#include "itrace.h"
+#include <string.h>
+
+#define SUMMARY_TOP 10 /* busiest addresses listed by --summary */
+
+static const char *const mnemonics[16] = {"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+                                          "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"};
+
+/**
+ * parse_range - Read "LO" or "LO:HI" in the given base
+ *
+ * Returns:
+ *   int: 1 on success, 0 if the text is not a range
+ */
+static int parse_range(const char *text, int base, uint64_t *lo, uint64_t *hi)
+{
+    char *end;
+    *lo = strtoull(text, &end, base);
+    if (end == text)
+    {
+        return 0;
+    }
+    *hi = *lo;
+    if (*end == ':')
+    {
+        const char *rest = end + 1;
+        *hi = strtoull(rest, &end, base);
+        if (end == rest)
+        {
+            return 0;
+        }
+    }
+    return *end == '\0';
+}
+
+/**
+ * print_record - Write one record as a line of text
+ */
+static void print_record(const struct itrace_record *rec)
+{
+    printf("#%-10llu x%04X x%04X %-4s", (unsigned long long)rec->index, rec->pc, rec->instr,
+           mnemonics[rec->instr >> 12]);
+    if (rec->dest >= 0)
+    {
+        printf(" R%d=x%04X", rec->dest, rec->value);
+    }
+    for (int r = 0; r < 8; ++r)
+    {
+        if (rec->regs & (1 << r))
+        {
+            printf(" R%d=x%04X", r, rec->values[r]);
+        }
+    }
+    if (rec->access != ACCESS_NONE)
+    {
+        printf(" %s x%04X = x%04X", rec->access == ACCESS_LOAD ? "ld" : "st", rec->addr, rec->data);
+    }
+    if (rec->untraced)
+    {
+        printf(" (stores not traced)");
+    }
+    printf("\n");
+}
+
+int main(int argc, const char *argv[])
+{
+    uint64_t from = 0, to = UINT64_MAX;
+    uint64_t pc_lo = 0, pc_hi = 0xFFFF;
+    uint64_t mem_lo = 0, mem_hi = 0xFFFF;
+    int mem_filter = 0;
+    int summary = 0;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; ++arg)
+    {
+        if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc && parse_range(argv[arg + 1], 10, &from, &to))
+        {
+            ++arg;
+        }
+        else if (strcmp(argv[arg], "--pc") == 0 && arg + 1 < argc && parse_range(argv[arg + 1], 16, &pc_lo, &pc_hi))
+        {
+            ++arg;
+        }
+        else if (strcmp(argv[arg], "--mem") == 0 && arg + 1 < argc &&
+                 parse_range(argv[arg + 1], 16, &mem_lo, &mem_hi))
+        {
+            mem_filter = 1;
+            ++arg;
+        }
+        else if (strcmp(argv[arg], "--summary") == 0)
+        {
+            summary = 1;
+        }
+        else
+        {
+            printf("unknown option: %s\n", argv[arg]);
+            exit(2);
+        }
+    }
+    if (arg + 1 != argc)
+    {
+        printf("lc3-itrace [-n from:to] [--pc lo[:hi]] [--mem lo[:hi]] [--summary] trace-file\n");
+        exit(2);
+    }
+
+    static struct itrace_reader reader;
+    if (!itrace_reader_open(&reader, argv[arg]))
+    {
+        printf("not a trace file: %s\n", argv[arg]);
+        exit(1);
+    }
+
+    static uint64_t hits[MEMORY_MAX];
+    uint64_t shown = 0, loads = 0, stores = 0;
+    struct itrace_record rec;
+    while (itrace_read(&reader, &rec) && rec.index < to)
+    {
+        if (rec.index < from || rec.pc < pc_lo || rec.pc > pc_hi)
+        {
+            continue;
+        }
+        if (mem_filter && (rec.access == ACCESS_NONE || rec.addr < mem_lo || rec.addr > mem_hi))
+        {
+            continue;
+        }
+        ++shown;
+        if (summary)
+        {
+            ++hits[rec.pc];
+            loads += rec.access == ACCESS_LOAD;
+            stores += rec.access == ACCESS_STORE;
+        }
+        else
+        {
+            print_record(&rec);
+        }
+    }
+    itrace_reader_close(&reader);
+
+    if (summary)
+    {
+        printf("instructions: %llu (%llu loads, %llu stores)\n", (unsigned long long)shown,
+               (unsigned long long)loads, (unsigned long long)stores);
+        printf("busiest addresses:\n");
+        for (int k = 0; k < SUMMARY_TOP; ++k)
+        {
+            uint32_t best = 0;
+            for (uint32_t a = 1; a < MEMORY_MAX; ++a)
+            {
+                best = hits[a] > hits[best] ? a : best;
+            }
+            if (hits[best] == 0)
+            {
+                break;
+            }
+            printf("  x%04X %12llu\n", best, (unsigned long long)hits[best]);
+            hits[best] = 0;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,294 @@
+/**
+ * mailbox.c - The mailbox device: mapping the segment, the guest's doorbell and the host API (see mailbox.h)
+ */
+#include "mailbox.h"
+#include "codemap.h"
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+struct mailbox_stats mailbox_stats;
+
+static struct mailbox vm_box; /* the VM's view, with the buffers in memory[]; shared is NULL without a mailbox */
+static uint32_t in_seen;      /* in_posted when the inbox was last found full */
+static uint16_t in_len;       /* length of that message, read once; 0 if it was too long */
+static int in_bad;            /* that message claimed more than MAILBOX_BOX_WORDS words */
+static int refused;           /* the last command was refused */
+static int copying;           /* the buffers are mapped outside memory[], so messages are copied */
+
+#ifndef _WIN32
+/**
+ * map_segment - Open (or create) a segment and map its buffers and handshake
+ *
+ * Where host pages do not fit the buffers, they cannot go at at; the segment is
+ * then mapped as a whole, as with at NULL, and box->inbox tells the caller so.
+ *
+ * Parameters:
+ *   at: Where the buffers should be mapped, or NULL to let the host choose
+ *
+ * Returns:
+ *   int: 1 on success, 0 if the segment cannot be opened, sized or mapped
+ */
+static int map_segment(struct mailbox *box, const char *name, uint16_t *at)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    if (page <= 0 || MAILBOX_BYTES % page != 0 || (uintptr_t)at % page != 0)
+    {
+        at = NULL;
+    }
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    /* Whichever side comes first sizes the segment; the handshake starts out zeroed */
+    struct stat st;
+    off_t size = MAILBOX_BYTES + MAILBOX_HEADER_BYTES;
+    if (fstat(fd, &st) != 0 || (st.st_size < size && ftruncate(fd, size) != 0))
+    {
+        close(fd);
+        return 0;
+    }
+    if (!at)
+    {
+        /* One mapping from offset 0, which suits any page size */
+        uint8_t *whole = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (whole == MAP_FAILED)
+        {
+            return 0;
+        }
+        box->shared = (struct mailbox_shared *)(whole + MAILBOX_BYTES);
+        box->inbox = (uint16_t *)whole;
+        box->outbox = box->inbox + MAILBOX_BOX_WORDS;
+        return 1;
+    }
+    void *header = mmap(NULL, MAILBOX_HEADER_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, MAILBOX_BYTES);
+    void *buffers = mmap(at, MAILBOX_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED || buffers == MAP_FAILED)
+    {
+        if (header != MAP_FAILED)
+        {
+            munmap(header, MAILBOX_HEADER_BYTES);
+        }
+        return 0;
+    }
+    box->shared = header;
+    box->inbox = buffers;
+    box->outbox = box->inbox + MAILBOX_BOX_WORDS;
+    return 1;
+}
+
+/**
+ * mailbox_close - Detach the VM from the handshake; the buffers stay in memory[] until the process exits
+ */
+void mailbox_close(void)
+{
+    if (vm_box.shared && copying)
+    {
+        munmap(vm_box.inbox, MAILBOX_BYTES + MAILBOX_HEADER_BYTES);
+        vm_box.shared = NULL;
+    }
+    else if (vm_box.shared)
+    {
+        munmap(vm_box.shared, MAILBOX_HEADER_BYTES);
+        vm_box.shared = NULL;
+    }
+}
+
+/**
+ * mailbox_detach - Unmap a host application's view of the segment
+ */
+void mailbox_detach(struct mailbox *box)
+{
+    if (box->shared)
+    {
+        munmap(box->inbox, MAILBOX_BYTES + MAILBOX_HEADER_BYTES);
+        box->shared = NULL;
+    }
+}
+#else
+static int map_segment(struct mailbox *box, const char *name, uint16_t *at)
+{
+    (void)box;
+    (void)name;
+    (void)at;
+    return 0; /* no shared memory */
+}
+
+void mailbox_close(void)
+{
+}
+
+void mailbox_detach(struct mailbox *box)
+{
+    (void)box;
+}
+#endif
+
+/**
+ * mailbox_open - Back the window of memory[] with the segment name, or failing that, copy messages through it
+ *
+ * Returns:
+ *   int: 1 on success, 0 if the segment cannot be mapped
+ */
+int mailbox_open(const char *name)
+{
+    if (!map_segment(&vm_box, name, memory + MAILBOX_BASE))
+    {
+        return 0;
+    }
+    copying = vm_box.inbox != memory + MAILBOX_BASE;
+    /* A message the host posted before the VM came up is new to it */
+    in_seen = atomic_load_explicit(&vm_box.shared->in_taken, memory_order_relaxed);
+    memory[MR_MBOX_STATUS] = mailbox_poll();
+    return 1;
+}
+
+/**
+ * mailbox_poll - Work out MR_MBOX_STATUS (and MR_MBOX_IN_LEN) for a load from it
+ *
+ * Returns:
+ *   uint16_t: The status bits, 0 without a mailbox
+ */
+uint16_t mailbox_poll(void)
+{
+    struct mailbox_shared *shared = vm_box.shared;
+    if (!shared)
+    {
+        return 0;
+    }
+    uint16_t status = MBOX_READY | (refused ? MBOX_ERROR : 0);
+    uint32_t posted = atomic_load_explicit(&shared->in_posted, memory_order_acquire);
+    if (posted != atomic_load_explicit(&shared->in_taken, memory_order_relaxed))
+    {
+        if (posted != in_seen)
+        {
+            /* The length is the other process's word: taken once, and never trusted past the inbox */
+            in_seen = posted;
+            in_len = shared->in_len;
+            in_bad = in_len > MAILBOX_BOX_WORDS;
+            if (in_bad)
+            {
+                in_len = 0;
+            }
+            /* The host wrote the message behind mem_write's back */
+            if (copying)
+            {
+                memcpy(memory + MAILBOX_INBOX, vm_box.inbox, in_len * sizeof(uint16_t));
+            }
+            code_write_range(MAILBOX_INBOX, MAILBOX_BOX_WORDS);
+        }
+        status |= MBOX_IN_FULL | (in_bad ? MBOX_ERROR : 0);
+        memory[MR_MBOX_IN_LEN] = in_len;
+    }
+    if (atomic_load_explicit(&shared->out_posted, memory_order_relaxed) !=
+        atomic_load_explicit(&shared->out_taken, memory_order_acquire))
+    {
+        status |= MBOX_OUT_FULL;
+    }
+    return status;
+}
+
+/**
+ * mailbox_command - Run a command stored into MR_MBOX_CMD, before the store itself
+ */
+void mailbox_command(uint16_t command)
+{
+    struct mailbox_shared *shared = vm_box.shared;
+    uint16_t length = memory[MR_MBOX_OUT_LEN];
+    if (shared && command == MBOX_TAKE && (mailbox_poll() & MBOX_IN_FULL))
+    {
+        ++mailbox_stats.received;
+        mailbox_stats.words_in += in_len;
+        atomic_fetch_add_explicit(&shared->in_taken, 1, memory_order_release);
+        refused = 0;
+    }
+    else if (shared && command == MBOX_POST && length <= MAILBOX_BOX_WORDS && !(mailbox_poll() & MBOX_OUT_FULL))
+    {
+        /* The release orders the guest's stores into the outbox before the host can see the message */
+        if (copying)
+        {
+            memcpy(vm_box.outbox, memory + MAILBOX_OUTBOX, length * sizeof(uint16_t));
+        }
+        shared->out_len = length;
+        ++mailbox_stats.sent;
+        mailbox_stats.words_out += length;
+        atomic_fetch_add_explicit(&shared->out_posted, 1, memory_order_release);
+        refused = 0;
+    }
+    else
+    {
+        ++mailbox_stats.refused;
+        refused = 1;
+    }
+    memory[MR_MBOX_STATUS] = mailbox_poll();
+}
+
+/**
+ * mailbox_attach - Map the segment name into a host application, creating it if the VM has not yet
+ *
+ * Returns:
+ *   int: 1 on success, 0 on failure
+ */
+int mailbox_attach(struct mailbox *box, const char *name)
+{
+    return map_segment(box, name, NULL);
+}
+
+/**
+ * mailbox_writable - Test whether the guest has taken the last message, so that the inbox may be written
+ */
+int mailbox_writable(const struct mailbox *box)
+{
+    return atomic_load_explicit(&box->shared->in_posted, memory_order_relaxed) ==
+           atomic_load_explicit(&box->shared->in_taken, memory_order_acquire);
+}
+
+/**
+ * mailbox_send - Post the first count words of the inbox, written after mailbox_writable said so, to the guest
+ *
+ * Returns:
+ *   int: 1 if posted, 0 if count is too large or the guest still holds the last message
+ */
+int mailbox_send(struct mailbox *box, uint16_t count)
+{
+    if (count > MAILBOX_BOX_WORDS || !mailbox_writable(box))
+    {
+        return 0;
+    }
+    box->shared->in_len = count;
+    atomic_fetch_add_explicit(&box->shared->in_posted, 1, memory_order_release);
+    return 1;
+}
+
+/**
+ * mailbox_receive - Look for a message from the guest
+ *
+ * Returns:
+ *   int: The number of words of the message in the outbox, -1 if there is none
+ */
+int mailbox_receive(const struct mailbox *box)
+{
+    if (atomic_load_explicit(&box->shared->out_posted, memory_order_acquire) ==
+        atomic_load_explicit(&box->shared->out_taken, memory_order_relaxed))
+    {
+        return -1;
+    }
+    return box->shared->out_len;
+}
+
+/**
+ * mailbox_release - Hand the outbox back to the guest once its message has been consumed
+ */
+void mailbox_release(struct mailbox *box)
+{
+    if (mailbox_receive(box) >= 0)
+    {
+        atomic_fetch_add_explicit(&box->shared->out_taken, 1, memory_order_release);
+    }
+}
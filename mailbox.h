@@ -0,0 +1,131 @@
+/**
+ * mailbox.h - Mailbox device exchanging buffers with a host process through shared memory
+ *
+ * With --mailbox NAME the guest addresses MAILBOX_BASE-xDFFF are backed by the
+ * POSIX shared-memory segment NAME (created if it does not exist), which a host
+ * application attaches to with mailbox_attach. The window holds two buffers:
+ *
+ *   MAILBOX_INBOX   xC000-xCFFF, messages from the host to the guest
+ *   MAILBOX_OUTBOX  xD000-xDFFF, messages from the guest to the host
+ *
+ * Each buffer holds one message of up to MAILBOX_BOX_WORDS words at a time.
+ * Payloads are not copied: the host writes straight into the inbox and reads
+ * straight out of the outbox, and the guest loads and stores them like any
+ * other memory. Only the handshake goes through registers in the device page
+ * (main.h):
+ *
+ *   MR_MBOX_STATUS   MBOX_READY while a mailbox is attached, MBOX_IN_FULL while
+ *                    a message waits in the inbox, MBOX_OUT_FULL while the host
+ *                    has not yet released the last message posted to the outbox,
+ *                    MBOX_ERROR if the last command was refused or the inbox
+ *                    message is malformed
+ *   MR_MBOX_IN_LEN   words in the inbox message, valid once MR_MBOX_STATUS
+ *                    has shown MBOX_IN_FULL
+ *   MR_MBOX_OUT_LEN  words of the message the guest is about to post
+ *   MR_MBOX_CMD      the doorbell: storing MBOX_TAKE hands the inbox back to
+ *                    the host, MBOX_POST posts MR_MBOX_OUT_LEN words of the
+ *                    outbox to it
+ *
+ * A guest receives by waiting for MBOX_IN_FULL, reading the message and ringing
+ * MBOX_TAKE, and sends by waiting for MBOX_OUT_FULL to clear, writing the
+ * outbox, setting MR_MBOX_OUT_LEN and ringing MBOX_POST. MBOX_TAKE with an empty
+ * inbox and MBOX_POST with a full outbox or an oversized length are refused.
+ * An inbox message the host gave more than MAILBOX_BOX_WORDS words shows as
+ * MBOX_IN_FULL with MBOX_ERROR and a length of 0; MBOX_TAKE discards it.
+ *
+ * The handshake itself lives in the segment, after the buffers: one counter
+ * per direction and side, bumped with release stores after the payload is in
+ * place and read with acquire loads, so a single host thread and the VM can
+ * run concurrently without locks. The host side of it is mailbox_writable,
+ * mailbox_send, mailbox_receive and mailbox_release, which never block;
+ * a host waiting for the guest polls them.
+ *
+ * The buffers can only be mapped into memory[] where host pages divide them.
+ * Where pages are larger, as on aarch64 kernels with 64KB pages, the segment
+ * is mapped elsewhere and messages are copied instead: into the inbox of
+ * memory[] when MR_MBOX_STATUS first shows them, out of its outbox on
+ * MBOX_POST. Guests and hosts see no difference but the cost of the copy.
+ *
+ * Host writes bypass mem_write, so translations built from the inbox are
+ * discarded when MR_MBOX_STATUS shows a new message. The segment is outside
+ * the machine state and changes under the guest's feet, so --mailbox cannot
+ * be combined with --reverse, --check or --batch.
+ */
+#ifndef MAILBOX_H
+#define MAILBOX_H
+#include "main.h"
+#include <stdatomic.h>
+
+#define MAILBOX_BASE 0xC000    /* first word of the window */
+#define MAILBOX_WORDS 0x2000   /* words in the window, the inbox and the outbox */
+#define MAILBOX_BYTES (MAILBOX_WORDS * 2)
+#define MAILBOX_BOX_WORDS (MAILBOX_WORDS / 2)      /* longest message */
+#define MAILBOX_INBOX MAILBOX_BASE
+#define MAILBOX_OUTBOX (MAILBOX_BASE + MAILBOX_BOX_WORDS)
+#define MAILBOX_HEADER_BYTES MAILBOX_BYTES         /* room for the handshake, whole host pages when the buffers are */
+
+/* Commands, stored into MR_MBOX_CMD */
+enum
+{
+    MBOX_TAKE = 1, /* the guest is done with the inbox message */
+    MBOX_POST = 2  /* the outbox holds a message for the host */
+};
+
+/* Bits of MR_MBOX_STATUS */
+enum
+{
+    MBOX_IN_FULL = 1 << 0,
+    MBOX_OUT_FULL = 1 << 1,
+    MBOX_ERROR = 1 << 2,
+    MBOX_READY = 1 << 15
+};
+
+/* The handshake, at MAILBOX_BYTES into the segment */
+struct mailbox_shared
+{
+    _Atomic uint32_t in_posted;  /* messages the host has put in the inbox */
+    _Atomic uint32_t in_taken;   /* of those, messages the guest has handed back */
+    _Atomic uint32_t out_posted; /* messages the guest has put in the outbox */
+    _Atomic uint32_t out_taken;  /* of those, messages the host has released */
+    uint16_t in_len;             /* words in the inbox message */
+    uint16_t out_len;            /* words in the outbox message */
+};
+
+/* One side's view of a segment */
+struct mailbox
+{
+    struct mailbox_shared *shared;
+    uint16_t *inbox;  /* MAILBOX_BOX_WORDS words, written by the host */
+    uint16_t *outbox; /* MAILBOX_BOX_WORDS words, written by the guest */
+};
+
+/* Counters for --stats */
+struct mailbox_stats
+{
+    uint64_t received;  /* inbox messages the guest took */
+    uint64_t sent;      /* outbox messages the guest posted */
+    uint64_t words_in;  /* words in the messages taken */
+    uint64_t words_out; /* words in the messages posted */
+    uint64_t refused;   /* commands refused */
+};
+
+extern struct mailbox_stats mailbox_stats;
+
+/**
+ * Function declarations/prototype
+ */
+/* The VM's side */
+int mailbox_open(const char *name);
+void mailbox_close(void);
+uint16_t mailbox_poll(void);
+void mailbox_command(uint16_t command);
+
+/* The host application's side */
+int mailbox_attach(struct mailbox *box, const char *name);
+void mailbox_detach(struct mailbox *box);
+int mailbox_writable(const struct mailbox *box);
+int mailbox_send(struct mailbox *box, uint16_t count);
+int mailbox_receive(const struct mailbox *box);
+void mailbox_release(struct mailbox *box);
+
+#endif /* MAILBOX_H */
@@ -1,211 +1,225 @@
 /**
- * main.c - Complete implementation of the virtual machine
+ * main.c - Command-line front end of the virtual machine
  *
- * This file contains all the code needed for the VM including
- * initialization, program loading, execution, and cleanup.
+ * Parses the options, loads the images and runs the instruction cycle; the
+ * machine itself lives in vm.c.
  */
 #include "main.h"
+#include "trap.h"
+#include "cfg.h"
+#include "trace.h"
+#include "codemap.h"
+#include "decode.h"
+#include "batch.h"
+#include "itrace.h"
+#include "breakpoint.h"
+#include "gdb.h"
+#include "replay.h"
+#include "cover.h"
+#include "check.h"
+#include "disk.h"
+#include "bank.h"
+#include "mailbox.h"
+#include "watch.h"
+#include <string.h>
+
+/* Output of one batch job, kept until all jobs are done */
+struct job_output
+{
+    char *text;
+    size_t len;
+};
 
-/* Global Windows console handles and mode settings */
-HANDLE hStdin = INVALID_HANDLE_VALUE; /* Handle for standard input stream */
-DWORD fdwMode, fdwOldMode;            /* Current and original console mode flags */
-
-/**
- * disable_input_buffering - Configure console for immediate input processing
- *
- * This function modifies the Windows console settings to allow for immediate
- * character-by-character input without requiring the user to press Enter.
- * It saves the original console mode to restore it later and disables features
- * like echo (displaying typed characters) and line buffering.
- */
-void disable_input_buffering()
+/* The jobs of a batch run and where their outputs go */
+struct job_table
 {
-    /* Get handle to standard input */
-    hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    /* Save the current console mode configuration */
-    GetConsoleMode(hStdin, &fdwOldMode);
-
-    /* Create a new mode by toggling specific bits in the original mode:
-     * - ENABLE_ECHO_INPUT: When disabled, typed characters aren't displayed
-     * - ENABLE_LINE_INPUT: When disabled, input is available immediately without Enter key
-     */
-    fdwMode = fdwOldMode ^ ENABLE_ECHO_INPUT /* no input echo */
-              ^ ENABLE_LINE_INPUT;           /* return when one or
-                                                more characters are available */
-
-    /* Apply the new mode settings to the console */
-    SetConsoleMode(hStdin, fdwMode);
-    /* Clear any pending input in the buffer */
-    FlushConsoleInputBuffer(hStdin);
-}
+    struct batch_job *jobs;
+    struct job_output *outputs;
+};
 
 /**
- * restore_input_buffering - Restore original console input behavior
- *
- * This function restores the console to its original input mode settings,
- * which were saved when disable_input_buffering was called. This ensures
- * that the console behaves normally after our program exits.
+ * keep_output - batch_done_fn that saves a job's output in its slot of the job_table in ctx
  */
-void restore_input_buffering()
+static void keep_output(struct batch_job *job, const char *output, size_t len, void *ctx)
 {
-    /* Restore the original console mode that was saved earlier */
-    SetConsoleMode(hStdin, fdwOldMode);
+    struct job_table *table = ctx;
+    struct job_output *slot = &table->outputs[job - table->jobs];
+    slot->text = malloc(len ? len : 1);
+    if (slot->text == NULL)
+    {
+        printf("out of memory\n");
+        exit(1);
+    }
+    memcpy(slot->text, output, len);
+    slot->len = len;
 }
 
 /**
- * check_key - Detect if a key has been pressed
+ * run_batch - Run every line of a file as a job on copies of the loaded image
+ *
+ * Each line, newline included, is the keyboard input of one guest. The outputs
+ * are printed in the order of the lines once all jobs are done.
  *
- * This function checks if any keyboard input is available for reading.
- * It waits for a short time (1 second maximum) to see if input arrives,
- * and uses _kbhit to check if a key is in the input buffer.
+ * Parameters:
+ *   path: The job file
+ *   workers: Number of worker threads
+ *   stats: Non-zero to print the batch counters to stderr
  *
  * Returns:
- *   uint16_t: Non-zero value if a key is available, zero otherwise
+ *   int: Exit status
  */
-uint16_t check_key()
+static int run_batch(const char *path, int workers, int stats)
 {
-    /* Wait for input for up to 1000ms (1 second) and check if any key is pressed
-     * WaitForSingleObject returns WAIT_OBJECT_0 if the input handle is signaled
-     * _kbhit returns non-zero if there's a key in the input buffer
-     */
-    return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        printf("failed to open job file: %s\n", path);
+        return EXIT_FAILURE;
+    }
+    size_t size = 0, cap = 4096;
+    char *text = malloc(cap);
+    for (size_t n; text != NULL && (n = fread(text + size, 1, cap - size, file)) > 0;)
+    {
+        size += n;
+        if (size == cap)
+        {
+            cap *= 2;
+            text = realloc(text, cap);
+        }
+    }
+    fclose(file);
+
+    size_t count = 0;
+    for (size_t i = 0; text != NULL && i < size; ++i)
+    {
+        count += text[i] == '\n' || i + 1 == size;
+    }
+    struct batch_job *jobs = calloc(count ? count : 1, sizeof(struct batch_job));
+    struct job_output *outputs = calloc(count ? count : 1, sizeof(struct job_output));
+    if (text == NULL || jobs == NULL || outputs == NULL)
+    {
+        printf("out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0, start = 0, j = 0; i < size; ++i)
+    {
+        if (text[i] == '\n' || i + 1 == size)
+        {
+            jobs[j].input = text + start;
+            jobs[j++].input_len = i + 1 - start;
+            start = i + 1;
+        }
+    }
+
+    struct job_table table = {jobs, outputs};
+    struct batch_stats bs;
+    if (!batch_run_workers(jobs, count, workers, keep_output, &table, &bs))
+    {
+        printf("failed to set up the batch workers\n");
+        return EXIT_FAILURE;
+    }
+
+    static const char *const endings[] = {"halted", "out of input", "fault"};
+    uint64_t total = 0;
+    for (size_t j = 0; j < count; ++j)
+    {
+        printf("--- job %zu: %s ---\n", j + 1, endings[jobs[j].status]);
+        fwrite(outputs[j].text, 1, outputs[j].len, stdout);
+        total += jobs[j].instructions;
+        free(outputs[j].text);
+    }
+    if (stats)
+    {
+        static const char *const backings[] = {"small pages", "transparent huge pages", "reserved huge pages"};
+        fprintf(stderr, "instructions: %llu in %zu jobs\n", (unsigned long long)total, count);
+        fprintf(stderr, "batch: %llu vector steps (%.2f lanes each), %llu scalar instructions in %llu bursts\n",
+                (unsigned long long)bs.vector_steps,
+                bs.vector_steps ? (double)bs.vector_lanes / bs.vector_steps : 0.0,
+                (unsigned long long)bs.scalar_instrs, (unsigned long long)bs.bursts);
+        fprintf(stderr, "pages: %llu copied on write, %llu allocated; arena: %zu KB used, %s\n",
+                (unsigned long long)bs.page_copies, (unsigned long long)bs.pages, bs.arena_used >> 10,
+                backings[bs.arena_backing]);
+        fprintf(stderr, "workers: %d on %d NUMA nodes, %llu steals (%llu across nodes)\n", workers, bs.nodes,
+                (unsigned long long)bs.steals, (unsigned long long)bs.remote_steals);
+    }
+    free(outputs);
+    free(jobs);
+    free(text);
+    return EXIT_SUCCESS;
 }
 
 /**
- * handle_interrupt - Clean up and exit when CTRL+C is pressed
- *
- * This function serves as a signal handler for interrupt signals (CTRL+C).
- * It restores the original console input settings and exits the program.
+ * dump_registers - Print the guest registers to stderr
  */
-void handle_interrupt()
+static void dump_registers(void)
 {
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
+    for (int i = R_R0; i <= R_R7; ++i)
+    {
+        fprintf(stderr, "R%d=x%04X%s", i, reg[i], i == R_R3 || i == R_R7 ? "\n" : " ");
+    }
+    fprintf(stderr, "PC=x%04X COND=%s\n", reg[R_PC],
+            reg[R_COND] == FL_NEG ? "n" : reg[R_COND] == FL_ZRO ? "z" : "p");
 }
 
 /**
- * sign_extend - Extend a value to 16 bits with sign preservation
- *
- * This function takes a value with a specific bit count and extends it
- * to a 16-bit value, preserving the sign bit (most significant bit).
- *
- * Parameters:
- *   x: The value to extend
- *   bit_count: The number of bits in the original value
- *
- * Returns:
- *   uint16_t: The sign-extended 16-bit value
+ * stop_at_breakpoint - bp_handler of --break: report where the guest stopped and halt it
  */
-uint16_t sign_extend(uint16_t x, int bit_count)
+static void stop_at_breakpoint(struct breakpoint *bp)
 {
-    if ((x >> (bit_count - 1)) & 1)
-    {
-        x |= (0xFFFF << bit_count);
-    }
-    return x;
+    fprintf(stderr, "\nbreakpoint at x%04X after %llu instructions\n", bp->address,
+            (unsigned long long)instr_count);
+    dump_registers();
+    running = 0;
 }
 
 /**
- * update_flags - Update condition flags based on register value
- *
- * This function sets the condition flags (N, Z, P) based on the value
- * in the specified register. Exactly one flag will be set.
- *
- * Parameters:
- *   r: Register index to check
+ * stop_at_watchpoint - watch_handler of --watch: report the access and halt the guest after the instruction
  */
-void update_flags(uint16_t r)
+static void stop_at_watchpoint(struct watchpoint *w, uint16_t address, int kind, uint16_t value)
 {
-    if (reg[r] == 0)
-    {
-        reg[R_COND] = FL_ZRO;
-    }
-    else if (reg[r] >> 15) /* Check if the most significant bit is 1 (negative) */
+    (void)w;
+    if (kind == WATCH_STORE)
     {
-        reg[R_COND] = FL_NEG;
+        fprintf(stderr, "\nwatchpoint: store of x%04X to x%04X (was x%04X)", value, address, memory[address]);
     }
     else
     {
-        reg[R_COND] = FL_POS;
+        fprintf(stderr, "\nwatchpoint: load of x%04X from x%04X", value, address);
     }
+    fprintf(stderr, " by the instruction at x%04X after %llu instructions\n", (uint16_t)(reg[R_PC] - 1),
+            (unsigned long long)instr_count - 1);
+    dump_registers();
+    running = 0;
 }
 
 /**
- * read_image - Load a program (binary file) image into memory for the VM's CPU to execute it.
- *
- * This function loads a program binary file into the VM's memory space.
- * The file format has a header specifying the origin address, followed
- * by the program data.
- *
- * Parameters:
- *   image_path: Path to the image file (i.e., "prog.obj")
+ * parse_watch - Set a watchpoint from "LO[-HI][,r|w|rw]"
  *
  * Returns:
- *   int: 1 on success, 0 on failure
+ *   int: 1 on success, 0 if the text does not parse or no watchpoint is free
  */
-uint16_t swap16(uint16_t x)
-{
-    return (x << 8) | (x >> 8);
-}
-
-void read_image_file(FILE *file)
+static int parse_watch(const char *text)
 {
-    /* the origin tells us where in memory to place the image */
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
-
-    /* we know the maximum file size so we only need one fread */
-    uint16_t max_read = MEMORY_MAX - origin;
-    uint16_t *p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
-
-    /* swap to little endian */
-    while (read-- > 0)
+    const char *end;
+    uint16_t lo, hi;
+    int kind = WATCH_STORE;
+    if (!bp_parse_value(text, &end, &lo))
     {
-        *p = swap16(*p);
-        ++p;
+        return 0;
     }
-}
-
-int read_image(const char *image_path)
-{
-    FILE *file = fopen(image_path, "rb");
-    if (!file)
+    hi = lo;
+    if (*end == '-' && !bp_parse_value(end + 1, &end, &hi))
     {
         return 0;
-    };
-    read_image_file(file);
-    fclose(file);
-    return 1;
-}
-
-/**
- * Memory mapped registers take memory access a bit more complicated.
- * We cant read or write to the memory array directly, but must instead call setter and getter functions.
- * When memory is read from KBSR, the getter will check the keyboard and update both memory locations
- */
-void mem_write(uint16_t address, uint16_t val)
-{
-    memory[address] = val;
-}
-
-uint16_t mem_read(uint16_t address)
-{
-    if (address == MR_KBSR)
+    }
+    if (*end == ',')
     {
-        if (check_key())
-        {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
-        }
-        else
-        {
-            memory[MR_KBSR] = 0;
-        }
+        ++end;
+        kind = strcmp(end, "r") == 0 ? WATCH_LOAD : strcmp(end, "w") == 0 ? WATCH_STORE
+             : strcmp(end, "rw") == 0 ? WATCH_ACCESS : 0;
+        end += strlen(end);
     }
-    return memory[address];
+    return *end == '\0' && kind && watch_set(lo, hi, kind) != NULL;
 }
 
 /**
@@ -225,14 +239,193 @@ int main(int argc, const char *argv[])
 {
     /* Load arguments */
     /* To handle command line input to make our program usable. We expect one or more paths to VM images and present a usage string if none are given. */
-    if (argc < 2)
+    /* Options come before the images:
+     *   --os-traps  service GETC/OUT/PUTS/IN/PUTSP/HALT with the trap routines of an OS image loaded
+     *               alongside the program (e.g. "vm --os-traps lc3os.obj prog.obj") instead of natively
+     *   --cfg       print the basic blocks, data ranges and loops of the loaded images and exit
+     *   --hot-traces  record and compile hot loops into optimized traces (see trace.h)
+     *   --stats     print execution counters to stderr when the VM halts
+     *   --switch    interpret with the reference decode switch instead of the specialized handler table
+     *   --batch FILE  run one copy of the image per line of FILE, with the line as its input (see batch.h)
+     *   --workers N   run the batch on N threads spread over the NUMA nodes (0: one per CPU)
+     *   --trace FILE  record every retired instruction to FILE (see itrace.h; read it with lc3-itrace)
+     *   --break ADDR[:COND]  stop before executing ADDR, if COND holds (see breakpoint.h); repeatable
+     *   --gdb PATH    wait for a debugger on the Unix socket PATH and let it control the guest (see gdb.h)
+     *   --watch LO[-HI][,r|w|rw]  stop after the instruction that stores to (w, the default), loads from (r)
+     *                 or accesses (rw) the address range (see watch.h); repeatable
+     *   --reverse   with --gdb, record a history the debugger can step and continue back through (see replay.h)
+     *   --cover FILE  collect edge coverage and write it to FILE as an lcov tracefile on exit (see cover.h)
+     *   --check     run every block on the handler table (and traces, with --hot-traces) and on the
+     *               reference switch, and stop at the first difference (see check.h)
+     *   --random N[:SEED]  instead of images, check N generated programs, from SEED (default 1) on
+     *   --disk FILE   attach FILE as the guest's block device (see disk.h)
+     *   --banks N     give the guest N banks of extended memory, switched into x8000-xBFFF (see bank.h)
+     *   --mailbox NAME  back xC000-xDFFF with the shared-memory segment NAME, for exchanging messages
+     *                 with a host application (see mailbox.h)
+     */
+    int trap_mode_arg = TRAP_MODE_NATIVE;
+    int cfg_only = 0;
+    int stats = 0;
+    int use_switch = 0;
+    const char *batch_file = NULL;
+    int workers = 1;
+    const char *trace_file = NULL;
+    const char *break_specs[BP_MAX];
+    int break_count = 0;
+    const char *gdb_socket = NULL;
+    const char *watch_specs[WATCH_MAX];
+    int watch_specs_count = 0;
+    int reverse = 0;
+    const char *cover_file = NULL;
+    int check = 0;
+    uint64_t random_programs = 0;
+    uint32_t random_seed = 1;
+    const char *disk_file = NULL;
+    uint32_t bank_count = 0;
+    const char *mailbox_name = NULL;
+    int first_image = 1;
+    for (; first_image < argc && strncmp(argv[first_image], "--", 2) == 0; ++first_image)
+    {
+        if (strcmp(argv[first_image], "--os-traps") == 0)
+        {
+            trap_mode_arg = TRAP_MODE_OS;
+        }
+        else if (strcmp(argv[first_image], "--cfg") == 0)
+        {
+            cfg_only = 1;
+        }
+        else if (strcmp(argv[first_image], "--hot-traces") == 0)
+        {
+            trace_tier = 1;
+        }
+        else if (strcmp(argv[first_image], "--stats") == 0)
+        {
+            stats = 1;
+        }
+        else if (strcmp(argv[first_image], "--switch") == 0)
+        {
+            use_switch = 1;
+        }
+        else if (strcmp(argv[first_image], "--batch") == 0 && first_image + 1 < argc)
+        {
+            batch_file = argv[++first_image];
+        }
+        else if (strcmp(argv[first_image], "--workers") == 0 && first_image + 1 < argc)
+        {
+            workers = atoi(argv[++first_image]);
+#ifndef _WIN32
+            if (workers <= 0)
+            {
+                workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            }
+#endif
+            if (workers <= 0)
+            {
+                workers = 1;
+            }
+        }
+        else if (strcmp(argv[first_image], "--trace") == 0 && first_image + 1 < argc)
+        {
+            trace_file = argv[++first_image];
+        }
+        else if (strcmp(argv[first_image], "--break") == 0 && first_image + 1 < argc && break_count < BP_MAX)
+        {
+            break_specs[break_count++] = argv[++first_image];
+        }
+        else if (strcmp(argv[first_image], "--gdb") == 0 && first_image + 1 < argc)
+        {
+            gdb_socket = argv[++first_image];
+        }
+        else if (strcmp(argv[first_image], "--watch") == 0 && first_image + 1 < argc &&
+                 watch_specs_count < WATCH_MAX)
+        {
+            watch_specs[watch_specs_count++] = argv[++first_image];
+        }
+        else if (strcmp(argv[first_image], "--reverse") == 0)
+        {
+            reverse = 1;
+        }
+        else if (strcmp(argv[first_image], "--cover") == 0 && first_image + 1 < argc)
+        {
+            cover_file = argv[++first_image];
+        }
+        else if (strcmp(argv[first_image], "--check") == 0)
+        {
+            check = 1;
+        }
+        else if (strcmp(argv[first_image], "--random") == 0 && first_image + 1 < argc)
+        {
+            char *end;
+            check = 1;
+            random_programs = strtoull(argv[++first_image], &end, 10);
+            if (*end == ':')
+            {
+                random_seed = (uint32_t)strtoul(end + 1, NULL, 10);
+            }
+        }
+        else if (strcmp(argv[first_image], "--disk") == 0 && first_image + 1 < argc)
+        {
+            disk_file = argv[++first_image];
+        }
+        else if (strcmp(argv[first_image], "--banks") == 0 && first_image + 1 < argc)
+        {
+            bank_count = (uint32_t)strtoul(argv[++first_image], NULL, 10);
+        }
+        else if (strcmp(argv[first_image], "--mailbox") == 0 && first_image + 1 < argc)
+        {
+            mailbox_name = argv[++first_image];
+        }
+        else
+        {
+            printf("unknown option: %s\n", argv[first_image]);
+            exit(2);
+        }
+    }
+
+    if (first_image >= argc && !random_programs)
+    {
+        printf("lc3 [--os-traps] [--cfg] [--hot-traces] [--stats] [--switch] [--batch jobs] [--workers n] [--trace file] [--break addr[:cond]] [--gdb socket] [--watch lo[-hi][,rw]] [--reverse] [--cover file] [--check] [--random n[:seed]] [--disk file] [--banks n] [--mailbox name] [image-file1] ...\n");
+        exit(2);
+    }
+
+    /* Going back needs a debugger to ask for it, and replay runs its own loop */
+    if (reverse && (gdb_socket == NULL || trace_file))
     {
-        printf("lc3 [image-file1] ...\n");
+        printf("--reverse needs --gdb and cannot be combined with --trace\n");
+        exit(2);
+    }
+
+    /* The checker compares the table against the switch on its own loop, and generated programs bring no OS */
+    if (check && (use_switch || trace_file || gdb_socket || break_count || watch_specs_count || cover_file ||
+                  batch_file || (random_programs && trap_mode_arg == TRAP_MODE_OS)))
+    {
+        printf("--check and --random cannot be combined with --switch, --trace, --gdb, --break, --watch, --cover or --batch, nor --random with --os-traps\n");
+        exit(2);
+    }
+
+    /* Replay would read sectors written after the history it goes back to, and batch jobs get no devices */
+    if (disk_file && (reverse || batch_file))
+    {
+        printf("--disk cannot be combined with --reverse or --batch\n");
+        exit(2);
+    }
+
+    /* Neither the history nor the batch lanes' copies of memory[] take in the banks outside the window */
+    if (bank_count && (reverse || batch_file))
+    {
+        printf("--banks cannot be combined with --reverse or --batch\n");
+        exit(2);
+    }
+
+    /* The host application changes the mailbox at any time, so runs of the guest cannot be repeated */
+    if (mailbox_name && (reverse || check || batch_file))
+    {
+        printf("--mailbox cannot be combined with --reverse, --check or --batch\n");
         exit(2);
     }
 
     // Load all image files provided as arguments
-    for (int j = 1; j < argc; ++j)
+    for (int j = first_image; j < argc; ++j)
     {
         if (!read_image(argv[j]))
         {
@@ -241,417 +434,166 @@ int main(int argc, const char *argv[])
         }
     }
 
-    /* Setup, to properly handle input to the terminal, we need to adjust some buffering settings. */
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
-
-    /* MAIN VM EXECUTION PROCEDURE */
-    /* Since exactly one condition flag should be set at any given time, set the Z flag */
-    reg[R_COND] = FL_ZRO;
+    trap_init(trap_mode_arg);
+    /* The machine control register starts with the clock enabled */
+    memory[MR_MCR] = (1 << 15);
 
-    /* set the PC to starting position */
-    /* 0x3000 is the default address */
-    /* Programs start at address 0x3000 instead of 0x0, because the lower addresses are left empty to leave space for the trap routine code. */
-    enum
+    if (batch_file)
     {
-        PC_START = 0x3000 // Address 0011000000000000 in binary (16-bit), 12288 in decimal. This is the index position on the memory array
-    };
-    reg[R_PC] = PC_START;
-
-    int running = 1;
-    printf("VM initialized and ready. Hit Ctrl+C to exit.\n");
+        return run_batch(batch_file, workers, stats);
+    }
 
-    /* CPU EXECUTION CYCLE */
-    while (running)
-    {
-        /* FETCH */
-        /* Fetch: Get the next instruction from memory at the address in PC, and advance PC */
-        uint16_t instr = memory[reg[R_PC]++]; // Access the memory array at the address stored in the PC register, get the instruction (16 bit unsigned short int) and after that access, increment program counter (PC) by 1 to point to the next instruction in memory
-
-        /* DECODE */
-        /* Decode: Get the instruction's opcode, which are the 4 leftmost bits in the 16 bit unsigned int (the instruction) */
-        uint16_t op = instr >> 12; // This right-shifts the instruction value by 12 bits. In the LC-3 architecture, the leftmost 4 bits (bits 12-15) contain the opcode that identifies which instruction to execute (ADD, AND, LD, etc.).
-
-        /* For now, just print the instruction for debugging */
-        // printf("Executing instruction at 0x%04X: 0x%04X (opcode: 0x%X)\n", reg[R_PC] - 1, instr, op);
-
-        /* EXECUTE */
-        switch (op)
-        {
-        case OP_BR:
-        {
-            /* Branch */
-            /*
-                --- Instruction format ---
-                15-12   11-9   8-0
-                |OP_BR| nzp |PCoffset9|
-                Where:
-                * Bits 15–12: opcode (0000 for BR)
-                * Bits 11–9: condition codes (N, Z, P) — e.g., 010 means "branch if result was zero"
-                * Bits 8–0: a signed 9-bit offset to jump relative to current PC
-
-                * The BR instruction will branch (jump) if ANY of the condition flags that are set in the instruction match the current condition flag in R_COND.
-            */
-            /*
-            The BR instruction is very powerful because it allows for different kinds of conditional branches:
-                1. BRn: Branch if negative (condition = 100)
-                2. BRz: Branch if zero (condition = 010)
-                3. BRp: Branch if positive (condition = 001)
-                4. BRnz: Branch if negative or zero (condition = 110)
-                5. BRnp: Branch if negative or positive (condition = 101)
-                6. BRzp: Branch if zero or positive (condition = 011)
-                7. BRnzp: Always branch (condition = 111)
-            */
-            uint16_t pc_offset = sign_extend(instr & 0x1FF, 9); // get 9-bit signed offset
-            uint16_t cond_flag = (instr >> 9) & 0x7;            // get NZP bits (bits 11–9)
-            if (cond_flag & reg[R_COND])                        // if current condition matches
-            {
-                reg[R_PC] += pc_offset; // jump relative to current PC
-            }
-        }
-        break;
+    /* The block device's registers are in memory[], so the disk is attached after the images are loaded */
+    if (disk_file && !disk_open(disk_file))
+    {
+        printf("failed to open disk: %s\n", disk_file);
+        exit(1);
+    }
 
-        case OP_ADD:
-        {
-            /* Add */
-            /**
-             * The ADD instruction takes two numbers, adds them together, and stores the result in a register. Each ADD instruction looks like the following:
-             * Instruction format:argc
-             *  15-12       11-9   8-6    5   4-3   2-0
-                |OP_BR|     DR    |SR1|   0  |00|   SR2
-            OR
+    /* Whatever the images put in the window becomes bank 0 */
+    if (bank_count && !bank_init(bank_count))
+    {
+        printf("failed to set up %u banks of extended memory\n", bank_count);
+        exit(1);
+    }
 
-                15-12       11-9   8-6     5      4-0
-                |OP_BR|     DR    |SR1|    1     |imm5|
+    if (mailbox_name && !mailbox_open(mailbox_name))
+    {
+        printf("failed to open mailbox: %s\n", mailbox_name);
+        exit(1);
+    }
 
-            If bit [5] is 0, the second source operand is obtained from SR2. If bit [5] is 1, the second source operand is obtained by sign-extending the imm5 field to 16 bits. In both cases, the second source operand is added to the contents of SR1 and the result stored in DR.
-            */
-            /* Destination register (DR) */
-            uint16_t dr = (instr >> 9) & 0x7;
-            /* First operand */
-            uint16_t r1 = (instr >> 6) & 0x7;
-            /* whether we are in immediate mode */
-            uint16_t imm_flag = (instr >> 5) & 0x1;
+    /* Recover the block structure of the loaded code, for the report and for coverage's data words */
+    if (cfg_only || cover_file)
+    {
+        cfg_build(PC_START);
+    }
+    if (cfg_only)
+    {
+        cfg_report(stdout);
+        exit(0);
+    }
 
-            if (imm_flag == 1)
-            {
-                /* Immediate mode */
-                uint16_t imm5 = sign_extend(instr & 0x1F, 5); // Convert 5-bit value to 16-bit signed
-                reg[dr] = reg[r1] + imm5;
-            }
-            else
-            {
-                /* Register mode */
-                uint16_t r2 = instr & 0x7;
-                reg[dr] = reg[r1] + reg[r2];
-            }
+    /* Decode every possible instruction word up front (see decode.h) */
+    if (!use_switch)
+    {
+        decode_init();
+    }
 
-            /* Update condition flags */
-            update_flags(dr);
-        }
-        break;
-
-        case OP_LD:
-        {
-            /* Load */
-            /**
-             * Loads a value from memory into a register
-             * PC-relative addressing, meaning: The memory address is computed as PC + offset, and the content at that memory address is stored in the destination register.
-             *  15     12 | 11    9 | 8                  0
-                [  0010   |  DR     |   PCoffset9         ]
-             *
-             - Opcode (bits 15–12) = 0010 → this is LD
-             - DR (bits 11–9): Destination Register (where to load the data)
-             - PCoffset9 (bits 8–0): a 9-bit signed offset from the current PC (program counter)
-             */
-            uint16_t dr = (instr >> 9) & 0x7;                   // get the 11-9 bits (dr)
-            uint16_t pc_offset = sign_extend(instr & 0x1FF, 9); // converts the 9-bit value into a proper signed 16-bit int, preserving its sign
-            // reg[dr] = memory[reg[R_PC] + pc_offset];
-            reg[dr] = mem_read(reg[R_PC] + pc_offset);
-            update_flags(dr);
-        }
-        break;
-
-        case OP_ST:
-        {
-            /* Store */
-            /**
-             * Store a register value into memory
-             *  15     12 | 11    9 | 8                  0
-                [  0011   |  DR    |   PCoffset9         ]
-             */
-            uint16_t dr = (instr >> 9) & 0x7;
-            uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-            // memory[reg[R_PC] + pc_offset] = reg[dr];
-            mem_write(reg[R_PC] + pc_offset, reg[dr]);
-        }
-        break;
-
-        case OP_JSR:
-        {
-            /* Jump Register */
-            /**
-             * Store a register value into memory
-             *  15     12 |11| 10                   0
-                [  0011   |DR| PCoffset11           ]
-             */
-            uint16_t long_flag = (instr >> 11) & 1;
-            reg[R_R7] = reg[R_PC];
-
-            if (long_flag == 1)
-            {
-                uint16_t long_pc_offset = sign_extend(instr & 0x7ff, 11);
-                reg[R_PC] += long_pc_offset; /* JSR */
-            }
-            else
-            {
-                uint16_t r1 = (instr >> 6) & 0x7;
-                reg[R_PC] = reg[r1]; /* JSRR */
-            }
-        }
-        break;
+    /* Coverage wraps the control transfers of the table, before breakpoints hook it */
+    if (cover_file)
+    {
+        cover_init(NULL, 0, 1);
+    }
 
-        case OP_AND:
+    /* Breakpoints hook the handler table, so they go in once it is built */
+    for (int i = 0; i < break_count; ++i)
+    {
+        const char *end;
+        uint16_t address;
+        if (!bp_parse_value(break_specs[i], &end, &address) || (*end != '\0' && *end != ':') ||
+            !bp_set(address, *end ? end + 1 : NULL))
         {
-            /* Bitwise AND */
-            uint16_t r0 = (instr >> 9) & 0x7;
-            uint16_t r1 = (instr >> 6) & 0x7;
-            uint16_t imm_flag = (instr >> 5) & 0x1;
-
-            if (imm_flag)
-            {
-                /* Immediate mode */
-                uint16_t imm5 = sign_extend(instr & 0x1f, 5);
-                reg[r0] = reg[r1] & imm5; // Bitwise AND
-            }
-            else
-            {
-                /* Register mode */
-                uint16_t r2 = instr & 0x7;
-                reg[r0] = reg[r1] & reg[r2]; // Bitwise AND
-            }
-            update_flags(r0);
+            printf("bad breakpoint: %s\n", break_specs[i]);
+            exit(2);
         }
-        break;
-
-        case OP_LDR:
+    }
+    bp_handler = stop_at_breakpoint;
+    for (int i = 0; i < watch_specs_count; ++i)
+    {
+        if (!parse_watch(watch_specs[i]))
         {
-            /* Load Register */
-            uint16_t r0 = (instr >> 9) & 0x7;
-            uint16_t r1 = (instr >> 6) & 0x7;
-            uint16_t offset = sign_extend(instr & 0x3F, 6);
-
-            // reg[r0] = memory[reg[r1] + offset];
-            reg[r0] = mem_read(reg[r1] + offset);
-            update_flags(r0);
+            printf("bad watchpoint: %s\n", watch_specs[i]);
+            exit(2);
         }
-        break;
+    }
+    watch_handler = stop_at_watchpoint;
 
-        case OP_STR:
+    if (random_programs)
+    {
+        /* Generated programs get an empty keyboard, and their output is noise */
+        if (!freopen("/dev/null", "r", stdin) || !freopen("/dev/null", "w", stdout))
         {
-            /* Store Register */
-            uint16_t r0 = (instr >> 9) & 0x7;
-            uint16_t r1 = (instr >> 6) & 0x7;
-            uint16_t offset = sign_extend(instr & 0x3F, 6);
-
-            // memory[reg[r1] + offset] = reg[r0];
-            mem_write(reg[r1] + offset, reg[r0]);
+            fprintf(stderr, "failed to open /dev/null\n");
+            exit(1);
         }
-        break;
-
-        case OP_RTI:
-            /* Return from Interrupt */
-            /* Unused in basic implementation */
-            printf("RTI instruction not implemented\n");
-            break;
-
-        case OP_NOT:
+        check_init();
+        int agreed = check_random(random_programs, random_seed);
+        if (stats)
         {
-            /* Bitwise NOT */
-            /**
-             * Perform logical negation on each bit, forming the 1's complement of the given binary value
-             */
-            uint16_t dr = (instr >> 9) & 0x7;
-            uint16_t sr = (instr >> 6) & 0x7;
-
-            reg[dr] = ~reg[sr]; // Bitwise NOT
-            update_flags(dr);
+            fprintf(stderr, "check: %llu programs, %llu blocks, %llu stores compared\n",
+                    (unsigned long long)check_stats.programs, (unsigned long long)check_stats.blocks,
+                    (unsigned long long)check_stats.stores);
+            fprintf(stderr, "traces: %llu compiled, %llu aborted, %llu entries\n",
+                    (unsigned long long)trace_stats.compiled, (unsigned long long)trace_stats.aborted,
+                    (unsigned long long)trace_stats.entries);
         }
-        break;
-
-        case OP_LDI:
-        {
-            /* Load indirect*/
-            /**
-             * Load a value from a location in memory into a register
-             * Store a register value into memory
-             *  15     12 | 11    9 | 8                  0
-                [  1010   |  DR    |   PCoffset9         ]
-             * An address is computed by sign-extending bits [8:0] to 16 bits and adding this value to the incremented PC. What is stored in memory at this address is the address of the data to be loaded into DR
-             */
-            /* destination register (DR) */
-            uint16_t dr = (instr >> 9) & 0x7;
-            /* PCoffset 9 */
-            uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+        return agreed ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-            /* add pc_offset to the current PC, look at that memory location to get the final address */
-            // uint16_t addr = memory[reg[R_PC] + pc_offset];
-            // reg[dr] = memory[addr];
-            reg[dr] = mem_read(mem_read(reg[R_PC] + pc_offset));
-            update_flags(dr);
-        }
-        break;
+    /* Setup, to properly handle input to the terminal, we need to adjust some buffering settings. */
+    signal(SIGINT, handle_interrupt);
+    disable_input_buffering();
 
-        case OP_STI:
-        {
-            /* Store Indirect */
-            uint16_t sr = (instr >> 9) & 0x7;
-            uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+    /* MAIN VM EXECUTION PROCEDURE */
+    /* Since exactly one condition flag should be set at any given time, set the Z flag */
+    reg[R_COND] = FL_ZRO;
 
-            /* Get the address */
-            // uint16_t addr = memory[reg[R_PC] + pc_offset];
-            /* Store the value at that address */
-            // memory[addr] = reg[sr];
-            mem_write(mem_read(reg[R_PC] + pc_offset), reg[sr]);
-        }
-        break;
+    /* set the PC to starting position (PC_START, see main.h) */
+    reg[R_PC] = PC_START;
 
-        case OP_JMP:
+    /* A debugger stops the guest through the handler table, which traces bypass */
+    if (gdb_socket)
+    {
+        trace_tier = 0;
+        if (!gdb_open(gdb_socket))
         {
-            /* Jump */
-            /* Also handles RET */
-            uint16_t r1 = (instr >> 6) & 0x7;
-            reg[R_PC] = reg[r1];
+            restore_input_buffering();
+            printf("failed to listen for gdb on %s\n", gdb_socket);
+            exit(1);
         }
-        break;
-
-        case OP_RES:
-            /* Reserved */
-            printf("Reserved opcode encountered\n");
-            break;
+    }
 
-        case OP_LEA:
+    /* Traces run outside interpret(), so their instructions would go unrecorded */
+    if (trace_file)
+    {
+        trace_tier = 0;
+        if (!itrace_open(trace_file))
         {
-            /* Load Effective Address */
-            uint16_t dr = (instr >> 9) & 0x7;
-            uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-
-            reg[dr] = reg[R_PC] + pc_offset;
-            update_flags(dr);
+            restore_input_buffering();
+            printf("failed to create trace file: %s\n", trace_file);
+            exit(1);
         }
-        break;
-
-        case OP_TRAP:
-            /* Trap / System Call */
-            /**
-             * The LC-3 provides a few predefined routines for performing common tasks and interacting with I/O devices. For example, there are routines for getting input from the keyboard and for displaying strings to the console. These are called trap routines which you can think of as the operating system or API for the LC-3. Each trap routine is assigned a trap code which identifies it (similar to an opcode). To execute one, the TRAP instruction is called with the trap code of the desired routine.
-             */
-            /*
-             * The trap will eventually return control back to where it was called from. So we store the current PC into register R7, which LC-3 uses as the return address register. This is similar to how real CPUs use a link register or stack to remember return points.
-             */
-            reg[R_R7] = reg[R_PC];
-
-            /* Get trap vector */
-            uint16_t trapvect = instr & 0xFF; // Extract lower 8 bits of the instruction
-
-            switch (trapvect)
-            {
-            case TRAP_GETC:
-                /* GETC: Read a character from keyboard */
-                /* read a single ASCII char */
-                reg[R_R0] = (uint16_t)getchar();
-                update_flags(R_R0);
-                break;
-
-            case TRAP_OUT:
-                /* OUT: Output a character */
-                putc((char)reg[R_R0], stdout);
-                fflush(stdout);
-                break;
-
-            case TRAP_PUTS:
-            {
-                /* PUTS: output a null-terminated string to the screen (similar to 'printf' in C) */
-                /**
-                 *  15    12 | 11-8  |  7      0
-                    [ 1111  | xxxx  | trapvect8 ]
-
-                 * Write a string of ASCII characters to the console display. The characters are contained in consecutive memory locations, one character per memory location, starting with the address specified in R0. Writing terminates with the occurrence of x0000 in a memory location. (Pg. 543)
-                 * To display a string, we must give the trap routine a string to display. This is done by storing the address of the first character in R0 before beginning the trap.
-                 */
-                /**
-                 * Notice that unlike C strings, characters are not stored in a single byte, but in a single memory location. Memory locations in LC-3 are 16 bits, so each character in the string is 16 bits wide. To display this with a C function, we will need to convert each value to a char and output them individually.
-                 */
-
-                // Get pointer to string in memory (R0 holds starting address)
-                uint16_t *str_ptr;
-                str_ptr = &memory[reg[R_R0]]; // point to the address of the value stored in memory's reg[R_R0] index
-                char c;
-
-                // Loop through each character until null terminator (x0000)
-                while (*str_ptr != 0)
-                {
-                    c = (char)(*str_ptr); // Cast 16-bit word to char
-                    putc(c, stdout);      // Print character to console
-                    str_ptr++;            // Move to next character in string
-                }
-                fflush(stdout); // Make sure it prints immediately
-            }
-            break;
-
-            case TRAP_IN:
-            {
-                /* IN: Input a character with echo */
-                printf("Enter a character: ");
-                char character = getchar();
-                putc(character, stdout);
-                fflush(stdout);
-                reg[R_R0] = (uint16_t)character;
-                update_flags(R_R0);
-            }
-            break;
+    }
 
-            case TRAP_PUTSP:
-            {
-                /* PUTSP: Output a byte string contained in a memory location (which is 16 bits or 2 bytes)*/
-                /*
-                 * sys call
-                 * Same as PUTS except that it outputs null terminated strings with two ASCII chars packed into a single memory location, with low 8 bits outputted frist then the high 8 bits
-                 * The “SP” means "String Packed”.
-                 * Each 16-bit memory word contains two characters, packed like this:
-                 * Low byte (bits 7–0) = first character
-                 * High byte (bits 15–8) = second character
-                 * This format saves space: instead of one character per word (like PUTS), you get two characters per word
-                 * Note: LC-3 is little-endian, so the lower byte comes first when printing.
-                 * one char per byte (two bytes per word) here we need to swap back to big endian format
-                 */
-                /* First, we need to get the address to the memory (uint_16) word stored in the R_R0 register */
-                uint16_t *c = memory + reg[R_R0];
-                while (*c)
-                {
-                    char char1 = (*c) & 0xFF;
-                    putc(char1, stdout);
-                    char char2 = (*c) >> 8;
-                    if (char2)
-                        putc(char2, stdout);
-                    ++c;
-                }
-                fflush(stdout);
-            }
-            break;
-
-            case TRAP_HALT:
-                /* HALT: Halt program execution */
-                puts("HALT");
-                fflush(stdout);
-                running = 0;
-                break;
-            }
-            break;
+    running = 1;
+    if (reverse)
+    {
+        replay_init();
+    }
+    if (check)
+    {
+        check_init();
+    }
+    printf("VM initialized and ready. Hit Ctrl+C to exit.\n");
 
-        default:
-            abort(); // Terminate or exit the program by raising the 'SIGABRT' signal. The 'SIGABRT' signal is one of the signals used in operating systems to indicate an abnormal termination of a program
-            break;
+    /* CPU EXECUTION CYCLE */
+    if (cover_enabled)
+    {
+        cover_start(reg[R_PC]);
+    }
+    interpret();
+    itrace_close();
+    gdb_close();
+    disk_close();
+    bank_close();
+    mailbox_close();
+    if (cover_enabled)
+    {
+        cover_stop();
+        if (!cover_write_lcov(cover_file, argv + first_image, argc - first_image))
+        {
+            fprintf(stderr, "failed to write coverage to %s\n", cover_file);
         }
     }
 
@@ -660,6 +602,58 @@ int main(int argc, const char *argv[])
 
     printf("\nVM Halted. Exiting.\n"); // More descriptive exit message
 
-    /* Return successful exit status */
-    return EXIT_SUCCESS;
+    if (stats)
+    {
+        fprintf(stderr, "instructions: %llu\n", (unsigned long long)instr_count);
+        fprintf(stderr, "traces: %llu compiled (%llu native), %llu aborted, %llu entries, %llu exits, %llu invalidated\n",
+                (unsigned long long)trace_stats.compiled, (unsigned long long)trace_stats.native,
+                (unsigned long long)trace_stats.aborted,
+                (unsigned long long)trace_stats.entries, (unsigned long long)trace_stats.exits,
+                (unsigned long long)trace_stats.invalidations);
+        fprintf(stderr, "code writes: %llu, %llu translations invalidated\n",
+                (unsigned long long)code_stats.writes, (unsigned long long)code_stats.invalidations);
+        if (trace_file)
+        {
+            fprintf(stderr, "trace: %llu records, %llu bytes encoded, %llu written, %llu ring stalls\n",
+                    (unsigned long long)itrace_stats.records, (unsigned long long)itrace_stats.raw,
+                    (unsigned long long)itrace_stats.stored, (unsigned long long)itrace_stats.stalls);
+        }
+        if (reverse)
+        {
+            fprintf(stderr, "reverse: %llu snapshots (%llu pages copied), %llu input events, %llu trips back, %llu instructions replayed\n",
+                    (unsigned long long)replay_stats.snapshots, (unsigned long long)replay_stats.pages,
+                    (unsigned long long)replay_stats.events, (unsigned long long)replay_stats.travels,
+                    (unsigned long long)replay_stats.replayed);
+        }
+        if (cover_enabled)
+        {
+            fprintf(stderr, "coverage: %u edges\n", cover_edges());
+        }
+        if (check_enabled)
+        {
+            fprintf(stderr, "check: %llu blocks, %llu stores compared\n", (unsigned long long)check_stats.blocks,
+                    (unsigned long long)check_stats.stores);
+        }
+        if (disk_file)
+        {
+            fprintf(stderr, "disk: %llu sectors read, %llu written, %llu commands refused\n",
+                    (unsigned long long)disk_stats.reads, (unsigned long long)disk_stats.writes,
+                    (unsigned long long)disk_stats.refused);
+        }
+        if (bank_count)
+        {
+            fprintf(stderr, "banks: %llu switches, %llu selections ignored\n",
+                    (unsigned long long)bank_stats.switches, (unsigned long long)bank_stats.ignored);
+        }
+        if (mailbox_name)
+        {
+            fprintf(stderr, "mailbox: %llu messages (%llu words) received, %llu (%llu words) sent, %llu commands refused\n",
+                    (unsigned long long)mailbox_stats.received, (unsigned long long)mailbox_stats.words_in,
+                    (unsigned long long)mailbox_stats.sent, (unsigned long long)mailbox_stats.words_out,
+                    (unsigned long long)mailbox_stats.refused);
+        }
+    }
+
+    /* Return successful exit status, or failure if the engines diverged */
+    return check_failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -11,7 +11,9 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <signal.h>
+#ifdef _WIN32
 /* windows only */
 #include <Windows.h>
 // _kbhit
@@ -24,13 +26,20 @@ typedef unsigned char uint8_t;       // 8-bit unsigned integer
 typedef unsigned short uint16_t;     // 16-bit unsigned integer, i.e., 1010 0000 1111 0000
 typedef unsigned int uint32_t;       // 32-bit unsigned integer
 typedef unsigned long long uint64_t; // 64-bit unsigned integer
+#else
+/* unix only: termios for raw console input, select for polling stdin */
+#include <unistd.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/select.h>
+#endif
 
 /**
  * MEMORY_MAX becomes 65536, which is the total number of memory locations the LC-3 (addressable range)
  * can address (from 0x0000 to 0xFFFF).
  */
 #define MEMORY_MAX (1 << 16) // "shift the number 1 to the left by 16 bits." = 10000000000000000 (17 bits) or 1 * 2^16 = 65536
-uint16_t memory[MEMORY_MAX]; /* 65536 unique addressable locations, each 16 bits wide */
+extern uint16_t memory[MEMORY_MAX]; /* 65536 unique addressable locations, each 16 bits wide */
 
 /* CPU Registers */
 enum
@@ -48,7 +57,10 @@ enum
     R_COUNT   /* Total number of registers (not an actual register) */
 };
 
-uint16_t reg[R_COUNT]; /* Array that stores the current values of all CPU registers */
+extern uint16_t reg[R_COUNT]; /* Array that stores the current values of all CPU registers */
+
+extern uint64_t instr_count; /* Number of instructions retired since the VM started */
+extern int running;          /* Non-zero while the VM is executing instructions */
 
 /* CPU Architecture (LC-3) Opcodes */
 /* Instructions are 16 bits long, with the left 4 bits storing the opcode... the rest of the 12 bits are used to store params */
@@ -93,6 +105,14 @@ enum
     TRAP_HALT = 0x25   /* halt the program */
 };
 
+/* set the PC to starting position */
+/* 0x3000 is the default address */
+/* Programs start at address 0x3000 instead of 0x0, because the lower addresses are left empty to leave space for the trap routine code. */
+enum
+{
+    PC_START = 0x3000 // Address 0011000000000000 in binary (16-bit), 12288 in decimal. This is the index position on the memory array
+};
+
 /* Memory mapped registers */
 /**
  * These are special registers that are not accessible from the normal register table.ABC
@@ -100,10 +120,33 @@ enum
  */
 enum
 {
-    MR_KBSR = 0xFE00, /* keyboard status */
-    MR_KBDR = 0xFE02  /* keyboard data */
+    MR_KBSR = 0xFE00,         /* keyboard status */
+    MR_KBDR = 0xFE02,         /* keyboard data */
+    MR_DSR = 0xFE04,          /* display status, used by the trap routines of an OS image */
+    MR_DDR = 0xFE06,          /* display data */
+    MR_DISK_SECTOR = 0xFE10,  /* block device (disk.h): sector to transfer */
+    MR_DISK_ADDR = 0xFE12,    /* block device: guest address of the sector buffer */
+    MR_DISK_CMD = 0xFE14,     /* block device: storing a command runs it */
+    MR_DISK_STATUS = 0xFE16,  /* block device: ready and error bits */
+    MR_DISK_SIZE = 0xFE18,    /* block device: sectors on the disk */
+    MR_BANK = 0xFE20,         /* extended memory (bank.h): bank mapped at x8000-xBFFF */
+    MR_BANK_COUNT = 0xFE22,   /* extended memory: number of banks */
+    MR_MBOX_STATUS = 0xFE30,  /* mailbox (mailbox.h): ready, full and error bits */
+    MR_MBOX_IN_LEN = 0xFE32,  /* mailbox: words in the inbox message */
+    MR_MBOX_OUT_LEN = 0xFE34, /* mailbox: words of the outbox message to post */
+    MR_MBOX_CMD = 0xFE36,     /* mailbox: the doorbell, storing a command runs it */
+    MR_MCR = 0xFFFE           /* machine control, clearing bit 15 halts the machine */
 };
 
+/* Idle detection */
+/**
+ * A guest that waits for input usually spins on KBSR, i.e. "LDI R0, KBSR; BRzp" with perhaps a counter
+ * increment in the loop. Instead of calling check_key() millions of times, such a loop is parked on the
+ * input handle until a key arrives and the skipped iterations are fast-forwarded.
+ */
+#define IDLE_LOOP_MAX 8  /* longest polling loop body (in instructions) that is recognized */
+#define IDLE_INSTR_NS 10 /* nominal guest time per instruction, used to fast-forward skipped spins */
+
 /**
  * Function declarations/prototype
  */
@@ -112,12 +155,19 @@ uint16_t mem_read(uint16_t address);
 void disable_input_buffering();
 void restore_input_buffering();
 uint16_t check_key();
+void wait_for_key();
+uint64_t host_time_ns();
+void console_putc(char c);
+void console_puts(const char *s);
+int idle_park();
 void handle_interrupt();
 uint16_t sign_extend(uint16_t x, int bit_count);
 uint16_t swap16(uint16_t x);
 void read_image_file(FILE *file);
 int read_image(const char *image_path);
 void update_flags(uint16_t r);
+void execute(uint16_t instr);
+void interpret(void);
 
 int main(int argc, const char *argv[]); /* Main function that serves as the entry point for the VM */
 
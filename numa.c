@@ -0,0 +1,150 @@
+/**
+ * numa.c - NUMA topology and placement (see numa.h)
+ */
+#include "numa.h"
+#include <string.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#define MPOL_PREFERRED 1 /* from linux/mempolicy.h: allocate on the node, fall back to others */
+
+/**
+ * parse_cpulist - Mark the CPUs of a sysfs list such as "0-3,8-11" in cpus
+ *
+ * Returns:
+ *   int: Number of CPUs marked
+ */
+static int parse_cpulist(const char *list, unsigned char *cpus)
+{
+    int count = 0;
+    while (*list)
+    {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+        if (end == list)
+        {
+            break;
+        }
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && cpu < NUMA_MAX_CPUS; ++cpu)
+        {
+            if (cpu >= 0 && !cpus[cpu])
+            {
+                cpus[cpu] = 1;
+                ++count;
+            }
+        }
+        list = *end == ',' ? end + 1 : end;
+        if (*list == '\n')
+        {
+            break;
+        }
+    }
+    return count;
+}
+
+/**
+ * numa_discover - List the nodes that have CPUs
+ *
+ * Parameters:
+ *   nodes: Filled with up to max nodes, in increasing node number
+ *   max: Capacity of nodes
+ *
+ * Returns:
+ *   int: Number of nodes, at least 1; a single node stands for the whole machine
+ *        when the topology cannot be read
+ */
+int numa_discover(struct numa_node *nodes, int max)
+{
+    int count = 0;
+#ifdef __linux__
+    for (int id = 0; id < NUMA_MAX_NODES && count < max; ++id)
+    {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+        FILE *file = fopen(path, "r");
+        if (file == NULL)
+        {
+            continue;
+        }
+        size_t n = fread(list, 1, sizeof(list) - 1, file);
+        fclose(file);
+        list[n] = '\0';
+
+        struct numa_node *node = &nodes[count];
+        memset(node, 0, sizeof(*node));
+        node->id = id;
+        node->cpu_count = parse_cpulist(list, node->cpus);
+        if (node->cpu_count > 0)
+        {
+            ++count;
+        }
+    }
+#endif
+    if (count == 0 && max > 0)
+    {
+        /* Unknown topology: one node, and no CPU set to pin to */
+        memset(&nodes[0], 0, sizeof(nodes[0]));
+        nodes[0].id = -1;
+        count = 1;
+    }
+    return count;
+}
+
+/**
+ * numa_pin_thread - Restrict the calling thread to the CPUs of a node
+ *
+ * Returns:
+ *   int: 1 if the thread was pinned
+ */
+int numa_pin_thread(const struct numa_node *node)
+{
+#ifdef __linux__
+    if (node->cpu_count == 0)
+    {
+        return 0;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < NUMA_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (node->cpus[cpu])
+        {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)node;
+    return 0;
+#endif
+}
+
+/**
+ * numa_bind - Prefer a node for the pages of a range that are not faulted in yet
+ *
+ * Returns:
+ *   int: 1 if the policy was set
+ */
+int numa_bind(void *addr, size_t len, const struct numa_node *node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    if (node->id < 0 || node->id >= (int)(8 * sizeof(unsigned long)) - 1)
+    {
+        return 0;
+    }
+    unsigned long mask = 1UL << node->id;
+    return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, 8 * sizeof(mask), 0) == 0;
+#else
+    (void)addr;
+    (void)len;
+    (void)node;
+    return 0;
+#endif
+}
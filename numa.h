@@ -0,0 +1,31 @@
+/**
+ * numa.h - NUMA topology and placement for worker threads and their memory
+ *
+ * Reads the node layout from sysfs and uses plain system calls to keep a
+ * worker and the memory it allocates on one node, so no libnuma is needed.
+ * Where the information or the calls are unavailable (a single-node host, a
+ * kernel without NUMA, Windows) everything degrades to one node holding all
+ * CPUs and placement requests do nothing.
+ */
+#ifndef NUMA_H
+#define NUMA_H
+#include "main.h"
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS 1024
+
+struct numa_node
+{
+    int id;                            /* kernel node number */
+    int cpu_count;
+    unsigned char cpus[NUMA_MAX_CPUS]; /* non-zero for the CPUs of the node */
+};
+
+/**
+ * Function declarations/prototype
+ */
+int numa_discover(struct numa_node *nodes, int max);
+int numa_pin_thread(const struct numa_node *node);
+int numa_bind(void *addr, size_t len, const struct numa_node *node);
+
+#endif /* NUMA_H */
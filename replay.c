@@ -0,0 +1,462 @@
+/**
+ * replay.c - Snapshots, the input log and travelling back (see replay.h)
+ */
+#include "replay.h"
+#include "codemap.h"
+#include "decode.h"
+#include "breakpoint.h"
+#include "fuzz.h"
+#include <string.h>
+
+#define PAGE_SIZE_WORDS (1 << PAGE_SHIFT)
+
+/* Kinds of input events */
+enum
+{
+    EVENT_KEY,  /* check_key: whether a key was ready */
+    EVENT_CHAR, /* getchar: the character */
+    EVENT_WAIT  /* idle_park: nanoseconds spent waiting for a key */
+};
+
+struct event
+{
+    uint8_t kind;
+    uint64_t value;
+};
+
+/* A copy of one page of memory, shared by the snapshots in which it did not change */
+struct page_copy
+{
+    uint32_t refs;
+    uint16_t words[PAGE_SIZE_WORDS];
+};
+
+struct snapshot
+{
+    uint64_t count; /* instr_count */
+    uint16_t reg[R_COUNT];
+    size_t log_pos; /* input events consumed */
+    struct page_copy *page[PAGE_COUNT];
+};
+
+int replay_enabled;
+int replaying;
+uint64_t replay_horizon;
+struct replay_stats replay_stats;
+
+static struct snapshot snapshots[REPLAY_SNAPSHOTS];
+static int snapshot_count;
+static uint64_t interval = REPLAY_INTERVAL;
+static uint64_t next_snapshot;
+
+static struct event *journal;
+static size_t log_len, log_cap;
+static size_t log_pos; /* next event to consume; the host is asked once it reaches log_len */
+
+static uint64_t hit_before; /* replay_hit only notes points before this count */
+static uint64_t hit_last;   /* the last point noted */
+static int hit_found;
+
+/**
+ * oom - Give up when the history cannot grow
+ */
+static void oom(void)
+{
+    printf("out of memory for the reverse execution history\n");
+    exit(1);
+}
+
+/**
+ * drop_page - Release a snapshot's reference to a page copy
+ */
+static void drop_page(struct page_copy *p)
+{
+    if (--p->refs == 0)
+    {
+        free(p);
+    }
+}
+
+/**
+ * drop_snapshot - Release the page copies of a snapshot
+ */
+static void drop_snapshot(struct snapshot *s)
+{
+    for (int i = 0; i < PAGE_COUNT; ++i)
+    {
+        drop_page(s->page[i]);
+    }
+}
+
+/**
+ * take_snapshot - Append a snapshot of the current state
+ *
+ * Pages equal to the previous snapshot's are shared with it; only the others
+ * (the pages dirtied since) are copied.
+ */
+static void take_snapshot(void)
+{
+    if (snapshot_count == REPLAY_SNAPSHOTS)
+    {
+        /* Thin out: keep the first and every second one after it */
+        int kept = 1;
+        for (int i = 1; i < snapshot_count; ++i)
+        {
+            if (i % 2 == 0)
+            {
+                snapshots[kept++] = snapshots[i];
+            }
+            else
+            {
+                drop_snapshot(&snapshots[i]);
+            }
+        }
+        snapshot_count = kept;
+        interval *= 2;
+    }
+
+    struct snapshot *s = &snapshots[snapshot_count];
+    const struct snapshot *prev = snapshot_count ? &snapshots[snapshot_count - 1] : NULL;
+    s->count = instr_count;
+    memcpy(s->reg, reg, sizeof(s->reg));
+    s->log_pos = log_pos;
+    for (int i = 0; i < PAGE_COUNT; ++i)
+    {
+        const uint16_t *words = memory + (i << PAGE_SHIFT);
+        if (prev && memcmp(prev->page[i]->words, words, sizeof(prev->page[i]->words)) == 0)
+        {
+            s->page[i] = prev->page[i];
+            ++s->page[i]->refs;
+            continue;
+        }
+        s->page[i] = malloc(sizeof(struct page_copy));
+        if (s->page[i] == NULL)
+        {
+            oom();
+        }
+        s->page[i]->refs = 1;
+        memcpy(s->page[i]->words, words, sizeof(s->page[i]->words));
+        ++replay_stats.pages;
+    }
+    ++snapshot_count;
+    ++replay_stats.snapshots;
+    next_snapshot = instr_count + interval;
+}
+
+/**
+ * restore - Put the machine back in the state of a snapshot
+ *
+ * Output of the instructions up to the point left is not written again.
+ */
+static void restore(const struct snapshot *s)
+{
+    if (instr_count > replay_horizon)
+    {
+        replay_horizon = instr_count;
+    }
+    for (int i = 0; i < PAGE_COUNT; ++i)
+    {
+        memcpy(memory + (i << PAGE_SHIFT), s->page[i]->words, sizeof(s->page[i]->words));
+    }
+    memcpy(reg, s->reg, sizeof(s->reg));
+    instr_count = s->count;
+    log_pos = s->log_pos;
+    running = 1;
+
+    /* Breakpoints follow the words under them, as after a store */
+    for (int i = 0; i < BP_MAX; ++i)
+    {
+        if (bp_at(breakpoints[i].address) == &breakpoints[i])
+        {
+            bp_write(breakpoints[i].address);
+        }
+    }
+}
+
+/**
+ * run_until - Re-execute until instr_count reaches target
+ *
+ * Returns:
+ *   uint64_t: The instruction count before the last instruction executed, which
+ *   differs from target - 1 when a parked idle loop advanced the count in one go
+ */
+static uint64_t run_until(uint64_t target)
+{
+    uint64_t start = instr_count;
+    uint64_t last = instr_count;
+    replaying = 1;
+    while (running && instr_count < target)
+    {
+        last = instr_count;
+        uint16_t instr = memory[reg[R_PC]++];
+        ++instr_count;
+        handler_table[instr](instr);
+    }
+    replaying = 0;
+    replay_stats.replayed += instr_count - start;
+    return last;
+}
+
+/**
+ * nearest - Index of the last snapshot taken at or before count
+ */
+static int nearest(uint64_t count)
+{
+    int i = snapshot_count - 1;
+    while (i > 0 && snapshots[i].count > count)
+    {
+        --i;
+    }
+    return i;
+}
+
+/**
+ * travel - Go to the state at instruction count target
+ *
+ * Lands on the last instruction boundary at or before target; inside the span
+ * of a parked idle loop, that is the load that parked it. Snapshots after the
+ * new point are dropped, as running on may take another path.
+ */
+static void travel(uint64_t target)
+{
+    int i = nearest(target);
+    restore(&snapshots[i]);
+    uint64_t before = run_until(target);
+    if (instr_count > target)
+    {
+        restore(&snapshots[i]);
+        run_until(before);
+    }
+
+    while (snapshot_count > 1 && snapshots[snapshot_count - 1].count > instr_count)
+    {
+        drop_snapshot(&snapshots[--snapshot_count]);
+    }
+    next_snapshot = snapshots[snapshot_count - 1].count + interval;
+    ++replay_stats.travels;
+}
+
+/**
+ * replay_init - Start recording: take the first snapshot, from which everything can be replayed
+ */
+void replay_init(void)
+{
+    if (!decode_ready)
+    {
+        decode_init();
+    }
+    replay_enabled = 1;
+    take_snapshot();
+}
+
+/**
+ * replay_interpret - The instruction cycle of interpret() while recording
+ */
+void replay_interpret(void)
+{
+    while (running)
+    {
+        if (instr_count >= next_snapshot)
+        {
+            take_snapshot();
+        }
+        uint16_t instr = memory[reg[R_PC]++];
+        ++instr_count;
+        handler_table[instr](instr);
+    }
+}
+
+/**
+ * replay_step_back - Go back one instruction
+ *
+ * Returns:
+ *   int: 1 if the machine moved, 0 if it is at the start of the history
+ */
+int replay_step_back(void)
+{
+    if (instr_count <= snapshots[0].count)
+    {
+        return 0;
+    }
+    travel(instr_count - 1);
+    return 1;
+}
+
+/**
+ * replay_hit - Note, while replaying, a point where the guest would have stopped
+ *
+ * Parameters:
+ *   count: Instruction count of the stop
+ */
+void replay_hit(uint64_t count)
+{
+    if (count < hit_before && (!hit_found || count > hit_last))
+    {
+        hit_last = count;
+        hit_found = 1;
+    }
+}
+
+/**
+ * replay_continue_back - Go back to the last point a breakpoint or watchpoint stopped the guest
+ *
+ * Returns:
+ *   int: 1 if there was one, 0 if the machine went back to the start of the history
+ */
+int replay_continue_back(void)
+{
+    uint64_t end = instr_count;
+    for (int i = nearest(end ? end - 1 : 0); i >= 0; --i)
+    {
+        if (snapshots[i].count >= end)
+        {
+            continue;
+        }
+        hit_before = end;
+        hit_found = 0;
+        restore(&snapshots[i]);
+        run_until(end);
+        if (hit_found)
+        {
+            travel(hit_last);
+            return 1;
+        }
+        end = snapshots[i].count;
+    }
+    travel(snapshots[0].count);
+    return 0;
+}
+
+/**
+ * next_event - Take the next logged event if it is of the expected kind
+ *
+ * After going back, the guest may run into its logged input in another order
+ * if the debugger changed its state; the rest of the log is then discarded.
+ *
+ * Returns:
+ *   int: 1 if value was taken from the log, 0 if the host must be asked
+ */
+static int next_event(uint8_t kind, uint64_t *value)
+{
+    if (log_pos < log_len)
+    {
+        if (journal[log_pos].kind == kind)
+        {
+            *value = journal[log_pos++].value;
+            return 1;
+        }
+        log_len = log_pos;
+    }
+    return 0;
+}
+
+/**
+ * log_event - Append an event taken from the host
+ */
+static void log_event(uint8_t kind, uint64_t value)
+{
+    if (log_len == log_cap)
+    {
+        log_cap = log_cap ? log_cap * 2 : 4096;
+        journal = realloc(journal, log_cap * sizeof(struct event));
+        if (journal == NULL)
+        {
+            oom();
+        }
+    }
+    journal[log_len].kind = kind;
+    journal[log_len++].value = value;
+    log_pos = log_len;
+    ++replay_stats.events;
+}
+
+/**
+ * replay_mark - Position in the input log, to come back to with replay_rewind
+ */
+size_t replay_mark(void)
+{
+    return log_pos;
+}
+
+/**
+ * replay_rewind - Have the input from a replay_mark position on read from the log again
+ */
+void replay_rewind(size_t mark)
+{
+    log_pos = mark;
+}
+
+/**
+ * replay_key - check_key, logged while recording
+ *
+ * This and the other host input functions take a fuzzing test case's input
+ * (fuzz.h) instead of the host's while one runs.
+ */
+uint16_t replay_key(void)
+{
+    uint64_t value;
+    if (fuzz_enabled)
+    {
+        return fuzz_key();
+    }
+    if (!replay_enabled)
+    {
+        return check_key();
+    }
+    if (!next_event(EVENT_KEY, &value))
+    {
+        value = check_key() != 0;
+        log_event(EVENT_KEY, value);
+    }
+    return (uint16_t)value;
+}
+
+/**
+ * replay_getchar - getchar, logged while recording
+ */
+uint16_t replay_getchar(void)
+{
+    uint64_t value;
+    if (fuzz_enabled)
+    {
+        return fuzz_getchar();
+    }
+    if (!replay_enabled)
+    {
+        return (uint16_t)getchar();
+    }
+    if (!next_event(EVENT_CHAR, &value))
+    {
+        value = (uint16_t)getchar();
+        log_event(EVENT_CHAR, value);
+    }
+    return (uint16_t)value;
+}
+
+/**
+ * replay_wait - Block until a key is available
+ *
+ * Returns:
+ *   uint64_t: Host nanoseconds spent waiting, logged while recording
+ */
+uint64_t replay_wait(void)
+{
+    uint64_t value;
+    if (fuzz_enabled)
+    {
+        /* A test case never waits: its input is all there, or it has ended */
+        return 0;
+    }
+    if (replay_enabled && next_event(EVENT_WAIT, &value))
+    {
+        return value;
+    }
+    uint64_t start = host_time_ns();
+    wait_for_key();
+    value = host_time_ns() - start;
+    if (replay_enabled)
+    {
+        log_event(EVENT_WAIT, value);
+    }
+    return value;
+}
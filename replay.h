@@ -0,0 +1,70 @@
+/**
+ * replay.h - Reverse execution from checkpoints and deterministic replay
+ *
+ * With --reverse the VM keeps a history it can travel back through:
+ *
+ *   - every REPLAY_INTERVAL instructions it takes a snapshot of reg[] and
+ *     instr_count, plus the pages of memory that differ from the previous
+ *     snapshot; unchanged pages are shared, so a snapshot of a program that
+ *     writes little costs little more than its registers,
+ *   - everything the guest reads from the host (whether a key is ready, the
+ *     characters themselves and how long an idle loop was parked) is appended
+ *     to an input log, and each snapshot remembers its position in the log.
+ *
+ * Going back to instruction count N restores the last snapshot at or before N
+ * and runs forward to N, taking input from the log instead of the host. Since
+ * snapshots are at most REPLAY_INTERVAL instructions apart, any point costs at
+ * most that much re-execution. Once REPLAY_SNAPSHOTS snapshots exist, every
+ * second one is dropped and the interval doubles, so the whole session stays
+ * reachable in bounded memory.
+ *
+ * Reverse-continue replays the segments before the current point, newest first,
+ * noting where breakpoints and watchpoints would have stopped the guest, and goes
+ * to the last such point. Console output is not repeated while the machine
+ * re-executes instructions it had already run, and after going back, running
+ * forward again consumes the rest of the log before asking the host for input.
+ *
+ * The recording loop checks one counter per instruction, so --reverse is
+ * opt-in. The gdb stub (gdb.h) exposes it as reverse-stepi and reverse-continue.
+ * The lockstep checker (check.h) uses only the input log, with replay_mark and
+ * replay_rewind, to give two runs of a block the same input.
+ */
+#ifndef REPLAY_H
+#define REPLAY_H
+#include "main.h"
+
+#define REPLAY_INTERVAL 1000000 /* instructions between snapshots, to start with */
+#define REPLAY_SNAPSHOTS 256    /* snapshots kept before thinning them out */
+
+/* Counters for --stats */
+struct replay_stats
+{
+    uint64_t snapshots; /* snapshots taken */
+    uint64_t pages;     /* page copies stored by them */
+    uint64_t events;    /* input events logged */
+    uint64_t travels;   /* trips back in time */
+    uint64_t replayed;  /* instructions re-executed to get there */
+};
+
+extern int replay_enabled;       /* set by replay_init */
+extern int replaying;            /* set while re-executing towards a point in the past */
+extern uint64_t replay_horizon;  /* furthest instruction count reached; output up to it was already written */
+extern struct replay_stats replay_stats;
+
+/**
+ * Function declarations/prototype
+ */
+void replay_init(void);
+void replay_interpret(void);
+int replay_step_back(void);
+int replay_continue_back(void);
+void replay_hit(uint64_t count);
+size_t replay_mark(void);
+void replay_rewind(size_t mark);
+
+/* Host input, logged and replayed */
+uint16_t replay_key(void);
+uint16_t replay_getchar(void);
+uint64_t replay_wait(void);
+
+#endif /* REPLAY_H */
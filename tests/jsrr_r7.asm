@@ -0,0 +1,12 @@
+; JSRR R7 writes R7 before it reads its base register, so it jumps to the
+; next instruction: the image prints "A" and halts. An engine that reads the
+; base first jumps to WRONG instead and halts without printing.
+        .ORIG x3000
+        LEA R7, WRONG
+        JSRR R7
+        LD R0, CHAR
+        OUT
+        HALT
+WRONG   HALT
+CHAR    .FILL x0041
+        .END
@@ -0,0 +1,93 @@
+; Reads keys up to ".", echoing each one, then prints a checksum of the keys
+; and their count in hex. The path taken depends on each key, so batch lanes
+; given different input split and meet again; between them, the main loop and
+; its subroutines use every opcode but RTI and the reserved one.
+        .ORIG x3000
+        LEA R6, STACKTOP     ; R6: stack pointer
+        AND R5, R5, #0       ; R5: checksum
+        ST R5, COUNT
+LOOP    GETC
+        OUT
+        LD R1, MINUSDOT
+        ADD R1, R0, R1
+        BRz DONE
+        JSR MIX
+        LDI R2, PCOUNT
+        ADD R2, R2, #1
+        STI R2, PCOUNT
+        AND R1, R0, #1       ; odd keys are also xored in
+        BRz LOOP
+        LEA R3, XOR
+        JSRR R3
+        BR LOOP
+DONE    LEA R0, SUMTEXT
+        PUTS
+        JSR HEX
+        LD R0, SPACE
+        OUT
+        LD R5, COUNT
+        JSR HEX
+        LD R0, NEWLINE
+        OUT
+        HALT
+
+; MIX: rotate the checksum left by one and add the key in R0
+MIX     ADD R5, R5, #0
+        BRn MIXCARRY
+        ADD R5, R5, R5
+        BR MIXADD
+MIXCARRY ADD R5, R5, R5
+        ADD R5, R5, #1
+MIXADD  ADD R5, R5, R0
+        RET
+
+; XOR: checksum = checksum xor key, from AND and NOT
+XOR     ADD R6, R6, #-1
+        STR R7, R6, #0
+        NOT R1, R5
+        AND R1, R1, R0
+        NOT R2, R0
+        AND R2, R2, R5
+        NOT R1, R1
+        NOT R2, R2
+        AND R1, R1, R2
+        NOT R5, R1
+        LDR R7, R6, #0
+        ADD R6, R6, #1
+        JMP R7
+
+; HEX: print R5 as four hex digits, shifting it out to the left
+HEX     ADD R6, R6, #-1
+        STR R7, R6, #0
+        AND R3, R3, #0
+        ADD R3, R3, #4
+HEXDIGIT AND R0, R0, #0
+        AND R4, R4, #0
+        ADD R4, R4, #4
+HEXBIT  ADD R0, R0, R0
+        ADD R5, R5, #0
+        BRzp HEXZERO
+        ADD R0, R0, #1
+HEXZERO ADD R5, R5, R5
+        ADD R4, R4, #-1
+        BRp HEXBIT
+        LEA R1, DIGITS
+        ADD R1, R1, R0
+        LDR R0, R1, #0
+        OUT
+        ADD R3, R3, #-1
+        BRp HEXDIGIT
+        LDR R7, R6, #0
+        ADD R6, R6, #1
+        RET
+
+MINUSDOT .FILL #-46
+SPACE   .FILL x0020
+NEWLINE .FILL x000A
+COUNT   .FILL 0
+PCOUNT  .FILL COUNT
+SUMTEXT .STRINGZ "\nsum "
+DIGITS  .STRINGZ "0123456789ABCDEF"
+STACK   .BLKW 4
+STACKTOP .FILL 0
+        .END
@@ -0,0 +1,785 @@
+/**
+ * trace.c - Recording, compiling and running traces of hot loops
+ *
+ * See trace.h for the overall design. A recording is a list of (pc, instruction,
+ * next pc) triples gathered while the interpreter executes one iteration of the
+ * loop; compile() turns it into trace_ops, and trace_run() executes those with the
+ * guest registers held in a struct trace_state, or hands that state to the host
+ * code a native backend generated for the trace.
+ */
+#include "trace.h"
+#include "trap.h"
+#include "codemap.h"
+#include "breakpoint.h"
+#include "watch.h"
+#include <string.h>
+
+/* One recorded step */
+struct rec
+{
+    uint16_t pc;    /* address of the instruction */
+    uint16_t instr; /* the instruction word */
+    uint16_t next;  /* PC after it executed */
+};
+
+int trace_tier;                       /* enabled by --hot-traces */
+uint64_t trace_iter_max = UINT64_MAX;
+struct trace_stats trace_stats;
+
+static struct trace *trace_at[MEMORY_MAX]; /* compiled trace for each loop head */
+static uint16_t hotness[MEMORY_MAX];       /* taken back edges since the last recording attempt */
+static uint8_t backoff[MEMORY_MAX];        /* failed recordings at each head */
+static struct trace *live;                 /* all traces in trace_at */
+static struct trace *graveyard;            /* invalidated traces, freed once none can be running */
+static int recording;                      /* set while an iteration is being recorded */
+
+/**
+ * flags_of - The condition codes update_flags would set for a value
+ */
+static inline uint16_t flags_of(uint16_t v)
+{
+    return v == 0 ? FL_ZRO : (v >> 15) ? FL_NEG : FL_POS;
+}
+
+/**
+ * off_trace - Check whether traces leave an access to address to the interpreter
+ *
+ * They do for the device page, and for watched pages, whose accesses must reach
+ * mem_read and mem_write.
+ */
+static inline int off_trace(uint16_t address)
+{
+    return address >= TRACE_MMIO || (page_flags[address >> PAGE_SHIFT] & PAGE_WATCH);
+}
+
+/**
+ * recordable - Check whether the instruction about to execute can be part of a trace
+ *
+ * Traces neither touch device registers (their reads have side effects and KBSR
+ * polling is left to idle_park) nor run guest trap routines or RTI/reserved opcodes,
+ * and they stop short of breakpoints, which only the handler table can hit.
+ * Dynamic addresses are checked against the current registers; the compiled trace
+ * guards them again on every use.
+ */
+static int recordable(uint16_t pc, uint16_t instr)
+{
+    uint16_t next = pc + 1;
+    uint16_t base = reg[(instr >> 6) & 0x7];
+
+    if (bp_at(pc))
+    {
+        return 0;
+    }
+    switch (instr >> 12)
+    {
+    case OP_LD:
+    case OP_ST:
+        return !off_trace(next + sign_extend(instr & 0x1FF, 9));
+    case OP_LDI:
+    case OP_STI:
+    {
+        uint16_t ptr = next + sign_extend(instr & 0x1FF, 9);
+        return !off_trace(ptr) && !off_trace(memory[ptr]);
+    }
+    case OP_LDR:
+    case OP_STR:
+        return !off_trace(base + sign_extend(instr & 0x3F, 6));
+    case OP_RTI:
+    case OP_RES:
+        return 0;
+    case OP_TRAP:
+        return (instr & 0xFF) != TRAP_HALT && trap_is_native(instr & 0xFF);
+    default:
+        return 1;
+    }
+}
+
+/**
+ * record - Execute one iteration of the loop at head, recording every step
+ *
+ * Returns:
+ *   int: Number of recorded instructions if control came back to head, 0 otherwise
+ */
+static int record(uint16_t head, struct rec *buf)
+{
+    int n = 0;
+    recording = 1;
+
+    while (running)
+    {
+        uint16_t pc = reg[R_PC];
+        if (n > 0 && pc == head)
+        {
+            break;
+        }
+        uint16_t instr = memory[pc];
+        if (n == TRACE_MAX || !recordable(pc, instr))
+        {
+            n = 0;
+            break;
+        }
+
+        reg[R_PC]++;
+        ++instr_count;
+        execute(instr);
+
+        buf[n].pc = pc;
+        buf[n].instr = instr;
+        buf[n].next = reg[R_PC];
+        ++n;
+    }
+    recording = 0;
+
+    if (!running)
+    {
+        return 0;
+    }
+    /* The loop may have rewritten its own code while it ran */
+    for (int i = 0; i < n; ++i)
+    {
+        if (memory[buf[i].pc] != buf[i].instr)
+        {
+            return 0;
+        }
+    }
+    return n;
+}
+
+/**
+ * hoist - Find or allocate the invariant slot for base + off
+ *
+ * Returns:
+ *   int: Slot index, or -1 if all slots are in use
+ */
+static int hoist(struct trace *t, uint8_t base, uint16_t off)
+{
+    for (int i = 0; i < t->inv_count; ++i)
+    {
+        if (t->inv_base[i] == base && t->inv_off[i] == off)
+        {
+            return i;
+        }
+    }
+    if (t->inv_count == TRACE_MAX_INV)
+    {
+        return -1;
+    }
+    t->inv_base[t->inv_count] = base;
+    t->inv_off[t->inv_count] = off;
+    return t->inv_count++;
+}
+
+/**
+ * compile - Turn a recorded iteration into trace ops
+ */
+static struct trace *compile(uint16_t head, const struct rec *rec, int n)
+{
+    struct trace *t = calloc(1, sizeof(struct trace));
+    t->head = head;
+    t->length = n;
+    t->lo = t->hi = head;
+
+    /* Registers the loop writes; everything else is invariant for the whole run */
+    uint8_t written = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        uint16_t instr = rec[i].instr;
+        switch (instr >> 12)
+        {
+        case OP_ADD:
+        case OP_AND:
+        case OP_NOT:
+        case OP_LD:
+        case OP_LDI:
+        case OP_LDR:
+        case OP_LEA:
+            written |= 1 << ((instr >> 9) & 0x7);
+            break;
+        case OP_JSR:
+            written |= 1 << R_R7;
+            break;
+        case OP_TRAP:
+            written = 0xFF; /* a handler may change any register */
+            break;
+        }
+    }
+
+    int8_t flag_reg = FLAG_COND;
+    for (int i = 0; i < n; ++i)
+    {
+        uint16_t pc = rec[i].pc, instr = rec[i].instr, next = rec[i].next;
+        uint16_t op = instr >> 12;
+        uint8_t dr = (instr >> 9) & 0x7;
+        uint8_t sr1 = (instr >> 6) & 0x7;
+        uint16_t pc_target = pc + 1 + sign_extend(instr & 0x1FF, 9);
+
+        t->pcs[i] = pc;
+        if (pc < t->lo)
+            t->lo = pc;
+        if (pc > t->hi)
+            t->hi = pc;
+
+        /* JSR/JSRR overwrite R7 without setting the condition codes: save them if R7 holds their source */
+        if (op == OP_JSR && flag_reg == R_R7)
+        {
+            struct trace_op *save = &t->ops[t->op_count++];
+            save->kind = T_SAVE_FLAGS;
+            save->flag_reg = flag_reg;
+            save->pc = pc;
+            save->retired = i;
+            flag_reg = FLAG_COND;
+        }
+
+        struct trace_op *o = &t->ops[t->op_count];
+        memset(o, 0, sizeof(*o));
+        o->pc = pc;
+        o->retired = i;
+        o->flag_reg = flag_reg;
+        o->dr = dr;
+        o->sr1 = sr1;
+        int emitted = 1, sets_flags = 0;
+
+        switch (op)
+        {
+        case OP_BR:
+            /* Never-taken, always-taken, and branches to the next word need no guard */
+            if (dr == 0 || dr == 0x7 || pc_target == (uint16_t)(pc + 1))
+            {
+                emitted = 0;
+                break;
+            }
+            o->kind = T_GUARD_BR;
+            o->sr1 = dr;
+            o->dr = next != (uint16_t)(pc + 1);
+            o->imm = o->dr ? pc + 1 : pc_target; /* where to go if the branch goes the other way */
+            break;
+
+        case OP_ADD:
+        case OP_AND:
+            if ((instr >> 5) & 0x1)
+            {
+                o->kind = op == OP_ADD ? T_ADDI : T_ANDI;
+                o->imm = sign_extend(instr & 0x1F, 5);
+            }
+            else
+            {
+                o->kind = op == OP_ADD ? T_ADD : T_AND;
+                o->sr2 = instr & 0x7;
+            }
+            sets_flags = 1;
+            break;
+
+        case OP_NOT:
+            o->kind = T_NOT;
+            sets_flags = 1;
+            break;
+
+        case OP_LEA:
+            o->kind = T_CONST;
+            o->imm = pc_target;
+            sets_flags = 1;
+            break;
+
+        case OP_LD:
+            o->kind = T_LD;
+            o->imm = pc_target;
+            sets_flags = 1;
+            break;
+
+        case OP_LDI:
+            o->kind = T_LDI;
+            o->imm = pc_target;
+            sets_flags = 1;
+            break;
+
+        case OP_ST:
+            o->kind = T_ST;
+            o->imm = pc_target;
+            o->sr2 = dr;
+            break;
+
+        case OP_STI:
+            o->kind = T_STI;
+            o->imm = pc_target;
+            o->sr2 = dr;
+            break;
+
+        case OP_LDR:
+        case OP_STR:
+        {
+            uint16_t off = sign_extend(instr & 0x3F, 6);
+            int slot = (written & (1 << sr1)) ? -1 : hoist(t, sr1, off);
+            if (slot >= 0)
+            {
+                o->kind = op == OP_LDR ? T_LDR_INV : T_STR_INV;
+                o->sr1 = slot;
+            }
+            else
+            {
+                o->kind = op == OP_LDR ? T_LDR : T_STR;
+                o->imm = off;
+            }
+            o->sr2 = dr;
+            sets_flags = op == OP_LDR;
+            break;
+        }
+
+        case OP_JSR:
+            if ((instr >> 11) & 1)
+            {
+                o->kind = T_LINK;
+                o->dr = R_R7;
+                o->imm = pc + 1;
+            }
+            else
+            {
+                o->kind = T_GUARD_JMP;
+                o->dr = 1;
+                o->imm = next;
+            }
+            break;
+
+        case OP_JMP:
+            o->kind = T_GUARD_JMP;
+            o->dr = 0;
+            o->imm = next;
+            break;
+
+        case OP_TRAP:
+            o->kind = T_TRAP;
+            o->imm = instr & 0xFF;
+            break;
+        }
+
+        if (emitted)
+        {
+            t->op_count++;
+        }
+        if (sets_flags)
+        {
+            flag_reg = dr;
+        }
+        else if (op == OP_TRAP)
+        {
+            flag_reg = FLAG_COND; /* reloaded from reg[R_COND] after the handler */
+        }
+    }
+
+    struct trace_op *loop = &t->ops[t->op_count++];
+    memset(loop, 0, sizeof(*loop));
+    loop->kind = T_LOOP;
+    loop->pc = head;
+    loop->retired = n;
+    loop->flag_reg = flag_reg;
+    return t;
+}
+
+/**
+ * trace_trap - Run the native trap of a T_TRAP op on the written-back state
+ *
+ * Returns:
+ *   int: 1 if the trace must not go on (halted, invalidated or redirected), 0 otherwise
+ */
+static int trace_trap(struct trace_state *s, const struct trace_op *op)
+{
+    struct trace *t = s->trace;
+
+    /* The handler works on reg[], so hand it the exact architectural state */
+    uint64_t done = s->iters * t->length + op->retired + 1;
+    memcpy(reg, s->r, sizeof(s->r));
+    reg[R_COND] = op->flag_reg == FLAG_COND ? s->cond : flags_of(s->r[op->flag_reg]);
+    reg[R_PC] = op->pc + 1;
+    instr_count += done - s->flushed;
+    s->flushed = done;
+
+    trap_execute(op->imm);
+
+    memcpy(s->r, reg, sizeof(s->r));
+    s->cond = reg[R_COND];
+    if (!running || t->dead || reg[R_PC] != (uint16_t)(op->pc + 1))
+    {
+        ++trace_stats.exits;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * trace_exit - Write the state of a trace back to the interpreter
+ *
+ * Parameters:
+ *   op: The op the trace left at; its flag_reg says where the condition codes are
+ *   pc: Address the interpreter continues at
+ *   retired: Guest instructions of the current iteration that completed
+ */
+static void trace_exit(const struct trace_state *s, const struct trace_op *op, uint16_t pc, uint16_t retired)
+{
+    memcpy(reg, s->r, sizeof(s->r));
+    reg[R_PC] = pc;
+    reg[R_COND] = op->flag_reg == FLAG_COND ? s->cond : flags_of(s->r[op->flag_reg]);
+    instr_count += s->iters * s->trace->length + retired - s->flushed;
+    ++trace_stats.exits;
+}
+
+/**
+ * trace_native_store - Store on behalf of native trace code
+ *
+ * Returns:
+ *   uint32_t: Non-zero if the store overwrote the running trace
+ */
+uint32_t trace_native_store(struct trace_state *s, uint32_t address, uint32_t value)
+{
+    mem_write(address, value);
+    return s->trace->dead;
+}
+
+/**
+ * trace_native_trap - Run the T_TRAP op at index on behalf of native trace code
+ *
+ * Returns:
+ *   uint32_t: Non-zero if the trap already ended the run
+ */
+uint32_t trace_native_trap(struct trace_state *s, uint32_t index)
+{
+    return trace_trap(s, &s->trace->ops[index]);
+}
+
+/**
+ * run_native - Execute the host code of a trace and decode how it left
+ */
+static void run_native(struct trace_state *s)
+{
+    uint32_t code = s->trace->native(s);
+    const struct trace_op *op = &s->trace->ops[code >> 2];
+
+    switch (code & 3)
+    {
+    case TRACE_EXIT_GUARD:
+        trace_exit(s, op, op->kind == T_GUARD_BR ? op->imm : s->r[op->sr1], op->retired + 1);
+        break;
+    case TRACE_EXIT_BEFORE:
+        trace_exit(s, op, op->pc, op->retired);
+        break;
+    case TRACE_EXIT_AFTER:
+        trace_exit(s, op, op->pc + 1, op->retired + 1);
+        break;
+    case TRACE_EXIT_DONE:
+        break;
+    }
+}
+
+/**
+ * trace_run - Execute a compiled trace until a guard fails, or for trace_iter_max iterations
+ *
+ * Returns:
+ *   int: 1 if the trace ran, 0 if a hoisted address points at devices and the interpreter must go on
+ */
+static int trace_run(struct trace *t)
+{
+    struct trace_state s;
+    uint16_t *r = s.r;
+    memcpy(r, reg, sizeof(s.r));
+
+    for (int i = 0; i < t->inv_count; ++i)
+    {
+        s.inv[i] = r[t->inv_base[i]] + t->inv_off[i];
+        if (off_trace(s.inv[i]))
+        {
+            return 0;
+        }
+    }
+
+    s.cond = reg[R_COND];
+    s.iters = s.flushed = 0;
+    s.memory = memory;
+    s.trace = t;
+    ++trace_stats.entries;
+
+    if (t->native && trace_iter_max == UINT64_MAX)
+    {
+        run_native(&s);
+        return 1;
+    }
+
+    const struct trace_op *op = t->ops;
+    for (;;)
+    {
+        switch (op->kind)
+        {
+        case T_ADD:
+            r[op->dr] = r[op->sr1] + r[op->sr2];
+            break;
+        case T_ADDI:
+            r[op->dr] = r[op->sr1] + op->imm;
+            break;
+        case T_AND:
+            r[op->dr] = r[op->sr1] & r[op->sr2];
+            break;
+        case T_ANDI:
+            r[op->dr] = r[op->sr1] & op->imm;
+            break;
+        case T_NOT:
+            r[op->dr] = ~r[op->sr1];
+            break;
+        case T_CONST:
+            r[op->dr] = op->imm;
+            break;
+        case T_LD:
+            r[op->dr] = memory[op->imm];
+            break;
+        case T_LDI:
+        {
+            uint16_t address = memory[op->imm];
+            if (off_trace(address))
+            {
+                goto exit_before;
+            }
+            r[op->dr] = memory[address];
+            break;
+        }
+        case T_LDR:
+        {
+            uint16_t address = r[op->sr1] + op->imm;
+            if (off_trace(address))
+            {
+                goto exit_before;
+            }
+            r[op->dr] = memory[address];
+            break;
+        }
+        case T_LDR_INV:
+            r[op->dr] = memory[s.inv[op->sr1]];
+            break;
+        case T_ST:
+            mem_write(op->imm, r[op->sr2]);
+            if (t->dead)
+            {
+                goto exit_after;
+            }
+            break;
+        case T_STI:
+        {
+            uint16_t address = memory[op->imm];
+            if (off_trace(address))
+            {
+                goto exit_before;
+            }
+            mem_write(address, r[op->sr2]);
+            if (t->dead)
+            {
+                goto exit_after;
+            }
+            break;
+        }
+        case T_STR:
+        {
+            uint16_t address = r[op->sr1] + op->imm;
+            if (off_trace(address))
+            {
+                goto exit_before;
+            }
+            mem_write(address, r[op->sr2]);
+            if (t->dead)
+            {
+                goto exit_after;
+            }
+            break;
+        }
+        case T_STR_INV:
+            mem_write(s.inv[op->sr1], r[op->sr2]);
+            if (t->dead)
+            {
+                goto exit_after;
+            }
+            break;
+        case T_LINK:
+            r[R_R7] = op->imm;
+            break;
+        case T_GUARD_BR:
+        {
+            uint16_t flags = op->flag_reg == FLAG_COND ? s.cond : flags_of(r[op->flag_reg]);
+            if (((flags & op->sr1) != 0) != op->dr)
+            {
+                trace_exit(&s, op, op->imm, op->retired + 1);
+                return 1;
+            }
+            break;
+        }
+        case T_GUARD_JMP:
+            if (op->dr)
+            {
+                r[R_R7] = op->pc + 1;
+            }
+            if (r[op->sr1] != op->imm)
+            {
+                trace_exit(&s, op, r[op->sr1], op->retired + 1);
+                return 1;
+            }
+            break;
+        case T_SAVE_FLAGS:
+            s.cond = flags_of(r[op->flag_reg]);
+            break;
+        case T_TRAP:
+            if (trace_trap(&s, op))
+            {
+                return 1;
+            }
+            break;
+        case T_LOOP:
+            if (op->flag_reg != FLAG_COND)
+            {
+                s.cond = flags_of(r[op->flag_reg]);
+            }
+            if (++s.iters == trace_iter_max)
+            {
+                trace_exit(&s, op, t->head, 0);
+                return 1;
+            }
+            op = t->ops;
+            continue;
+        }
+        ++op;
+    }
+
+exit_before: /* the instruction has not executed */
+    trace_exit(&s, op, op->pc, op->retired);
+    return 1;
+exit_after: /* the instruction executed, but it overwrote traced code */
+    trace_exit(&s, op, op->pc + 1, op->retired + 1);
+    return 1;
+}
+
+/**
+ * bury - Unlink a trace so it is never entered again
+ *
+ * The trace may be the one executing, so it is only freed later, by trace_backedge.
+ */
+static void bury(struct trace *t)
+{
+    t->dead = 1;
+    trace_at[t->head] = NULL;
+    for (int i = 0; i < t->length; ++i)
+    {
+        code_release(t->pcs[i]);
+    }
+    t->next = graveyard;
+    graveyard = t;
+}
+
+/**
+ * trace_backedge - Called by the interpreter after a taken backward branch
+ *
+ * Runs the trace for the loop head if there is one, otherwise counts the edge and
+ * records and compiles the loop once it is hot.
+ *
+ * Parameters:
+ *   head: Target of the branch, i.e. the new PC
+ */
+void trace_backedge(uint16_t head)
+{
+    if (recording)
+    {
+        return;
+    }
+    while (graveyard)
+    {
+        struct trace *t = graveyard;
+        graveyard = t->next;
+#ifdef TRACE_NATIVE
+        trace_native_free(t);
+#endif
+        free(t);
+    }
+
+    struct trace *t = trace_at[head];
+    if (t)
+    {
+        trace_run(t);
+        return;
+    }
+
+    if (++hotness[head] < (TRACE_HOT << backoff[head]))
+    {
+        return;
+    }
+    hotness[head] = 0;
+
+    static struct rec buf[TRACE_MAX];
+    int n = record(head, buf);
+    if (n == 0)
+    {
+        ++trace_stats.aborted;
+        if (backoff[head] < TRACE_BACKOFF)
+        {
+            ++backoff[head];
+        }
+        return;
+    }
+
+    t = compile(head, buf, n);
+#ifdef TRACE_NATIVE
+    /* Native code only keeps clear of the device page */
+    if (watch_count == 0 && trace_native_compile(t))
+    {
+        ++trace_stats.native;
+    }
+#endif
+    trace_at[head] = t;
+    t->next = live;
+    live = t;
+    for (int i = 0; i < t->length; ++i)
+    {
+        code_claim(t->pcs[i]);
+    }
+    ++trace_stats.compiled;
+}
+
+/**
+ * trace_flush - Discard every trace
+ */
+void trace_flush(void)
+{
+    while (live)
+    {
+        struct trace *t = live;
+        live = t->next;
+        bury(t);
+        ++trace_stats.invalidations;
+    }
+}
+
+/**
+ * trace_invalidate - Discard every trace built from the instruction at address
+ *
+ * Called from code_write for words the traces claimed.
+ *
+ * Returns:
+ *   int: Number of traces discarded
+ */
+int trace_invalidate(uint16_t address)
+{
+    int count = 0;
+    struct trace **link = &live;
+    while (*link)
+    {
+        struct trace *t = *link;
+        int hit = 0;
+        if (address >= t->lo && address <= t->hi)
+        {
+            for (int i = 0; i < t->length && !hit; ++i)
+            {
+                hit = t->pcs[i] == address;
+            }
+        }
+        if (!hit)
+        {
+            link = &t->next;
+            continue;
+        }
+        *link = t->next;
+        bury(t);
+        ++trace_stats.invalidations;
+        ++count;
+    }
+    return count;
+}
@@ -0,0 +1,163 @@
+/**
+ * trace.h - Trace-based optimizing tier for hot loops
+ *
+ * Taken backward branches (BR with a negative offset) are counted per target. Once
+ * a loop head is hot, the interpreter records the path one iteration actually takes,
+ * across as many basic blocks, calls and returns as it spans, until control comes
+ * back to the head. The recording is compiled into a linear trace:
+ *
+ *   - conditional branches and indirect jumps become guards that leave the trace
+ *     when the direction or target differs from the recorded one,
+ *   - condition codes are computed lazily from the register that last set them,
+ *     only where a guard or an exit reads them, so dead update_flags work disappears,
+ *   - PC-relative addresses are folded to constants, and LDR/STR addresses whose
+ *     base register the loop never writes are computed once on entry,
+ *   - guest registers live in locals for the whole run instead of in reg[].
+ *
+ * Guard exits write the state back and return to the interpreter at the right PC.
+ * Traces claim their instructions in the code map (codemap.h), so stores into
+ * traced code discard the affected traces.
+ *
+ * Traces run through a portable op loop, or as machine code on hosts that have a
+ * backend (AArch64 Linux, trace_a64.c).
+ */
+#ifndef TRACE_H
+#define TRACE_H
+#include "main.h"
+#include <stddef.h>
+
+#define TRACE_HOT 64      /* taken back edges before a loop head is recorded */
+#define TRACE_MAX 256     /* longest trace, in guest instructions */
+#define TRACE_MAX_INV 8   /* loop-invariant addresses hoisted per trace */
+#define TRACE_BACKOFF 8   /* after a failed recording, wait 2^n times longer, up to this n */
+
+/* Counters for --stats */
+struct trace_stats
+{
+    uint64_t compiled;      /* traces compiled */
+    uint64_t aborted;       /* recordings that did not close the loop */
+    uint64_t entries;       /* times a compiled trace was entered */
+    uint64_t exits;         /* guard exits back to the interpreter */
+    uint64_t invalidations; /* traces discarded because their code was overwritten */
+    uint64_t native;        /* traces also compiled to host code */
+};
+
+/* First address of the device page; the trace never touches it directly */
+#define TRACE_MMIO 0xFE00
+/* flag_reg value meaning "the condition codes are in the cond field of the run state" */
+#define FLAG_COND (-1)
+
+/* Trace operations */
+enum
+{
+    T_ADD,        /* r[dr] = r[sr1] + r[sr2] */
+    T_ADDI,       /* r[dr] = r[sr1] + imm */
+    T_AND,        /* r[dr] = r[sr1] & r[sr2] */
+    T_ANDI,       /* r[dr] = r[sr1] & imm */
+    T_NOT,        /* r[dr] = ~r[sr1] */
+    T_CONST,      /* r[dr] = imm (LEA with its address folded) */
+    T_LD,         /* r[dr] = memory[imm] */
+    T_LDI,        /* r[dr] = memory[memory[imm]] */
+    T_LDR,        /* r[dr] = memory[r[sr1] + imm] */
+    T_LDR_INV,    /* r[dr] = memory[inv[sr1]], a hoisted loop-invariant address */
+    T_ST,         /* memory[imm] = r[sr2] */
+    T_STI,        /* memory[memory[imm]] = r[sr2] */
+    T_STR,        /* memory[r[sr1] + imm] = r[sr2] */
+    T_STR_INV,    /* memory[inv[sr1]] = r[sr2] */
+    T_LINK,       /* r[R7] = imm, without touching the condition codes (JSR) */
+    T_GUARD_BR,   /* leave for imm unless the branch on mask sr1 goes the recorded way (dr = taken) */
+    T_GUARD_JMP,  /* link R7 if dr (JSRR), then leave for r[sr1] unless it equals imm */
+    T_SAVE_FLAGS, /* cond = condition codes of r[flag_reg], before that register is clobbered */
+    T_TRAP,       /* run native trap imm on the written-back state */
+    T_LOOP        /* end of the iteration: back to the first op */
+};
+
+/* One operation of a compiled trace */
+struct trace_op
+{
+    uint8_t kind;     /* T_* */
+    uint8_t dr;       /* destination register; branch direction for T_GUARD_BR, link flag for T_GUARD_JMP */
+    uint8_t sr1;      /* source or base register, invariant slot, or condition mask */
+    uint8_t sr2;      /* second source register, or the register a store writes */
+    int8_t flag_reg;  /* register the condition codes derive from before this op, or FLAG_COND */
+    uint16_t imm;     /* immediate, constant address, expected target or exit address */
+    uint16_t pc;      /* address of the guest instruction */
+    uint16_t retired; /* guest instructions of the iteration completed before this op */
+};
+
+struct trace_state;
+/* Entry point of a trace compiled to host code; returns a TRACE_EXIT_CODE */
+typedef uint32_t (*trace_native_fn)(struct trace_state *state);
+
+/* A compiled trace, anchored at its loop head */
+struct trace
+{
+    uint16_t head;                      /* loop head the trace starts and ends at */
+    uint16_t length;                    /* guest instructions per iteration */
+    uint16_t lo, hi;                    /* lowest and highest traced address */
+    int dead;                           /* set when the code under the trace was overwritten */
+    int op_count;                       /* valid entries in ops */
+    int inv_count;                      /* hoisted addresses */
+    uint8_t inv_base[TRACE_MAX_INV];    /* base register of each hoisted address */
+    uint16_t inv_off[TRACE_MAX_INV];    /* sign-extended offset of each hoisted address */
+    uint16_t pcs[TRACE_MAX];            /* the traced instructions, for invalidation */
+    struct trace *next;                 /* next live (or dead, in the graveyard) trace */
+    trace_native_fn native;             /* host code for the trace, or NULL to use the op loop */
+    void *code;                         /* mapping that holds the host code */
+    size_t code_size;                   /* size of that mapping in bytes, 0 if the code is in the code cache */
+    struct trace_op ops[2 * TRACE_MAX + 1];
+};
+
+/*
+ * Native backends. On hosts with a code generator, a trace is also compiled to
+ * machine code that works on a struct trace_state and returns an exit code: the
+ * index of the op it left at and how it left. trace.c then writes the state back
+ * exactly as the op loop would.
+ */
+#if !defined(TRACE_NATIVE) && defined(__aarch64__) && defined(__linux__)
+#define TRACE_NATIVE 1
+#endif
+
+/* How a native trace left, in the low two bits of its exit code */
+enum
+{
+    TRACE_EXIT_GUARD,  /* a guard failed: the branch or jump target differs */
+    TRACE_EXIT_BEFORE, /* the op's instruction did not execute (device address) */
+    TRACE_EXIT_AFTER,  /* the instruction executed, but it overwrote traced code */
+    TRACE_EXIT_DONE    /* a trap already wrote the state back */
+};
+#define TRACE_EXIT_CODE(index, how) ((uint32_t)(index) << 2 | (how))
+
+/* Guest state of a running trace, shared by the op loop and native code */
+struct trace_state
+{
+    uint16_t r[8];                /* guest registers */
+    uint16_t cond;                /* condition codes when no register holds their source */
+    uint16_t inv[TRACE_MAX_INV];  /* hoisted loop-invariant addresses */
+    uint64_t iters;               /* completed iterations */
+    uint64_t flushed;             /* instructions already added to instr_count */
+    uint16_t *memory;             /* guest memory, for native code */
+    struct trace *trace;          /* the trace being run */
+};
+
+extern int trace_tier;                   /* non-zero when the tier is enabled */
+extern uint64_t trace_iter_max;          /* iterations after which a run goes back to the interpreter at its head;
+                                            when set, native traces run on the op loop */
+extern struct trace_stats trace_stats;
+
+/**
+ * Function declarations/prototype
+ */
+void trace_backedge(uint16_t head);
+int trace_invalidate(uint16_t address);
+void trace_flush(void);
+
+/* Called from native trace code */
+uint32_t trace_native_store(struct trace_state *s, uint32_t address, uint32_t value);
+uint32_t trace_native_trap(struct trace_state *s, uint32_t index);
+
+/* Provided by the backend for the host (trace_a64.c) */
+int trace_native_compile(struct trace *t);
+void trace_native_free(struct trace *t);
+
+#endif /* TRACE_H */
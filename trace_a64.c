@@ -0,0 +1,472 @@
+/**
+ * trace_a64.c - AArch64 code generator for compiled traces
+ *
+ * Turns the ops of a struct trace into a host function that runs the loop with
+ * the guest registers in callee-saved registers:
+ *
+ *   w19-w26  guest R0-R7, always zero-extended 16-bit values
+ *   w27      cond, the condition codes when no register holds their source
+ *   x28      the struct trace_state being run
+ *   x9       base of guest memory, reloaded after every call
+ *   w10-w12  scratch
+ *
+ * The code is laid out as [common exit][entry: prologue][ops][loop branch], so every
+ * branch to the exit is backward and the loop branch target is known when it is
+ * emitted; nothing needs patching. Each exit loads its TRACE_EXIT_CODE into w0 and
+ * branches to the common exit, which stores the registers into the state and
+ * returns. Stores and traps call back into trace.c, so invalidation and trap
+ * handling are shared with the op loop.
+ *
+ * The code of all traces is packed into one code cache, an arena (see arena.h)
+ * backed by huge pages, so hot loops spread over many traces do not each cost
+ * an instruction TLB entry. Code of discarded traces is not reused; once the
+ * cache is full, further traces get a mapping of their own.
+ *
+ * Built only for AArch64 Linux (see TRACE_NATIVE in trace.h). To try it from an
+ * x86-64 box, cross-build with `make aarch64` and run the result under qemu-user.
+ */
+#include "trace.h"
+
+#ifdef TRACE_NATIVE
+#include "arena.h"
+#include <string.h>
+#include <sys/mman.h>
+
+#define A64_CODE_CACHE ((size_t)16 << 20) /* bytes reserved for generated code */
+
+static struct arena code_cache; /* generated code of the traces */
+static int code_cache_state;    /* 0 until first used, 1 when usable, -1 if it could not be reserved */
+
+/* Upper bound of instructions emitted for one op, exits included */
+#define A64_OP_WORDS 40
+/* Instructions outside the ops: common exit, prologue and loop branch */
+#define A64_FIXED_WORDS 64
+
+/* Host registers */
+enum
+{
+    X_ARG0 = 0,
+    X_ARG1 = 1,
+    X_ARG2 = 2,
+    X_MEM = 9,
+    X_T0 = 10,
+    X_T1 = 11,
+    X_T2 = 12,
+    X_CALL = 16,
+    X_GUEST = 19, /* guest R0; R1-R7 follow */
+    X_COND = 27,
+    X_STATE = 28,
+    X_FP = 29,
+    X_LR = 30,
+    X_ZR = 31, /* also SP, depending on the instruction */
+};
+
+/* Condition codes of B.cond and CSEL; cc ^ 1 is the inverse */
+enum
+{
+    CC_EQ = 0x0,
+    CC_NE = 0x1,
+    CC_GE = 0xA,
+    CC_LT = 0xB,
+    CC_GT = 0xC,
+    CC_LE = 0xD,
+};
+
+/* Code being emitted */
+struct a64
+{
+    uint32_t *code; /* start of the buffer */
+    int n;          /* instructions emitted */
+    int exit;       /* index of the common exit */
+};
+
+/**
+ * emit - Append one instruction word
+ */
+static void emit(struct a64 *a, uint32_t word)
+{
+    a->code[a->n++] = word;
+}
+
+/**
+ * guest - Host register that holds guest register r
+ */
+static uint32_t guest(int r)
+{
+    return X_GUEST + r;
+}
+
+/* Instruction encodings; w = 32-bit, x = 64-bit */
+static uint32_t movz_w(uint32_t rd, uint16_t imm) { return 0x52800000 | (uint32_t)imm << 5 | rd; }
+static uint32_t movz_x(uint32_t rd, uint16_t imm, int hw) { return 0xD2800000 | (uint32_t)hw << 21 | (uint32_t)imm << 5 | rd; }
+static uint32_t movk_x(uint32_t rd, uint16_t imm, int hw) { return 0xF2800000 | (uint32_t)hw << 21 | (uint32_t)imm << 5 | rd; }
+static uint32_t mov_w(uint32_t rd, uint32_t rm) { return 0x2A0003E0 | rm << 16 | rd; } /* ORR wd, wzr, wm */
+static uint32_t mov_x(uint32_t rd, uint32_t rm) { return 0xAA0003E0 | rm << 16 | rd; } /* ORR xd, xzr, xm */
+static uint32_t add_w(uint32_t rd, uint32_t rn, uint32_t rm) { return 0x0B000000 | rm << 16 | rn << 5 | rd; }
+static uint32_t addi_w(uint32_t rd, uint32_t rn, uint32_t imm) { return 0x11000000 | imm << 10 | rn << 5 | rd; }
+static uint32_t subi_w(uint32_t rd, uint32_t rn, uint32_t imm) { return 0x51000000 | imm << 10 | rn << 5 | rd; }
+static uint32_t addi_x(uint32_t rd, uint32_t rn, uint32_t imm) { return 0x91000000 | imm << 10 | rn << 5 | rd; }
+static uint32_t and_w(uint32_t rd, uint32_t rn, uint32_t rm) { return 0x0A000000 | rm << 16 | rn << 5 | rd; }
+static uint32_t tst_w(uint32_t rn, uint32_t rm) { return 0x6A000000 | rm << 16 | rn << 5 | X_ZR; } /* ANDS wzr */
+static uint32_t mvn_w(uint32_t rd, uint32_t rm) { return 0x2A2003E0 | rm << 16 | rd; } /* ORN wd, wzr, wm */
+static uint32_t uxth_w(uint32_t rd, uint32_t rn) { return 0x53003C00 | rn << 5 | rd; }
+static uint32_t sxth_w(uint32_t rd, uint32_t rn) { return 0x13003C00 | rn << 5 | rd; }
+static uint32_t lsr9_w(uint32_t rd, uint32_t rn) { return 0x53097C00 | rn << 5 | rd; }  /* UBFM wd, wn, #9, #31 */
+static uint32_t cmpi_w(uint32_t rn, uint32_t imm) { return 0x7100001F | imm << 10 | rn << 5; }
+static uint32_t cmp_w(uint32_t rn, uint32_t rm) { return 0x6B00001F | rm << 16 | rn << 5; }
+static uint32_t csel_w(uint32_t rd, uint32_t rn, uint32_t rm, int cc) { return 0x1A800000 | rm << 16 | (uint32_t)cc << 12 | rn << 5 | rd; }
+static uint32_t ldrh_imm(uint32_t rt, uint32_t rn, size_t off) { return 0x79400000 | (uint32_t)(off / 2) << 10 | rn << 5 | rt; }
+static uint32_t strh_imm(uint32_t rt, uint32_t rn, size_t off) { return 0x79000000 | (uint32_t)(off / 2) << 10 | rn << 5 | rt; }
+static uint32_t ldrh_idx(uint32_t rt, uint32_t rn, uint32_t rm) { return 0x78605800 | rm << 16 | rn << 5 | rt; } /* [xn, wm, uxtw #1] */
+static uint32_t ldr_x(uint32_t rt, uint32_t rn, size_t off) { return 0xF9400000 | (uint32_t)(off / 8) << 10 | rn << 5 | rt; }
+static uint32_t str_x(uint32_t rt, uint32_t rn, size_t off) { return 0xF9000000 | (uint32_t)(off / 8) << 10 | rn << 5 | rt; }
+static uint32_t stp_x(uint32_t rt, uint32_t rt2, int off) { return 0xA9000000 | (uint32_t)((off / 8) & 0x7F) << 15 | rt2 << 10 | X_ZR << 5 | rt; }
+static uint32_t ldp_x(uint32_t rt, uint32_t rt2, int off) { return 0xA9400000 | (uint32_t)((off / 8) & 0x7F) << 15 | rt2 << 10 | X_ZR << 5 | rt; }
+
+/* Stack frame: x29/x30 and the ten callee-saved registers the trace uses */
+#define A64_FRAME 96
+#define STP_FP_LR_PRE 0xA9BA7BFD  /* stp x29, x30, [sp, #-96]! */
+#define LDP_FP_LR_POST 0xA8C67BFD /* ldp x29, x30, [sp], #96 */
+#define MOV_FP_SP 0x910003FD      /* mov x29, sp */
+#define BLR_CALL 0xD63F0200       /* blr x16 */
+#define RET 0xD65F03C0
+
+/**
+ * branch - B to instruction index target
+ */
+static void branch(struct a64 *a, int target)
+{
+    emit(a, 0x14000000 | ((uint32_t)(target - a->n) & 0x3FFFFFF));
+}
+
+/**
+ * exit_if - Leave the trace with code when condition cc holds
+ *
+ * Emits b.!cc over "mov w0, #code; b exit".
+ */
+static void exit_if(struct a64 *a, int cc, uint32_t code)
+{
+    emit(a, 0x54000000 | 3 << 5 | (uint32_t)(cc ^ 1));
+    emit(a, movz_w(X_ARG0, code));
+    branch(a, a->exit);
+}
+
+/**
+ * exit_if_nonzero - Leave the trace with code when w0 is non-zero
+ */
+static void exit_if_nonzero(struct a64 *a, uint32_t code)
+{
+    emit(a, 0x34000000 | 3 << 5 | X_ARG0); /* cbz w0, over the exit */
+    emit(a, movz_w(X_ARG0, code));
+    branch(a, a->exit);
+}
+
+/**
+ * exit_if_device - Leave before the op if the address in rn is in the device page
+ */
+static void exit_if_device(struct a64 *a, uint32_t rn, uint32_t code)
+{
+    emit(a, lsr9_w(X_T1, rn));
+    emit(a, cmpi_w(X_T1, TRACE_MMIO >> 9));
+    exit_if(a, CC_EQ, code);
+}
+
+/**
+ * add_imm - rd = (rn + imm) & 0xFFFF for a sign-extended 16-bit immediate of at most 12 bits
+ */
+static void add_imm(struct a64 *a, uint32_t rd, uint32_t rn, uint16_t imm)
+{
+    if (imm & 0x8000)
+        emit(a, subi_w(rd, rn, (uint16_t)-imm));
+    else
+        emit(a, addi_w(rd, rn, imm));
+    emit(a, uxth_w(rd, rd));
+}
+
+/**
+ * flags_into - rd = condition codes of the value in rn, as flags_of would compute
+ */
+static void flags_into(struct a64 *a, uint32_t rd, uint32_t rn)
+{
+    emit(a, sxth_w(X_T0, rn));
+    emit(a, cmpi_w(X_T0, 0));
+    emit(a, movz_w(X_T1, FL_POS));
+    emit(a, movz_w(X_T2, FL_NEG));
+    emit(a, csel_w(X_T1, X_T2, X_T1, CC_LT));
+    emit(a, movz_w(X_T2, FL_ZRO));
+    emit(a, csel_w(rd, X_T2, X_T1, CC_EQ));
+}
+
+/**
+ * call - Call a C function; x0 is the state, the other arguments must already be set
+ *
+ * Guest registers survive in callee-saved registers; the memory base is reloaded.
+ */
+static void call(struct a64 *a, void *fn)
+{
+    uint64_t address = (uint64_t)(uintptr_t)fn;
+    emit(a, mov_x(X_ARG0, X_STATE));
+    emit(a, movz_x(X_CALL, address & 0xFFFF, 0));
+    emit(a, movk_x(X_CALL, (address >> 16) & 0xFFFF, 1));
+    emit(a, movk_x(X_CALL, (address >> 32) & 0xFFFF, 2));
+    emit(a, movk_x(X_CALL, (address >> 48) & 0xFFFF, 3));
+    emit(a, BLR_CALL);
+    emit(a, ldr_x(X_MEM, X_STATE, offsetof(struct trace_state, memory)));
+}
+
+/**
+ * store_regs / load_regs - Move guest registers and cond between host registers and the state
+ */
+static void store_regs(struct a64 *a)
+{
+    for (int r = 0; r < 8; ++r)
+    {
+        emit(a, strh_imm(guest(r), X_STATE, offsetof(struct trace_state, r) + 2 * r));
+    }
+    emit(a, strh_imm(X_COND, X_STATE, offsetof(struct trace_state, cond)));
+}
+
+static void load_regs(struct a64 *a)
+{
+    for (int r = 0; r < 8; ++r)
+    {
+        emit(a, ldrh_imm(guest(r), X_STATE, offsetof(struct trace_state, r) + 2 * r));
+    }
+    emit(a, ldrh_imm(X_COND, X_STATE, offsetof(struct trace_state, cond)));
+}
+
+/**
+ * store - Emit a store of guest register value to the address in w1
+ */
+static void store(struct a64 *a, int value, uint32_t code_after)
+{
+    emit(a, mov_w(X_ARG2, guest(value)));
+    call(a, (void *)trace_native_store);
+    exit_if_nonzero(a, code_after);
+}
+
+/**
+ * guard_br - Leave unless the branch on mask goes the recorded way
+ *
+ * With a register holding the source of the condition codes, the signed compare
+ * against zero gives every mask a single condition: p GT, z EQ, zp GE, n LT,
+ * np NE, nz LE.
+ */
+static void guard_br(struct a64 *a, const struct trace_op *op, uint32_t code)
+{
+    static const int taken_cc[8] = {0, CC_GT, CC_EQ, CC_GE, CC_LT, CC_NE, CC_LE, 0};
+    int taken;
+
+    if (op->flag_reg == FLAG_COND)
+    {
+        emit(a, movz_w(X_T0, op->sr1));
+        emit(a, tst_w(X_COND, X_T0));
+        taken = CC_NE;
+    }
+    else
+    {
+        emit(a, sxth_w(X_T0, guest(op->flag_reg)));
+        emit(a, cmpi_w(X_T0, 0));
+        taken = taken_cc[op->sr1 & 0x7];
+    }
+    exit_if(a, op->dr ? taken ^ 1 : taken, code);
+}
+
+/**
+ * emit_op - Emit the code of one op
+ */
+static void emit_op(struct a64 *a, const struct trace_op *op, int index, int top)
+{
+    uint32_t rd = guest(op->dr), rs = guest(op->sr1);
+    uint32_t before = TRACE_EXIT_CODE(index, TRACE_EXIT_BEFORE);
+    uint32_t after = TRACE_EXIT_CODE(index, TRACE_EXIT_AFTER);
+    size_t inv = offsetof(struct trace_state, inv) + 2 * op->sr1;
+
+    switch (op->kind)
+    {
+    case T_ADD:
+        emit(a, add_w(rd, rs, guest(op->sr2)));
+        emit(a, uxth_w(rd, rd));
+        break;
+    case T_ADDI:
+        add_imm(a, rd, rs, op->imm);
+        break;
+    case T_AND:
+        emit(a, and_w(rd, rs, guest(op->sr2)));
+        break;
+    case T_ANDI:
+        emit(a, movz_w(X_T0, op->imm));
+        emit(a, and_w(rd, rs, X_T0));
+        break;
+    case T_NOT:
+        emit(a, mvn_w(rd, rs));
+        emit(a, uxth_w(rd, rd));
+        break;
+    case T_CONST:
+        emit(a, movz_w(rd, op->imm));
+        break;
+    case T_LD:
+        emit(a, movz_w(X_T0, op->imm));
+        emit(a, ldrh_idx(rd, X_MEM, X_T0));
+        break;
+    case T_LDI:
+        emit(a, movz_w(X_T0, op->imm));
+        emit(a, ldrh_idx(X_T0, X_MEM, X_T0));
+        exit_if_device(a, X_T0, before);
+        emit(a, ldrh_idx(rd, X_MEM, X_T0));
+        break;
+    case T_LDR:
+        add_imm(a, X_T0, rs, op->imm);
+        exit_if_device(a, X_T0, before);
+        emit(a, ldrh_idx(rd, X_MEM, X_T0));
+        break;
+    case T_LDR_INV:
+        emit(a, ldrh_imm(X_T0, X_STATE, inv));
+        emit(a, ldrh_idx(rd, X_MEM, X_T0));
+        break;
+    case T_ST:
+        emit(a, movz_w(X_ARG1, op->imm));
+        store(a, op->sr2, after);
+        break;
+    case T_STI:
+        emit(a, movz_w(X_T0, op->imm));
+        emit(a, ldrh_idx(X_ARG1, X_MEM, X_T0));
+        exit_if_device(a, X_ARG1, before);
+        store(a, op->sr2, after);
+        break;
+    case T_STR:
+        add_imm(a, X_ARG1, rs, op->imm);
+        exit_if_device(a, X_ARG1, before);
+        store(a, op->sr2, after);
+        break;
+    case T_STR_INV:
+        emit(a, ldrh_imm(X_ARG1, X_STATE, inv));
+        store(a, op->sr2, after);
+        break;
+    case T_LINK:
+        emit(a, movz_w(guest(R_R7), op->imm));
+        break;
+    case T_GUARD_BR:
+        guard_br(a, op, TRACE_EXIT_CODE(index, TRACE_EXIT_GUARD));
+        break;
+    case T_GUARD_JMP:
+        if (op->dr)
+        {
+            emit(a, movz_w(guest(R_R7), op->pc + 1));
+        }
+        emit(a, movz_w(X_T0, op->imm));
+        emit(a, cmp_w(rs, X_T0));
+        exit_if(a, CC_NE, TRACE_EXIT_CODE(index, TRACE_EXIT_GUARD));
+        break;
+    case T_SAVE_FLAGS:
+        flags_into(a, X_COND, guest(op->flag_reg));
+        break;
+    case T_TRAP:
+        store_regs(a);
+        emit(a, movz_w(X_ARG1, index));
+        call(a, (void *)trace_native_trap);
+        exit_if_nonzero(a, TRACE_EXIT_CODE(index, TRACE_EXIT_DONE));
+        load_regs(a);
+        break;
+    case T_LOOP:
+        if (op->flag_reg != FLAG_COND)
+        {
+            flags_into(a, X_COND, guest(op->flag_reg));
+        }
+        emit(a, ldr_x(X_T0, X_STATE, offsetof(struct trace_state, iters)));
+        emit(a, addi_x(X_T0, X_T0, 1));
+        emit(a, str_x(X_T0, X_STATE, offsetof(struct trace_state, iters)));
+        branch(a, top);
+        break;
+    }
+}
+
+/**
+ * trace_native_compile - Generate AArch64 code for a compiled trace
+ *
+ * The buffer is written while mapped read-write and only then made executable,
+ * so it is never writable and executable at the same time. In the code cache
+ * this flips the whole cache, which is safe because traces are only compiled
+ * from the interpreter, never while native code runs.
+ *
+ * Returns:
+ *   int: 1 if t->native was set, 0 if the trace stays on the op loop
+ */
+int trace_native_compile(struct trace *t)
+{
+    size_t size = (size_t)(t->op_count * A64_OP_WORDS + A64_FIXED_WORDS) * sizeof(uint32_t);
+    void *code = NULL;
+    if (code_cache_state == 0)
+    {
+        code_cache_state = arena_init(&code_cache, A64_CODE_CACHE) ? 1 : -1;
+    }
+    if (code_cache_state > 0 && arena_protect(&code_cache, 1))
+    {
+        code = arena_alloc(&code_cache, size, 64);
+    }
+    int cached = code != NULL;
+    if (!cached)
+    {
+        code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED)
+        {
+            return 0;
+        }
+    }
+    struct a64 a = {code, 0, 0};
+
+    /* Common exit: w0 holds the exit code */
+    store_regs(&a);
+    for (int i = 0; i < 5; ++i)
+    {
+        emit(&a, ldp_x(X_GUEST + 2 * i, X_GUEST + 2 * i + 1, 16 + 16 * i));
+    }
+    emit(&a, LDP_FP_LR_POST);
+    emit(&a, RET);
+
+    /* Entry */
+    int entry = a.n;
+    emit(&a, STP_FP_LR_PRE);
+    emit(&a, MOV_FP_SP);
+    for (int i = 0; i < 5; ++i)
+    {
+        emit(&a, stp_x(X_GUEST + 2 * i, X_GUEST + 2 * i + 1, 16 + 16 * i));
+    }
+    emit(&a, mov_x(X_STATE, X_ARG0));
+    load_regs(&a);
+    emit(&a, ldr_x(X_MEM, X_STATE, offsetof(struct trace_state, memory)));
+
+    int top = a.n;
+    for (int i = 0; i < t->op_count; ++i)
+    {
+        emit_op(&a, &t->ops[i], i, top);
+    }
+
+    if (cached ? !arena_protect(&code_cache, 0) : mprotect(code, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        if (!cached)
+        {
+            munmap(code, size);
+        }
+        return 0;
+    }
+    __builtin___clear_cache((char *)code, (char *)code + size);
+
+    t->code = code;
+    t->code_size = cached ? 0 : size; /* 0: lives in the code cache */
+    t->native = (trace_native_fn)(void *)(a.code + entry);
+    return 1;
+}
+
+/**
+ * trace_native_free - Release the host code of a trace
+ */
+void trace_native_free(struct trace *t)
+{
+    if (t->code && t->code_size)
+    {
+        munmap(t->code, t->code_size);
+    }
+}
+
+#endif /* TRACE_NATIVE */
@@ -0,0 +1,489 @@
+/**
+ * trap.c - TRAP dispatch and the host implementations of the standard trap routines
+ *
+ * See trap.h for how native handlers and the guest trap vector table interact.
+ */
+#include "trap.h"
+#include "codemap.h"
+#include "watch.h"
+#include "replay.h"
+#include "fuzz.h"
+#include "check.h"
+#include <string.h>
+
+int trap_mode = TRAP_MODE_NATIVE;         /* how the standard I/O traps are serviced */
+static trap_handler trap_table[1 << 8];   /* one slot per 8-bit trap vector, NULL = guest routine */
+
+/**
+ * trap_getc - GETC: Read a character from keyboard
+ */
+static void trap_getc(void)
+{
+    /* read a single ASCII char */
+    reg[R_R0] = replay_getchar();
+    update_flags(R_R0);
+}
+
+/**
+ * trap_out - OUT: Output a character
+ */
+static void trap_out(void)
+{
+    console_putc((char)reg[R_R0]);
+    fflush(stdout);
+}
+
+/**
+ * trap_puts - PUTS: output a null-terminated string to the screen (similar to 'printf' in C)
+ */
+static void trap_puts(void)
+{
+    /**
+     *  15    12 | 11-8  |  7      0
+        [ 1111  | xxxx  | trapvect8 ]
+
+     * Write a string of ASCII characters to the console display. The characters are contained in consecutive memory locations, one character per memory location, starting with the address specified in R0. Writing terminates with the occurrence of x0000 in a memory location. (Pg. 543)
+     * To display a string, we must give the trap routine a string to display. This is done by storing the address of the first character in R0 before beginning the trap.
+     */
+    /**
+     * Notice that unlike C strings, characters are not stored in a single byte, but in a single memory location. Memory locations in LC-3 are 16 bits, so each character in the string is 16 bits wide. To display this with a C function, we will need to convert each value to a char and output them individually.
+     */
+
+    // Get pointer to string in memory (R0 holds starting address)
+    uint16_t *str_ptr;
+    str_ptr = &memory[reg[R_R0]]; // point to the address of the value stored in memory's reg[R_R0] index
+    char c;
+
+    // Loop through each character until null terminator (x0000)
+    while (*str_ptr != 0)
+    {
+        c = (char)(*str_ptr); // Cast 16-bit word to char
+        console_putc(c);      // Print character to console
+        str_ptr++;            // Move to next character in string
+    }
+    fflush(stdout); // Make sure it prints immediately
+}
+
+/**
+ * trap_in - IN: Input a character with echo
+ */
+static void trap_in(void)
+{
+    console_puts("Enter a character: ");
+    char character = replay_getchar();
+    console_putc(character);
+    fflush(stdout);
+    reg[R_R0] = (uint16_t)character;
+    update_flags(R_R0);
+}
+
+/**
+ * trap_putsp - PUTSP: Output a byte string contained in a memory location (which is 16 bits or 2 bytes)
+ */
+static void trap_putsp(void)
+{
+    /*
+     * sys call
+     * Same as PUTS except that it outputs null terminated strings with two ASCII chars packed into a single memory location, with low 8 bits outputted frist then the high 8 bits
+     * The “SP” means "String Packed”.
+     * Each 16-bit memory word contains two characters, packed like this:
+     * Low byte (bits 7–0) = first character
+     * High byte (bits 15–8) = second character
+     * This format saves space: instead of one character per word (like PUTS), you get two characters per word
+     * Note: LC-3 is little-endian, so the lower byte comes first when printing.
+     * one char per byte (two bytes per word) here we need to swap back to big endian format
+     */
+    /* First, we need to get the address to the memory (uint_16) word stored in the R_R0 register */
+    uint16_t *c = memory + reg[R_R0];
+    while (*c)
+    {
+        char char1 = (*c) & 0xFF;
+        console_putc(char1);
+        char char2 = (*c) >> 8;
+        if (char2)
+            console_putc(char2);
+        ++c;
+    }
+    fflush(stdout);
+}
+
+/**
+ * trap_halt - HALT: Halt program execution
+ */
+static void trap_halt(void)
+{
+    console_puts("HALT\n");
+    fflush(stdout);
+    running = 0;
+}
+
+/**
+ * copy_out - Copy count words starting at guest address src into buf, wrapping at 0xFFFF
+ */
+static void copy_out(uint16_t *buf, uint16_t src, uint32_t count)
+{
+    uint32_t first = MEMORY_MAX - src; /* words before the wrap */
+    if (first > count)
+    {
+        first = count;
+    }
+    memcpy(buf, memory + src, first * sizeof(uint16_t));
+    memcpy(buf + first, memory, (count - first) * sizeof(uint16_t));
+}
+
+/**
+ * copy_in - Copy count words from buf to guest address dst, wrapping at 0xFFFF
+ */
+static void copy_in(uint16_t dst, const uint16_t *buf, uint32_t count)
+{
+    uint32_t first = MEMORY_MAX - dst;
+    if (first > count)
+    {
+        first = count;
+    }
+    memcpy(memory + dst, buf, first * sizeof(uint16_t));
+    memcpy(memory, buf + first, (count - first) * sizeof(uint16_t));
+}
+
+/**
+ * trap_memmove - MEMMOVE: copy R2 words from address R1 to address R0
+ */
+static void trap_memmove(void)
+{
+    uint16_t dst = reg[R_R0], src = reg[R_R1];
+    uint32_t count = reg[R_R2];
+
+    if (watch_count)
+    {
+        watch_store_range(dst, count, 1, src);
+    }
+    if (fuzz_enabled)
+    {
+        fuzz_dirty_range(dst, count);
+    }
+    if (check_enabled)
+    {
+        check_store_range(dst, count);
+    }
+    if ((uint32_t)dst + count <= MEMORY_MAX && (uint32_t)src + count <= MEMORY_MAX)
+    {
+        /* Neither range wraps: a single memmove, which also handles overlap */
+        memmove(memory + dst, memory + src, count * sizeof(uint16_t));
+    }
+    else
+    {
+        /* Wrapping ranges may overlap in both directions at once, so bounce through a buffer */
+        static uint16_t bounce[MEMORY_MAX];
+        copy_out(bounce, src, count);
+        copy_in(dst, bounce, count);
+    }
+    code_write_range(reg[R_R0], reg[R_R2]);
+}
+
+/**
+ * trap_memset - MEMSET: store the value R1 into R2 words starting at address R0
+ */
+static void trap_memset(void)
+{
+    uint16_t dst = reg[R_R0], val = reg[R_R1];
+    uint32_t count = reg[R_R2];
+
+    if (watch_count)
+    {
+        watch_store_range(dst, count, 0, val);
+    }
+    if (fuzz_enabled)
+    {
+        fuzz_dirty_range(dst, count);
+    }
+    if (check_enabled)
+    {
+        check_store_range(dst, count);
+    }
+    while (count > 0)
+    {
+        uint32_t run = MEMORY_MAX - dst; /* words until the end of memory */
+        if (run > count)
+        {
+            run = count;
+        }
+        uint16_t *p = memory + dst;
+        if ((val & 0xFF) == (val >> 8))
+        {
+            memset(p, val & 0xFF, run * sizeof(uint16_t));
+        }
+        else
+        {
+            for (uint32_t i = 0; i < run; ++i)
+            {
+                p[i] = val;
+            }
+        }
+        dst += run;
+        count -= run;
+    }
+    code_write_range(reg[R_R0], reg[R_R2]);
+}
+
+/**
+ * trap_memcmp - MEMCMP: compare R2 words at address R0 with the words at address R1
+ *
+ * R0 becomes -1, 0 or 1 depending on whether the first differing word of the first
+ * block is smaller or larger (as unsigned values), and R1 the index of that word.
+ */
+static void trap_memcmp(void)
+{
+    uint16_t a = reg[R_R0], b = reg[R_R1];
+    uint32_t count = reg[R_R2];
+    uint32_t i = 0;
+
+    while (i < count)
+    {
+        /* Largest run in which neither address wraps */
+        uint32_t run = count - i;
+        if (run > (uint32_t)MEMORY_MAX - a)
+        {
+            run = MEMORY_MAX - a;
+        }
+        if (run > (uint32_t)MEMORY_MAX - b)
+        {
+            run = MEMORY_MAX - b;
+        }
+
+        if (memcmp(memory + a, memory + b, run * sizeof(uint16_t)) != 0)
+        {
+            /* Find the first differing word: byte order makes memcmp's sign meaningless here */
+            while (memory[a] == memory[b])
+            {
+                ++a;
+                ++b;
+                ++i;
+            }
+            reg[R_R0] = memory[a] < memory[b] ? 0xFFFF : 1;
+            reg[R_R1] = i;
+            update_flags(R_R0);
+            return;
+        }
+        a += run;
+        b += run;
+        i += run;
+    }
+
+    reg[R_R0] = 0;
+    reg[R_R1] = count;
+    update_flags(R_R0);
+}
+
+/**
+ * trap_checksum - CHECKSUM: R0 = sum of the R1 words starting at address R0, modulo 0x10000
+ */
+static void trap_checksum(void)
+{
+    uint16_t addr = reg[R_R0];
+    uint32_t count = reg[R_R1];
+    uint16_t sum = 0;
+
+    while (count > 0)
+    {
+        uint32_t run = MEMORY_MAX - addr;
+        if (run > count)
+        {
+            run = count;
+        }
+        const uint16_t *p = memory + addr;
+        for (uint32_t i = 0; i < run; ++i)
+        {
+            sum += p[i];
+        }
+        addr += run;
+        count -= run;
+    }
+
+    reg[R_R0] = sum;
+    update_flags(R_R0);
+}
+
+/**
+ * trap_mul - MUL: unsigned 16x16 -> 32 bit multiply, R1:R0 = R0 * R1
+ */
+static void trap_mul(void)
+{
+    uint32_t product = (uint32_t)reg[R_R0] * reg[R_R1];
+    reg[R_R0] = (uint16_t)product;
+    reg[R_R1] = (uint16_t)(product >> 16);
+    update_flags(R_R0);
+}
+
+/**
+ * trap_smul - SMUL: signed 16x16 -> 32 bit multiply, R1:R0 = R0 * R1
+ */
+static void trap_smul(void)
+{
+    uint32_t product = (uint32_t)((int32_t)(int16_t)reg[R_R0] * (int16_t)reg[R_R1]);
+    reg[R_R0] = (uint16_t)product;
+    reg[R_R1] = (uint16_t)(product >> 16);
+    update_flags(R_R0);
+}
+
+/**
+ * trap_divu - DIVU: unsigned divide, R0 = R0 / R1 and R1 = R0 % R1
+ */
+static void trap_divu(void)
+{
+    uint16_t dividend = reg[R_R0], divisor = reg[R_R1];
+    if (divisor == 0)
+    {
+        reg[R_R0] = 0xFFFF;
+        reg[R_R1] = dividend;
+    }
+    else
+    {
+        reg[R_R0] = dividend / divisor;
+        reg[R_R1] = dividend % divisor;
+    }
+    update_flags(R_R0);
+}
+
+/**
+ * trap_divs - DIVS: signed divide rounding toward zero, R0 = R0 / R1 and R1 = R0 % R1
+ */
+static void trap_divs(void)
+{
+    int32_t dividend = (int16_t)reg[R_R0], divisor = (int16_t)reg[R_R1];
+    if (divisor == 0)
+    {
+        reg[R_R0] = 0xFFFF;
+        reg[R_R1] = (uint16_t)dividend;
+    }
+    else
+    {
+        /* Computed in 32 bits, so -32768 / -1 simply wraps back to -32768 */
+        reg[R_R0] = (uint16_t)(dividend / divisor);
+        reg[R_R1] = (uint16_t)(dividend % divisor);
+    }
+    update_flags(R_R0);
+}
+
+/**
+ * trap_shl - SHL: R0 = R0 << R1
+ */
+static void trap_shl(void)
+{
+    reg[R_R0] = reg[R_R1] >= 16 ? 0 : (uint16_t)(reg[R_R0] << reg[R_R1]);
+    update_flags(R_R0);
+}
+
+/**
+ * trap_shr - SHR: R0 = R0 >> R1 (logical)
+ */
+static void trap_shr(void)
+{
+    reg[R_R0] = reg[R_R1] >= 16 ? 0 : reg[R_R0] >> reg[R_R1];
+    update_flags(R_R0);
+}
+
+/**
+ * trap_sra - SRA: R0 = R0 >> R1 (arithmetic)
+ */
+static void trap_sra(void)
+{
+    uint16_t count = reg[R_R1] >= 16 ? 15 : reg[R_R1];
+    reg[R_R0] = (uint16_t)((int16_t)reg[R_R0] >> count);
+    update_flags(R_R0);
+}
+
+/**
+ * trap_init - Reset the trap table for the given mode
+ *
+ * Clears every slot, then installs the host implementations of the standard
+ * I/O traps unless the OS image is supposed to service them, and the helper traps.
+ *
+ * Parameters:
+ *   mode: TRAP_MODE_NATIVE or TRAP_MODE_OS
+ */
+void trap_init(int mode)
+{
+    trap_mode = mode;
+    for (int i = 0; i < (1 << 8); ++i)
+    {
+        trap_table[i] = NULL;
+    }
+
+    if (mode == TRAP_MODE_NATIVE)
+    {
+        trap_table[TRAP_GETC] = trap_getc;
+        trap_table[TRAP_OUT] = trap_out;
+        trap_table[TRAP_PUTS] = trap_puts;
+        trap_table[TRAP_IN] = trap_in;
+        trap_table[TRAP_PUTSP] = trap_putsp;
+        trap_table[TRAP_HALT] = trap_halt;
+    }
+
+    trap_table[TRAP_MEMMOVE] = trap_memmove;
+    trap_table[TRAP_MEMSET] = trap_memset;
+    trap_table[TRAP_MEMCMP] = trap_memcmp;
+    trap_table[TRAP_CHECKSUM] = trap_checksum;
+    trap_table[TRAP_MUL] = trap_mul;
+    trap_table[TRAP_SMUL] = trap_smul;
+    trap_table[TRAP_DIVU] = trap_divu;
+    trap_table[TRAP_DIVS] = trap_divs;
+    trap_table[TRAP_SHL] = trap_shl;
+    trap_table[TRAP_SHR] = trap_shr;
+    trap_table[TRAP_SRA] = trap_sra;
+}
+
+/**
+ * trap_register - Install a native handler for a trap vector
+ *
+ * Replaces whatever serviced the vector before, including the built-in handlers
+ * and guest routines. Passing NULL hands the vector back to the guest vector table.
+ *
+ * Parameters:
+ *   trapvect: The 8-bit trap vector
+ *   handler: Host function to run for TRAP trapvect, or NULL
+ */
+void trap_register(uint8_t trapvect, trap_handler handler)
+{
+    trap_table[trapvect] = handler;
+}
+
+/**
+ * trap_execute - Execute TRAP trapvect
+ *
+ * The LC-3 provides a few predefined routines for performing common tasks and interacting with I/O devices. For example, there are routines for getting input from the keyboard and for displaying strings to the console. These are called trap routines which you can think of as the operating system or API for the LC-3. Each trap routine is assigned a trap code which identifies it (similar to an opcode). To execute one, the TRAP instruction is called with the trap code of the desired routine.
+ *
+ * Parameters:
+ *   trapvect: The 8-bit trap vector from the instruction
+ */
+void trap_execute(uint16_t trapvect)
+{
+    /*
+     * The trap will eventually return control back to where it was called from. So we store the current PC into register R7, which LC-3 uses as the return address register. This is similar to how real CPUs use a link register or stack to remember return points.
+     */
+    reg[R_R7] = reg[R_PC];
+
+    if (trap_table[trapvect])
+    {
+        trap_table[trapvect]();
+        return;
+    }
+
+    /* No native handler: jump to the guest routine whose address is in the trap vector table.
+     * Without an OS image the table is empty; in native mode such traps are ignored as before. */
+    uint16_t routine = mem_read(trapvect);
+    if (routine != 0 || trap_mode == TRAP_MODE_OS)
+    {
+        reg[R_PC] = routine;
+    }
+}
+
+/**
+ * trap_is_native - Tell whether a trap vector is serviced by a native handler
+ *
+ * Returns:
+ *   int: Non-zero if TRAP trapvect runs host code rather than a guest routine
+ */
+int trap_is_native(uint8_t trapvect)
+{
+    return trap_table[trapvect] != NULL;
+}
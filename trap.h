@@ -0,0 +1,75 @@
+/**
+ * trap.h - Configurable TRAP layer for the virtual machine
+ *
+ * Every TRAP instruction goes through a table of 256 handlers, one per trap vector.
+ * A slot holding a host (native) handler runs C code directly; an empty slot behaves
+ * like the real LC-3: R7 gets the return address and the PC is loaded from the trap
+ * vector table at memory[0x0000..0x00FF], so the guest's own routine runs.
+ *
+ * In native mode the standard I/O traps (GETC/OUT/PUTS/IN/PUTSP/HALT) are host
+ * implementations. In OS mode their slots are left empty, so a real LC-3 OS image
+ * loaded alongside the program services them through the vector table.
+ * Users can register additional native handlers for any vector with trap_register.
+ */
+#ifndef TRAP_H
+#define TRAP_H
+#include "main.h"
+
+/* Trap modes */
+enum
+{
+    TRAP_MODE_NATIVE = 0, /* standard traps implemented on the host (fast, default) */
+    TRAP_MODE_OS          /* standard traps dispatched through the guest vector table (faithful) */
+};
+
+/* Native helper traps */
+/**
+ * Host implementations of the loops guest libraries otherwise write with LDR/STR.
+ * They are installed in both modes, since no OS image provides them. Counts are in
+ * words, addresses wrap around at 0xFFFF, and the copies access memory[] directly,
+ * so device registers in the 0xFE00 page see no side effects. Unless listed as a
+ * result, registers are preserved.
+ */
+enum
+{
+    TRAP_MEMMOVE = 0x30, /* copy R2 words from R1 to R0; overlapping ranges are handled like memmove */
+    TRAP_MEMSET = 0x31,  /* store the value R1 into R2 words starting at R0 */
+    TRAP_MEMCMP = 0x32,  /* compare R2 words at R0 and R1 (unsigned); R0 = -1/0/1, R1 = index of the first difference (R2 if equal) */
+    TRAP_CHECKSUM = 0x33 /* R0 = sum of the R1 words starting at R0, modulo 0x10000 */
+};
+
+/**
+ * Arithmetic helpers for what the ISA lacks (multiply, divide, shifts). Operands are
+ * R0 and R1; results go to R0 (and R1 where listed), and the condition codes are set
+ * from R0 as update_flags does. Division by zero gives a quotient of 0xFFFF and leaves
+ * the dividend as remainder; signed -32768 / -1 gives -32768 with remainder 0.
+ * Shift counts of 16 or more shift every bit out.
+ */
+enum
+{
+    TRAP_MUL = 0x38,  /* unsigned R0 * R1; R0 = low word, R1 = high word of the 32-bit product */
+    TRAP_SMUL = 0x39, /* signed R0 * R1; R0 = low word, R1 = high word of the 32-bit product */
+    TRAP_DIVU = 0x3A, /* unsigned R0 / R1; R0 = quotient, R1 = remainder */
+    TRAP_DIVS = 0x3B, /* signed R0 / R1 rounded toward zero; R0 = quotient, R1 = remainder (sign of the dividend) */
+    TRAP_SHL = 0x3C,  /* R0 = R0 << R1 */
+    TRAP_SHR = 0x3D,  /* R0 = R0 >> R1, shifting in zeros */
+    TRAP_SRA = 0x3E   /* R0 = R0 >> R1, shifting in copies of the sign bit */
+};
+
+/**
+ * A native trap handler. It runs with R7 already holding the return address and
+ * reads its arguments from / writes its results to reg[] and memory[] directly.
+ */
+typedef void (*trap_handler)(void);
+
+extern int trap_mode;
+
+/**
+ * Function declarations/prototype
+ */
+void trap_init(int mode);
+void trap_register(uint8_t trapvect, trap_handler handler);
+void trap_execute(uint16_t trapvect);
+int trap_is_native(uint8_t trapvect);
+
+#endif /* TRAP_H */
@@ -0,0 +1,864 @@
+/**
+ * vm.c - The LC-3 machine: state, console, memory access, image loading and the interpreter
+ *
+ * Everything a front end needs to run a program except main(): the VM itself
+ * (main.c), and programs translated ahead of time by lc3-aot, link against this
+ * file together with trap.c.
+ */
+#include "main.h"
+#include "trap.h"
+#include "cfg.h"
+#include "trace.h"
+#include "codemap.h"
+#include "decode.h"
+#include "itrace.h"
+#include "watch.h"
+#include "replay.h"
+#include "fuzz.h"
+#include "check.h"
+#include "disk.h"
+#include "bank.h"
+#include "mailbox.h"
+#include <string.h>
+
+/* Aligned for bank.c and mailbox.c, which map host pages over windows of it */
+uint16_t memory[MEMORY_MAX] __attribute__((aligned(BANK_WINDOW_BYTES))); /* 65536 unique addressable locations, each 16 bits wide */
+uint16_t reg[R_COUNT];       /* Array that stores the current values of all CPU registers */
+uint64_t instr_count;        /* Number of instructions retired since the VM started */
+int running;                 /* Cleared by HALT (or the OS clearing MCR) to stop the execution cycle */
+
+#ifdef _WIN32
+/* Global Windows console handles and mode settings */
+HANDLE hStdin = INVALID_HANDLE_VALUE; /* Handle for standard input stream */
+DWORD fdwMode, fdwOldMode;            /* Current and original console mode flags */
+
+/**
+ * disable_input_buffering - Configure console for immediate input processing
+ *
+ * This function modifies the Windows console settings to allow for immediate
+ * character-by-character input without requiring the user to press Enter.
+ * It saves the original console mode to restore it later and disables features
+ * like echo (displaying typed characters) and line buffering.
+ */
+void disable_input_buffering()
+{
+    /* Get handle to standard input */
+    hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    /* Save the current console mode configuration */
+    GetConsoleMode(hStdin, &fdwOldMode);
+
+    /* Create a new mode by toggling specific bits in the original mode:
+     * - ENABLE_ECHO_INPUT: When disabled, typed characters aren't displayed
+     * - ENABLE_LINE_INPUT: When disabled, input is available immediately without Enter key
+     */
+    fdwMode = fdwOldMode ^ ENABLE_ECHO_INPUT /* no input echo */
+              ^ ENABLE_LINE_INPUT;           /* return when one or
+                                                more characters are available */
+
+    /* Apply the new mode settings to the console */
+    SetConsoleMode(hStdin, fdwMode);
+    /* Clear any pending input in the buffer */
+    FlushConsoleInputBuffer(hStdin);
+}
+
+/**
+ * restore_input_buffering - Restore original console input behavior
+ *
+ * This function restores the console to its original input mode settings,
+ * which were saved when disable_input_buffering was called. This ensures
+ * that the console behaves normally after our program exits.
+ */
+void restore_input_buffering()
+{
+    /* Restore the original console mode that was saved earlier */
+    SetConsoleMode(hStdin, fdwOldMode);
+}
+
+/**
+ * check_key - Detect if a key has been pressed
+ *
+ * This function checks if any keyboard input is available for reading.
+ * It waits for a short time (1 second maximum) to see if input arrives,
+ * and uses _kbhit to check if a key is in the input buffer.
+ *
+ * Returns:
+ *   uint16_t: Non-zero value if a key is available, zero otherwise
+ */
+uint16_t check_key()
+{
+    /* Wait for input for up to 1000ms (1 second) and check if any key is pressed
+     * WaitForSingleObject returns WAIT_OBJECT_0 if the input handle is signaled
+     * _kbhit returns non-zero if there's a key in the input buffer
+     */
+    return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
+}
+
+/**
+ * wait_for_key - Block until a key is available
+ *
+ * Like check_key, but without a timeout. The console handle is also signaled
+ * for events that are not key presses (focus, mouse), so keep waiting until
+ * _kbhit confirms there is a character to read.
+ */
+void wait_for_key()
+{
+    while (!(WaitForSingleObject(hStdin, INFINITE) == WAIT_OBJECT_0 && _kbhit()))
+    {
+    }
+}
+
+/**
+ * host_time_ns - Monotonic host time in nanoseconds
+ */
+uint64_t host_time_ns()
+{
+    return GetTickCount64() * 1000000ULL;
+}
+#else
+/* Original terminal settings, restored on exit */
+struct termios original_tio;
+
+/**
+ * disable_input_buffering - Configure the terminal for immediate input processing
+ *
+ * Puts the terminal in non-canonical mode without echo, so characters are
+ * delivered one at a time without waiting for Enter. stdin is also made
+ * unbuffered: check_key asks the file descriptor whether input is pending,
+ * which is only accurate if stdio has not already pulled that input into its
+ * own buffer.
+ */
+void disable_input_buffering()
+{
+    setvbuf(stdin, NULL, _IONBF, 0);
+    tcgetattr(STDIN_FILENO, &original_tio);
+    struct termios new_tio = original_tio;
+    new_tio.c_lflag &= ~ICANON & ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+}
+
+/**
+ * restore_input_buffering - Restore the terminal settings saved by disable_input_buffering
+ */
+void restore_input_buffering()
+{
+    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+}
+
+/**
+ * check_key - Detect if a key has been pressed
+ *
+ * Polls stdin with a zero timeout. End of input also counts as "available",
+ * so a guest reading from a closed pipe sees EOF instead of waiting forever.
+ *
+ * Returns:
+ *   uint16_t: Non-zero value if a key is available, zero otherwise
+ */
+uint16_t check_key()
+{
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(STDIN_FILENO, &readfds);
+
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 0;
+    return select(1, &readfds, NULL, NULL, &timeout) > 0;
+}
+
+/**
+ * wait_for_key - Block until a key is available
+ *
+ * Same as check_key but with no timeout, so the host thread sleeps in the
+ * kernel until stdin becomes readable.
+ */
+void wait_for_key()
+{
+    fd_set readfds;
+    do
+    {
+        FD_ZERO(&readfds);
+        FD_SET(STDIN_FILENO, &readfds);
+    } while (select(1, &readfds, NULL, NULL, NULL) <= 0);
+}
+
+/**
+ * host_time_ns - Monotonic host time in nanoseconds
+ */
+uint64_t host_time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+/**
+ * handle_interrupt - Clean up and exit when CTRL+C is pressed
+ *
+ * This function serves as a signal handler for interrupt signals (CTRL+C).
+ * It restores the original console input settings and exits the program.
+ */
+void handle_interrupt()
+{
+    restore_input_buffering();
+    printf("\n");
+    exit(-2);
+}
+
+/**
+ * sign_extend - Extend a value to 16 bits with sign preservation
+ *
+ * This function takes a value with a specific bit count and extends it
+ * to a 16-bit value, preserving the sign bit (most significant bit).
+ *
+ * Parameters:
+ *   x: The value to extend
+ *   bit_count: The number of bits in the original value
+ *
+ * Returns:
+ *   uint16_t: The sign-extended 16-bit value
+ */
+uint16_t sign_extend(uint16_t x, int bit_count)
+{
+    if ((x >> (bit_count - 1)) & 1)
+    {
+        x |= (0xFFFF << bit_count);
+    }
+    return x;
+}
+
+/**
+ * update_flags - Update condition flags based on register value
+ *
+ * This function sets the condition flags (N, Z, P) based on the value
+ * in the specified register. Exactly one flag will be set.
+ *
+ * Parameters:
+ *   r: Register index to check
+ */
+void update_flags(uint16_t r)
+{
+    if (reg[r] == 0)
+    {
+        reg[R_COND] = FL_ZRO;
+    }
+    else if (reg[r] >> 15) /* Check if the most significant bit is 1 (negative) */
+    {
+        reg[R_COND] = FL_NEG;
+    }
+    else
+    {
+        reg[R_COND] = FL_POS;
+    }
+}
+
+/**
+ * idle_park - Park a guest that is spinning on the keyboard status register
+ *
+ * Called when a read of KBSR finds no key. If the instruction that did the read
+ * is part of a tight polling loop, i.e. it is immediately followed by a branch that
+ * is taken while KBSR reads zero and jumps back over a body consisting only of
+ * "ADD Rx, Rx, #imm" counter increments, then nothing but the key press can change
+ * the outcome of the loop. Rather than spinning, block the host thread until input
+ * arrives, then fast-forward the counters and instr_count by the number of iterations
+ * the loop would have run in the meantime (2048 uses such a counter as its random seed).
+ *
+ * Returns:
+ *   int: 1 if the guest was parked and a key is now available, 0 if the loop was not recognized
+ */
+int idle_park()
+{
+    /* The load has been fetched, so R_PC points at the instruction after it */
+    uint16_t load_pc = reg[R_PC] - 1;
+    uint16_t load = memory[load_pc];
+    uint16_t load_op = load >> 12;
+    if (load_op != OP_LD && load_op != OP_LDI && load_op != OP_LDR)
+    {
+        return 0;
+    }
+    uint16_t dr = (load >> 9) & 0x7;
+
+    /* The load must be followed by a branch on its flags, taken on zero but not on negative (key ready) */
+    uint16_t br = memory[reg[R_PC]];
+    uint16_t cond_flag = (br >> 9) & 0x7;
+    if ((br >> 12) != OP_BR || !(cond_flag & FL_ZRO) || (cond_flag & FL_NEG))
+    {
+        return 0;
+    }
+    uint16_t head = reg[R_PC] + 1 + sign_extend(br & 0x1FF, 9);
+    uint16_t body_len = load_pc - head; /* instructions in front of the load */
+    if (body_len >= IDLE_LOOP_MAX)
+    {
+        return 0;
+    }
+
+    /* Everything between the loop head and the load must be a register increment */
+    uint16_t step[8] = {0};
+    for (uint16_t i = 0; i < body_len; ++i)
+    {
+        uint16_t instr = memory[(uint16_t)(head + i)];
+        uint16_t r = (instr >> 9) & 0x7;
+        int is_increment = (instr >> 12) == OP_ADD && ((instr >> 6) & 0x7) == r && ((instr >> 5) & 0x1);
+        if (!is_increment || r == dr || (load_op == OP_LDR && r == ((load >> 6) & 0x7)))
+        {
+            return 0;
+        }
+        step[r] += sign_extend(instr & 0x1F, 5);
+    }
+
+    /* Sleep until a key arrives */
+    uint64_t spins = replay_wait() / (IDLE_INSTR_NS * (body_len + 2));
+
+    /* Fast-forward as if the loop had been spinning the whole time */
+    for (int r = 0; r < 8; ++r)
+    {
+        reg[r] += (uint16_t)(step[r] * spins);
+    }
+    instr_count += spins * (body_len + 2);
+    return 1;
+}
+
+/**
+ * read_image - Load a program (binary file) image into memory for the VM's CPU to execute it.
+ *
+ * This function loads a program binary file into the VM's memory space.
+ * The file format has a header specifying the origin address, followed
+ * by the program data.
+ *
+ * Parameters:
+ *   image_path: Path to the image file (i.e., "prog.obj")
+ *
+ * Returns:
+ *   int: 1 on success, 0 on failure
+ */
+uint16_t swap16(uint16_t x)
+{
+    return (x << 8) | (x >> 8);
+}
+
+void read_image_file(FILE *file)
+{
+    /* the origin tells us where in memory to place the image */
+    uint16_t origin;
+    fread(&origin, sizeof(origin), 1, file);
+    origin = swap16(origin);
+
+    /* we know the maximum file size so we only need one fread */
+    uint16_t max_read = MEMORY_MAX - origin;
+    uint16_t *p = memory + origin;
+    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+
+    /* remember which words hold the image, for the control-flow analysis */
+    cfg_mark_loaded(origin, read);
+
+    /* swap to little endian */
+    while (read-- > 0)
+    {
+        *p = swap16(*p);
+        ++p;
+    }
+}
+
+int read_image(const char *image_path)
+{
+    FILE *file = fopen(image_path, "rb");
+    if (!file)
+    {
+        return 0;
+    };
+    read_image_file(file);
+    fclose(file);
+    return 1;
+}
+
+/**
+ * console_putc - Write a character of guest output to the console
+ *
+ * After reverse execution (replay.h) took the machine back, instructions it
+ * runs again have already written their output, so it is not repeated; the
+ * same goes for the second run of each block under --check (check.h). Test
+ * cases run by the fuzzing harness (fuzz.h) have their output discarded.
+ */
+void console_putc(char c)
+{
+    if (!fuzz_enabled && (!replay_enabled || instr_count > replay_horizon))
+    {
+        putc(c, stdout);
+    }
+}
+
+/**
+ * console_puts - Write a string of guest output to the console, as console_putc
+ */
+void console_puts(const char *s)
+{
+    while (*s)
+    {
+        console_putc(*s++);
+    }
+}
+
+/**
+ * device_store - Run the device behind a store into the device page, before the store itself
+ *
+ * Returns:
+ *   uint16_t: The value the register takes, which a device may change from val
+ */
+static uint16_t device_store(uint16_t address, uint16_t val)
+{
+    if (address == MR_DDR)
+    {
+        /* The display is always ready, so every character written goes straight out */
+        console_putc((char)val);
+        fflush(stdout);
+    }
+    else if (address == MR_MCR && !(val >> 15))
+    {
+        /* Clearing the clock enable bit is how the OS HALT routine stops the machine */
+        running = 0;
+    }
+    else if (address == MR_DISK_CMD)
+    {
+        disk_command(val);
+    }
+    else if (address == MR_BANK)
+    {
+        val = bank_select(val);
+    }
+    else if (address == MR_MBOX_CMD)
+    {
+        mailbox_command(val);
+    }
+    return val;
+}
+
+/**
+ * device_load - Bring a device register up to date for a load from the device page
+ */
+static void device_load(uint16_t address)
+{
+    if (address == MR_KBSR)
+    {
+        if (replay_key() || idle_park())
+        {
+            memory[MR_KBSR] = (1 << 15);
+            memory[MR_KBDR] = replay_getchar();
+        }
+        else
+        {
+            memory[MR_KBSR] = 0;
+        }
+    }
+    else if (address == MR_DSR)
+    {
+        memory[MR_DSR] = (1 << 15);
+    }
+    else if (address == MR_MBOX_STATUS)
+    {
+        memory[MR_MBOX_STATUS] = mailbox_poll();
+    }
+}
+
+/**
+ * Memory mapped registers take memory access a bit more complicated.
+ * We cant read or write to the memory array directly, but must instead call setter and getter functions.
+ * When memory is read from KBSR, the getter will check the keyboard and update both memory locations
+ */
+void mem_write(uint16_t address, uint16_t val)
+{
+    /* Stores into pages with watchpoints are checked against their ranges first, the
+       first store into a page after a fuzzing snapshot marks it dirty, and the
+       lockstep checker logs every store */
+    uint8_t flags = page_flags[address >> PAGE_SHIFT];
+    if (flags & (PAGE_WATCH | PAGE_SNAPSHOT | PAGE_CHECK))
+    {
+        if (flags & PAGE_WATCH)
+        {
+            watch_store(address, val);
+        }
+        if (flags & PAGE_SNAPSHOT)
+        {
+            fuzz_dirty(address);
+        }
+        if (flags & PAGE_CHECK)
+        {
+            check_store(address, val);
+        }
+    }
+    /* Only the device page has registers that act on stores */
+    if (address >= MR_KBSR)
+    {
+        val = device_store(address, val);
+    }
+    memory[address] = val;
+
+    /* Stores into translated code discard the translations built from it */
+    if (code_is_translated(address))
+    {
+        code_write(address);
+    }
+}
+
+uint16_t mem_read(uint16_t address)
+{
+    if (address >= MR_KBSR)
+    {
+        device_load(address);
+    }
+    if (page_flags[address >> PAGE_SHIFT] & PAGE_WATCH)
+    {
+        watch_load(address);
+    }
+    return memory[address];
+}
+
+/**
+ * execute - Decode and execute a single instruction
+ *
+ * The instruction has already been fetched, so R_PC points at the next one.
+ * This is the reference implementation of the instruction set; the faster
+ * execution tiers fall back to it and must agree with it.
+ *
+ * Parameters:
+ *   instr: The 16-bit instruction word
+ */
+void execute(uint16_t instr)
+{
+    /* DECODE */
+    /* Decode: Get the instruction's opcode, which are the 4 leftmost bits in the 16 bit unsigned int (the instruction) */
+    uint16_t op = instr >> 12; // This right-shifts the instruction value by 12 bits. In the LC-3 architecture, the leftmost 4 bits (bits 12-15) contain the opcode that identifies which instruction to execute (ADD, AND, LD, etc.).
+
+    /* For now, just print the instruction for debugging */
+    // printf("Executing instruction at 0x%04X: 0x%04X (opcode: 0x%X)\n", reg[R_PC] - 1, instr, op);
+
+    /* EXECUTE */
+    switch (op)
+    {
+    case OP_BR:
+    {
+        /* Branch */
+        /*
+            --- Instruction format ---
+            15-12   11-9   8-0
+            |OP_BR| nzp |PCoffset9|
+            Where:
+            * Bits 15–12: opcode (0000 for BR)
+            * Bits 11–9: condition codes (N, Z, P) — e.g., 010 means "branch if result was zero"
+            * Bits 8–0: a signed 9-bit offset to jump relative to current PC
+
+            * The BR instruction will branch (jump) if ANY of the condition flags that are set in the instruction match the current condition flag in R_COND.
+        */
+        /*
+        The BR instruction is very powerful because it allows for different kinds of conditional branches:
+            1. BRn: Branch if negative (condition = 100)
+            2. BRz: Branch if zero (condition = 010)
+            3. BRp: Branch if positive (condition = 001)
+            4. BRnz: Branch if negative or zero (condition = 110)
+            5. BRnp: Branch if negative or positive (condition = 101)
+            6. BRzp: Branch if zero or positive (condition = 011)
+            7. BRnzp: Always branch (condition = 111)
+        */
+        uint16_t pc_offset = sign_extend(instr & 0x1FF, 9); // get 9-bit signed offset
+        uint16_t cond_flag = (instr >> 9) & 0x7;            // get NZP bits (bits 11–9)
+        if (cond_flag & reg[R_COND])                        // if current condition matches
+        {
+            reg[R_PC] += pc_offset; // jump relative to current PC
+
+            /* A taken backward branch closes a loop: let the trace tier count it or take over */
+            if ((pc_offset >> 15) && trace_tier)
+            {
+                trace_backedge(reg[R_PC]);
+            }
+        }
+    }
+    break;
+
+    case OP_ADD:
+    {
+        /* Add */
+        /**
+         * The ADD instruction takes two numbers, adds them together, and stores the result in a register. Each ADD instruction looks like the following:
+         * Instruction format:argc
+         *  15-12       11-9   8-6    5   4-3   2-0
+            |OP_BR|     DR    |SR1|   0  |00|   SR2
+        OR
+
+            15-12       11-9   8-6     5      4-0
+            |OP_BR|     DR    |SR1|    1     |imm5|
+
+        If bit [5] is 0, the second source operand is obtained from SR2. If bit [5] is 1, the second source operand is obtained by sign-extending the imm5 field to 16 bits. In both cases, the second source operand is added to the contents of SR1 and the result stored in DR.
+        */
+        /* Destination register (DR) */
+        uint16_t dr = (instr >> 9) & 0x7;
+        /* First operand */
+        uint16_t r1 = (instr >> 6) & 0x7;
+        /* whether we are in immediate mode */
+        uint16_t imm_flag = (instr >> 5) & 0x1;
+
+        if (imm_flag == 1)
+        {
+            /* Immediate mode */
+            uint16_t imm5 = sign_extend(instr & 0x1F, 5); // Convert 5-bit value to 16-bit signed
+            reg[dr] = reg[r1] + imm5;
+        }
+        else
+        {
+            /* Register mode */
+            uint16_t r2 = instr & 0x7;
+            reg[dr] = reg[r1] + reg[r2];
+        }
+
+        /* Update condition flags */
+        update_flags(dr);
+    }
+    break;
+
+    case OP_LD:
+    {
+        /* Load */
+        /**
+         * Loads a value from memory into a register
+         * PC-relative addressing, meaning: The memory address is computed as PC + offset, and the content at that memory address is stored in the destination register.
+         *  15     12 | 11    9 | 8                  0
+            [  0010   |  DR     |   PCoffset9         ]
+         *
+         - Opcode (bits 15–12) = 0010 → this is LD
+         - DR (bits 11–9): Destination Register (where to load the data)
+         - PCoffset9 (bits 8–0): a 9-bit signed offset from the current PC (program counter)
+         */
+        uint16_t dr = (instr >> 9) & 0x7;                   // get the 11-9 bits (dr)
+        uint16_t pc_offset = sign_extend(instr & 0x1FF, 9); // converts the 9-bit value into a proper signed 16-bit int, preserving its sign
+        // reg[dr] = memory[reg[R_PC] + pc_offset];
+        reg[dr] = mem_read(reg[R_PC] + pc_offset);
+        update_flags(dr);
+    }
+    break;
+
+    case OP_ST:
+    {
+        /* Store */
+        /**
+         * Store a register value into memory
+         *  15     12 | 11    9 | 8                  0
+            [  0011   |  DR    |   PCoffset9         ]
+         */
+        uint16_t dr = (instr >> 9) & 0x7;
+        uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+        // memory[reg[R_PC] + pc_offset] = reg[dr];
+        mem_write(reg[R_PC] + pc_offset, reg[dr]);
+    }
+    break;
+
+    case OP_JSR:
+    {
+        /* Jump Register */
+        /**
+         * Store a register value into memory
+         *  15     12 |11| 10                   0
+            [  0011   |DR| PCoffset11           ]
+         */
+        uint16_t long_flag = (instr >> 11) & 1;
+        reg[R_R7] = reg[R_PC];
+
+        if (long_flag == 1)
+        {
+            uint16_t long_pc_offset = sign_extend(instr & 0x7ff, 11);
+            reg[R_PC] += long_pc_offset; /* JSR */
+        }
+        else
+        {
+            uint16_t r1 = (instr >> 6) & 0x7;
+            reg[R_PC] = reg[r1]; /* JSRR */
+        }
+    }
+    break;
+
+    case OP_AND:
+    {
+        /* Bitwise AND */
+        uint16_t r0 = (instr >> 9) & 0x7;
+        uint16_t r1 = (instr >> 6) & 0x7;
+        uint16_t imm_flag = (instr >> 5) & 0x1;
+
+        if (imm_flag)
+        {
+            /* Immediate mode */
+            uint16_t imm5 = sign_extend(instr & 0x1f, 5);
+            reg[r0] = reg[r1] & imm5; // Bitwise AND
+        }
+        else
+        {
+            /* Register mode */
+            uint16_t r2 = instr & 0x7;
+            reg[r0] = reg[r1] & reg[r2]; // Bitwise AND
+        }
+        update_flags(r0);
+    }
+    break;
+
+    case OP_LDR:
+    {
+        /* Load Register */
+        uint16_t r0 = (instr >> 9) & 0x7;
+        uint16_t r1 = (instr >> 6) & 0x7;
+        uint16_t offset = sign_extend(instr & 0x3F, 6);
+
+        // reg[r0] = memory[reg[r1] + offset];
+        reg[r0] = mem_read(reg[r1] + offset);
+        update_flags(r0);
+    }
+    break;
+
+    case OP_STR:
+    {
+        /* Store Register */
+        uint16_t r0 = (instr >> 9) & 0x7;
+        uint16_t r1 = (instr >> 6) & 0x7;
+        uint16_t offset = sign_extend(instr & 0x3F, 6);
+
+        // memory[reg[r1] + offset] = reg[r0];
+        mem_write(reg[r1] + offset, reg[r0]);
+    }
+    break;
+
+    case OP_RTI:
+        /* Return from Interrupt */
+        /* Unused in basic implementation */
+        console_puts("RTI instruction not implemented\n");
+        break;
+
+    case OP_NOT:
+    {
+        /* Bitwise NOT */
+        /**
+         * Perform logical negation on each bit, forming the 1's complement of the given binary value
+         */
+        uint16_t dr = (instr >> 9) & 0x7;
+        uint16_t sr = (instr >> 6) & 0x7;
+
+        reg[dr] = ~reg[sr]; // Bitwise NOT
+        update_flags(dr);
+    }
+    break;
+
+    case OP_LDI:
+    {
+        /* Load indirect*/
+        /**
+         * Load a value from a location in memory into a register
+         * Store a register value into memory
+         *  15     12 | 11    9 | 8                  0
+            [  1010   |  DR    |   PCoffset9         ]
+         * An address is computed by sign-extending bits [8:0] to 16 bits and adding this value to the incremented PC. What is stored in memory at this address is the address of the data to be loaded into DR
+         */
+        /* destination register (DR) */
+        uint16_t dr = (instr >> 9) & 0x7;
+        /* PCoffset 9 */
+        uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+
+        /* add pc_offset to the current PC, look at that memory location to get the final address */
+        // uint16_t addr = memory[reg[R_PC] + pc_offset];
+        // reg[dr] = memory[addr];
+        reg[dr] = mem_read(mem_read(reg[R_PC] + pc_offset));
+        update_flags(dr);
+    }
+    break;
+
+    case OP_STI:
+    {
+        /* Store Indirect */
+        uint16_t sr = (instr >> 9) & 0x7;
+        uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+
+        /* Get the address */
+        // uint16_t addr = memory[reg[R_PC] + pc_offset];
+        /* Store the value at that address */
+        // memory[addr] = reg[sr];
+        mem_write(mem_read(reg[R_PC] + pc_offset), reg[sr]);
+    }
+    break;
+
+    case OP_JMP:
+    {
+        /* Jump */
+        /* Also handles RET */
+        uint16_t r1 = (instr >> 6) & 0x7;
+        reg[R_PC] = reg[r1];
+    }
+    break;
+
+    case OP_RES:
+        /* Reserved */
+        console_puts("Reserved opcode encountered\n");
+        break;
+
+    case OP_LEA:
+    {
+        /* Load Effective Address */
+        uint16_t dr = (instr >> 9) & 0x7;
+        uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
+
+        reg[dr] = reg[R_PC] + pc_offset;
+        update_flags(dr);
+    }
+    break;
+
+    case OP_TRAP:
+        /* Trap / System Call */
+        /* Serviced by a native handler or the guest trap routine, see trap.c */
+        trap_execute(instr & 0xFF); // Extract lower 8 bits of the instruction
+        break;
+
+    default:
+        abort(); // Terminate or exit the program by raising the 'SIGABRT' signal. The 'SIGABRT' signal is one of the signals used in operating systems to indicate an abnormal termination of a program
+        break;
+    }
+}
+
+/**
+ * interpret - Run the instruction cycle from reg[R_PC] until the machine halts
+ *
+ * Dispatches through the specialized handlers once decode_init has built their
+ * table, and through execute() otherwise. While a trace file is open, the
+ * recording loop of itrace.c runs instead, and with --reverse the one of
+ * replay.c, which takes snapshots.
+ */
+void interpret(void)
+{
+    if (itrace_enabled)
+    {
+        itrace_interpret();
+        return;
+    }
+    if (check_enabled)
+    {
+        check_interpret();
+        return;
+    }
+    if (replay_enabled)
+    {
+        replay_interpret();
+        return;
+    }
+    if (decode_ready)
+    {
+        while (running)
+        {
+            uint16_t instr = memory[reg[R_PC]++];
+            ++instr_count;
+            handler_table[instr](instr);
+        }
+        return;
+    }
+
+    while (running)
+    {
+        /* FETCH */
+        /* Fetch: Get the next instruction from memory at the address in PC, and advance PC */
+        uint16_t instr = memory[reg[R_PC]++]; // Access the memory array at the address stored in the PC register, get the instruction (16 bit unsigned short int) and after that access, increment program counter (PC) by 1 to point to the next instruction in memory
+        ++instr_count;
+
+        /* DECODE and EXECUTE */
+        execute(instr);
+    }
+}
@@ -0,0 +1,151 @@
+/**
+ * watch.c - Tagging watched pages and checking accesses to them (see watch.h)
+ */
+#include "watch.h"
+#include "codemap.h"
+#include "trace.h"
+
+struct watchpoint watchpoints[WATCH_MAX];
+int watch_count;
+watch_handler_fn watch_handler;
+
+static uint8_t page_watches[PAGE_COUNT]; /* watchpoints spanning each page */
+
+/**
+ * check - Report an access to a watched page if it falls in a range that catches it
+ */
+static void check(uint16_t address, int kind, uint16_t value)
+{
+    for (int i = 0; i < WATCH_MAX; ++i)
+    {
+        struct watchpoint *w = &watchpoints[i];
+        if ((w->kind & kind) && address >= w->lo && address <= w->hi)
+        {
+            ++w->hits;
+            if (watch_handler)
+            {
+                watch_handler(w, address, kind, value);
+            }
+        }
+    }
+}
+
+/**
+ * watch_load - Slow path of mem_read for watched pages, after the value is read
+ */
+void watch_load(uint16_t address)
+{
+    check(address, WATCH_LOAD, memory[address]);
+}
+
+/**
+ * watch_store - Slow path of mem_write for watched pages, before the value is stored
+ */
+void watch_store(uint16_t address, uint16_t value)
+{
+    check(address, WATCH_STORE, value);
+}
+
+/**
+ * watch_store_range - Report the stores of a block write before it happens
+ *
+ * The block may wrap around the end of memory. Unwatched pages are skipped whole.
+ *
+ * Parameters:
+ *   address: First word to be written
+ *   count: Words to be written
+ *   copy: Non-zero if word i receives memory[source + i] (MEMMOVE), zero if every word receives source (MEMSET)
+ *   source: Source address, or the fill value
+ */
+void watch_store_range(uint16_t address, uint32_t count, int copy, uint16_t source)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint16_t at = address + i;
+        if (!(page_flags[at >> PAGE_SHIFT] & PAGE_WATCH))
+        {
+            /* Skip to the next page */
+            i += ((1u << PAGE_SHIFT) - 1) - (at & ((1u << PAGE_SHIFT) - 1));
+            continue;
+        }
+        check(at, WATCH_STORE, copy ? memory[(uint16_t)(source + i)] : source);
+    }
+}
+
+/**
+ * tag - Add (delta 1) or remove (delta -1) a watchpoint's pages from the page map
+ */
+static void tag(const struct watchpoint *w, int delta)
+{
+    for (uint32_t page = w->lo >> PAGE_SHIFT; page <= (uint32_t)(w->hi >> PAGE_SHIFT); ++page)
+    {
+        page_watches[page] += delta;
+        if (page_watches[page])
+        {
+            page_flags[page] |= PAGE_WATCH;
+        }
+        else
+        {
+            page_flags[page] &= ~PAGE_WATCH;
+        }
+    }
+}
+
+/**
+ * watch_set - Watch a range of addresses
+ *
+ * Discards the compiled traces, which may access the range without checking it.
+ *
+ * Parameters:
+ *   lo, hi: First and last address of the range
+ *   kind: WATCH_LOAD, WATCH_STORE or WATCH_ACCESS
+ *
+ * Returns:
+ *   struct watchpoint *: The watchpoint, or NULL if the range is empty or all
+ *   WATCH_MAX watchpoints are in use
+ */
+struct watchpoint *watch_set(uint16_t lo, uint16_t hi, int kind)
+{
+    if (lo > hi || !(kind & WATCH_ACCESS))
+    {
+        return NULL;
+    }
+    for (int i = 0; i < WATCH_MAX; ++i)
+    {
+        struct watchpoint *w = &watchpoints[i];
+        if (w->kind == 0)
+        {
+            w->lo = lo;
+            w->hi = hi;
+            w->kind = kind & WATCH_ACCESS;
+            w->hits = 0;
+            tag(w, 1);
+            ++watch_count;
+            trace_flush();
+            return w;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * watch_clear - Remove the watchpoint set with the same range and kind
+ *
+ * Returns:
+ *   int: 1 if there was one, 0 otherwise
+ */
+int watch_clear(uint16_t lo, uint16_t hi, int kind)
+{
+    for (int i = 0; i < WATCH_MAX; ++i)
+    {
+        struct watchpoint *w = &watchpoints[i];
+        if (w->kind && w->kind == (kind & WATCH_ACCESS) && w->lo == lo && w->hi == hi)
+        {
+            tag(w, -1);
+            w->kind = 0;
+            --watch_count;
+            return 1;
+        }
+    }
+    return 0;
+}
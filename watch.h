@@ -0,0 +1,57 @@
+/**
+ * watch.h - Data watchpoints through the page map
+ *
+ * A watchpoint covers a range of guest addresses and catches loads, stores or
+ * both. Rather than comparing every access with every range, setting one tags
+ * the pages it spans PAGE_WATCH in page_flags[] (codemap.h). mem_read and
+ * mem_write already look at the page of each access; only accesses to tagged
+ * pages call into this module, which checks the exact ranges. Accesses to any
+ * other page cost what they did before.
+ *
+ * The trace tier reads and writes memory[] directly, so traces leave to the
+ * interpreter at accesses to watched pages, as they do for the device page, and
+ * no native traces are compiled while watchpoints exist. MEMMOVE and MEMSET
+ * report each word they are about to overwrite.
+ *
+ * watch_handler runs during the access, before a store takes effect (so
+ * memory[address] still holds the old value) and after a load has read the
+ * value. reg[R_PC] points past the instruction, or the trap, making it.
+ */
+#ifndef WATCH_H
+#define WATCH_H
+#include "main.h"
+
+#define WATCH_MAX 32 /* watchpoints set at once */
+
+/* What a watchpoint catches; also the kind of a reported access */
+enum
+{
+    WATCH_LOAD = 1 << 0,
+    WATCH_STORE = 1 << 1,
+    WATCH_ACCESS = WATCH_LOAD | WATCH_STORE
+};
+
+struct watchpoint
+{
+    uint16_t lo, hi; /* inclusive range of addresses */
+    int kind;        /* WATCH_*, or 0 for an unused slot */
+    uint64_t hits;
+};
+
+/* Called for an access that hits a watchpoint; value is the value loaded or to be stored */
+typedef void (*watch_handler_fn)(struct watchpoint *w, uint16_t address, int kind, uint16_t value);
+
+extern struct watchpoint watchpoints[WATCH_MAX];
+extern int watch_count; /* watchpoints set */
+extern watch_handler_fn watch_handler;
+
+/**
+ * Function declarations/prototype
+ */
+struct watchpoint *watch_set(uint16_t lo, uint16_t hi, int kind);
+int watch_clear(uint16_t lo, uint16_t hi, int kind);
+void watch_load(uint16_t address);
+void watch_store(uint16_t address, uint16_t value);
+void watch_store_range(uint16_t address, uint32_t count, int copy, uint16_t source);
+
+#endif /* WATCH_H */